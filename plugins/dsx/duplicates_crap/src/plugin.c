@@ -1,7 +1,14 @@
 #define _GNU_SOURCE
 #include <glib.h>
-#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include "dsxplugin.h"
 
 #include <dlfcn.h>
@@ -9,14 +16,83 @@
 #include <libintl.h>
 #include <locale.h>
 
-#define cmdf "/bin/sh -c \"find '%s' -type f -name '%s' -exec b2sum '{}' ';' | sort | uniq --all-repeated=separate -w 128 | cut -c 131-\""
 #define _(STRING) gettext(STRING)
 #define GETTEXT_PACKAGE "plugins"
 
+#define SEPARATOR "-----------------------------------------"
+#define EDGE_SIZE 4096
+#define BUFF_SIZE 131072
+#define DIGEST_LEN 64
+#define FIEMAP_BATCH 64
+#define STATUS_INTERVAL 100000
+
+// How it goes: the tree is walked once, files of a unique size are dropped right away.
+// The rest are checked by the first and the last EDGE_SIZE bytes and only the files
+// that still match are hashed completely. Names of the same inode are hashed once,
+// files that share all their extents (reflinked copies) are not read past the edges.
+
+enum
+{
+	STAGE_EDGES,
+	STAGE_FULL
+};
+
+enum
+{
+	LINK_NONE,
+	LINK_HARD,
+	LINK_CLONE
+};
+
+typedef struct sGroup tGroup;
+
+typedef struct sFile
+{
+	gchar *path;
+	goffset size;
+	dev_t dev;
+	ino_t ino;
+	struct sFile *link;
+	gint link_type;
+	guint mark;
+	gboolean failed;
+	gboolean has_extents;
+	guint8 digest[DIGEST_LEN];
+	guint8 extents[DIGEST_LEN];
+	tGroup *group;
+} tFile;
+
+struct sGroup
+{
+	gint stage;
+	guint pending;
+	GPtrArray *names;
+	GPtrArray *heads;
+};
+
+typedef struct sSearch
+{
+	int nr;
+	GThreadPool *pool;
+	GAsyncQueue *done;
+	GQueue edges;
+	GQueue full;
+	GPtrArray *groups;
+	guint in_pool;
+	guint window;
+	guint mark;
+	gsize scanned;
+	gsize found;
+	gint64 status_time;
+	gboolean hardlinks;
+	gboolean reflinks;
+} tSearch;
+
 tSAddFileProc gAddFileProc;
 tSUpdateStatusProc gUpdateStatus;
 
 gboolean stop_search;
+GKeyFile *gCfg = NULL;
 
 int DCPCALL Init(tDsxDefaultParamStruct* dsp, tSAddFileProc pAddFileProc, tSUpdateStatusProc pUpdateStatus)
 {
@@ -25,6 +101,7 @@ int DCPCALL Init(tDsxDefaultParamStruct* dsp, tSAddFileProc pAddFileProc, tSUpda
 
 	Dl_info dlinfo;
 	static char plg_path[PATH_MAX];
+	static char cfg_path[PATH_MAX];
 	const char* loc_dir = "langs";
 
 	memset(&dlinfo, 0, sizeof(dlinfo));
@@ -40,79 +117,672 @@ int DCPCALL Init(tDsxDefaultParamStruct* dsp, tSAddFileProc pAddFileProc, tSUpda
 		setlocale (LC_ALL, "");
 		bindtextdomain(GETTEXT_PACKAGE, plg_path);
 		textdomain(GETTEXT_PACKAGE);
+
+		g_strlcpy(cfg_path, dlinfo.dli_fname, PATH_MAX);
+		pos = strrchr(cfg_path, '/');
+
+		if (pos)
+			strcpy(pos + 1, "settings.ini");
+
+		gCfg = g_key_file_new();
+		g_key_file_load_from_file(gCfg, cfg_path, 0, NULL);
 	}
 
 	return 0;
 }
 
-void DCPCALL StartSearch(int PluginNr, tDsxSearchRecord* pSearchRec)
+static gboolean cfg_get_boolean(const gchar *key, gboolean def)
 {
-	gchar **argv;
-	gchar *line, *command;
-	gsize len, term, i = 1;
-	GPid pid;
-	gint fp;
-	GSpawnFlags flags;
 	GError *err = NULL;
+	gboolean result;
+
+	if (!gCfg)
+		return def;
 
-	stop_search = FALSE;
-	command = g_strdup_printf(cmdf, pSearchRec->StartPath, pSearchRec->FileMask);
-	gUpdateStatus(PluginNr, command, 0);
+	result = g_key_file_get_boolean(gCfg, "Search", key, &err);
 
-	if (!g_shell_parse_argv(command, NULL, &argv, &err))
+	if (err)
 	{
-		gUpdateStatus(PluginNr, err->message, 0);
-		gAddFileProc(PluginNr, "");
+		g_error_free(err);
+		return def;
 	}
 
-	g_clear_error(&err);
+	return result;
+}
+
+static void update_status(tSearch *search, const gchar *path, gboolean force)
+{
+	gint64 now = g_get_monotonic_time();
+
+	if (!force && now - search->status_time < STATUS_INTERVAL)
+		return;
+
+	search->status_time = now;
+	gUpdateStatus(search->nr, (char*)path, (int)search->scanned);
+}
+
+static void file_free(tFile *file)
+{
+	g_free(file->path);
+	g_free(file);
+}
+
+static int open_file(tFile *file)
+{
+	struct stat st;
+	int fd = open(file->path, O_RDONLY | O_CLOEXEC | O_NOATIME);
+
+	if (fd == -1 && errno == EPERM)
+		fd = open(file->path, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return -1;
 
-	if (!g_spawn_async_with_pipes(NULL, argv, NULL, 0, NULL, NULL, &pid, NULL, &fp, NULL, &err))
+	if (fstat(fd, &st) != 0 || st.st_ino != file->ino || st.st_dev != file->dev || st.st_size != file->size)
 	{
-		gUpdateStatus(PluginNr, err->message, 0);
-		gAddFileProc(PluginNr, "");
+		close(fd);
+		return -1;
 	}
+
+	return fd;
+}
+
+static gboolean read_at(int fd, guint8 *buf, gsize len, off_t offset)
+{
+	while (len > 0)
+	{
+		ssize_t bytes = pread(fd, buf, len, offset);
+
+		if (bytes == -1 && errno == EINTR)
+			continue;
+
+		if (bytes <= 0)
+			return FALSE;
+
+		buf += bytes;
+		len -= bytes;
+		offset += bytes;
+	}
+
+	return TRUE;
+}
+
+// fingerprint of the physical layout, only if every extent is shared with some other file
+static gboolean get_extents(int fd, tFile *file)
+{
+#ifdef FS_IOC_FIEMAP
+	struct
+	{
+		struct fiemap map;
+		struct fiemap_extent ext[FIEMAP_BATCH];
+	} req;
+	const guint32 unreliable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+	                           FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED |
+	                           FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN;
+	guint64 start = 0;
+	gboolean last = FALSE, result = TRUE;
+	gsize len = DIGEST_LEN;
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA512);
+
+	g_checksum_update(checksum, (guchar*)&file->dev, sizeof(file->dev));
+
+	while (result && !last && !g_atomic_int_get(&stop_search))
+	{
+		memset(&req.map, 0, sizeof(req.map));
+		req.map.fm_start = start;
+		req.map.fm_length = FIEMAP_MAX_OFFSET - start;
+		req.map.fm_extent_count = FIEMAP_BATCH;
+
+		if (ioctl(fd, FS_IOC_FIEMAP, &req.map) != 0 || req.map.fm_mapped_extents == 0)
+			break;
+
+		for (guint32 i = 0; i < req.map.fm_mapped_extents; i++)
+		{
+			struct fiemap_extent *ext = &req.map.fm_extents[i];
+
+			if (!(ext->fe_flags & FIEMAP_EXTENT_SHARED) || (ext->fe_flags & unreliable))
+			{
+				result = FALSE;
+				break;
+			}
+
+			g_checksum_update(checksum, (guchar*)&ext->fe_logical, sizeof(ext->fe_logical));
+			g_checksum_update(checksum, (guchar*)&ext->fe_physical, sizeof(ext->fe_physical));
+			g_checksum_update(checksum, (guchar*)&ext->fe_length, sizeof(ext->fe_length));
+			start = ext->fe_logical + ext->fe_length;
+
+			if (ext->fe_flags & FIEMAP_EXTENT_LAST)
+				last = TRUE;
+		}
+	}
+
+	result = result && last;
+
+	if (result)
+		g_checksum_get_digest(checksum, file->extents, &len);
+
+	g_checksum_free(checksum);
+
+	return result;
+#else
+	return FALSE;
+#endif
+}
+
+static void hash_edges(tFile *file)
+{
+	guint8 buf[EDGE_SIZE];
+	gsize len = DIGEST_LEN;
+	gsize head = MIN(file->size, EDGE_SIZE);
+	gsize tail = MIN(file->size - head, EDGE_SIZE);
+	int fd = open_file(file);
+
+	if (fd == -1)
+	{
+		file->failed = TRUE;
+		return;
+	}
+
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA512);
+
+	if (!read_at(fd, buf, head, 0))
+		file->failed = TRUE;
 	else
 	{
+		g_checksum_update(checksum, buf, head);
+
+		if (tail > 0 && !read_at(fd, buf, tail, file->size - tail))
+			file->failed = TRUE;
+		else
+			g_checksum_update(checksum, buf, tail);
+	}
 
-		gUpdateStatus(PluginNr, _("not found"), 0);
+	if (!file->failed)
+	{
+		g_checksum_get_digest(checksum, file->digest, &len);
 
-		GIOChannel *stdout = g_io_channel_unix_new(fp);
+		if (file->size > EDGE_SIZE * 2)
+			file->has_extents = get_extents(fd, file);
+	}
+
+	g_checksum_free(checksum);
+	close(fd);
+}
+
+static void hash_full(tFile *file)
+{
+	ssize_t bytes;
+	goffset total = 0;
+	gsize len = DIGEST_LEN;
+	int fd = open_file(file);
+
+	if (fd == -1)
+	{
+		file->failed = TRUE;
+		return;
+	}
 
-		while (!stop_search && (G_IO_STATUS_NORMAL == g_io_channel_read_line(stdout, &line, &len, &term, NULL)))
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	guint8 *buf = g_malloc(BUFF_SIZE);
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA512);
+
+	while ((bytes = read(fd, buf, BUFF_SIZE)) != 0)
+	{
+		if (bytes == -1)
 		{
-			line[term] = '\0';
+			if (errno == EINTR)
+				continue;
 
-			if (line[0] == '\0')
-				gAddFileProc(PluginNr, "-----------------------------------------");
-			else
+			break;
+		}
+
+		if (g_atomic_int_get(&stop_search))
+			break;
+
+		g_checksum_update(checksum, buf, bytes);
+		total += bytes;
+	}
+
+	if (bytes != 0 || total != file->size)
+		file->failed = TRUE;
+	else
+		g_checksum_get_digest(checksum, file->digest, &len);
+
+	g_checksum_free(checksum);
+	g_free(buf);
+	close(fd);
+}
+
+static void hash_pool_func(gpointer data, gpointer user_data)
+{
+	tFile *file = (tFile*)data;
+	tSearch *search = (tSearch*)user_data;
+
+	if (g_atomic_int_get(&stop_search))
+		file->failed = TRUE;
+	else if (file->group->stage == STAGE_EDGES)
+		hash_edges(file);
+	else
+		hash_full(file);
+
+	g_async_queue_push(search->done, file);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0(*(gchar**)a, *(gchar**)b);
+}
+
+static gint compare_digest(gconstpointer a, gconstpointer b)
+{
+	return memcmp((*(tFile**)a)->digest, (*(tFile**)b)->digest, DIGEST_LEN);
+}
+
+static gint compare_extents(gconstpointer a, gconstpointer b)
+{
+	tFile *fa = *(tFile**)a;
+	tFile *fb = *(tFile**)b;
+
+	if (fa->has_extents != fb->has_extents)
+		return fa->has_extents ? -1 : 1;
+
+	return memcmp(fa->extents, fb->extents, DIGEST_LEN);
+}
+
+static gint compare_files(gconstpointer a, gconstpointer b)
+{
+	tFile *fa = *(tFile**)a;
+	tFile *fb = *(tFile**)b;
+
+	if (fa->size != fb->size)
+		return fa->size > fb->size ? -1 : 1;
+
+	if (fa->dev != fb->dev)
+		return fa->dev < fb->dev ? -1 : 1;
+
+	if (fa->ino != fb->ino)
+		return fa->ino < fb->ino ? -1 : 1;
+
+	return g_strcmp0(fa->path, fb->path);
+}
+
+// heads[first..last) are known to be the same, list every name that leads to them
+static void emit_group(tSearch *search, tGroup *group, guint first, guint last)
+{
+	GPtrArray *list = g_ptr_array_new();
+
+	search->mark++;
+
+	for (guint i = first; i < last; i++)
+		((tFile*)g_ptr_array_index(group->heads, i))->mark = search->mark;
+
+	for (guint i = 0; i < group->names->len; i++)
+	{
+		tFile *file = g_ptr_array_index(group->names, i);
+		gboolean visible = TRUE;
+
+		while (file->link)
+		{
+			if ((file->link_type == LINK_HARD && !search->hardlinks) ||
+			                (file->link_type == LINK_CLONE && !search->reflinks))
+				visible = FALSE;
+
+			file = file->link;
+		}
+
+		if (visible && file->mark == search->mark)
+			g_ptr_array_add(list, ((tFile*)g_ptr_array_index(group->names, i))->path);
+	}
+
+	if (list->len > 1)
+	{
+		g_ptr_array_sort(list, compare_names);
+
+		if (search->found > 0)
+			gAddFileProc(search->nr, SEPARATOR);
+
+		for (guint i = 0; i < list->len; i++)
+			gAddFileProc(search->nr, g_ptr_array_index(list, i));
+
+		search->found++;
+	}
+
+	g_ptr_array_free(list, TRUE);
+}
+
+static tGroup* group_new(tSearch *search, GPtrArray *names, gint stage)
+{
+	tGroup *group = g_new0(tGroup, 1);
+
+	group->stage = stage;
+	group->names = g_ptr_array_ref(names);
+	group->heads = g_ptr_array_new();
+	g_ptr_array_add(search->groups, group);
+
+	return group;
+}
+
+static void group_free(tGroup *group)
+{
+	g_ptr_array_unref(group->names);
+	g_ptr_array_free(group->heads, TRUE);
+	g_free(group);
+}
+
+static void group_queue(tSearch *search, tGroup *group)
+{
+	GQueue *queue = (group->stage == STAGE_EDGES) ? &search->edges : &search->full;
+
+	group->pending = group->heads->len;
+
+	for (guint i = 0; i < group->heads->len; i++)
+	{
+		tFile *file = g_ptr_array_index(group->heads, i);
+		file->group = group;
+		g_queue_push_tail(queue, file);
+	}
+}
+
+// reflinked copies are the same data, keep only one of them for the full hash
+static void group_merge_clones(tGroup *group)
+{
+	guint i = 0;
+
+	g_ptr_array_sort(group->heads, compare_extents);
+
+	while (i + 1 < group->heads->len)
+	{
+		tFile *head = g_ptr_array_index(group->heads, i);
+		tFile *file = g_ptr_array_index(group->heads, i + 1);
+
+		if (head->has_extents && file->has_extents && memcmp(head->extents, file->extents, DIGEST_LEN) == 0 &&
+		                memcmp(head->digest, file->digest, DIGEST_LEN) == 0)
+		{
+			file->link = head;
+			file->link_type = LINK_CLONE;
+			g_ptr_array_remove_index(group->heads, i + 1);
+		}
+		else
+			i++;
+	}
+}
+
+// all hashes of the current stage are there
+static void group_next(tSearch *search, tGroup *group)
+{
+	guint i = 0, j;
+
+	while (i < group->heads->len)
+	{
+		if (((tFile*)g_ptr_array_index(group->heads, i))->failed)
+			g_ptr_array_remove_index(group->heads, i);
+		else
+			i++;
+	}
+
+	if (group->stage == STAGE_EDGES)
+		group_merge_clones(group);
+
+	g_ptr_array_sort(group->heads, compare_digest);
+
+	for (i = 0; i < group->heads->len; i = j)
+	{
+		tFile *head = g_ptr_array_index(group->heads, i);
+
+		for (j = i + 1; j < group->heads->len; j++)
+			if (compare_digest(&head, &g_ptr_array_index(group->heads, j)) != 0)
+				break;
+
+		if (group->stage == STAGE_FULL || j - i == 1 || head->size <= EDGE_SIZE * 2)
+			emit_group(search, group, i, j);
+		else
+		{
+			tGroup *next = group_new(search, group->names, STAGE_FULL);
+
+			for (guint k = i; k < j; k++)
+				g_ptr_array_add(next->heads, g_ptr_array_index(group->heads, k));
+
+			group_queue(search, next);
+		}
+	}
+
+	g_ptr_array_set_size(group->heads, 0);
+}
+
+static void search_feed(tSearch *search)
+{
+	while (search->in_pool < search->window)
+	{
+		tFile *file = g_queue_pop_head(&search->full);
+
+		if (!file)
+			file = g_queue_pop_head(&search->edges);
+
+		if (!file)
+			break;
+
+		search->in_pool++;
+		g_thread_pool_push(search->pool, file, NULL);
+	}
+}
+
+static gboolean match_mask(gchar **masks, const gchar *name)
+{
+	if (!masks || !masks[0])
+		return TRUE;
+
+	for (gchar **mask = masks; *mask; mask++)
+		if (**mask != '\0' && fnmatch(*mask, name, 0) == 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+static void walk_tree(tSearch *search, const gchar *start, gchar **masks, GPtrArray *files)
+{
+	gchar *dir;
+	GQueue dirs = G_QUEUE_INIT;
+
+	g_queue_push_head(&dirs, g_strdup(start));
+
+	while ((dir = g_queue_pop_head(&dirs)) != NULL)
+	{
+		DIR *dp;
+		struct dirent *ent;
+
+		if (g_atomic_int_get(&stop_search) || (dp = opendir(dir)) == NULL)
+		{
+			g_free(dir);
+			continue;
+		}
+
+		update_status(search, dir, FALSE);
+
+		while ((ent = readdir(dp)) != NULL && !g_atomic_int_get(&stop_search))
+		{
+			struct stat st;
+
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+				continue;
+
+			if (ent->d_type == DT_DIR)
 			{
-				gAddFileProc(PluginNr, line);
-				gUpdateStatus(PluginNr, line, i++);
+				g_queue_push_head(&dirs, g_build_filename(dir, ent->d_name, NULL));
+				continue;
 			}
 
-			g_free(line);
+			if (ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN)
+				continue;
+
+			if (fstatat(dirfd(dp), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+
+			if (S_ISDIR(st.st_mode))
+				g_queue_push_head(&dirs, g_build_filename(dir, ent->d_name, NULL));
+			else if (S_ISREG(st.st_mode) && match_mask(masks, ent->d_name))
+			{
+				tFile *file = g_new0(tFile, 1);
+				file->path = g_build_filename(dir, ent->d_name, NULL);
+				file->size = st.st_size;
+				file->dev = st.st_dev;
+				file->ino = st.st_ino;
+				g_ptr_array_add(files, file);
+				search->scanned++;
+			}
 		}
 
-		kill(pid, SIGTERM);
-		g_spawn_close_pid(pid);
-		g_io_channel_shutdown(stdout, TRUE, NULL);
-		g_io_channel_unref(stdout);
-		close(fp);
+		closedir(dp);
+		g_free(dir);
 	}
 
-	if (err)
-		g_error_free(err);
+}
+
+// files of the same size become a group, names of the same inode are linked to the first one
+static void make_groups(tSearch *search, GPtrArray *files)
+{
+	guint i = 0, j;
+
+	g_ptr_array_sort(files, compare_files);
+
+	while (i < files->len)
+	{
+		tFile *first = g_ptr_array_index(files, i);
+
+		for (j = i + 1; j < files->len; j++)
+			if (((tFile*)g_ptr_array_index(files, j))->size != first->size)
+				break;
+
+		if (j - i == 1)
+			file_free(first);
+		else
+		{
+			GPtrArray *names = g_ptr_array_new_full(j - i, (GDestroyNotify)file_free);
+			tGroup *group = group_new(search, names, STAGE_EDGES);
+			tFile *head = NULL;
+
+			for (guint k = i; k < j; k++)
+			{
+				tFile *file = g_ptr_array_index(files, k);
+
+				if (head && head->dev == file->dev && head->ino == file->ino)
+				{
+					file->link = head;
+					file->link_type = LINK_HARD;
+				}
+				else
+				{
+					head = file;
+					g_ptr_array_add(group->heads, file);
+				}
+
+				g_ptr_array_add(names, file);
+			}
+
+			g_ptr_array_unref(names);
+
+			if (group->heads->len == 1 || first->size == 0)
+			{
+				emit_group(search, group, 0, group->heads->len);
+				g_ptr_array_set_size(group->heads, 0);
+			}
+			else
+				group_queue(search, group);
+		}
+
+		i = j;
+	}
+
+	g_ptr_array_set_size(files, 0);
+}
+
+void DCPCALL StartSearch(int PluginNr, tDsxSearchRecord* pSearchRec)
+{
+	gint threads = 0;
+	GError *err = NULL;
+	tSearch search;
+	gchar **masks = NULL;
+	GPtrArray *files = g_ptr_array_new();
+
+	g_atomic_int_set(&stop_search, FALSE);
+	memset(&search, 0, sizeof(search));
+	search.nr = PluginNr;
+	search.groups = g_ptr_array_new_with_free_func((GDestroyNotify)group_free);
+	search.hardlinks = cfg_get_boolean("list_hardlinks", TRUE);
+	search.reflinks = cfg_get_boolean("list_reflinks", TRUE);
+
+	if (gCfg)
+		threads = g_key_file_get_integer(gCfg, "Search", "threads", NULL);
+
+	if (threads < 1)
+		threads = (gint)g_get_num_processors();
+
+	if (pSearchRec->FileMask[0] != '\0')
+		masks = g_strsplit(pSearchRec->FileMask, ";", -1);
+
+	update_status(&search, pSearchRec->StartPath, TRUE);
+	walk_tree(&search, pSearchRec->StartPath, masks, files);
+	g_strfreev(masks);
+
+	if (!g_atomic_int_get(&stop_search))
+		make_groups(&search, files);
+
+	g_ptr_array_foreach(files, (GFunc)file_free, NULL);
+	g_ptr_array_free(files, TRUE);
+
+	search.scanned = 0;
+	search.window = threads * 4;
+	search.done = g_async_queue_new();
+	search.pool = g_thread_pool_new(hash_pool_func, &search, threads, FALSE, &err);
+
+	if (!search.pool)
+	{
+		gUpdateStatus(PluginNr, err ? err->message : "", 0);
+		g_clear_error(&err);
+	}
+	else
+	{
+		search_feed(&search);
+
+		while (search.in_pool > 0 && !g_atomic_int_get(&stop_search))
+		{
+			tFile *file = g_async_queue_timeout_pop(search.done, STATUS_INTERVAL);
+
+			if (!file)
+				continue;
+
+			search.in_pool--;
+			search.scanned++;
+			update_status(&search, file->path, FALSE);
+
+			if (--file->group->pending == 0)
+				group_next(&search, file->group);
+
+			search_feed(&search);
+		}
+
+		g_thread_pool_free(search.pool, TRUE, TRUE);
+
+		if (search.found == 0 && !g_atomic_int_get(&stop_search))
+			gUpdateStatus(PluginNr, _("not found"), 0);
+	}
+
+	g_queue_clear(&search.edges);
+	g_queue_clear(&search.full);
+	g_async_queue_unref(search.done);
+	g_ptr_array_free(search.groups, TRUE);
 
 	gAddFileProc(PluginNr, "");
 }
 
 void DCPCALL StopSearch(int PluginNr)
 {
-	stop_search = TRUE;
+	g_atomic_int_set(&stop_search, TRUE);
 }
 
 void DCPCALL Finalize(int PluginNr)
 {
+	if (gCfg)
+		g_key_file_free(gCfg);
 
+	gCfg = NULL;
 }
@@ -1,7 +1,10 @@
 #define _GNU_SOURCE
 #include <glib.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "dsxplugin.h"
 
 #include <dlfcn.h>
@@ -9,14 +12,45 @@
 #include <libintl.h>
 #include <locale.h>
 
-#define cmdf "/bin/sh -c \"find '%s' -links +1 -type f -name '%s' -printf '%%20i\\t%%p\\n' | sort | uniq --all-repeated=separate -w 20 | cut -f2-\""
 #define _(STRING) gettext(STRING)
 #define GETTEXT_PACKAGE "plugins"
 
+#define SEPARATOR "-----------------------------------------"
+#define STATUS_INTERVAL 100000
+#define MIN_THREADS 4
+#define MAX_THREADS 16
+
+// Directories are read by a thread pool, only files with st_nlink > 1 are remembered.
+// A group leaves the table as soon as all of its links are found, so the memory
+// depends on the groups with links outside of the search path, not on the tree size.
+
+typedef struct sInode
+{
+	dev_t dev;
+	ino_t ino;
+	nlink_t nlink;
+	GPtrArray *names;
+} tInode;
+
+typedef struct sSearch
+{
+	int nr;
+	GThreadPool *pool;
+	GAsyncQueue *ready;
+	GHashTable *inodes;
+	GMutex mutex;
+	gchar **masks;
+	gchar *current;
+	gint pending;
+	gint scanned;
+	gsize found;
+} tSearch;
+
 tSAddFileProc gAddFileProc;
 tSUpdateStatusProc gUpdateStatus;
 
 gboolean stop_search;
+static tInode gWalkDone;
 
 int DCPCALL Init(tDsxDefaultParamStruct* dsp, tSAddFileProc pAddFileProc, tSUpdateStatusProc pUpdateStatus)
 {
@@ -45,74 +79,287 @@ int DCPCALL Init(tDsxDefaultParamStruct* dsp, tSAddFileProc pAddFileProc, tSUpda
 	return 0;
 }
 
-void DCPCALL StartSearch(int PluginNr, tDsxSearchRecord* pSearchRec)
+static guint inode_hash(gconstpointer key)
 {
-	gchar **argv;
-	gchar *line, *command;
-	gsize len, term, i = 1;
-	GPid pid;
-	gint fp;
-	GSpawnFlags flags;
-	GError *err = NULL;
+	const tInode *inode = key;
+
+	return (guint)(inode->ino ^ (inode->ino >> 32)) ^ ((guint)inode->dev * 2654435761U);
+}
 
-	stop_search = FALSE;
-	command = g_strdup_printf(cmdf, pSearchRec->StartPath, pSearchRec->FileMask);
-	gUpdateStatus(PluginNr, command, 0);
+static gboolean inode_equal(gconstpointer a, gconstpointer b)
+{
+	const tInode *ia = a;
+	const tInode *ib = b;
 
-	if (!g_shell_parse_argv(command, NULL, &argv, &err))
+	return ia->ino == ib->ino && ia->dev == ib->dev;
+}
+
+static void inode_free(tInode *inode)
+{
+	g_ptr_array_free(inode->names, TRUE);
+	g_free(inode);
+}
+
+static gint compare_inodes(gconstpointer a, gconstpointer b)
+{
+	const tInode *ia = *(tInode**)a;
+	const tInode *ib = *(tInode**)b;
+
+	if (ia->dev != ib->dev)
+		return ia->dev < ib->dev ? -1 : 1;
+
+	if (ia->ino != ib->ino)
+		return ia->ino < ib->ino ? -1 : 1;
+
+	return 0;
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0(*(gchar**)a, *(gchar**)b);
+}
+
+static gboolean match_mask(gchar **masks, const gchar *name)
+{
+	if (!masks || !masks[0])
+		return TRUE;
+
+	for (gchar **mask = masks; *mask; mask++)
+		if (**mask != '\0' && fnmatch(*mask, name, 0) == 0)
+			return TRUE;
+
+	return FALSE;
+}
+
+static void add_name(tSearch *search, gchar *path, struct stat *st)
+{
+	tInode key, *inode;
+
+	key.dev = st->st_dev;
+	key.ino = st->st_ino;
+
+	g_mutex_lock(&search->mutex);
+
+	inode = g_hash_table_lookup(search->inodes, &key);
+
+	if (!inode)
 	{
-		gUpdateStatus(PluginNr, err->message, 0);
-		gAddFileProc(PluginNr, "");
+		inode = g_new0(tInode, 1);
+		inode->dev = st->st_dev;
+		inode->ino = st->st_ino;
+		inode->nlink = st->st_nlink;
+		inode->names = g_ptr_array_new_with_free_func(g_free);
+		g_hash_table_add(search->inodes, inode);
 	}
 
-	g_clear_error(&err);
+	g_ptr_array_add(inode->names, path);
 
-	if (!g_spawn_async_with_pipes(NULL, argv, NULL, 0, NULL, NULL, &pid, NULL, &fp, NULL, &err))
+	if (inode->names->len >= inode->nlink)
 	{
-		gUpdateStatus(PluginNr, err->message, 0);
-		gAddFileProc(PluginNr, "");
+		g_hash_table_steal(search->inodes, inode);
+		g_async_queue_push(search->ready, inode);
 	}
-	else
+
+	g_mutex_unlock(&search->mutex);
+}
+
+static void walk_dir(tSearch *search, const gchar *dir)
+{
+	DIR *dp;
+	struct dirent *ent;
+
+	if ((dp = opendir(dir)) == NULL)
+		return;
+
+	g_mutex_lock(&search->mutex);
+	g_free(search->current);
+	search->current = g_strdup(dir);
+	g_mutex_unlock(&search->mutex);
+
+	while ((ent = readdir(dp)) != NULL && !g_atomic_int_get(&stop_search))
 	{
+		struct stat st;
 
-		gUpdateStatus(PluginNr, _("not found"), 0);
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
 
-		GIOChannel *stdout = g_io_channel_unix_new(fp);
+		if (ent->d_type != DT_DIR && ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN)
+			continue;
 
-		while (!stop_search && (G_IO_STATUS_NORMAL == g_io_channel_read_line(stdout, &line, &len, &term, NULL)))
+		if (ent->d_type == DT_DIR)
+			st.st_mode = S_IFDIR;
+		else if (fstatat(dirfd(dp), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			g_atomic_int_inc(&search->pending);
+			g_thread_pool_push(search->pool, g_build_filename(dir, ent->d_name, NULL), NULL);
+		}
+		else if (S_ISREG(st.st_mode))
 		{
-			if (line)
+			g_atomic_int_inc(&search->scanned);
+
+			if (st.st_nlink > 1 && match_mask(search->masks, ent->d_name))
+				add_name(search, g_build_filename(dir, ent->d_name, NULL), &st);
+		}
+	}
+
+	closedir(dp);
+}
+
+static void walk_pool_func(gpointer data, gpointer user_data)
+{
+	gchar *dir = (gchar*)data;
+	tSearch *search = (tSearch*)user_data;
+
+	if (!g_atomic_int_get(&stop_search))
+		walk_dir(search, dir);
+
+	g_free(dir);
+
+	if (g_atomic_int_dec_and_test(&search->pending))
+		g_async_queue_push(search->ready, &gWalkDone);
+}
+
+static void emit_group(tSearch *search, tInode *inode)
+{
+	if (inode->names->len < 2)
+		return;
+
+	g_ptr_array_sort(inode->names, compare_names);
+
+	if (search->found > 0)
+		gAddFileProc(search->nr, SEPARATOR);
+
+	for (guint i = 0; i < inode->names->len; i++)
+		gAddFileProc(search->nr, g_ptr_array_index(inode->names, i));
+
+	search->found++;
+}
+
+// the rest have links outside of the search path (or were filtered by the mask)
+static void emit_incomplete(tSearch *search)
+{
+	GPtrArray *list = g_ptr_array_new();
+	GHashTableIter iter;
+	gpointer inode;
+
+	g_hash_table_iter_init(&iter, search->inodes);
+
+	while (g_hash_table_iter_next(&iter, &inode, NULL))
+		g_ptr_array_add(list, inode);
+
+	g_ptr_array_sort(list, compare_inodes);
+
+	for (guint i = 0; i < list->len && !g_atomic_int_get(&stop_search); i++)
+		emit_group(search, g_ptr_array_index(list, i));
+
+	g_ptr_array_free(list, TRUE);
+}
+
+void DCPCALL StartSearch(int PluginNr, tDsxSearchRecord* pSearchRec)
+{
+	tSearch search;
+	GError *err = NULL;
+	gboolean done = FALSE;
+	gint64 status_time = 0;
+	gint threads = CLAMP((gint)g_get_num_processors() * 2, MIN_THREADS, MAX_THREADS);
+
+	g_atomic_int_set(&stop_search, FALSE);
+	memset(&search, 0, sizeof(search));
+	search.nr = PluginNr;
+	g_mutex_init(&search.mutex);
+	search.ready = g_async_queue_new();
+	search.inodes = g_hash_table_new_full(inode_hash, inode_equal, (GDestroyNotify)inode_free, NULL);
+
+	if (pSearchRec->FileMask[0] != '\0')
+		search.masks = g_strsplit(pSearchRec->FileMask, ";", -1);
+
+	gUpdateStatus(PluginNr, pSearchRec->StartPath, 0);
+	search.pending = 1;
+	search.pool = g_thread_pool_new(walk_pool_func, &search, threads, FALSE, &err);
+
+	if (!search.pool)
+	{
+		gUpdateStatus(PluginNr, err ? err->message : "", 0);
+		g_clear_error(&err);
+	}
+	else
+	{
+		g_thread_pool_push(search.pool, g_strdup(pSearchRec->StartPath), NULL);
+
+		while (!g_atomic_int_get(&stop_search))
+		{
+			tInode *inode = g_async_queue_timeout_pop(search.ready, STATUS_INTERVAL);
+
+			if (inode == &gWalkDone)
+			{
+				done = TRUE;
+				break;
+			}
+
+			if (inode)
+			{
+				emit_group(&search, inode);
+				inode_free(inode);
+			}
+
+			gint64 now = g_get_monotonic_time();
+
+			if (now - status_time >= STATUS_INTERVAL)
 			{
-				line[term] = '\0';
+				status_time = now;
+				g_mutex_lock(&search.mutex);
 
-				if (line[0] == '\0')
-					gAddFileProc(PluginNr, "-----------------------------------------");
-				else
-				{
-					gAddFileProc(PluginNr, line);
-					gUpdateStatus(PluginNr, line, i++);
-				}
+				if (search.current)
+					gUpdateStatus(PluginNr, search.current, g_atomic_int_get(&search.scanned));
 
-				g_free(line);
+				g_mutex_unlock(&search.mutex);
 			}
 		}
 
-		kill(pid, SIGTERM);
-		g_spawn_close_pid(pid);
-		g_io_channel_shutdown(stdout, TRUE, NULL);
-		g_io_channel_unref(stdout);
-		close(fp);
+		// on stop the workers only drop the queued directories, the pool is freed once
+		// none of them is left to push another one into it
+		while (!done)
+		{
+			tInode *inode = g_async_queue_pop(search.ready);
+
+			if (inode == &gWalkDone)
+				done = TRUE;
+			else
+				inode_free(inode);
+		}
+
+		g_thread_pool_free(search.pool, FALSE, TRUE);
+
+		if (!g_atomic_int_get(&stop_search))
+		{
+			emit_incomplete(&search);
+
+			if (search.found == 0)
+				gUpdateStatus(PluginNr, _("not found"), g_atomic_int_get(&search.scanned));
+		}
 	}
 
-	if (err)
-		g_error_free(err);
+	tInode *inode;
+
+	while ((inode = g_async_queue_try_pop(search.ready)) != NULL)
+		if (inode != &gWalkDone)
+			inode_free(inode);
+
+	g_async_queue_unref(search.ready);
+	g_hash_table_destroy(search.inodes);
+	g_strfreev(search.masks);
+	g_free(search.current);
+	g_mutex_clear(&search.mutex);
 
 	gAddFileProc(PluginNr, "");
 }
 
 void DCPCALL StopSearch(int PluginNr)
 {
-	stop_search = TRUE;
+	g_atomic_int_set(&stop_search, TRUE);
 }
 
 void DCPCALL Finalize(int PluginNr)
@@ -4,16 +4,44 @@
 #include <gcrypt.h>
 #include <libgen.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <linux/limits.h>
 #include <string.h>
+#include <errno.h>
 #include "wcxplugin.h"
 #include "extension.h"
 
 #define BUFF_SIZE 4096
+#define PROGRESS_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+
+typedef struct sHashPool
+{
+	GThreadPool *threads;
+	GMutex mutex;
+	GCond cond;
+	gint cancel;
+	guint window;
+} tHashPool;
+
+typedef struct sHashJob
+{
+	int algo;
+	char path[PATH_MAX];
+	const char *name;
+	char *hash;
+	gboolean is_link;
+	gboolean done;
+	gint skip;
+	off_t size;
+	off_t processed;
+	off_t reported;
+	tHashPool *pool;
+} tHashJob;
 
 typedef struct sArcData
 {
+	char arc_path[PATH_MAX];
 	char dir_path[PATH_MAX];
 	char last_path[PATH_MAX];
 	int algo;
@@ -25,6 +53,9 @@ typedef struct sArcData
 	GRegex *re;
 	FILE *fp;
 	gchar *last_hash;
+	FILE *ahead;
+	tHashPool *pool;
+	GQueue pending;
 	tChangeVolProc ChangeVolProc;
 	tProcessDataProc ProcessDataProc;
 } tArcData;
@@ -37,6 +68,16 @@ tExtensionStartupInfo* gStartupInfo = NULL;
 
 static char gLastPath[PATH_MAX];
 static int gFileNamePos;
+static int gThreads = 0;
+static gsize gBufSize = 1024 * 1024;
+
+static void free_read_buffer(gpointer data)
+{
+	free(data);
+}
+
+static GPrivate gReadBuffer = G_PRIVATE_INIT(free_read_buffer);
+
 static const char *gDialogData = R"(
 object DialogBox: TDialogBox
   Left = 245
@@ -260,90 +301,359 @@ static int get_algo_from_ext(const char*ext)
 	return ret;
 }
 
-static char* calc_hash(int algo, char *path, tProcessDataProc proc)
+void DCPCALL PackSetDefaultParams(PackDefaultParamStruct* dps)
 {
-	gcry_md_hd_t h;
-	gcry_error_t err;
-	size_t i, bytes, res_size;
-	unsigned char data[BUFF_SIZE];
+	GKeyFile *cfg = g_key_file_new();
+	gchar *cfg_dir = g_path_get_dirname(dps->DefaultIniName);
+	gchar *cfg_path = g_strdup_printf("%s/gcrypt_hash_crap.ini", cfg_dir);
+	g_free(cfg_dir);
+
+	if (g_key_file_load_from_file(cfg, cfg_path, G_KEY_FILE_KEEP_COMMENTS, NULL))
+	{
+		gThreads = g_key_file_get_integer(cfg, "Global", "Threads", NULL);
+		int kib = g_key_file_get_integer(cfg, "Global", "BufferSizeKiB", NULL);
+
+		if (kib > 0)
+			gBufSize = (gsize)kib * 1024;
+	}
+	else
+	{
+		g_key_file_set_integer(cfg, "Global", "Threads", gThreads);
+		g_key_file_set_comment(cfg, "Global", "Threads", "0 - use the number of available processors", NULL);
+		g_key_file_set_integer(cfg, "Global", "BufferSizeKiB", gBufSize / 1024);
+		g_key_file_save_to_file(cfg, cfg_path, NULL);
+	}
+
+	g_free(cfg_path);
+	g_key_file_free(cfg);
+}
+
+static char* digest_to_hex(gcry_md_hd_t h, int algo)
+{
+	size_t i;
 	char* result = NULL;
-	unsigned char* digest;
-	unsigned int digestlen;
+	unsigned char* digest = gcry_md_read(h, algo);
+	unsigned int digestlen = gcry_md_get_algo_dlen(algo);
+
+	if (digest == NULL || digestlen == 0)
+		return NULL;
+
+	result = (char*)malloc((size_t)digestlen * 2 + 1);
+
+	if (result != NULL)
+	{
+		for (i = 0; i < digestlen; i++)
+			sprintf(&result[i * 2], "%02x", digest[i]);
+	}
+
+	return result;
+}
+
+static unsigned char* get_read_buffer(void)
+{
+	void *buff = g_private_get(&gReadBuffer);
+
+	if (buff == NULL)
+	{
+		if (posix_memalign(&buff, sysconf(_SC_PAGESIZE), gBufSize) != 0)
+			return NULL;
+
+		g_private_set(&gReadBuffer, buff);
+	}
+
+	return (unsigned char*)buff;
+}
+
+// runs in a worker thread, must not touch the UI or the DC callbacks
+static char* calc_hash(tHashJob *job)
+{
+	int fd;
+	ssize_t bytes;
+	gcry_md_hd_t h;
 	struct stat buf;
-	size_t csize = 0, prcnt;
+	char* result = NULL;
+	unsigned char *data = get_read_buffer();
 
-	if (lstat(path, &buf) != 0)
+	if (data == NULL || lstat(job->path, &buf) != 0)
 		return NULL;
 
 	if (S_ISLNK(buf.st_mode))
 	{
-		if (stat(path, &buf) != 0 || !S_ISREG(buf.st_mode))
+		if (stat(job->path, &buf) != 0 || !S_ISREG(buf.st_mode))
 			return NULL;
 
-		char *msg;
-		asprintf(&msg, "\"%s\" is not a regular file.", path);
-		errmsg(msg, MB_OK | MB_ICONWARNING);
-		free(msg);
+		job->is_link = TRUE;
 	}
 	else if (!S_ISREG(buf.st_mode))
 		return NULL;
 
-	FILE *inFile = fopen(path, "rb");
+	__atomic_store_n(&job->size, buf.st_size, __ATOMIC_RELAXED);
 
-	if (inFile == NULL)
+	if ((fd = open(job->path, O_RDONLY | O_CLOEXEC)) == -1)
 		return NULL;
 
-	err = gcry_md_open(&h, algo, 0);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-	if (gcry_err_code(err))
+	if (gcry_err_code(gcry_md_open(&h, job->algo, 0)))
 	{
-		fclose(inFile);
+		close(fd);
 		return NULL;
 	}
 
-	while ((bytes = fread(data, 1, BUFF_SIZE, inFile)) != 0)
+	while ((bytes = read(fd, data, gBufSize)) != 0)
 	{
-		if (proc && proc(path, bytes) == 0)
+		if (bytes == -1)
 		{
-			fclose(inFile);
-			gcry_md_close(h);
-			return NULL;
+			if (errno == EINTR)
+				continue;
+
+			break;
 		}
 
+		if (g_atomic_int_get(&job->skip) || g_atomic_int_get(&job->pool->cancel))
+			break;
+
 		gcry_md_write(h, data, bytes);
+		__atomic_add_fetch(&job->processed, bytes, __ATOMIC_RELAXED);
+	}
+
+	if (bytes == 0)
+		result = digest_to_hex(h, job->algo);
 
-		if (buf.st_size > 0)
+	close(fd);
+	gcry_md_close(h);
+
+	return result;
+}
+
+static void hash_pool_func(gpointer data, gpointer user_data)
+{
+	tHashJob *job = (tHashJob*)data;
+	tHashPool *pool = (tHashPool*)user_data;
+
+	if (!g_atomic_int_get(&job->skip) && !g_atomic_int_get(&pool->cancel))
+		job->hash = calc_hash(job);
+
+	g_mutex_lock(&pool->mutex);
+	job->done = TRUE;
+	g_cond_broadcast(&pool->cond);
+	g_mutex_unlock(&pool->mutex);
+}
+
+static tHashPool* hash_pool_new(void)
+{
+	GError *err = NULL;
+	tHashPool *pool = g_new0(tHashPool, 1);
+	int threads = gThreads > 0 ? gThreads : (int)g_get_num_processors();
+
+	g_mutex_init(&pool->mutex);
+	g_cond_init(&pool->cond);
+	pool->window = threads * 4;
+	pool->threads = g_thread_pool_new(hash_pool_func, pool, threads, FALSE, &err);
+
+	if (pool->threads == NULL)
+	{
+		if (err)
 		{
-			csize += bytes;
-			prcnt = csize * 100 / buf.st_size;
+			errmsg(err->message, MB_OK | MB_ICONERROR);
+			g_error_free(err);
 		}
-		else
-			prcnt = 0;
 
-		proc(path, -(1000 + prcnt));
+		g_mutex_clear(&pool->mutex);
+		g_cond_clear(&pool->cond);
+		g_free(pool);
+		return NULL;
 	}
 
-	digest = gcry_md_read(h, algo);
-	digestlen = gcry_md_get_algo_dlen(algo);
+	return pool;
+}
+
+static void hash_job_free(tHashJob *job)
+{
+	if (job->hash)
+		free(job->hash);
+
+	g_free(job);
+}
+
+static void hash_pool_free(tHashPool *pool, GQueue *pending)
+{
+	if (!pool)
+		return;
+
+	g_atomic_int_set(&pool->cancel, 1);
+	g_thread_pool_free(pool->threads, TRUE, TRUE);
+	g_queue_foreach(pending, (GFunc)hash_job_free, NULL);
+	g_queue_clear(pending);
+	g_mutex_clear(&pool->mutex);
+	g_cond_clear(&pool->cond);
+	g_free(pool);
+}
+
+static tHashJob* hash_pool_push(tHashPool *pool, int algo, const char *path, const char *name)
+{
+	tHashJob *job = g_new0(tHashJob, 1);
+
+	job->algo = algo;
+	job->name = name;
+	job->pool = pool;
+	g_strlcpy(job->path, path, PATH_MAX);
+	g_thread_pool_push(pool->threads, job, NULL);
+
+	return job;
+}
+
+static gboolean hash_job_report(tHashJob *job, tProcessDataProc proc)
+{
+	size_t prcnt = 0;
+	off_t size = __atomic_load_n(&job->size, __ATOMIC_RELAXED);
+	off_t processed = __atomic_load_n(&job->processed, __ATOMIC_RELAXED);
+
+	if (!proc || processed == job->reported)
+		return TRUE;
+
+	if (proc(job->path, processed - job->reported) == 0)
+		return FALSE;
+
+	job->reported = processed;
 
-	if (digestlen > 0)
+	if (size > 0)
+		prcnt = processed * 100 / size;
+
+	proc(job->path, -(1000 + prcnt));
+
+	return TRUE;
+}
+
+// waits for the job, meanwhile reporting the progress of every job that is being hashed in parallel
+static gboolean hash_job_wait(tHashJob *job, GQueue *pending, tProcessDataProc proc)
+{
+	GList *l;
+	gboolean done;
+	gboolean ret = TRUE;
+	tHashPool *pool = job->pool;
+
+	do
 	{
-		res_size = (size_t)digestlen * sizeof(char) * 2 + 1;
-		result = (char*)malloc(res_size);
+		g_mutex_lock(&pool->mutex);
+
+		if (!job->done)
+			g_cond_wait_until(&pool->cond, &pool->mutex, g_get_monotonic_time() + PROGRESS_INTERVAL);
+
+		done = job->done;
+		g_mutex_unlock(&pool->mutex);
+
+		if (!ret)
+			continue;
+
+		ret = hash_job_report(job, proc);
+
+		for (l = pending ? pending->head : NULL; ret && l != NULL; l = l->next)
+			ret = hash_job_report((tHashJob*)l->data, proc);
+
+		if (!ret)
+			g_atomic_int_set(&pool->cancel, 1);
 	}
+	while (!done);
 
-	if (result != NULL)
+	return ret;
+}
+
+static void hash_job_discard(tHashJob *job)
+{
+	g_atomic_int_set(&job->skip, 1);
+	hash_job_wait(job, NULL, NULL);
+	hash_job_free(job);
+}
+
+static gboolean parse_line(ArcData handle, const char *line, gchar **hash, char *name, size_t name_size, char *path)
+{
+	GMatchInfo *match_info = NULL;
+
+	if (!g_regex_match(handle->re, line, 0, &match_info))
+	{
+		g_match_info_free(match_info);
+		return FALSE;
+	}
+
+	gchar *str_file = g_match_info_fetch(match_info, 2);
+
+	if (hash)
+		*hash = g_match_info_fetch(match_info, 1);
+
+	if (str_file[0] != '/')
 	{
-		memset(result, 0, res_size);
+		if (name)
+			g_strlcpy(name, str_file, name_size);
 
-		for (i = 0; i < digestlen; i++)
-			sprintf(&result[i * 2], "%02x", digest[i]);
+		snprintf(path, PATH_MAX, "%s/%s", handle->dir_path, str_file);
 	}
+	else
+	{
+		if (name)
+			g_strlcpy(name, str_file + 1, name_size);
 
-	fclose(inFile);
-	gcry_md_close(h);
-	return result;
+		g_strlcpy(path, str_file, PATH_MAX);
+	}
+
+	g_free(str_file);
+	g_match_info_free(match_info);
+
+	return TRUE;
+}
+
+static void verify_reset(ArcData handle)
+{
+	tHashJob *job;
+
+	while ((job = g_queue_pop_head(&handle->pending)) != NULL)
+		hash_job_discard(job);
 
+	if (handle->ahead)
+		fseek(handle->ahead, ftell(handle->fp), SEEK_SET);
+}
+
+// hashes the entries following the current one while DC is busy with it
+static void verify_prefetch(ArcData handle)
+{
+	char *line = NULL;
+	size_t len = 0;
+	char path[PATH_MAX];
+
+	if (!handle->ahead)
+	{
+		if ((handle->ahead = fopen(handle->arc_path, "r")) == NULL)
+			return;
+
+		fseek(handle->ahead, ftell(handle->fp), SEEK_SET);
+	}
+
+	while (g_queue_get_length(&handle->pending) < handle->pool->window && getline(&line, &len, handle->ahead) != -1)
+	{
+		if (!parse_line(handle, line, NULL, NULL, 0, path))
+			break;
+
+		g_queue_push_tail(&handle->pending, hash_pool_push(handle->pool, handle->algo, path, NULL));
+	}
+
+	free(line);
+}
+
+static tHashJob* verify_take(ArcData handle)
+{
+	tHashJob *job = g_queue_peek_head(&handle->pending);
+
+	if (job && strcmp(job->path, handle->last_path) == 0)
+		g_queue_pop_head(&handle->pending);
+	else
+	{
+		verify_reset(handle);
+		job = hash_pool_push(handle->pool, handle->algo, handle->last_path, NULL);
+	}
+
+	verify_prefetch(handle);
+
+	return job;
 }
 
 HANDLE DCPCALL OpenArchive(tOpenArchiveData *ArchiveData)
@@ -363,6 +673,7 @@ HANDLE DCPCALL OpenArchive(tOpenArchiveData *ArchiveData)
 	memset(handle, 0, sizeof(tArcData));
 
 	g_strlcpy(arc, ArchiveData->ArcName, PATH_MAX);
+	g_strlcpy(handle->arc_path, ArchiveData->ArcName, PATH_MAX);
 
 	const char *ext = strrchr(arc, '.');
 	handle->algo = get_algo_from_ext(ext);
@@ -394,6 +705,7 @@ HANDLE DCPCALL OpenArchive(tOpenArchiveData *ArchiveData)
 
 	if (handle->fp == NULL)
 	{
+		g_regex_unref(handle->re);
 		free(handle);
 		ArchiveData->OpenResult = E_UNKNOWN_FORMAT;
 		return E_SUCCESS;
@@ -401,6 +713,7 @@ HANDLE DCPCALL OpenArchive(tOpenArchiveData *ArchiveData)
 
 	g_strlcpy(handle->dir_path, dirname(arc), PATH_MAX);
 	handle->op_test = FALSE;
+	g_queue_init(&handle->pending);
 
 	return (HANDLE)handle;
 }
@@ -416,7 +729,6 @@ int DCPCALL ReadHeaderEx(HANDLE hArcData, tHeaderDataEx *HeaderDataEx)
 	size_t len = 0;
 	ssize_t lread;
 	struct stat buf;
-	GMatchInfo *match_info;
 
 	memset(HeaderDataEx, 0, sizeof(&HeaderDataEx));
 	ArcData handle = (ArcData)hArcData;
@@ -430,26 +742,13 @@ int DCPCALL ReadHeaderEx(HANDLE hArcData, tHeaderDataEx *HeaderDataEx)
 
 	if ((lread = getline(&line, &len, handle->fp)) != -1)
 	{
-		if (!g_regex_match(handle->re, line, 0, &match_info))
+		if (!parse_line(handle, line, &handle->last_hash, HeaderDataEx->FileName, sizeof(HeaderDataEx->FileName) - 1, handle->last_path))
 		{
+			free(line);
 			errmsg("Failed to parse file.", MB_OK | MB_ICONERROR);
 			return E_BAD_ARCHIVE;
 		}
 
-		handle->last_hash = g_strdup(g_match_info_fetch(match_info, 1));
-		gchar *str_file = g_match_info_fetch(match_info, 2);
-
-		if (str_file[0] != '/')
-		{
-			g_strlcpy(HeaderDataEx->FileName, str_file, sizeof(HeaderDataEx->FileName) - 1);
-			snprintf(handle->last_path, PATH_MAX, "%s/%s", handle->dir_path, str_file);
-		}
-		else
-		{
-			g_strlcpy(HeaderDataEx->FileName, str_file + 1, sizeof(HeaderDataEx->FileName) - 1);
-			g_strlcpy(handle->last_path, str_file, PATH_MAX);
-		}
-
 		handle->last_file_len = strlen(HeaderDataEx->FileName);
 
 		if (lstat(handle->last_path, &buf) == 0)
@@ -463,10 +762,10 @@ int DCPCALL ReadHeaderEx(HANDLE hArcData, tHeaderDataEx *HeaderDataEx)
 		}
 	}
 	else
+	{
+		free(line);
 		return E_END_ARCHIVE;
-
-	if (match_info)
-		g_match_info_free(match_info);
+	}
 
 	if (line)
 		free(line);
@@ -496,12 +795,41 @@ int DCPCALL ProcessFile(HANDLE hArcData, int Operation, char *DestPath, char *De
 			g_strlcpy(handle->dir_path, gLastPath, len - handle->last_file_len);
 	}
 
+	if (Operation != PK_TEST)
+	{
+		tHashJob *job = g_queue_peek_head(&handle->pending);
+
+		if (job && strcmp(job->path, handle->last_path) == 0)
+			hash_job_discard(g_queue_pop_head(&handle->pending));
+	}
+
 	if (Operation == PK_TEST)
 	{
 		if (handle->op_test == FALSE)
 			handle->op_test = TRUE;
 
-		char *hash = calc_hash(handle->algo, handle->last_path, handle->ProcessDataProc);
+		if (!handle->pool && (handle->pool = hash_pool_new()) == NULL)
+			return E_NO_MEMORY;
+
+		tHashJob *job = verify_take(handle);
+
+		if (!hash_job_wait(job, &handle->pending, handle->ProcessDataProc))
+		{
+			hash_job_free(job);
+			return E_EABORTED;
+		}
+
+		if (job->is_link)
+		{
+			char *msg;
+			asprintf(&msg, "\"%s\" is not a regular file.", job->path);
+			errmsg(msg, MB_OK | MB_ICONWARNING);
+			free(msg);
+		}
+
+		char *hash = job->hash;
+		job->hash = NULL;
+		hash_job_free(job);
 
 		if (hash)
 		{
@@ -514,7 +842,10 @@ int DCPCALL ProcessFile(HANDLE hArcData, int Operation, char *DestPath, char *De
 				handle->differ++;
 
 				if (ret != ID_OK)
+				{
+					free(hash);
 					return E_EABORTED;
+				}
 			}
 			else
 				handle->same++;
@@ -559,9 +890,14 @@ int DCPCALL CloseArchive(HANDLE hArcData)
 {
 	ArcData handle = (ArcData)hArcData;
 
+	hash_pool_free(handle->pool, &handle->pending);
+
 	if (handle->last_hash != NULL)
 		g_free(handle->last_hash);
 
+	if (handle->ahead)
+		fclose(handle->ahead);
+
 	fclose(handle->fp);
 	g_regex_unref(handle->re);
 
@@ -616,7 +952,10 @@ int DCPCALL GetPackerCaps(void)
 int DCPCALL PackFiles(char *PackedFile, char *SubPath, char *SrcPath, char *AddList, int Flags)
 {
 	FILE *fp;
+	tHashJob *job;
+	tHashPool *pool;
 	char path[PATH_MAX];
+	GQueue pending = G_QUEUE_INIT;
 	const char *ext = strrchr(PackedFile, '.');
 	int algo = get_algo_from_ext(ext);
 
@@ -626,39 +965,71 @@ int DCPCALL PackFiles(char *PackedFile, char *SubPath, char *SrcPath, char *AddL
 	if (access(PackedFile, F_OK) != -1)
 		errmsg("Only append to file is supported.", MB_OK | MB_ICONWARNING);
 
+	if ((pool = hash_pool_new()) == NULL)
+		return E_NO_MEMORY;
+
 	if ((fp = fopen(PackedFile, "a")) == NULL)
+	{
+		hash_pool_free(pool, &pending);
 		return E_EWRITE;
+	}
 
-	while (*AddList)
+	while (TRUE)
 	{
-		if (AddList[strlen(AddList) - 1] != '/')
+		while (*AddList && g_queue_get_length(&pending) < pool->window)
 		{
-			snprintf(path, PATH_MAX, "%s%s", SrcPath, AddList);
-
-			char *hash = calc_hash(algo, path, gProcessDataProc);
-
-			if (hash)
+			if (AddList[strlen(AddList) - 1] != '/')
 			{
-				fprintf(fp, "%s *%s\n", hash, AddList);
-				free(hash);
+				snprintf(path, PATH_MAX, "%s%s", SrcPath, AddList);
+				g_queue_push_tail(&pending, hash_pool_push(pool, algo, path, AddList));
 			}
-			else if (gProcessDataProc(path, 0) == 0)
-				break;
-			else
-			{
-				char *msg;
-				asprintf(&msg, "Unable to compute hash (%s) of \"%s\".", gcry_md_algo_name(algo), path);
 
-				if (errmsg(msg, MB_OKCANCEL | MB_ICONERROR) != ID_OK)
-					break;
+			while (*AddList++);
+		}
 
-				free(msg);
+		// the lines are written in AddList order, no matter which worker finishes first
+		if ((job = g_queue_pop_head(&pending)) == NULL)
+			break;
+
+		if (!hash_job_wait(job, &pending, gProcessDataProc))
+		{
+			hash_job_free(job);
+			break;
+		}
+
+		if (job->is_link)
+		{
+			char *msg;
+			asprintf(&msg, "\"%s\" is not a regular file.", job->path);
+			errmsg(msg, MB_OK | MB_ICONWARNING);
+			free(msg);
+		}
+
+		if (job->hash)
+			fprintf(fp, "%s *%s\n", job->hash, job->name);
+		else if (gProcessDataProc(job->path, 0) == 0)
+		{
+			hash_job_free(job);
+			break;
+		}
+		else
+		{
+			char *msg;
+			asprintf(&msg, "Unable to compute hash (%s) of \"%s\".", gcry_md_algo_name(algo), job->path);
+			int ret = errmsg(msg, MB_OKCANCEL | MB_ICONERROR);
+			free(msg);
+
+			if (ret != ID_OK)
+			{
+				hash_job_free(job);
+				break;
 			}
 		}
 
-		while (*AddList++);
+		hash_job_free(job);
 	}
 
+	hash_pool_free(pool, &pending);
 	fclose(fp);
 
 	return E_SUCCESS;
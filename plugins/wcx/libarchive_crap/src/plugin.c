@@ -22,13 +22,28 @@
 #include <fnmatch.h>
 #include <dlfcn.h>
 #include <limits.h>
+#include <time.h>
+#include <zlib.h>
 
 #include <glib.h>
 
 typedef struct sArcData
 {
 	struct archive *archive;
+	struct archive *disk;
 	struct archive_entry *entry;
+	char *wbuff;
+	char *list;
+	gsize list_len;
+	gsize list_pos;
+	int list_format;
+	int64_t list_offset;
+	mode_t list_mode;
+	char list_name[PATH_MAX];
+	int list_fd;
+	GByteArray *record;
+	bool record_seekable;
+	GHashTable *zip_offsets;
 	char arcname[PATH_MAX + 1];
 	tChangeVolProc gChangeVolProc;
 	tProcessDataProc gProcessDataProc;
@@ -37,7 +52,120 @@ typedef struct sArcData
 typedef tArcData* ArcData;
 typedef void *HINSTANCE;
 
+typedef struct sAppendData
+{
+	int fd;
+	off_t offset;
+	off_t end;
+	size_t skip;
+	char *tail;
+	size_t tail_len;
+} tAppendData;
+
 #define BUFF_SIZE 8192
+#define READ_BLOCK_SIZE 262144
+#define WRITE_BUFF_SIZE 1048576
+#define PREALLOC_MIN_SIZE 1048576
+#define APPEND_MAX_TAIL 1048576
+#define PGZ_BLOCK_SIZE 131072
+#define PGZ_DICT_SIZE 32768
+#define RA_SLOTS 16
+#define RA_BUFF_SIZE 524288
+#define LISTCACHE_DIR "libarchive_crap.cache"
+#define LISTCACHE_MAGIC "DCLACIX2"
+#define LISTCACHE_MAX_FILES 256
+
+typedef struct sPgzBlock
+{
+	unsigned char *in;
+	unsigned char *out;
+	size_t in_len;
+	size_t out_len;
+	unsigned char dict[PGZ_DICT_SIZE];
+	size_t dict_len;
+	uLong crc;
+	bool last;
+	bool done;
+	bool failed;
+} tPgzBlock;
+
+typedef struct sPgzData
+{
+	int fd;
+	int level;
+	GThreadPool *pool;
+	GQueue *blocks;
+	GMutex lock;
+	GCond cond;
+	tPgzBlock *cur;
+	unsigned char dict[PGZ_DICT_SIZE];
+	size_t dict_len;
+	uLong crc;
+	uint64_t isize;
+	guint max_blocks;
+	bool failed;
+} tPgzData;
+
+typedef struct sReadAheadSlot
+{
+	char *buff;
+	size_t len;
+	int index;
+	int error;
+	bool eof;
+} tReadAheadSlot;
+
+typedef struct sReadAhead
+{
+	GThread *thread;
+	GMutex lock;
+	GCond cond;
+	char *srcpath;
+	char *list;
+	tReadAheadSlot slots[RA_SLOTS];
+	guint head;
+	guint tail;
+	int index;
+	bool stop;
+	bool done;
+} tReadAhead;
+
+typedef struct sListCacheHeader
+{
+	char magic[8];
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+	guint opts;
+	gint format;
+} tListCacheHeader;
+
+typedef struct sListCacheRecord
+{
+	uint64_t pack_size;
+	uint64_t unp_size;
+	int64_t offset;
+	int32_t time;
+	int32_t attr;
+	int32_t flags;
+	uint32_t name_len;
+} tListCacheRecord;
+
+typedef struct sListCacheFile
+{
+	gchar *path;
+	time_t mtime;
+} tListCacheFile;
+
+typedef struct sPackProgress
+{
+	const char *infile;
+	uint64_t packed;
+	gint64 start;
+	size_t csize;
+	size_t fsize;
+	char label[PATH_MAX + 32];
+} tPackProgress;
 
 tChangeVolProc gChangeVolProc  = NULL;
 tProcessDataProc gProcessDataProc = NULL;
@@ -61,6 +189,7 @@ static int  gTarFormat = ARCHIVE_FORMAT_TAR;
 static int  gCpioFormat = ARCHIVE_FORMAT_CPIO;
 static bool gArFormatBsd = false;
 static bool gSharFormatDump = false;
+static int  gThreads = 0;
 
 GKeyFile *gCfg;
 gchar *gCfgPath = NULL;
@@ -95,6 +224,7 @@ static void config_get_options(void)
 	gCpioFormat = g_key_file_get_integer(gCfg, "Global", "CpioFormat", NULL);
 	gArFormatBsd = g_key_file_get_boolean(gCfg, "Global", "ArFormatBsd", NULL);
 	gSharFormatDump = g_key_file_get_boolean(gCfg, "Global", "SharFormatDump", NULL);
+	gThreads = g_key_file_get_integer(gCfg, "Global", "Threads", NULL);
 }
 
 static void config_set_options(void)
@@ -111,6 +241,7 @@ static void config_set_options(void)
 	g_key_file_set_integer(gCfg, "Global", "CpioFormat", gCpioFormat);
 	g_key_file_set_boolean(gCfg, "Global", "ArFormatBsd", gArFormatBsd);
 	g_key_file_set_boolean(gCfg, "Global", "SharFormatDump", gSharFormatDump);
+	g_key_file_set_integer(gCfg, "Global", "Threads", gThreads);
 
 	g_key_file_set_string(gCfg, "Global", "Encryption", gEncryption);
 }
@@ -304,6 +435,368 @@ static bool mtree_opts_nodata(void)
 	return result;
 }
 
+static int filter_threads(void)
+{
+	if (gThreads > 0)
+		return gThreads;
+
+	return (int)g_get_num_processors();
+}
+
+static bool pgz_enabled(const char *ext)
+{
+	if (!ext || filter_threads() < 2 || g_key_file_has_key(gCfg, ext, "write_cmd", NULL))
+		return false;
+
+	return (strcasecmp(ext, ".gz") == 0 || strcasecmp(ext, ".tgz") == 0);
+}
+
+// pigz style: every block is deflated on its own, primed with the last 32K of the previous one
+static void pgz_deflate_block(gpointer data, gpointer user_data)
+{
+	z_stream strm;
+	tPgzBlock *block = (tPgzBlock*)data;
+	tPgzData *pgz = (tPgzData*)user_data;
+	int ret = Z_STREAM_ERROR;
+
+	memset(&strm, 0, sizeof(strm));
+	block->crc = crc32(0L, block->in, block->in_len);
+
+	if (deflateInit2(&strm, pgz->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+	{
+		if (block->dict_len > 0)
+			deflateSetDictionary(&strm, block->dict, block->dict_len);
+
+		// a sync flush adds an empty stored block (5 bytes) to the deflate bound
+		block->out_len = deflateBound(&strm, block->in_len) + 64;
+		block->out = malloc(block->out_len);
+
+		if (block->out)
+		{
+			strm.next_in = block->in;
+			strm.avail_in = block->in_len;
+			strm.next_out = block->out;
+			strm.avail_out = block->out_len;
+			ret = deflate(&strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+			block->out_len -= strm.avail_out;
+
+			if ((block->last && ret != Z_STREAM_END) || (!block->last && (ret != Z_OK || strm.avail_out == 0)))
+				ret = Z_BUF_ERROR;
+			else
+				ret = Z_OK;
+		}
+
+		deflateEnd(&strm);
+	}
+
+	g_mutex_lock(&pgz->lock);
+	block->failed = (ret != Z_OK);
+	block->done = true;
+	g_cond_broadcast(&pgz->cond);
+	g_mutex_unlock(&pgz->lock);
+}
+
+static bool pgz_write_all(int fd, const unsigned char *buff, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0)
+	{
+		ret = write(fd, buff, len);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		else if (ret <= 0)
+			return false;
+
+		buff += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static void pgz_block_free(tPgzBlock *block)
+{
+	free(block->in);
+	free(block->out);
+	free(block);
+}
+
+// writes out finished blocks in order until no more than keep are in flight
+static bool pgz_drain(tPgzData *pgz, guint keep)
+{
+	tPgzBlock *block;
+
+	while (g_queue_get_length(pgz->blocks) > keep)
+	{
+		block = (tPgzBlock*)g_queue_peek_head(pgz->blocks);
+
+		g_mutex_lock(&pgz->lock);
+
+		while (!block->done)
+			g_cond_wait(&pgz->cond, &pgz->lock);
+
+		g_mutex_unlock(&pgz->lock);
+		g_queue_pop_head(pgz->blocks);
+
+		if (!pgz->failed)
+		{
+			if (block->failed || !pgz_write_all(pgz->fd, block->out, block->out_len))
+				pgz->failed = true;
+
+			pgz->crc = crc32_combine(pgz->crc, block->crc, block->in_len);
+			pgz->isize += block->in_len;
+		}
+
+		pgz_block_free(block);
+	}
+
+	return !pgz->failed;
+}
+
+static bool pgz_submit(tPgzData *pgz, bool last)
+{
+	tPgzBlock *block = pgz->cur;
+
+	if (!block)
+	{
+		block = g_new0(tPgzBlock, 1);
+		block->in = malloc(1);
+	}
+
+	pgz->cur = NULL;
+	block->last = last;
+	memcpy(block->dict, pgz->dict, pgz->dict_len);
+	block->dict_len = pgz->dict_len;
+
+	if (block->in_len >= PGZ_DICT_SIZE)
+	{
+		memcpy(pgz->dict, block->in + block->in_len - PGZ_DICT_SIZE, PGZ_DICT_SIZE);
+		pgz->dict_len = PGZ_DICT_SIZE;
+	}
+	else if (block->in_len > 0)
+	{
+		size_t keep = MIN(pgz->dict_len, PGZ_DICT_SIZE - block->in_len);
+		memmove(pgz->dict, pgz->dict + pgz->dict_len - keep, keep);
+		memcpy(pgz->dict + keep, block->in, block->in_len);
+		pgz->dict_len = keep + block->in_len;
+	}
+
+	g_queue_push_tail(pgz->blocks, block);
+	g_thread_pool_push(pgz->pool, block, NULL);
+
+	return pgz_drain(pgz, pgz->max_blocks);
+}
+
+static la_ssize_t pgz_write_cb(struct archive *a, void *client_data, const void *buff, size_t length)
+{
+	size_t chunk;
+	size_t done = 0;
+	tPgzData *pgz = (tPgzData*)client_data;
+
+	while (done < length)
+	{
+		if (!pgz->cur)
+		{
+			pgz->cur = g_new0(tPgzBlock, 1);
+			pgz->cur->in = malloc(PGZ_BLOCK_SIZE);
+
+			if (!pgz->cur->in)
+			{
+				archive_set_error(a, ENOMEM, "Can't allocate gzip block");
+				return -1;
+			}
+		}
+
+		chunk = MIN(length - done, PGZ_BLOCK_SIZE - pgz->cur->in_len);
+		memcpy(pgz->cur->in + pgz->cur->in_len, (const char*)buff + done, chunk);
+		pgz->cur->in_len += chunk;
+		done += chunk;
+
+		if (pgz->cur->in_len == PGZ_BLOCK_SIZE && !pgz_submit(pgz, false))
+		{
+			archive_set_error(a, EIO, "gzip: write failed");
+			return -1;
+		}
+	}
+
+	return length;
+}
+
+static int pgz_close_cb(struct archive *a, void *client_data)
+{
+	int ret = ARCHIVE_OK;
+	unsigned char trailer[8];
+	tPgzData *pgz = (tPgzData*)client_data;
+
+	if (pgz_submit(pgz, true) && pgz_drain(pgz, 0))
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			trailer[i] = (pgz->crc >> (i * 8)) & 0xFF;
+			trailer[i + 4] = (pgz->isize >> (i * 8)) & 0xFF;
+		}
+
+		if (!pgz_write_all(pgz->fd, trailer, sizeof(trailer)))
+			pgz->failed = true;
+	}
+
+	if (pgz->failed)
+	{
+		archive_set_error(a, EIO, "gzip: write failed");
+		ret = ARCHIVE_FATAL;
+	}
+
+	g_thread_pool_free(pgz->pool, FALSE, TRUE);
+	pgz_drain(pgz, 0);
+
+	if (pgz->cur)
+		pgz_block_free(pgz->cur);
+
+	g_queue_free(pgz->blocks);
+	g_mutex_clear(&pgz->lock);
+	g_cond_clear(&pgz->cond);
+	g_free(pgz);
+
+	return ret;
+}
+
+/*
+ * Splits the gzip options off, libarchive does not know them without its own gzip filter.
+ * rest receives everything else.
+ */
+static void pgz_parse_options(const char *options, int *level, bool *timestamp, char *rest)
+{
+	rest[0] = '\0';
+
+	if (!options || options[0] == '\0')
+		return;
+
+	gchar **items = g_strsplit(options, ",", -1);
+
+	for (gchar **item = items; *item; item++)
+	{
+		char *opt = *item;
+		char *colon = strchr(opt, ':');
+
+		if (colon && strncmp(opt, "gzip:", 5) == 0)
+			opt = colon + 1;
+		else if (colon)
+		{
+			if (rest[0] != '\0')
+				g_strlcat(rest, ",", PATH_MAX);
+
+			g_strlcat(rest, *item, PATH_MAX);
+			continue;
+		}
+
+		if (strncmp(opt, "compression-level=", 18) == 0)
+			*level = atoi(opt + 18);
+		else if (strcmp(opt, "timestamp") == 0)
+			*timestamp = true;
+		else if (strcmp(opt, "!timestamp") == 0)
+			*timestamp = false;
+		else if (opt[0] != '\0' && opt == *item)
+		{
+			if (rest[0] != '\0')
+				g_strlcat(rest, ",", PATH_MAX);
+
+			g_strlcat(rest, opt, PATH_MAX);
+		}
+	}
+
+	g_strfreev(items);
+}
+
+static int archive_apply_options(struct archive *a, const char *ext, const char *options)
+{
+	int level = Z_DEFAULT_COMPRESSION;
+	bool timestamp = true;
+	char rest[PATH_MAX];
+
+	if (!pgz_enabled(ext))
+		return archive_write_set_options(a, options);
+
+	pgz_parse_options(options, &level, &timestamp, rest);
+
+	if (rest[0] == '\0')
+		return ARCHIVE_OK;
+
+	return archive_write_set_options(a, rest);
+}
+
+static int archive_open_output(struct archive *a, const char *ext, int ofd, const char *options)
+{
+	tPgzData *pgz;
+	bool timestamp = true;
+	char rest[PATH_MAX];
+	unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+	if (!pgz_enabled(ext))
+		return archive_write_open_fd(a, ofd);
+
+	pgz = g_new0(tPgzData, 1);
+	pgz->fd = ofd;
+	pgz->level = Z_DEFAULT_COMPRESSION;
+	pgz_parse_options(options, &pgz->level, &timestamp, rest);
+
+	if (pgz->level < 0 || pgz->level > 9)
+		pgz->level = Z_DEFAULT_COMPRESSION;
+
+	if (timestamp)
+	{
+		time_t now = time(NULL);
+
+		for (int i = 0; i < 4; i++)
+			header[4 + i] = (now >> (i * 8)) & 0xFF;
+	}
+
+	if (pgz->level == 9)
+		header[8] = 2;
+	else if (pgz->level == 1)
+		header[8] = 4;
+
+	pgz->max_blocks = filter_threads() * 2;
+	pgz->blocks = g_queue_new();
+	g_mutex_init(&pgz->lock);
+	g_cond_init(&pgz->cond);
+	pgz->pool = g_thread_pool_new(pgz_deflate_block, pgz, filter_threads(), FALSE, NULL);
+
+	if (!pgz_write_all(ofd, header, sizeof(header)))
+		pgz->failed = true;
+
+	// raw gzip stream, the last block must not be padded
+	archive_write_set_bytes_in_last_block(a, 1);
+
+	return archive_write_open(a, pgz, NULL, pgz_write_cb, pgz_close_cb);
+}
+
+static void archive_set_filter_threads(struct archive *a)
+{
+	char threads[16];
+
+	snprintf(threads, sizeof(threads), "%d", filter_threads());
+
+	for (int i = 0; i < archive_filter_count(a); i++)
+	{
+		if (archive_filter_code(a, i) == ARCHIVE_FILTER_XZ)
+			archive_write_set_filter_option(a, "xz", "threads", threads);
+		else if (archive_filter_code(a, i) == ARCHIVE_FILTER_ZSTD)
+			archive_write_set_filter_option(a, "zstd", "threads", threads);
+	}
+}
+
+static void progress_label(const char *infile, uint64_t done, gint64 start, char *label, size_t size)
+{
+	gint64 elapsed = g_get_monotonic_time() - start;
+
+	if (elapsed < G_USEC_PER_SEC)
+		g_strlcpy(label, infile, size);
+	else
+		snprintf(label, size, "%s (%.1f MiB/s)", infile, (double)done / 1048576 * G_USEC_PER_SEC / elapsed);
+}
+
 static int archive_set_format_filter(struct archive *a, const char*ext)
 {
 	int ret;
@@ -379,7 +872,9 @@ static int archive_set_format_filter(struct archive *a, const char*ext)
 	else if (strcasecmp(ext, ".gz") == 0)
 	{
 		ret = archive_write_set_format_raw(a);
-		ret = archive_write_add_filter_gzip(a);
+
+		if (!pgz_enabled(ext))
+			ret = archive_write_add_filter_gzip(a);
 	}
 	else if (strcasecmp(ext, ".xz") == 0)
 	{
@@ -429,7 +924,9 @@ static int archive_set_format_filter(struct archive *a, const char*ext)
 	else if (strcasecmp(ext, ".tgz") == 0)
 	{
 		ret = archive_write_set_format(a, gTarFormat);
-		ret = archive_write_add_filter_gzip(a);
+
+		if (!pgz_enabled(ext))
+			ret = archive_write_add_filter_gzip(a);
 	}
 	else if (strcasecmp(ext, ".tbz2") == 0)
 	{
@@ -457,16 +954,49 @@ const char *archive_password_cb(struct archive *a, void *data)
 		return NULL;
 }
 
+static bool repack_skip_name(const char *infile, char *skiplist, char *subpath, int flags)
+{
+	char fname[PATH_MAX];
+	char rmfile[PATH_MAX];
+
+	while (*skiplist)
+	{
+		g_strlcpy(fname, skiplist, PATH_MAX);
+
+		if (!(flags & PK_PACK_SAVE_PATHS))
+		{
+			gchar *bname = g_path_get_basename(fname);
+			g_strlcpy(fname, bname, PATH_MAX);
+			g_free(bname);
+		}
+
+		if (!subpath)
+			strcpy(rmfile, fname);
+		else
+			snprintf(rmfile, PATH_MAX, "%s/%s", subpath, fname);
+
+		size_t len = strlen(rmfile);
+
+		if (len >= 4 && strncmp(rmfile + len - 4, "/*.*", 4) == 0)
+			rmfile[len - 2] = 0;
+
+		if (strcmp(rmfile, infile) == 0 || fnmatch(rmfile, infile, FNM_CASEFOLD) == 0)
+			return true;
+
+		while (*skiplist++);
+	}
+
+	return false;
+}
+
 int archive_repack_existing(struct archive *a, char* filename, char** tmpfn, int ofd, char* headlist, char* subpath, int flags, const char *ext)
 {
 	size_t size;
 	la_int64_t offset;
 	const void *buff;
-	bool skip_file;
-	char fname[PATH_MAX];
 	char infile[PATH_MAX];
-	char rmfile[PATH_MAX];
-	char *msg, *skiplist;
+	char *msg;
+	char *options = NULL;
 	struct archive_entry *entry;
 	int result = E_SUCCESS, ret, ret_header;
 	size_t fsize, csize, prcnt;
@@ -491,8 +1021,12 @@ int archive_repack_existing(struct archive *a, char* filename, char** tmpfn, int
 			asprintf(&msg, "Use these options '%s'?", gOptions);
 
 			if (errmsg(msg, MB_YESNO | MB_ICONQUESTION) == ID_YES)
-				if (archive_write_set_options(a, gOptions) < ARCHIVE_OK)
+			{
+				options = gOptions;
+
+				if (archive_apply_options(a, ext, options) < ARCHIVE_OK)
 					errmsg(archive_error_string(a), MB_OK | MB_ICONWARNING);
+			}
 
 			free(msg);
 		}
@@ -523,102 +1057,854 @@ int archive_repack_existing(struct archive *a, char* filename, char** tmpfn, int
 			result = E_EWRITE;
 		else if ((ofd = open(*tmpfn, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
 			result = E_EWRITE;
-		else if (archive_write_open_fd(a, ofd) < ARCHIVE_OK)
+		else if (archive_open_output(a, ext, ofd, options) < ARCHIVE_OK)
 		{
 			errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
 			result = E_EWRITE;
 		}
 
-		while (result == E_SUCCESS && (ret_header = archive_read_next_header(org, &entry)) == ARCHIVE_OK)
+		while (result == E_SUCCESS && (ret_header = archive_read_next_header(org, &entry)) == ARCHIVE_OK)
+		{
+			fsize = archive_entry_size(entry);
+			csize = 0;
+
+			g_strlcpy(infile, archive_entry_pathname(entry), PATH_MAX);
+
+			if (!repack_skip_name(infile, headlist, subpath, flags))
+			{
+				archive_write_header(a, entry);
+
+				while ((ret = archive_read_data_block(org, &buff, &size, &offset)) != ARCHIVE_EOF)
+				{
+					if (ret < ARCHIVE_OK)
+					{
+						errmsg(archive_error_string(org), MB_OK | MB_ICONERROR);
+						result = E_EABORTED;
+						break;
+					}
+					else if (archive_write_data(a, buff, size) < ARCHIVE_OK)
+					{
+						errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
+						result = E_EWRITE;
+						break;
+					}
+
+					if (fsize > 0)
+					{
+						csize += size;
+						prcnt = csize * 100 / fsize;
+					}
+					else
+						prcnt = 0;
+
+					if (gProcessDataProc(infile, -(1000 + prcnt)) == 0)
+					{
+						result = E_EABORTED;
+						break;
+					}
+				}
+			}
+		}
+
+		archive_read_close(org);
+	}
+
+	archive_read_free(org);
+
+	if (ret_header < ARCHIVE_OK)
+		result = E_EREAD;
+
+	if (result != E_SUCCESS)
+	{
+		if (*tmpfn != NULL)
+		{
+			remove_file(*tmpfn);
+			free(*tmpfn);
+			*tmpfn = NULL;
+		}
+	}
+
+	return result;
+}
+
+static void append_normalize_name(char *name)
+{
+	size_t len;
+
+	while (name[0] == '.' && name[1] == '/')
+		memmove(name, name + 2, strlen(name + 2) + 1);
+
+	while (name[0] == '/')
+		memmove(name, name + 1, strlen(name + 1) + 1);
+
+	len = strlen(name);
+
+	while (len > 0 && name[len - 1] == '/')
+		name[--len] = '\0';
+}
+
+static la_ssize_t append_write_cb(struct archive *a, void *client_data, const void *buff, size_t length)
+{
+	ssize_t ret;
+	tAppendData *data = (tAppendData*)client_data;
+	const char *pos = (const char*)buff;
+	size_t len = length;
+
+	// the ar writer always starts with the global header, the existing archive already has one
+	if (data->skip > 0)
+	{
+		size_t skip = data->skip < len ? data->skip : len;
+		data->skip -= skip;
+		pos += skip;
+		len -= skip;
+	}
+
+	while (len > 0)
+	{
+		if ((ret = write(data->fd, pos, len)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		pos += ret;
+		len -= ret;
+		data->end += ret;
+	}
+
+	return length;
+}
+
+/*
+ * Uncompressed tar, cpio and ar archives can be extended in place: new entries overwrite the
+ * end-of-archive marker and a new one is written after them. Returns E_NOT_SUPPORTED if the archive
+ * must be repacked instead (compressed, other format, or some of the added names already exist).
+ */
+static int archive_append_open(struct archive *a, char* filename, char* addlist, char* subpath, int flags, const char *ext, tAppendData *data)
+{
+	int ret;
+	int format;
+	struct stat st;
+	char fname[PATH_MAX];
+	char pkfile[PATH_MAX];
+	struct archive_entry *entry;
+	int result = E_NOT_SUPPORTED;
+	GHashTable *names = NULL;
+
+	memset(data, 0, sizeof(tAppendData));
+	data->fd = -1;
+
+	if (g_key_file_has_key(gCfg, ext, "write_cmd", NULL))
+		return E_NOT_SUPPORTED;
+
+	if (strcasecmp(ext, ".tar") != 0 && strcasecmp(ext, ".cpio") != 0 && strcasecmp(ext, ".ar") != 0)
+		return E_NOT_SUPPORTED;
+
+	struct archive *org = archive_read_new();
+	archive_read_support_filter_all(org);
+	archive_read_support_format_all(org);
+
+	if (archive_read_open_filename(org, filename, READ_BLOCK_SIZE) < ARCHIVE_OK)
+	{
+		archive_read_free(org);
+		return E_NOT_SUPPORTED;
+	}
+
+	names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	// data is skipped by seeking, so only the headers are read
+	while ((ret = archive_read_next_header(org, &entry)) == ARCHIVE_OK || ret == ARCHIVE_WARN)
+	{
+		const char *pathname = archive_entry_pathname(entry);
+
+		if (pathname)
+		{
+			g_strlcpy(fname, pathname, PATH_MAX);
+			append_normalize_name(fname);
+			g_hash_table_add(names, g_strdup(fname));
+		}
+	}
+
+	format = archive_format(org);
+
+	if (ret == ARCHIVE_EOF && archive_filter_count(org) == 1 && archive_filter_code(org, 0) == ARCHIVE_FILTER_NONE)
+	{
+		data->offset = archive_read_header_position(org);
+
+		if ((format & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_TAR)
+			result = E_SUCCESS;
+		else if ((format & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_CPIO && format == gCpioFormat)
+			result = E_SUCCESS;
+		else if (format == ARCHIVE_FORMAT_AR || format == (gArFormatBsd ? ARCHIVE_FORMAT_AR_BSD : ARCHIVE_FORMAT_AR_GNU))
+		{
+			data->skip = 8; // "!<arch>\n"
+			result = E_SUCCESS;
+		}
+	}
+
+	archive_read_close(org);
+	archive_read_free(org);
+
+	while (result == E_SUCCESS && *addlist)
+	{
+		g_strlcpy(fname, addlist, PATH_MAX);
+
+		if (!(flags & PK_PACK_SAVE_PATHS))
+		{
+			gchar *bname = g_path_get_basename(fname);
+			g_strlcpy(fname, bname, PATH_MAX);
+			g_free(bname);
+		}
+
+		if (!subpath)
+			g_strlcpy(pkfile, fname, PATH_MAX);
+		else
+			snprintf(pkfile, PATH_MAX, "%s/%s", subpath, fname);
+
+		append_normalize_name(pkfile);
+
+		if (g_hash_table_contains(names, pkfile))
+			result = E_NOT_SUPPORTED;
+		else if (data->skip > 0 && !gArFormatBsd && strlen(strrchr(pkfile, '/') ? strrchr(pkfile, '/') + 1 : pkfile) > 15)
+			result = E_NOT_SUPPORTED; // would need a new SVR4 filename table
+
+		while (*addlist++);
+	}
+
+	g_hash_table_destroy(names);
+
+	if (result != E_SUCCESS)
+		return result;
+
+	if ((data->fd = open(filename, O_RDWR | O_CLOEXEC)) == -1)
+		return E_EWRITE;
+
+	if (fstat(data->fd, &st) != 0 || data->offset > st.st_size || st.st_size - data->offset > APPEND_MAX_TAIL)
+	{
+		close(data->fd);
+		data->fd = -1;
+		return E_NOT_SUPPORTED;
+	}
+
+	// keep the old end-of-archive marker to restore it if something goes wrong
+	data->tail_len = st.st_size - data->offset;
+
+	if (data->tail_len > 0)
+	{
+		data->tail = malloc(data->tail_len);
+
+		if (!data->tail || pread(data->fd, data->tail, data->tail_len, data->offset) != (ssize_t)data->tail_len)
+		{
+			free(data->tail);
+			data->tail = NULL;
+			close(data->fd);
+			data->fd = -1;
+			return E_NOT_SUPPORTED;
+		}
+	}
+
+	if ((gOptions[0] != '\0') && archive_write_set_options(a, gOptions) < ARCHIVE_OK)
+		printf("libarchive: %s\n", archive_error_string(a));
+
+	// the new end-of-archive marker is written as is, padding would be taken for another entry
+	data->end = data->offset;
+	archive_write_set_bytes_in_last_block(a, 1);
+
+	if (lseek(data->fd, data->offset, SEEK_SET) == -1 || archive_write_open(a, data, NULL, append_write_cb, NULL) < ARCHIVE_OK)
+	{
+		errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
+		result = E_EWRITE;
+	}
+
+	return result;
+}
+
+static void archive_append_close(tAppendData *data, bool success)
+{
+	if (data->fd == -1)
+		return;
+
+	if (success)
+	{
+		if (ftruncate(data->fd, data->end) != 0)
+			printf("ftruncate: %s\n", strerror(errno));
+	}
+	else if (ftruncate(data->fd, data->offset) != 0 ||
+	                (data->tail_len > 0 && pwrite(data->fd, data->tail, data->tail_len, data->offset) != (ssize_t)data->tail_len))
+		errmsg("Failed to restore the end of the archive.", MB_OK | MB_ICONERROR);
+
+	close(data->fd);
+	free(data->tail);
+	data->fd = -1;
+	data->tail = NULL;
+}
+
+#define ZIP_LOCAL_SIG 0x04034b50
+#define ZIP_CENTRAL_SIG 0x02014b50
+#define ZIP_EOCD_SIG 0x06054b50
+#define ZIP64_EOCD_SIG 0x06064b50
+#define ZIP64_LOCATOR_SIG 0x07064b50
+#define ZIP_EOCD_SIZE 22
+#define ZIP_CENTRAL_SIZE 46
+
+typedef struct sZipEntry
+{
+	const unsigned char *rec;
+	size_t rec_len;
+	char *name;
+	uint64_t offset;
+	uint64_t csize;
+	uint64_t usize;
+	uint64_t end;
+	uint64_t new_offset;
+	bool skip;
+} tZipEntry;
+
+typedef struct sZipDir
+{
+	int fd;
+	unsigned char *cd;
+	uint64_t cd_offset;
+	uint64_t cd_size;
+	uint64_t count;
+	unsigned char *comment;
+	uint16_t comment_len;
+	tZipEntry *entries;
+	tZipEntry **sorted;
+} tZipDir;
+
+static uint16_t zip_get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t zip_get32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t zip_get64(const unsigned char *p)
+{
+	return (uint64_t)zip_get32(p) | ((uint64_t)zip_get32(p + 4) << 32);
+}
+
+static void zip_put16(GByteArray *buf, uint16_t v)
+{
+	unsigned char p[2] = { v & 0xFF, v >> 8 };
+	g_byte_array_append(buf, p, sizeof(p));
+}
+
+static void zip_put32(GByteArray *buf, uint32_t v)
+{
+	zip_put16(buf, v & 0xFFFF);
+	zip_put16(buf, v >> 16);
+}
+
+static void zip_put64(GByteArray *buf, uint64_t v)
+{
+	zip_put32(buf, v & 0xFFFFFFFF);
+	zip_put32(buf, v >> 32);
+}
+
+static int zip_entry_cmp(const void *a, const void *b)
+{
+	uint64_t x = (*(tZipEntry**)a)->offset;
+	uint64_t y = (*(tZipEntry**)b)->offset;
+
+	return (x > y) - (x < y);
+}
+
+static void zip_dir_close(tZipDir *dir)
+{
+	if (dir->entries)
+	{
+		for (uint64_t i = 0; i < dir->count; i++)
+			g_free(dir->entries[i].name);
+	}
+
+	if (dir->fd != -1)
+		close(dir->fd);
+
+	g_free(dir->entries);
+	g_free(dir->sorted);
+	g_free(dir->cd);
+	g_free(dir->comment);
+	dir->fd = -1;
+	dir->comment = NULL;
+	dir->cd = NULL;
+	dir->entries = NULL;
+	dir->sorted = NULL;
+}
+
+// reads the central directory of a single-volume zip, only archives without leading data are supported
+static bool zip_dir_open(const char *filename, tZipDir *dir)
+{
+	struct stat st;
+	unsigned char *buf;
+	unsigned char rec[56];
+	const unsigned char *eocd = NULL;
+	uint64_t eocd_offset, i;
+	size_t pos, tail;
+
+	memset(dir, 0, sizeof(tZipDir));
+
+	if ((dir->fd = open(filename, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+
+	if (fstat(dir->fd, &st) != 0 || st.st_size < ZIP_EOCD_SIZE)
+	{
+		zip_dir_close(dir);
+		return false;
+	}
+
+	tail = st.st_size < ZIP_EOCD_SIZE + 65535 ? (size_t)st.st_size : ZIP_EOCD_SIZE + 65535;
+	buf = g_malloc(tail);
+
+	if (pread(dir->fd, buf, tail, st.st_size - tail) != (ssize_t)tail)
+	{
+		g_free(buf);
+		zip_dir_close(dir);
+		return false;
+	}
+
+	for (pos = tail - ZIP_EOCD_SIZE + 1; pos-- > 0;)
+	{
+		if (zip_get32(buf + pos) == ZIP_EOCD_SIG && pos + ZIP_EOCD_SIZE + zip_get16(buf + pos + 20) <= tail)
+		{
+			eocd = buf + pos;
+			break;
+		}
+	}
+
+	if (eocd == NULL || zip_get16(eocd + 4) != 0 || zip_get16(eocd + 6) != 0)
+	{
+		g_free(buf);
+		zip_dir_close(dir);
+		return false;
+	}
+
+	eocd_offset = st.st_size - tail + pos;
+	dir->count = zip_get16(eocd + 10);
+	dir->cd_size = zip_get32(eocd + 12);
+	dir->cd_offset = zip_get32(eocd + 16);
+	dir->comment_len = zip_get16(eocd + 20);
+	dir->comment = g_malloc(dir->comment_len + 1);
+	memcpy(dir->comment, eocd + ZIP_EOCD_SIZE, dir->comment_len);
+	g_free(buf);
+
+	if (eocd_offset >= 20 && pread(dir->fd, rec, 20, eocd_offset - 20) == 20 && zip_get32(rec) == ZIP64_LOCATOR_SIG)
+	{
+		uint64_t offset = zip_get64(rec + 8);
+
+		if (zip_get32(rec + 4) != 0 || zip_get32(rec + 16) > 1 || pread(dir->fd, rec, 56, offset) != 56 ||
+		                zip_get32(rec) != ZIP64_EOCD_SIG || zip_get32(rec + 16) != 0 || zip_get32(rec + 20) != 0)
+		{
+			zip_dir_close(dir);
+			return false;
+		}
+
+		eocd_offset = offset;
+		dir->count = zip_get64(rec + 32);
+		dir->cd_size = zip_get64(rec + 40);
+		dir->cd_offset = zip_get64(rec + 48);
+	}
+
+	if (dir->cd_offset + dir->cd_size != eocd_offset || dir->count > dir->cd_size / ZIP_CENTRAL_SIZE)
+	{
+		zip_dir_close(dir);
+		return false;
+	}
+
+	dir->cd = g_malloc(dir->cd_size + 1);
+	dir->entries = g_new0(tZipEntry, dir->count + 1);
+	dir->sorted = g_new0(tZipEntry*, dir->count + 1);
+
+	if (pread(dir->fd, dir->cd, dir->cd_size, dir->cd_offset) != (ssize_t)dir->cd_size)
+	{
+		zip_dir_close(dir);
+		return false;
+	}
+
+	for (i = 0, pos = 0; i < dir->count; i++)
+	{
+		tZipEntry *entry = &dir->entries[i];
+		const unsigned char *p = dir->cd + pos;
+
+		if (pos + ZIP_CENTRAL_SIZE > dir->cd_size || zip_get32(p) != ZIP_CENTRAL_SIG)
+			break;
+
+		size_t name_len = zip_get16(p + 28);
+		size_t extra_len = zip_get16(p + 30);
+		entry->rec = p;
+		entry->rec_len = ZIP_CENTRAL_SIZE + name_len + extra_len + zip_get16(p + 32);
+
+		if (pos + entry->rec_len > dir->cd_size || (zip_get16(p + 34) != 0 && zip_get16(p + 34) != 0xFFFF))
+			break;
+
+		entry->name = g_strndup((const char*)p + ZIP_CENTRAL_SIZE, name_len);
+		entry->csize = zip_get32(p + 20);
+		entry->usize = zip_get32(p + 24);
+		entry->offset = zip_get32(p + 42);
+
+		const unsigned char *extra = p + ZIP_CENTRAL_SIZE + name_len;
+
+		for (size_t e = 0; e + 4 <= extra_len; e += 4 + zip_get16(extra + e + 2))
+		{
+			if (zip_get16(extra + e) == 0x0001)
+			{
+				const unsigned char *z = extra + e + 4;
+				const unsigned char *zend = z + zip_get16(extra + e + 2);
+
+				if (entry->usize == 0xFFFFFFFF && z + 8 <= zend)
+				{
+					entry->usize = zip_get64(z);
+					z += 8;
+				}
+
+				if (entry->csize == 0xFFFFFFFF && z + 8 <= zend)
+				{
+					entry->csize = zip_get64(z);
+					z += 8;
+				}
+
+				if (entry->offset == 0xFFFFFFFF && z + 8 <= zend)
+					entry->offset = zip_get64(z);
+			}
+		}
+
+		dir->sorted[i] = entry;
+		pos += entry->rec_len;
+	}
+
+	if (i != dir->count)
+	{
+		zip_dir_close(dir);
+		return false;
+	}
+
+	// each entry takes everything up to the next local header (local header, data and data descriptor)
+	qsort(dir->sorted, dir->count, sizeof(tZipEntry*), zip_entry_cmp);
+
+	for (i = 0; i < dir->count; i++)
+	{
+		dir->sorted[i]->end = (i + 1 < dir->count) ? dir->sorted[i + 1]->offset : dir->cd_offset;
+
+		if ((i == 0 && dir->sorted[i]->offset != 0) || dir->sorted[i]->end <= dir->sorted[i]->offset)
+		{
+			zip_dir_close(dir);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void zip_write_central(GByteArray *cd, tZipEntry *entry)
+{
+	unsigned char head[ZIP_CENTRAL_SIZE];
+	const unsigned char *p = entry->rec;
+	size_t name_len = zip_get16(p + 28);
+	size_t extra_len = zip_get16(p + 30);
+	size_t comment_len = zip_get16(p + 32);
+	const unsigned char *extra = p + ZIP_CENTRAL_SIZE + name_len;
+	GByteArray *new_extra = g_byte_array_new();
+	GByteArray *zip64 = g_byte_array_new();
+
+	memcpy(head, p, ZIP_CENTRAL_SIZE);
+
+	// the zip64 extra field is rebuilt for the new offset, the others are kept
+	if (entry->usize >= 0xFFFFFFFF)
+		zip_put64(zip64, entry->usize);
+
+	if (entry->csize >= 0xFFFFFFFF)
+		zip_put64(zip64, entry->csize);
+
+	if (entry->new_offset >= 0xFFFFFFFF)
+		zip_put64(zip64, entry->new_offset);
+
+	if (zip64->len > 0)
+	{
+		zip_put16(new_extra, 0x0001);
+		zip_put16(new_extra, zip64->len);
+		g_byte_array_append(new_extra, zip64->data, zip64->len);
+
+		// version needed to extract: 4.5
+		if (zip_get16(head + 6) < 45)
+		{
+			head[6] = 45;
+			head[7] = 0;
+		}
+	}
+
+	g_byte_array_free(zip64, TRUE);
+
+	for (size_t e = 0; e + 4 <= extra_len; e += 4 + zip_get16(extra + e + 2))
+	{
+		size_t len = 4 + zip_get16(extra + e + 2);
+
+		if (zip_get16(extra + e) != 0x0001 && e + len <= extra_len)
+			g_byte_array_append(new_extra, extra + e, len);
+	}
+
+	g_byte_array_append(cd, head, 20);
+	zip_put32(cd, entry->csize >= 0xFFFFFFFF ? 0xFFFFFFFF : entry->csize);
+	zip_put32(cd, entry->usize >= 0xFFFFFFFF ? 0xFFFFFFFF : entry->usize);
+	zip_put16(cd, name_len);
+	zip_put16(cd, new_extra->len);
+	zip_put16(cd, comment_len);
+	zip_put16(cd, 0);
+	g_byte_array_append(cd, head + 36, 6);
+	zip_put32(cd, entry->new_offset >= 0xFFFFFFFF ? 0xFFFFFFFF : entry->new_offset);
+	g_byte_array_append(cd, p + ZIP_CENTRAL_SIZE, name_len);
+	g_byte_array_append(cd, new_extra->data, new_extra->len);
+	g_byte_array_append(cd, extra + extra_len, comment_len);
+	g_byte_array_free(new_extra, TRUE);
+}
+
+static bool zip_copy_range(int ifd, uint64_t offset, uint64_t len, int ofd, char *buff)
+{
+	ssize_t ret;
+	loff_t in_off = offset;
+	bool use_copy_range = true;
+
+	while (len > 0)
+	{
+		size_t chunk = len > WRITE_BUFF_SIZE ? WRITE_BUFF_SIZE : len;
+
+		if (use_copy_range)
+		{
+			// lets the filesystem share the extents (reflink) where possible
+			if ((ret = copy_file_range(ifd, &in_off, ofd, NULL, chunk, 0)) > 0)
+			{
+				len -= ret;
+				continue;
+			}
+			else if (ret == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				use_copy_range = false;
+				continue;
+			}
+
+			return false;
+		}
+
+		if ((ret = pread(ifd, buff, chunk, in_off)) <= 0)
+			return false;
+
+		if (write(ofd, buff, ret) != ret)
+			return false;
+
+		in_off += ret;
+		len -= ret;
+	}
+
+	return true;
+}
+
+static int zip_copy_entries(tZipDir *dir, int ofd, uint64_t *pos, char *buff, uint64_t *done, uint64_t total)
+{
+	unsigned char sig[4];
+
+	for (uint64_t i = 0; i < dir->count; i++)
+	{
+		tZipEntry *entry = dir->sorted[i];
+
+		if (entry->skip)
+			continue;
+
+		if (pread(dir->fd, sig, 4, entry->offset) != 4 || zip_get32(sig) != ZIP_LOCAL_SIG)
+			return E_BAD_ARCHIVE;
+
+		entry->new_offset = *pos;
+
+		if (!zip_copy_range(dir->fd, entry->offset, entry->end - entry->offset, ofd, buff))
+			return E_EWRITE;
+
+		*pos += entry->end - entry->offset;
+		*done += entry->end - entry->offset;
+
+		if (gProcessDataProc && gProcessDataProc(entry->name, -(1000 + (total > 0 ? *done * 100 / total : 0))) == 0)
+			return E_EABORTED;
+	}
+
+	return E_SUCCESS;
+}
+
+// DC sends the names as libarchive decoded them, the raw ones can be matched only if no decoding applies:
+// ASCII or flagged UTF-8 (bit 11) and no Info-ZIP Unicode Path field (0x7075)
+static bool zip_dir_plain_names(tZipDir *dir)
+{
+	for (uint64_t i = 0; i < dir->count; i++)
+	{
+		const unsigned char *p = dir->entries[i].rec;
+		size_t name_len = zip_get16(p + 28);
+		size_t extra_len = zip_get16(p + 30);
+		const unsigned char *extra = p + ZIP_CENTRAL_SIZE + name_len;
+
+		if (!(zip_get16(p + 8) & 0x0800))
+		{
+			for (size_t n = 0; n < name_len; n++)
+			{
+				if (p[ZIP_CENTRAL_SIZE + n] & 0x80)
+					return false;
+			}
+		}
+
+		for (size_t e = 0; e + 4 <= extra_len; e += 4 + zip_get16(extra + e + 2))
+		{
+			if (zip_get16(extra + e) == 0x7075)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static bool zip_can_passthrough(const char *filename, const char *ext)
+{
+	tZipDir dir;
+	bool result;
+
+	if (!ext || strcasecmp(ext, ".zip") != 0 || g_key_file_has_key(gCfg, ext, "write_cmd", NULL))
+		return false;
+
+	// the names would be converted from the user charset
+	if (gReadCharset[0] != '\0')
+		return false;
+
+	if (!zip_dir_open(filename, &dir))
+		return false;
+
+	result = zip_dir_plain_names(&dir);
+	zip_dir_close(&dir);
+
+	return result;
+}
+
+/*
+ * Rewrites a zip without recompressing: the kept entries of filename and all entries of newfn (if any)
+ * are copied as they are, only the central directory is written anew.
+ */
+static int zip_passthrough_repack(char *filename, char *newfn, char *skiplist, char *subpath, int flags)
+{
+	tZipDir src, add;
+	char infile[PATH_MAX];
+	uint64_t i, pos = 0, done = 0, total = 0, count = 0;
+	int ofd, result = E_SUCCESS;
+	char *tmpfn, *buff;
+
+	memset(&add, 0, sizeof(tZipDir));
+	add.fd = -1;
+
+	if (!zip_dir_open(filename, &src))
+		return E_BAD_ARCHIVE;
+
+	if (newfn && !zip_dir_open(newfn, &add))
+	{
+		zip_dir_close(&src);
+		return E_BAD_ARCHIVE;
+	}
+
+	for (i = 0; i < src.count; i++)
+	{
+		if (skiplist && repack_skip_name(src.entries[i].name, skiplist, subpath, flags))
+			src.entries[i].skip = true;
+		else
 		{
-			fsize = archive_entry_size(entry);
-			csize = 0;
+			total += src.entries[i].end - src.entries[i].offset;
+			count++;
+		}
+	}
 
-			skiplist = headlist;
-			g_strlcpy(infile, archive_entry_pathname(entry), PATH_MAX);
-			skip_file = false;
+	for (i = 0; i < add.count; i++)
+		total += add.entries[i].end - add.entries[i].offset;
 
-			while (*skiplist)
-			{
-				g_strlcpy(fname, skiplist, PATH_MAX);
+	count += add.count;
 
-				if (!(flags & PK_PACK_SAVE_PATHS))
-				{
-					gchar *bname = g_path_get_basename(fname);
-					g_strlcpy(fname, bname, PATH_MAX);
-					g_free(bname);
-				}
+	g_strlcpy(infile, filename, PATH_MAX);
+	tmpfn = tempnam(dirname(infile), "arc_");
+	buff = malloc(WRITE_BUFF_SIZE);
 
-				if (!subpath)
-					strcpy(rmfile, fname);
-				else
-					snprintf(rmfile, PATH_MAX, "%s/%s", subpath, fname);
+	if (!tmpfn || !buff || (ofd = open(tmpfn, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) == -1)
+	{
+		free(tmpfn);
+		free(buff);
+		zip_dir_close(&src);
+		zip_dir_close(&add);
+		return E_EWRITE;
+	}
 
-				if (strncmp(rmfile + strlen(rmfile) - 4, "/*.*", 4) == 0)
-					rmfile[strlen(rmfile) - 2] = 0;
+	result = zip_copy_entries(&src, ofd, &pos, buff, &done, total);
 
-				if (strcmp(rmfile, infile) == 0 || fnmatch(rmfile, infile, FNM_CASEFOLD) == 0)
-				{
-					skip_file = true;
-					break;
-				}
+	if (result == E_SUCCESS && add.count > 0)
+		result = zip_copy_entries(&add, ofd, &pos, buff, &done, total);
 
-				while (*skiplist++);
-			}
+	if (result == E_SUCCESS)
+	{
+		GByteArray *cd = g_byte_array_new();
 
-			if (!skip_file)
-			{
-				archive_write_header(a, entry);
+		for (i = 0; i < src.count; i++)
+		{
+			if (!src.entries[i].skip)
+				zip_write_central(cd, &src.entries[i]);
+		}
 
-				while ((ret = archive_read_data_block(org, &buff, &size, &offset)) != ARCHIVE_EOF)
-				{
-					if (ret < ARCHIVE_OK)
-					{
-						errmsg(archive_error_string(org), MB_OK | MB_ICONERROR);
-						result = E_EABORTED;
-						break;
-					}
-					else if (archive_write_data(a, buff, size) < ARCHIVE_OK)
-					{
-						errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
-						result = E_EWRITE;
-						break;
-					}
+		for (i = 0; i < add.count; i++)
+			zip_write_central(cd, &add.entries[i]);
 
-					if (fsize > 0)
-					{
-						csize += size;
-						prcnt = csize * 100 / fsize;
-					}
-					else
-						prcnt = 0;
+		uint64_t cd_size = cd->len;
 
-					if (gProcessDataProc(infile, -(1000 + prcnt)) == 0)
-					{
-						result = E_EABORTED;
-						break;
-					}
-				}
-			}
+		if (count >= 0xFFFF || pos >= 0xFFFFFFFF || cd_size >= 0xFFFFFFFF)
+		{
+			zip_put32(cd, ZIP64_EOCD_SIG);
+			zip_put64(cd, 44);
+			zip_put16(cd, 45);
+			zip_put16(cd, 45);
+			zip_put32(cd, 0);
+			zip_put32(cd, 0);
+			zip_put64(cd, count);
+			zip_put64(cd, count);
+			zip_put64(cd, cd_size);
+			zip_put64(cd, pos);
+
+			zip_put32(cd, ZIP64_LOCATOR_SIG);
+			zip_put32(cd, 0);
+			zip_put64(cd, pos + cd_size);
+			zip_put32(cd, 1);
 		}
 
-		archive_read_close(org);
+		zip_put32(cd, ZIP_EOCD_SIG);
+		zip_put16(cd, 0);
+		zip_put16(cd, 0);
+		zip_put16(cd, count >= 0xFFFF ? 0xFFFF : count);
+		zip_put16(cd, count >= 0xFFFF ? 0xFFFF : count);
+		zip_put32(cd, cd_size >= 0xFFFFFFFF ? 0xFFFFFFFF : cd_size);
+		zip_put32(cd, pos >= 0xFFFFFFFF ? 0xFFFFFFFF : pos);
+		zip_put16(cd, src.comment_len);
+		g_byte_array_append(cd, src.comment, src.comment_len);
+
+		if (write(ofd, cd->data, cd->len) != (ssize_t)cd->len)
+			result = E_EWRITE;
+
+		g_byte_array_free(cd, TRUE);
 	}
 
-	archive_read_free(org);
+	if (close(ofd) != 0 && result == E_SUCCESS)
+		result = E_EWRITE;
 
-	if (ret_header < ARCHIVE_OK)
-		result = E_EREAD;
+	zip_dir_close(&src);
+	zip_dir_close(&add);
+	free(buff);
+
+	if (result == E_SUCCESS && rename(tmpfn, filename) != 0)
+		result = E_EWRITE;
 
 	if (result != E_SUCCESS)
-	{
-		if (*tmpfn != NULL)
-		{
-			remove_file(*tmpfn);
-			free(*tmpfn);
-			*tmpfn = NULL;
-		}
-	}
+		remove_file(tmpfn);
+
+	free(tmpfn);
 
 	return result;
 }
@@ -850,6 +2136,9 @@ intptr_t DCPCALL DlgProc(uintptr_t pDlg, char* DlgItemName, intptr_t Msg, intptr
 
 		gStartupInfo->SendDlgMsg(pDlg, "cbEncrypt", DM_SETTEXT, (intptr_t)gEncryption, 0);
 
+		snprintf(string, PATH_MAX, "%d", gThreads);
+		gStartupInfo->SendDlgMsg(pDlg, "edThreads", DM_SETTEXT, (intptr_t)string, 0);
+
 		listbox_get_extentions(pDlg);
 
 		break;
@@ -874,6 +2163,7 @@ intptr_t DCPCALL DlgProc(uintptr_t pDlg, char* DlgItemName, intptr_t Msg, intptr
 			gNotabene = (bool)gStartupInfo->SendDlgMsg(pDlg, "chkDisclaimer", DM_GETCHECK, 0, 0);
 			gArFormatBsd = (bool)gStartupInfo->SendDlgMsg(pDlg, "cbArFormat", DM_LISTGETITEMINDEX, 0, 0);
 			gSharFormatDump = (bool)gStartupInfo->SendDlgMsg(pDlg, "cbSharFormat", DM_LISTGETITEMINDEX, 0, 0);
+			gThreads = atoi((char*)gStartupInfo->SendDlgMsg(pDlg, "edThreads", DM_GETTEXT, 0, 0));
 
 			numval = (int)gStartupInfo->SendDlgMsg(pDlg, "cbTarFormat", DM_LISTGETITEMINDEX, 0, 0);
 
@@ -1284,27 +2574,406 @@ intptr_t DCPCALL DlgProc(uintptr_t pDlg, char* DlgItemName, intptr_t Msg, intptr
 				gStartupInfo->SendDlgMsg(pDlg, "edOptions", DM_SETTEXT, 0, 0);
 		}
 
-		break;
+		break;
+
+	case DM_KEYUP:
+		if (strncmp(DlgItemName, "edExternal", 10) == 0)
+		{
+			gStartupInfo->SendDlgMsg(pDlg, "btnExternalSave", DM_ENABLE, 1, 0);
+			gchar *ext = (char*)gStartupInfo->SendDlgMsg(pDlg, "edExternalExt", DM_GETTEXT, 0, 0);
+
+			if (ext && g_key_file_has_group(gCfg, ext))
+				gStartupInfo->SendDlgMsg(pDlg, "btnExternalReload", DM_ENABLE, 1, 0);
+			else
+				gStartupInfo->SendDlgMsg(pDlg, "btnExternalReload", DM_ENABLE, 0, 0);
+		}
+
+		break;
+	}
+
+	if (err)
+		g_error_free(err);
+
+	return 0;
+}
+
+static guint listcache_opts_hash(void)
+{
+	gchar *opts = g_strdup_printf("%d%d%d%d%d%d%d%d%s", gReadSkipDot, gReadCompat2x, gReadIgnoreCRC, gReadMacExt,
+	                              gReadDisableJoliet, gReadDisableRockridge, gOnlyTarFormat, gMtreeCheckFS, gReadCharset);
+	guint hash = g_str_hash(opts);
+	g_free(opts);
+
+	return hash;
+}
+
+static gchar* listcache_path(const char *arcname)
+{
+	if (!gCfgPath)
+		return NULL;
+
+	gchar *cfg_dir = g_path_get_dirname(gCfgPath);
+	gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, arcname, -1);
+	gchar *path = g_strdup_printf("%s/%s/%s", cfg_dir, LISTCACHE_DIR, hash);
+	g_free(hash);
+	g_free(cfg_dir);
+
+	return path;
+}
+
+/*
+ * Extraction needs an index with header offsets, the entries are then read straight from there
+ * (uncompressed tar and cpio, zip).
+ */
+static bool listcache_load(ArcData handle, bool seekable)
+{
+	gchar *path;
+	struct stat st;
+	tListCacheHeader hdr;
+
+	if (stat(handle->arcname, &st) != 0 || (path = listcache_path(handle->arcname)) == NULL)
+		return false;
+
+	if (g_file_get_contents(path, &handle->list, &handle->list_len, NULL))
+	{
+		if (handle->list_len >= sizeof(hdr))
+			memcpy(&hdr, handle->list, sizeof(hdr));
+
+		if (handle->list_len < sizeof(hdr) || memcmp(hdr.magic, LISTCACHE_MAGIC, 8) != 0 ||
+		                hdr.size != (uint64_t)st.st_size || hdr.mtime != st.st_mtim.tv_sec ||
+		                hdr.mtime_nsec != st.st_mtim.tv_nsec || hdr.opts != listcache_opts_hash() ||
+		                (seekable && hdr.format == 0))
+		{
+			g_free(handle->list);
+			handle->list = NULL;
+		}
+		else
+		{
+			handle->list_pos = sizeof(hdr);
+			handle->list_format = hdr.format;
+			// the file mtime tells the pruning which listings are still in use
+			utimensat(AT_FDCWD, path, NULL, 0);
+		}
+	}
+
+	g_free(path);
+
+	return (handle->list != NULL);
+}
+
+static void listcache_start(ArcData handle)
+{
+	struct stat st;
+	tListCacheHeader hdr;
+
+	if (!gCfgPath || stat(handle->arcname, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LISTCACHE_MAGIC, 8);
+	hdr.size = st.st_size;
+	hdr.mtime = st.st_mtim.tv_sec;
+	hdr.mtime_nsec = st.st_mtim.tv_nsec;
+	hdr.opts = listcache_opts_hash();
+
+	handle->record = g_byte_array_new();
+	handle->record_seekable = true;
+	g_byte_array_append(handle->record, (guint8*)&hdr, sizeof(hdr));
+}
+
+static void zip_offsets_free(gpointer data)
+{
+	g_free(data);
+}
+
+static int64_t listcache_entry_offset(ArcData handle)
+{
+	tZipDir dir;
+	int64_t *offset;
+
+	if (archive_filter_count(handle->archive) != 1)
+		return -1;
+
+	switch (archive_format(handle->archive) & ARCHIVE_FORMAT_BASE_MASK)
+	{
+	case ARCHIVE_FORMAT_TAR:
+	case ARCHIVE_FORMAT_CPIO:
+		return archive_read_header_position(handle->archive);
+
+	case ARCHIVE_FORMAT_ZIP:
+		if (!handle->zip_offsets)
+		{
+			handle->zip_offsets = g_hash_table_new_full(g_str_hash, g_str_equal, zip_offsets_free, zip_offsets_free);
+
+			if (zip_dir_open(handle->arcname, &dir))
+			{
+				for (uint64_t i = 0; i < dir.count; i++)
+				{
+					offset = g_new(int64_t, 1);
+					*offset = dir.entries[i].offset;
+					g_hash_table_replace(handle->zip_offsets, g_strdup(dir.entries[i].name), offset);
+				}
+
+				zip_dir_close(&dir);
+			}
+		}
+
+		offset = g_hash_table_lookup(handle->zip_offsets, archive_entry_pathname(handle->entry));
+
+		return offset ? *offset : -1;
+	}
+
+	return -1;
+}
+
+static int listcache_read(ArcData handle, tHeaderDataEx *HeaderDataEx)
+{
+	tListCacheRecord rec;
+
+	if (handle->list_pos + sizeof(rec) > handle->list_len)
+		return E_END_ARCHIVE;
+
+	memcpy(&rec, handle->list + handle->list_pos, sizeof(rec));
+	handle->list_pos += sizeof(rec);
+
+	if (rec.name_len >= sizeof(HeaderDataEx->FileName) || handle->list_pos + rec.name_len > handle->list_len)
+		return E_BAD_ARCHIVE;
+
+	memcpy(HeaderDataEx->FileName, handle->list + handle->list_pos, rec.name_len);
+	HeaderDataEx->FileName[rec.name_len] = '\0';
+	handle->list_pos += rec.name_len;
+
+	HeaderDataEx->PackSizeHigh = (rec.pack_size & 0xFFFFFFFF00000000) >> 32;
+	HeaderDataEx->PackSize = rec.pack_size & 0x00000000FFFFFFFF;
+	HeaderDataEx->UnpSizeHigh = (rec.unp_size & 0xFFFFFFFF00000000) >> 32;
+	HeaderDataEx->UnpSize = rec.unp_size & 0x00000000FFFFFFFF;
+	HeaderDataEx->FileTime = rec.time;
+	HeaderDataEx->FileAttr = rec.attr;
+	HeaderDataEx->Flags = rec.flags;
+
+	handle->list_offset = rec.offset;
+	handle->list_mode = rec.attr;
+	g_strlcpy(handle->list_name, HeaderDataEx->FileName, PATH_MAX);
+
+	return E_SUCCESS;
+}
+
+static void listcache_add(ArcData handle, tHeaderDataEx *HeaderDataEx)
+{
+	tListCacheRecord rec;
+
+	if (!handle->record)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.pack_size = ((uint64_t)HeaderDataEx->PackSizeHigh << 32) | HeaderDataEx->PackSize;
+	rec.unp_size = ((uint64_t)HeaderDataEx->UnpSizeHigh << 32) | HeaderDataEx->UnpSize;
+	rec.time = HeaderDataEx->FileTime;
+	rec.attr = HeaderDataEx->FileAttr;
+	rec.flags = HeaderDataEx->Flags;
+	rec.name_len = strlen(HeaderDataEx->FileName);
+	rec.offset = listcache_entry_offset(handle);
+
+	if (rec.offset < 0)
+		handle->record_seekable = false;
+
+	g_byte_array_append(handle->record, (guint8*)&rec, sizeof(rec));
+	g_byte_array_append(handle->record, (guint8*)HeaderDataEx->FileName, rec.name_len);
+}
+
+static int listcache_cmp_mtime(gconstpointer a, gconstpointer b)
+{
+	const tListCacheFile *fa = (const tListCacheFile*)a;
+	const tListCacheFile *fb = (const tListCacheFile*)b;
+
+	return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+// drops the least recently used listings
+static void listcache_prune(const char *dir)
+{
+	struct stat st;
+	const gchar *name;
+	tListCacheFile file;
+	GDir *gdir = g_dir_open(dir, 0, NULL);
+
+	if (!gdir)
+		return;
+
+	GArray *files = g_array_new(FALSE, FALSE, sizeof(tListCacheFile));
+
+	while ((name = g_dir_read_name(gdir)) != NULL)
+	{
+		file.path = g_build_filename(dir, name, NULL);
+
+		if (stat(file.path, &st) == 0 && S_ISREG(st.st_mode))
+		{
+			file.mtime = st.st_mtime;
+			g_array_append_val(files, file);
+		}
+		else
+			g_free(file.path);
+	}
+
+	g_dir_close(gdir);
+
+	if (files->len >= LISTCACHE_MAX_FILES)
+	{
+		g_array_sort(files, listcache_cmp_mtime);
+
+		for (guint i = 0; i <= files->len - LISTCACHE_MAX_FILES; i++)
+			unlink(g_array_index(files, tListCacheFile, i).path);
+	}
+
+	for (guint i = 0; i < files->len; i++)
+		g_free(g_array_index(files, tListCacheFile, i).path);
+
+	g_array_free(files, TRUE);
+}
+
+static void listcache_save(ArcData handle)
+{
+	struct stat st;
+	tListCacheHeader hdr;
+	GByteArray *record = handle->record;
+	gchar *path = listcache_path(handle->arcname);
+
+	handle->record = NULL;
+	memcpy(&hdr, record->data, sizeof(hdr));
+
+	if (handle->record_seekable)
+	{
+		hdr.format = archive_format(handle->archive);
+		memcpy(record->data, &hdr, sizeof(hdr));
+	}
+
+	// changed while it was listed
+	if (path && stat(handle->arcname, &st) == 0 && hdr.size == (uint64_t)st.st_size &&
+	                hdr.mtime == st.st_mtim.tv_sec && hdr.mtime_nsec == st.st_mtim.tv_nsec)
+	{
+		gchar *dir = g_path_get_dirname(path);
+
+		if (g_mkdir_with_parents(dir, 0755) == 0)
+		{
+			listcache_prune(dir);
+			g_file_set_contents(path, (gchar*)record->data, record->len, NULL);
+		}
+
+		g_free(dir);
+	}
+
+	g_free(path);
+	g_byte_array_free(record, TRUE);
+}
+
+static void archive_read_set_user_options(struct archive *a, const char *arcname)
+{
+	if (gMtreeCheckFS && strcasestr(arcname, ".mtree") != NULL)
+		archive_read_set_options(a, "checkfs");
+	else if ((gReadDisableJoliet || gReadDisableRockridge) && strcasestr(arcname, ".iso") != NULL)
+	{
+		if (gReadDisableJoliet)
+			archive_read_set_options(a, "!joliet");
+
+		if (gReadDisableRockridge)
+			archive_read_set_options(a, "!rockridge");
+	}
+	else
+	{
+		if (gReadIgnoreCRC)
+			archive_read_set_options(a, "ignorecrc32");
+
+		if (gReadMacExt)
+			archive_read_set_options(a, "mac-ext");
+
+		if (gReadCompat2x)
+			archive_read_set_options(a, "compat-2x");
+
+		if (gReadCharset[0] != '\0')
+			archive_read_set_format_option(a, NULL, "hdrcharset", gReadCharset);
+	}
+}
+
+// opens a reader right at the header of the current index entry
+// the streamable zip reader does not see the central directory where the mode is kept, the listing has it
+static int listcache_zip_mode(ArcData handle)
+{
+	la_ssize_t len;
+	char target[PATH_MAX];
+
+	if (!S_ISLNK(handle->list_mode))
+	{
+		if (archive_entry_filetype(handle->entry) == (handle->list_mode & AE_IFMT))
+			archive_entry_set_mode(handle->entry, handle->list_mode);
+
+		return E_SUCCESS;
+	}
+
+	if (archive_entry_symlink(handle->entry))
+		return E_SUCCESS;
+
+	// the link target is stored as the entry data
+	if ((len = archive_read_data(handle->archive, target, sizeof(target) - 1)) < 0)
+	{
+		errmsg(archive_error_string(handle->archive), MB_OK | MB_ICONERROR);
+		return E_EREAD;
+	}
+
+	target[len] = '\0';
+	archive_entry_set_mode(handle->entry, handle->list_mode);
+	archive_entry_set_size(handle->entry, 0);
+	archive_entry_set_symlink(handle->entry, target);
+
+	return E_SUCCESS;
+}
+
+static int listcache_seek_entry(ArcData handle)
+{
+	const char *pathname;
+
+	if (handle->archive)
+	{
+		archive_read_close(handle->archive);
+		archive_read_free(handle->archive);
+		handle->archive = NULL;
+	}
+
+	if (handle->list_offset < 0)
+		return E_NOT_SUPPORTED;
 
-	case DM_KEYUP:
-		if (strncmp(DlgItemName, "edExternal", 10) == 0)
-		{
-			gStartupInfo->SendDlgMsg(pDlg, "btnExternalSave", DM_ENABLE, 1, 0);
-			gchar *ext = (char*)gStartupInfo->SendDlgMsg(pDlg, "edExternalExt", DM_GETTEXT, 0, 0);
+	if (handle->list_fd == -1 && (handle->list_fd = open(handle->arcname, O_RDONLY | O_CLOEXEC)) == -1)
+		return E_EOPEN;
 
-			if (ext && g_key_file_has_group(gCfg, ext))
-				gStartupInfo->SendDlgMsg(pDlg, "btnExternalReload", DM_ENABLE, 1, 0);
-			else
-				gStartupInfo->SendDlgMsg(pDlg, "btnExternalReload", DM_ENABLE, 0, 0);
-		}
+	if (lseek(handle->list_fd, handle->list_offset, SEEK_SET) == -1)
+		return E_EREAD;
 
-		break;
+	handle->archive = archive_read_new();
+	archive_read_set_passphrase_callback(handle->archive, NULL, archive_password_cb);
+
+	// the seekable zip reader would start over from the central directory
+	if ((handle->list_format & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_ZIP)
+		archive_read_support_format_zip_streamable(handle->archive);
+	else
+		archive_read_support_format_by_code(handle->archive, handle->list_format);
+
+	archive_read_set_user_options(handle->archive, handle->arcname);
+
+	if (archive_read_open_fd(handle->archive, handle->list_fd, READ_BLOCK_SIZE) < ARCHIVE_OK ||
+	                archive_read_next_header(handle->archive, &handle->entry) < ARCHIVE_WARN)
+	{
+		errmsg(archive_error_string(handle->archive), MB_OK | MB_ICONERROR);
+		return E_BAD_ARCHIVE;
 	}
 
-	if (err)
-		g_error_free(err);
+	pathname = archive_entry_pathname(handle->entry);
 
-	return 0;
+	if (!pathname || !g_str_has_suffix(pathname, handle->list_name))
+		return E_BAD_ARCHIVE;
+
+	if ((handle->list_format & ARCHIVE_FORMAT_BASE_MASK) == ARCHIVE_FORMAT_ZIP)
+		return listcache_zip_mode(handle);
+
+	return E_SUCCESS;
 }
 
 HANDLE DCPCALL OpenArchive(tOpenArchiveData *ArchiveData)
@@ -1319,6 +2988,13 @@ HANDLE DCPCALL OpenArchive(tOpenArchiveData *ArchiveData)
 	}
 
 	memset(handle, 0, sizeof(tArcData));
+	handle->list_fd = -1;
+	g_strlcpy(handle->arcname, ArchiveData->ArcName, PATH_MAX);
+
+	// served without decompressing anything, extraction seeks to the wanted entries
+	if (listcache_load(handle, ArchiveData->OpenMode != PK_OM_LIST))
+		return (HANDLE)handle;
+
 	handle->archive = archive_read_new();
 
 	if (archive_read_set_passphrase_callback(handle->archive, NULL, archive_password_cb) < ARCHIVE_OK)
@@ -1334,34 +3010,9 @@ HANDLE DCPCALL OpenArchive(tOpenArchiveData *ArchiveData)
 	else
 		archive_read_support_format_all(handle->archive);
 
-	g_strlcpy(handle->arcname, ArchiveData->ArcName, PATH_MAX);
-
-	if (gMtreeCheckFS && strcasestr(ArchiveData->ArcName, ".mtree") != NULL)
-		archive_read_set_options(handle->archive, "checkfs");
-	else if ((gReadDisableJoliet || gReadDisableRockridge) && strcasestr(ArchiveData->ArcName, ".iso") != NULL)
-	{
-		if (gReadDisableJoliet)
-			archive_read_set_options(handle->archive, "!joliet");
-
-		if (gReadDisableRockridge)
-			archive_read_set_options(handle->archive, "!rockridge");
-	}
-	else
-	{
-		if (gReadIgnoreCRC)
-			archive_read_set_options(handle->archive, "ignorecrc32");
-
-		if (gReadMacExt)
-			archive_read_set_options(handle->archive, "mac-ext");
-
-		if (gReadCompat2x)
-			archive_read_set_options(handle->archive, "compat-2x");
-
-		if (gReadCharset[0] != '\0')
-			archive_read_set_format_option(handle->archive, NULL, "hdrcharset", gReadCharset);
-	}
+	archive_read_set_user_options(handle->archive, ArchiveData->ArcName);
 
-	int r = archive_read_open_filename(handle->archive, ArchiveData->ArcName, 10240);
+	int r = archive_read_open_filename(handle->archive, ArchiveData->ArcName, READ_BLOCK_SIZE);
 
 	if (r != ARCHIVE_OK)
 	{
@@ -1372,6 +3023,9 @@ HANDLE DCPCALL OpenArchive(tOpenArchiveData *ArchiveData)
 		return E_SUCCESS;
 	}
 
+	if (ArchiveData->OpenMode == PK_OM_LIST)
+		listcache_start(handle);
+
 	return (HANDLE)handle;
 }
 
@@ -1390,6 +3044,9 @@ int DCPCALL ReadHeaderEx(HANDLE hArcData, tHeaderDataEx *HeaderDataEx)
 	char arcname[PATH_MAX + 1];
 	struct stat st;
 
+	if (handle->list)
+		return listcache_read(handle, HeaderDataEx);
+
 	while ((ret = archive_read_next_header(handle->archive, &handle->entry)) == ARCHIVE_RETRY ||
 	                (gReadSkipDot && (ret == ARCHIVE_OK && strcmp(".", archive_entry_pathname(handle->entry)) == 0)))
 	{
@@ -1400,6 +3057,12 @@ int DCPCALL ReadHeaderEx(HANDLE hArcData, tHeaderDataEx *HeaderDataEx)
 
 	if (ret == ARCHIVE_FATAL)
 	{
+		if (handle->record)
+		{
+			g_byte_array_free(handle->record, TRUE);
+			handle->record = NULL;
+		}
+
 		errmsg(archive_error_string(handle->archive), MB_OK | MB_ICONERROR);
 		return E_BAD_ARCHIVE;
 	}
@@ -1464,12 +3127,48 @@ int DCPCALL ReadHeaderEx(HANDLE hArcData, tHeaderDataEx *HeaderDataEx)
 				HeaderDataEx->Flags |= RHDF_ENCRYPTED;
 		}
 
+		listcache_add(handle, HeaderDataEx);
+
 		return E_SUCCESS;
 	}
 
+	if (handle->record)
+		listcache_save(handle);
+
 	return E_END_ARCHIVE;
 }
 
+static struct archive* extract_get_writer(ArcData handle)
+{
+	if (handle->disk == NULL)
+	{
+		int flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_FFLAGS;
+
+		handle->disk = archive_write_disk_new();
+		archive_write_disk_set_options(handle->disk, flags);
+		// the lookup keeps its uid/gid cache as long as the writer lives
+		archive_write_disk_set_standard_lookup(handle->disk);
+	}
+
+	if (handle->wbuff == NULL)
+		handle->wbuff = malloc(WRITE_BUFF_SIZE);
+
+	return handle->disk;
+}
+
+static void extract_prealloc(const char *filename, la_int64_t size)
+{
+	int fd = open(filename, O_WRONLY | O_CLOEXEC);
+
+	if (fd != -1)
+	{
+		if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0 && errno != EOPNOTSUPP)
+			printf("fallocate: %s: %s\n", filename, strerror(errno));
+
+		close(fd);
+	}
+}
+
 int DCPCALL ProcessFile(HANDLE hArcData, int Operation, char *DestPath, char *DestName)
 {
 	int ret;
@@ -1477,11 +3176,18 @@ int DCPCALL ProcessFile(HANDLE hArcData, int Operation, char *DestPath, char *De
 	size_t size;
 	la_int64_t offset;
 	const void *buff;
-	struct archive *a;
+	struct archive *a = NULL;
 	const char *pathname;
 	char filename[PATH_MAX];
+	size_t wlen = 0;
+	la_int64_t woffset = 0;
 	ArcData handle = (ArcData)hArcData;
 
+	if (handle->list && Operation == PK_SKIP)
+		return E_SUCCESS;
+	else if (handle->list && (result = listcache_seek_entry(handle)) != E_SUCCESS)
+		return result;
+
 	if (Operation != PK_SKIP && !DestPath)
 	{
 		pathname = archive_entry_pathname(handle->entry);
@@ -1493,20 +3199,18 @@ int DCPCALL ProcessFile(HANDLE hArcData, int Operation, char *DestPath, char *De
 
 		if (Operation == PK_EXTRACT)
 		{
-			int fd = open(DestName, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			a = extract_get_writer(handle);
+			archive_entry_set_pathname(handle->entry, DestName);
 
-			if (fd == -1)
+			if (archive_write_header(a, handle->entry) < ARCHIVE_WARN)
+			{
+				printf("libarchive: %s\n", archive_error_string(a));
+				archive_write_finish_entry(a);
 				return E_ECREATE;
-			else
-				close(fd);
-
-			int flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_FFLAGS;
+			}
 
-			a = archive_write_disk_new();
-			archive_entry_set_pathname(handle->entry, DestName);
-			archive_write_disk_set_options(a, flags);
-			archive_write_disk_set_standard_lookup(a);
-			archive_write_header(a, handle->entry);
+			if (archive_entry_filetype(handle->entry) == AE_IFREG && archive_entry_size(handle->entry) >= PREALLOC_MIN_SIZE)
+				extract_prealloc(DestName, archive_entry_size(handle->entry));
 		}
 
 		while ((ret = archive_read_data_block(handle->archive, &buff, &size, &offset)) != ARCHIVE_EOF)
@@ -1526,15 +3230,41 @@ int DCPCALL ProcessFile(HANDLE hArcData, int Operation, char *DestPath, char *De
 
 				break;
 			}
-			else if (Operation == PK_EXTRACT && archive_write_data_block(a, buff, size, offset) < ARCHIVE_OK)
+
+			if (Operation == PK_EXTRACT)
 			{
-				//printf("libarchive: %s\n", archive_error_string(a));
-				//result = E_EWRITE;
-				errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
-				result = E_EABORTED;
-				break;
+				// small blocks are merged into large sequential writes
+				if (handle->wbuff && wlen > 0 && (woffset + (la_int64_t)wlen != offset || wlen + size > WRITE_BUFF_SIZE))
+				{
+					if (archive_write_data_block(a, handle->wbuff, wlen, woffset) < ARCHIVE_OK)
+					{
+						errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
+						result = E_EABORTED;
+						break;
+					}
+
+					wlen = 0;
+				}
+
+				if (handle->wbuff && size < WRITE_BUFF_SIZE)
+				{
+					if (wlen == 0)
+						woffset = offset;
+
+					memcpy(handle->wbuff + wlen, buff, size);
+					wlen += size;
+				}
+				else if (archive_write_data_block(a, buff, size, offset) < ARCHIVE_OK)
+				{
+					//printf("libarchive: %s\n", archive_error_string(a));
+					//result = E_EWRITE;
+					errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
+					result = E_EABORTED;
+					break;
+				}
 			}
-			else if (handle->gProcessDataProc && handle->gProcessDataProc(filename, size) == 0)
+
+			if (handle->gProcessDataProc && handle->gProcessDataProc(filename, size) == 0)
 			{
 				result = E_EABORTED;
 				break;
@@ -1543,9 +3273,13 @@ int DCPCALL ProcessFile(HANDLE hArcData, int Operation, char *DestPath, char *De
 
 		if (Operation == PK_EXTRACT)
 		{
+			if (result == E_SUCCESS && wlen > 0 && archive_write_data_block(a, handle->wbuff, wlen, woffset) < ARCHIVE_OK)
+			{
+				errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
+				result = E_EABORTED;
+			}
+
 			archive_write_finish_entry(a);
-			archive_write_close(a);
-			archive_write_free(a);
 		}
 	}
 
@@ -1555,8 +3289,32 @@ int DCPCALL ProcessFile(HANDLE hArcData, int Operation, char *DestPath, char *De
 int DCPCALL CloseArchive(HANDLE hArcData)
 {
 	ArcData handle = (ArcData)hArcData;
-	archive_read_close(handle->archive);
-	archive_read_free(handle->archive);
+
+	if (handle->disk)
+	{
+		archive_write_close(handle->disk);
+		archive_write_free(handle->disk);
+	}
+
+	if (handle->wbuff)
+		free(handle->wbuff);
+
+	if (handle->record)
+		g_byte_array_free(handle->record, TRUE);
+
+	if (handle->zip_offsets)
+		g_hash_table_destroy(handle->zip_offsets);
+
+	if (handle->list_fd != -1)
+		close(handle->list_fd);
+
+	if (handle->archive)
+	{
+		archive_read_close(handle->archive);
+		archive_read_free(handle->archive);
+	}
+
+	g_free(handle->list);
 	free(handle);
 	return E_SUCCESS;
 }
@@ -1633,22 +3391,256 @@ void DCPCALL ConfigurePacker(HWND Parent, HINSTANCE DllInstance)
 		gStartupInfo->DialogBoxLFMFile(gLFMPath, DlgProc);
 }
 
+static void pack_src_path(char *infile, const char *srcpath, const char *name)
+{
+	strcpy(infile, srcpath);
+	char* pos = strrchr(infile, '/');
+
+	if (pos != NULL)
+		strcpy(pos + 1, name);
+	else
+		strcpy(infile, name);
+}
+
+// reader side: waits for a free slot, NULL means the consumer is gone
+static tReadAheadSlot* readahead_get_free(tReadAhead *ra)
+{
+	tReadAheadSlot *slot = NULL;
+
+	g_mutex_lock(&ra->lock);
+
+	while (!ra->stop && ra->tail - ra->head >= RA_SLOTS)
+		g_cond_wait(&ra->cond, &ra->lock);
+
+	if (!ra->stop)
+		slot = &ra->slots[ra->tail % RA_SLOTS];
+
+	g_mutex_unlock(&ra->lock);
+
+	return slot;
+}
+
+static void readahead_post(tReadAhead *ra)
+{
+	g_mutex_lock(&ra->lock);
+	ra->tail++;
+	g_cond_broadcast(&ra->cond);
+	g_mutex_unlock(&ra->lock);
+}
+
+static void readahead_file(tReadAhead *ra, const char *infile)
+{
+	ssize_t ret;
+	tReadAheadSlot *slot;
+	int fd = open(infile, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1)
+		return;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	do
+	{
+		if ((slot = readahead_get_free(ra)) == NULL)
+			break;
+
+		slot->index = ra->index;
+		slot->len = 0;
+		slot->error = 0;
+		ret = 0;
+
+		while (slot->len < RA_BUFF_SIZE)
+		{
+			ret = read(fd, slot->buff + slot->len, RA_BUFF_SIZE - slot->len);
+
+			if (ret == -1 && errno == EINTR)
+				continue;
+			else if (ret <= 0)
+				break;
+
+			slot->len += ret;
+		}
+
+		if (ret == -1)
+			slot->error = errno;
+
+		// a partly filled block is the last one
+		slot->eof = (ret <= 0);
+		readahead_post(ra);
+	}
+	while (!slot->eof);
+
+	close(fd);
+}
+
+static gpointer readahead_thread(gpointer data)
+{
+	struct stat st;
+	bool stop = false;
+	char infile[PATH_MAX];
+	tReadAhead *ra = (tReadAhead*)data;
+
+	for (char *name = ra->list; *name && !stop; name += strlen(name) + 1)
+	{
+		pack_src_path(infile, ra->srcpath, name);
+
+		if (lstat(infile, &st) == 0 && S_ISREG(st.st_mode))
+			readahead_file(ra, infile);
+
+		g_mutex_lock(&ra->lock);
+		ra->index++;
+		stop = ra->stop;
+		g_cond_broadcast(&ra->cond);
+		g_mutex_unlock(&ra->lock);
+	}
+
+	g_mutex_lock(&ra->lock);
+	ra->done = true;
+	g_cond_broadcast(&ra->cond);
+	g_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+static tReadAhead* readahead_new(char *srcpath, char *list)
+{
+	tReadAhead *ra = g_new0(tReadAhead, 1);
+
+	for (int i = 0; i < RA_SLOTS; i++)
+	{
+		if ((ra->slots[i].buff = malloc(RA_BUFF_SIZE)) == NULL)
+		{
+			while (i-- > 0)
+				free(ra->slots[i].buff);
+
+			g_free(ra);
+			return NULL;
+		}
+	}
+
+	ra->srcpath = srcpath;
+	ra->list = list;
+	g_mutex_init(&ra->lock);
+	g_cond_init(&ra->cond);
+	ra->thread = g_thread_new("readahead", readahead_thread, ra);
+
+	return ra;
+}
+
+static void readahead_free(tReadAhead *ra)
+{
+	if (!ra)
+		return;
+
+	g_mutex_lock(&ra->lock);
+	ra->stop = true;
+	g_cond_broadcast(&ra->cond);
+	g_mutex_unlock(&ra->lock);
+
+	g_thread_join(ra->thread);
+
+	for (int i = 0; i < RA_SLOTS; i++)
+		free(ra->slots[i].buff);
+
+	g_mutex_clear(&ra->lock);
+	g_cond_clear(&ra->cond);
+	g_free(ra);
+}
+
+/*
+ * Consumer side: the next prefetched block of the file at position index in AddList.
+ * NULL if the reader has nothing for this file, the caller reads it by itself then.
+ */
+static tReadAheadSlot* readahead_take(tReadAhead *ra, int index)
+{
+	tReadAheadSlot *slot = NULL;
+
+	if (!ra)
+		return NULL;
+
+	g_mutex_lock(&ra->lock);
+
+	while (true)
+	{
+		while (ra->head == ra->tail && !ra->done && ra->index <= index)
+			g_cond_wait(&ra->cond, &ra->lock);
+
+		if (ra->head == ra->tail)
+			break;
+
+		slot = &ra->slots[ra->head % RA_SLOTS];
+
+		if (slot->index >= index)
+			break;
+
+		// left over from a file the consumer skipped
+		slot = NULL;
+		ra->head++;
+		g_cond_broadcast(&ra->cond);
+	}
+
+	if (slot && (slot->index != index || slot->error != 0))
+		slot = NULL;
+
+	g_mutex_unlock(&ra->lock);
+
+	return slot;
+}
+
+static void readahead_release(tReadAhead *ra)
+{
+	g_mutex_lock(&ra->lock);
+	ra->head++;
+	g_cond_broadcast(&ra->cond);
+	g_mutex_unlock(&ra->lock);
+}
+
+static int pack_write_data(struct archive *a, const void *data, size_t len, tPackProgress *prog)
+{
+	size_t prcnt = 0;
+
+	if (archive_write_data(a, data, len) < ARCHIVE_OK)
+	{
+		errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
+		return E_EWRITE;
+	}
+
+	prog->packed += len;
+	prog->csize += len;
+	progress_label(prog->infile, prog->packed, prog->start, prog->label, sizeof(prog->label));
+
+	if (gProcessDataProc(prog->label, len) == 0)
+		return E_EABORTED;
+
+	if (prog->fsize > 0)
+		prcnt = prog->csize * 100 / prog->fsize;
+
+	if (gProcessDataProc(prog->label, -(1000 + prcnt)) == 0)
+		return E_EABORTED;
+
+	return E_SUCCESS;
+}
+
 int DCPCALL PackFiles(char *PackedFile, char *SubPath, char *SrcPath, char *AddList, int Flags)
 {
 	struct archive_entry *entry;
 	struct stat st;
-	char buff[BUFF_SIZE];
-	int fd, ofd = -1, ret, id;
+	char *buff = NULL;
+	int fd, ofd = -1, ret, id, index = 0;
 	ssize_t len;
 	char fname[PATH_MAX];
 	char infile[PATH_MAX];
 	char pkfile[PATH_MAX];
 	char link[PATH_MAX + 1];
 	int result = E_SUCCESS;
-	char *msg, *rmlist = NULL, *tmpfn = NULL;
+	tPackProgress prog = { .start = g_get_monotonic_time() };
+	tReadAhead *ra = NULL;
+	tReadAheadSlot *slot;
+	char *msg, *rmlist = NULL, *tmpfn = NULL, *newfn = NULL;
+	char *headlist = AddList;
+	tAppendData append = { .fd = -1 };
 	struct passwd *pw;
 	struct group  *gr;
-	size_t csize, prcnt;
 
 	const char *ext = strrchr(PackedFile, '.');
 
@@ -1671,12 +3663,27 @@ int DCPCALL PackFiles(char *PackedFile, char *SubPath, char *SrcPath, char *AddL
 		return 0;
 	}
 
+	archive_set_filter_threads(a);
+
 	if (access(PackedFile, F_OK) != -1)
-		result = archive_repack_existing(a, PackedFile, &tmpfn, ofd, AddList, SubPath, Flags, ext);
-	else
+	{
+		result = archive_append_open(a, PackedFile, AddList, SubPath, Flags, ext, &append);
+
+		// new files go to a separate zip, the old entries are copied over as they are afterwards
+		if (result == E_NOT_SUPPORTED && zip_can_passthrough(PackedFile, ext))
+		{
+			g_strlcpy(infile, PackedFile, PATH_MAX);
+			newfn = tempnam(dirname(infile), "arc_");
+			result = newfn ? E_SUCCESS : E_ECREATE;
+		}
+		else if (result == E_NOT_SUPPORTED)
+			result = archive_repack_existing(a, PackedFile, &tmpfn, ofd, AddList, SubPath, Flags, ext);
+	}
+
+	if (newfn || access(PackedFile, F_OK) == -1)
 	{
 
-		if ((gOptions[0] != '\0') && archive_write_set_options(a, gOptions) < ARCHIVE_OK)
+		if ((gOptions[0] != '\0') && archive_apply_options(a, ext, gOptions) < ARCHIVE_OK)
 		{
 			errmsg(archive_error_string(a), MB_OK | MB_ICONWARNING);
 		}
@@ -1717,11 +3724,11 @@ int DCPCALL PackFiles(char *PackedFile, char *SubPath, char *SrcPath, char *AddL
 		if (strcasecmp(ext, ".shar") == 0 || strcasecmp(ext, ".run") == 0)
 			omode |= S_IXUSR | S_IXGRP | S_IXOTH;
 
-		ofd = open(PackedFile, O_WRONLY | O_CREAT | O_TRUNC, omode);
+		ofd = open(newfn ? newfn : PackedFile, O_WRONLY | O_CREAT | O_TRUNC, omode);
 
 		if (ofd == -1)
 			result = E_ECREATE;
-		else if (archive_write_open_fd(a, ofd) < ARCHIVE_OK)
+		else if (archive_open_output(a, ext, ofd, gOptions) < ARCHIVE_OK)
 		{
 			errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
 			result = E_ECREATE;
@@ -1733,18 +3740,18 @@ int DCPCALL PackFiles(char *PackedFile, char *SubPath, char *SrcPath, char *AddL
 		struct archive *disk = archive_read_disk_new();
 		archive_read_disk_set_standard_lookup(disk);
 		archive_read_disk_set_symlink_physical(disk);
+		buff = malloc(RA_BUFF_SIZE);
 
-		while (*AddList)
+		if (!buff)
+			result = E_NO_MEMORY;
+		else if (strcmp(ext, ".mtree") != 0 || !mtree_opts_nodata())
+			ra = readahead_new(SrcPath, AddList);
+
+		while (result == E_SUCCESS && *AddList)
 		{
-			strcpy(infile, SrcPath);
-			char* pos = strrchr(infile, '/');
+			pack_src_path(infile, SrcPath, AddList);
 			g_strlcpy(fname, AddList, PATH_MAX);
 
-			if (pos != NULL)
-				strcpy(pos + 1, fname);
-			else
-				strcpy(infile, fname);
-
 			if (!(Flags & PK_PACK_SAVE_PATHS))
 				g_strlcpy(fname, strdup(basename(fname)), PATH_MAX);
 
@@ -1880,34 +3887,30 @@ int DCPCALL PackFiles(char *PackedFile, char *SubPath, char *SrcPath, char *AddL
 						archive_read_disk_entry_from_file(disk, entry, fd, &st);
 						archive_entry_set_pathname(entry, pkfile);
 						archive_write_header(a, entry);
-						csize = 0;
+						prog.infile = infile;
+						prog.csize = 0;
+						prog.fsize = st.st_size;
+						bool prefetched = false;
 
-						while ((len = read(fd, buff, sizeof(buff))) > 0)
+						while ((slot = readahead_take(ra, index)) != NULL)
 						{
-							if (archive_write_data(a, buff, len) < ARCHIVE_OK)
-							{
-								errmsg(archive_error_string(a), MB_OK | MB_ICONERROR);
-								result = E_EWRITE;
-								break;
-							}
+							prefetched = true;
+							ret = (slot->len > 0) ? pack_write_data(a, slot->buff, slot->len, &prog) : E_SUCCESS;
+							bool eof = slot->eof;
+							readahead_release(ra);
 
-							if (gProcessDataProc(infile, len) == 0)
-							{
-								result = E_EABORTED;
-								break;
-							}
+							if (ret != E_SUCCESS)
+								result = ret;
 
-							if (st.st_size > 0)
-							{
-								csize += len;
-								prcnt = csize * 100 / st.st_size;
-							}
-							else
-								prcnt = 0;
+							if (ret != E_SUCCESS || eof)
+								break;
+						}
 
-							if (gProcessDataProc(infile, -(1000 + prcnt)) == 0)
+						while (!prefetched && (len = read(fd, buff, RA_BUFF_SIZE)) > 0)
+						{
+							if ((ret = pack_write_data(a, buff, len, &prog)) != E_SUCCESS)
 							{
-								result = E_EABORTED;
+								result = ret;
 								break;
 							}
 						}
@@ -1949,18 +3952,32 @@ int DCPCALL PackFiles(char *PackedFile, char *SubPath, char *SrcPath, char *AddL
 				break;
 
 			while (*AddList++);
+
+			index++;
 		}
 
+		readahead_free(ra);
+		free(buff);
 		archive_read_free(disk);
 		archive_write_finish_entry(a);
 	}
 
 	archive_write_close(a);
 	archive_write_free(a);
+	archive_append_close(&append, result == E_SUCCESS);
 
 	if (ofd > -1)
 		close(ofd);
 
+	if (newfn)
+	{
+		if (result == E_SUCCESS)
+			result = zip_passthrough_repack(PackedFile, newfn, headlist, SubPath, Flags);
+
+		remove_file(newfn);
+		free(newfn);
+	}
+
 	if ((Flags & PK_PACK_MOVE_FILES && result == E_SUCCESS) &&
 	                (!gNotabene || errmsg("Now WILL TRY to REMOVE ALL (including SKIPPED!) source files. Are you sure you want this?", MB_YESNO | MB_ICONWARNING) == ID_YES))
 	{
@@ -1998,6 +4015,13 @@ int DCPCALL DeleteFiles(char *PackedFile, char *DeleteList)
 
 	const char *ext = strrchr(PackedFile, '.');
 
+	if (zip_can_passthrough(PackedFile, ext))
+	{
+		result = zip_passthrough_repack(PackedFile, NULL, DeleteList, NULL, PK_PACK_SAVE_PATHS);
+		gProcessDataProc(PackedFile, -100);
+		return result;
+	}
+
 	struct archive *a = archive_write_new();
 
 	if ((ret = archive_set_format_filter(a, ext)) == ARCHIVE_WARN)
@@ -2011,6 +4035,7 @@ int DCPCALL DeleteFiles(char *PackedFile, char *DeleteList)
 		return 0;
 	}
 
+	archive_set_filter_threads(a);
 	result = archive_repack_existing(a, PackedFile, &tmpfn, ofd, DeleteList, NULL, PK_PACK_SAVE_PATHS, ext);
 	gProcessDataProc(PackedFile, -100);
 	archive_write_finish_entry(a);
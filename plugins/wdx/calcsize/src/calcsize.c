@@ -1,47 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
-#include <dirent.h>
 #include <math.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include "wdxplugin.h"
+#include "dirstats.h"
+#include "delayed.h"
 
-static int64_t calcdirszie(const char *name)
+static void calcsize_work(const char *path, int arg, const bool *cancel)
 {
-	DIR *dir;
-	int64_t size = 0;
-	struct dirent *ent;
-	struct stat buf;
-
-	if ((dir = opendir(name)) != NULL)
-	{
-		while ((ent = readdir(dir)) != NULL)
-		{
-			if ((strcmp(ent->d_name, ".") != 0) && (strcmp(ent->d_name, "..") != 0))
-			{
-				if (ent->d_type == DT_REG)
-				{
-					char file[PATH_MAX];
-					snprintf(file, PATH_MAX, "%s/%s", name, ent->d_name);
-
-					if (stat(file, &buf) == 0)
-						size += buf.st_size;
-				}
-
-				if (ent->d_type == DT_DIR)
-				{
-					char path[PATH_MAX];
-					snprintf(path, PATH_MAX, "%s/%s", name, ent->d_name);
-					size += calcdirszie(path);
-				}
-			}
-		}
-
-		closedir(dir);
-	}
-
-	return size;
+	tDirStats stats;
+	dirstats_get(path, false, cancel, &stats);
 }
 
 static double sizecnv(int64_t size, int bytes, int bpow)
@@ -52,7 +23,7 @@ static double sizecnv(int64_t size, int bytes, int bpow)
 
 int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Units, int maxlen)
 {
-	strncpy(Units, "default|files only|dirs only", maxlen - 1);
+	strncpy(Units, "default|files only|dirs only|allocated|allocated, files only|allocated, dirs only", maxlen - 1);
 
 	switch (FieldIndex)
 	{
@@ -101,7 +72,8 @@ int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Unit
 int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void* FieldValue, int maxlen, int flags)
 {
 	struct stat buf;
-	int64_t rsize;
+	int64_t rsize, rblocks;
+	int mode = UnitIndex % 3;
 
 	if (strncmp(FileName + strlen(FileName) - 3, "/..", 4) == 0)
 		return ft_fileerror;
@@ -109,15 +81,39 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 	if (lstat(FileName, &buf) != 0)
 		return ft_fileerror;
 
-	if (S_ISDIR(buf.st_mode) && UnitIndex != 1)
-		rsize = calcdirszie(FileName);
-	else if (!S_ISDIR(buf.st_mode) && UnitIndex != 2)
+	if (S_ISDIR(buf.st_mode) && access(FileName, R_OK) != 0)
+		return ft_fieldempty;
+
+	if (S_ISDIR(buf.st_mode) && mode != 1)
+	{
+		tDirStats stats;
+
+		if (!dirstats_peek(FileName, &stats))
+		{
+			if (flags & CONTENT_DELAYIFSLOW)
+			{
+				delayed_submit(FileName, 0);
+				*(char*)FieldValue = '\0';
+				return ft_delayed;
+			}
+
+			if (!delayed_run(FileName, 0) || !dirstats_get(FileName, false, NULL, &stats))
+				return ft_fieldempty;
+		}
+
+		rsize = stats.size;
+		rblocks = stats.blocks;
+	}
+	else if (!S_ISDIR(buf.st_mode) && mode != 2)
+	{
 		rsize = buf.st_size;
+		rblocks = buf.st_blocks;
+	}
 	else
 		return ft_fieldempty;
 
-	if (S_ISDIR(buf.st_mode) && access(FileName, R_OK) != 0)
-		return ft_fieldempty;
+	if (UnitIndex > 2)
+		rsize = rblocks * 512;
 
 	switch (FieldIndex)
 	{
@@ -163,3 +159,20 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 
 	return ft_numeric_floating;
 }
+
+void DCPCALL ContentStopGetValue(char* FileName)
+{
+	delayed_stop(FileName);
+}
+
+void DCPCALL ContentSetDefaultParams(ContentDefaultParamStruct* dps)
+{
+	// the walk is parallel itself, one folder at a time is enough
+	delayed_init(calcsize_work, 1);
+}
+
+void DCPCALL ContentPluginUnloading(void)
+{
+	delayed_shutdown();
+	dirstats_shutdown();
+}
@@ -0,0 +1,297 @@
+#ifndef _DELAYED_H
+#define _DELAYED_H
+
+// Background evaluation for slow wdx fields.
+// The foreground call (CONTENT_DELAYIFSLOW) queues the file with delayed_submit() and returns ft_delayed,
+// a few workers start on it at once. DC asks again from its own thread: delayed_run() then waits for the
+// queued work (or does it right there if no worker took it yet). ContentStopGetValue() -> delayed_stop()
+// cancels the file and everything still queued from the same folder, the work function is expected
+// to look at *cancel now and then.
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <string.h>
+
+#define DELAYED_MAX_THREADS 8
+#define DELAYED_QUEUE_MAX 256
+
+typedef void (*tDelayedFunc)(const char *path, int arg, const bool *cancel);
+
+typedef struct sDelayedTask
+{
+	char *path;
+	int arg;
+	bool cancel;
+	bool running;
+	bool done;
+	int refs;
+	struct sDelayedTask *next;
+} tDelayedTask;
+
+static pthread_mutex_t gDelayedLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gDelayedCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t gDelayedDone = PTHREAD_COND_INITIALIZER;
+static tDelayedTask *gDelayedTasks = NULL;
+static tDelayedFunc gDelayedFunc = NULL;
+static pthread_t gDelayedThreads[DELAYED_MAX_THREADS];
+static int gDelayedThreadCount = 0;
+static int gDelayedStarted = 0;
+static bool gDelayedQuit = false;
+
+static size_t delayed_dirlen(const char *path)
+{
+	const char *pos = strrchr(path, '/');
+
+	return pos ? (size_t)(pos - path) : 0;
+}
+
+static bool delayed_same_dir(const char *a, const char *b)
+{
+	size_t len = delayed_dirlen(a);
+
+	return (len == delayed_dirlen(b) && strncmp(a, b, len) == 0);
+}
+
+static tDelayedTask* delayed_find(const char *path)
+{
+	for (tDelayedTask *task = gDelayedTasks; task; task = task->next)
+		if (!task->done && strcmp(task->path, path) == 0)
+			return task;
+
+	return NULL;
+}
+
+static void delayed_unref(tDelayedTask *task)
+{
+	if (--task->refs == 0)
+	{
+		free(task->path);
+		free(task);
+	}
+}
+
+// called with gDelayedLock held
+static void delayed_finish(tDelayedTask *task)
+{
+	task->done = true;
+	pthread_cond_broadcast(&gDelayedDone);
+
+	for (tDelayedTask **p = &gDelayedTasks; *p; p = &(*p)->next)
+	{
+		if (*p == task)
+		{
+			*p = task->next;
+			delayed_unref(task);
+			break;
+		}
+	}
+}
+
+static tDelayedTask* delayed_add(const char *path, int arg, bool running)
+{
+	tDelayedTask *task = calloc(1, sizeof(tDelayedTask));
+
+	if (!task || (task->path = strdup(path)) == NULL)
+	{
+		free(task);
+		return NULL;
+	}
+
+	task->arg = arg;
+	task->running = running;
+	task->refs = 1;
+
+	tDelayedTask **p = &gDelayedTasks;
+
+	while (*p)
+		p = &(*p)->next;
+
+	*p = task;
+
+	return task;
+}
+
+// called with gDelayedLock held, leaves it held
+static bool delayed_execute(tDelayedTask *task)
+{
+	task->refs++;
+	pthread_mutex_unlock(&gDelayedLock);
+
+	if (!__atomic_load_n(&task->cancel, __ATOMIC_RELAXED))
+		gDelayedFunc(task->path, task->arg, &task->cancel);
+
+	pthread_mutex_lock(&gDelayedLock);
+	bool result = !task->cancel;
+	delayed_finish(task);
+	delayed_unref(task);
+
+	return result;
+}
+
+static void* delayed_worker(void *data)
+{
+	pthread_mutex_lock(&gDelayedLock);
+
+	while (!gDelayedQuit)
+	{
+		tDelayedTask *task = gDelayedTasks;
+
+		while (task && task->running)
+			task = task->next;
+
+		if (!task)
+		{
+			pthread_cond_wait(&gDelayedCond, &gDelayedLock);
+			continue;
+		}
+
+		task->running = true;
+		delayed_execute(task);
+	}
+
+	pthread_mutex_unlock(&gDelayedLock);
+
+	return NULL;
+}
+
+static void delayed_init(tDelayedFunc func, int threads)
+{
+	pthread_mutex_lock(&gDelayedLock);
+	gDelayedFunc = func;
+	gDelayedThreadCount = (threads < 1) ? 1 : (threads > DELAYED_MAX_THREADS ? DELAYED_MAX_THREADS : threads);
+	pthread_mutex_unlock(&gDelayedLock);
+}
+
+// queue the file for the workers, false if it can't be queued
+static bool delayed_submit(const char *path, int arg)
+{
+	int count = 0;
+	bool result = false;
+
+	pthread_mutex_lock(&gDelayedLock);
+
+	if (!gDelayedFunc || gDelayedQuit)
+	{
+		pthread_mutex_unlock(&gDelayedLock);
+		return false;
+	}
+
+	while (gDelayedStarted < gDelayedThreadCount &&
+	                pthread_create(&gDelayedThreads[gDelayedStarted], NULL, delayed_worker, NULL) == 0)
+		gDelayedStarted++;
+
+	for (tDelayedTask *task = gDelayedTasks; task; task = task->next)
+		count++;
+
+	if (delayed_find(path))
+		result = true;
+	else if (gDelayedStarted > 0 && count < DELAYED_QUEUE_MAX && delayed_add(path, arg, false))
+	{
+		pthread_cond_signal(&gDelayedCond);
+		result = true;
+	}
+
+	pthread_mutex_unlock(&gDelayedLock);
+
+	return result;
+}
+
+// compute the file now or wait for the worker that already does, false if it was cancelled
+static bool delayed_run(const char *path, int arg)
+{
+	bool result = false;
+
+	pthread_mutex_lock(&gDelayedLock);
+
+	if (!gDelayedFunc || gDelayedQuit)
+	{
+		pthread_mutex_unlock(&gDelayedLock);
+		return false;
+	}
+
+	tDelayedTask *task = delayed_find(path);
+
+	if (!task)
+		task = delayed_add(path, arg, true);
+	else if (!task->running)
+		task->running = true;
+	else
+	{
+		task->refs++;
+
+		while (!task->done)
+			pthread_cond_wait(&gDelayedDone, &gDelayedLock);
+
+		result = !task->cancel;
+		delayed_unref(task);
+		pthread_mutex_unlock(&gDelayedLock);
+
+		return result;
+	}
+
+	if (task)
+		result = delayed_execute(task);
+	else
+	{
+		// out of memory, nothing to cancel it with
+		pthread_mutex_unlock(&gDelayedLock);
+		gDelayedFunc(path, arg, &gDelayedQuit);
+
+		return true;
+	}
+
+	pthread_mutex_unlock(&gDelayedLock);
+
+	return result;
+}
+
+// DC gave up on the file, so it left the folder or is about to: drop the rest of the folder too
+static void delayed_stop(const char *path)
+{
+	pthread_mutex_lock(&gDelayedLock);
+
+	tDelayedTask *task = gDelayedTasks;
+
+	while (task)
+	{
+		tDelayedTask *next = task->next;
+
+		if (strcmp(task->path, path) == 0 || (!task->running && delayed_same_dir(task->path, path)))
+		{
+			__atomic_store_n(&task->cancel, true, __ATOMIC_RELAXED);
+
+			if (!task->running)
+				delayed_finish(task);
+		}
+
+		task = next;
+	}
+
+	pthread_mutex_unlock(&gDelayedLock);
+}
+
+static void delayed_shutdown(void)
+{
+	pthread_mutex_lock(&gDelayedLock);
+	gDelayedQuit = true;
+
+	for (tDelayedTask *task = gDelayedTasks; task; task = task->next)
+		__atomic_store_n(&task->cancel, true, __ATOMIC_RELAXED);
+
+	pthread_cond_broadcast(&gDelayedCond);
+	pthread_mutex_unlock(&gDelayedLock);
+
+	for (int i = 0; i < gDelayedStarted; i++)
+		pthread_join(gDelayedThreads[i], NULL);
+
+	pthread_mutex_lock(&gDelayedLock);
+	gDelayedStarted = 0;
+
+	while (gDelayedTasks)
+		delayed_finish(gDelayedTasks);
+
+	pthread_mutex_unlock(&gDelayedLock);
+}
+
+#endif
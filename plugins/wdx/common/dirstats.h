@@ -0,0 +1,1357 @@
+#ifndef _DIRSTATS_H
+#define _DIRSTATS_H
+
+// Subtree statistics shared by the recursive wdx columns (calcsize, emptydir, fewfiles).
+// One walk fills every counter. Directory nodes are kept between calls and a directory is
+// read again only when its mtime/ctime changed; otherwise its entries are taken from the last walk.
+// Walked directories are also put under inotify: a subtree without events since the last call
+// is neither walked nor summed again, its totals are returned as they are.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <string.h>
+
+#define DS_MAX_THREADS 8
+#define DS_MAX_ROOTS 32
+#define DS_INODES_MIN_SIZE 1024
+#define DS_RESULTS 16
+#define DS_RESULT_TTL 1000000000L // ns, fields of one file are asked back to back
+#define DS_WATCH_BUCKETS 4096
+#define DS_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+enum
+{
+	DS_DIR,
+	DS_REG,
+	DS_LNK,
+	DS_FIFO,
+	DS_SOCK,
+	DS_BLK,
+	DS_CHR,
+	DS_UNKNOWN,
+	DS_TYPES
+};
+
+typedef struct sDirStats
+{
+	int64_t size;             // regular files, hardlinks counted once
+	int64_t blocks;           // 512-byte blocks of files and directories
+	int64_t count[DS_TYPES];
+	int64_t noaccess;         // subdirs w/o read or search permission
+	bool empty;
+	bool emptydirs;           // nothing but (empty) directories
+} tDirStats;
+
+typedef struct sDirLink
+{
+	dev_t dev;
+	ino_t ino;
+	int64_t size;
+	int64_t blocks;
+} tDirLink;
+
+typedef struct sDirNode
+{
+	char *name;
+	struct sDirNode *parent;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	bool valid;               // entries may be reused if mtime/ctime match
+	bool clean;               // total is up to date (no events since it was summed)
+	bool noaccess;
+	bool mark;
+	int wd;
+	uint64_t stamp;
+	int64_t blocks;
+	int64_t size;
+	int64_t fblocks;
+	int64_t count[DS_TYPES];
+	tDirLink *links;
+	size_t nlinks;
+	struct sDirNode **subdirs;
+	size_t nsubdirs;
+	tDirStats total;
+	int64_t total_links;      // multi-link files below, total depends on what was counted before
+	int64_t total_unwatched;  // directories below that have to be validated by mtime
+} tDirNode;
+
+typedef struct sDirWatch
+{
+	int wd;
+	tDirNode *node;
+	struct sDirWatch *next;
+} tDirWatch;
+
+typedef struct sDirRoot
+{
+	char *path;
+	tDirNode *node;
+	uint64_t used;
+} tDirRoot;
+
+typedef struct sDirResult
+{
+	char *path;
+	tDirStats stats;
+	struct timespec time;
+} tDirResult;
+
+typedef struct sDirJob
+{
+	tDirNode *node;
+	char *path;
+	int flags;
+} tDirJob;
+
+typedef struct sDirQueue
+{
+	pthread_mutex_t lock;
+	tDirJob *items;
+	size_t head;
+	size_t count;
+	size_t size;
+} tDirQueue;
+
+typedef struct sDirWalk
+{
+	int nthreads;
+	tDirQueue queues[DS_MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t pending;
+	size_t queued;
+	int idle;
+	const bool *cancel;
+} tDirWalk;
+
+typedef struct sDirWorker
+{
+	tDirWalk *walk;
+	int index;
+	char path[PATH_MAX];
+} tDirWorker;
+
+typedef struct sInodeSet
+{
+	tDirLink *items;
+	size_t count;
+	size_t size;
+} tInodeSet;
+
+// gDirWalkLock: the node tree, held through a walk; gDirStatsLock: the recent results, never held long.
+// When both are needed gDirWalkLock is taken first.
+static pthread_mutex_t gDirWalkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t gDirStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t gDirRootsLock = PTHREAD_MUTEX_INITIALIZER;
+static tDirRoot gDirRoots[DS_MAX_ROOTS];
+static uint64_t gDirRootsStamp = 0;
+static tDirResult gDirResults[DS_RESULTS];
+static int gDirResultsNext = 0;
+static int gDirNotify = -1;
+static int gDirNotifyWake[2] = { -1, -1 };
+static pthread_t gDirNotifyThread;
+static bool gDirNotifyFull = false;
+static pthread_once_t gDirNotifyOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t gDirWatchLock = PTHREAD_MUTEX_INITIALIZER;
+static tDirWatch *gDirWatches[DS_WATCH_BUCKETS];
+static uint64_t gDirStamp = 0;
+
+static int dirstats_type(unsigned char d_type)
+{
+	switch (d_type)
+	{
+	case DT_DIR:
+		return DS_DIR;
+
+	case DT_REG:
+		return DS_REG;
+
+	case DT_LNK:
+		return DS_LNK;
+
+	case DT_FIFO:
+		return DS_FIFO;
+
+	case DT_SOCK:
+		return DS_SOCK;
+
+	case DT_BLK:
+		return DS_BLK;
+
+	case DT_CHR:
+		return DS_CHR;
+
+	default:
+		return DS_UNKNOWN;
+	}
+}
+
+static int dirstats_mode_type(mode_t mode)
+{
+	if (S_ISDIR(mode))
+		return DS_DIR;
+	else if (S_ISREG(mode))
+		return DS_REG;
+	else if (S_ISLNK(mode))
+		return DS_LNK;
+	else if (S_ISFIFO(mode))
+		return DS_FIFO;
+	else if (S_ISSOCK(mode))
+		return DS_SOCK;
+	else if (S_ISBLK(mode))
+		return DS_BLK;
+	else if (S_ISCHR(mode))
+		return DS_CHR;
+
+	return DS_UNKNOWN;
+}
+
+static bool inodeset_insert(tDirLink *items, size_t size, tDirLink *link)
+{
+	uint64_t h = ((uint64_t)link->ino * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)link->dev;
+	size_t i = (size_t)(h ^ (h >> 29)) & (size - 1);
+
+	while (items[i].ino != 0)
+	{
+		if (items[i].ino == link->ino && items[i].dev == link->dev)
+			return false;
+
+		i = (i + 1) & (size - 1);
+	}
+
+	items[i] = *link;
+
+	return true;
+}
+
+// true if this is the first time we see the inode
+static bool inodeset_add(tInodeSet *set, tDirLink *link)
+{
+	if (link->ino == 0)
+		return true;
+
+	if ((set->count + 1) * 2 > set->size)
+	{
+		size_t size = set->size ? set->size * 2 : DS_INODES_MIN_SIZE;
+		tDirLink *items = calloc(size, sizeof(tDirLink));
+
+		if (!items)
+			return true;
+
+		for (size_t i = 0; i < set->size; i++)
+			if (set->items[i].ino != 0)
+				inodeset_insert(items, size, &set->items[i]);
+
+		free(set->items);
+		set->items = items;
+		set->size = size;
+	}
+
+	if (!inodeset_insert(set->items, set->size, link))
+		return false;
+
+	set->count++;
+
+	return true;
+}
+
+static void dirwatch_add(tDirNode *node, const char *path)
+{
+	if (gDirNotify == -1 || node->wd >= 0 || __atomic_load_n(&gDirNotifyFull, __ATOMIC_RELAXED))
+		return;
+
+	int wd = inotify_add_watch(gDirNotify, path, DS_WATCH_MASK);
+
+	if (wd < 0)
+	{
+		if (errno == ENOSPC)
+			__atomic_store_n(&gDirNotifyFull, true, __ATOMIC_RELAXED);
+
+		return;
+	}
+
+	pthread_mutex_lock(&gDirWatchLock);
+
+	tDirWatch **slot = &gDirWatches[(unsigned)wd % DS_WATCH_BUCKETS];
+
+	// the same directory reached twice (bind mounts, overlapping roots), first node keeps the watch
+	for (tDirWatch *item = *slot; item; item = item->next)
+	{
+		if (item->wd == wd)
+		{
+			pthread_mutex_unlock(&gDirWatchLock);
+			return;
+		}
+	}
+
+	tDirWatch *item = malloc(sizeof(tDirWatch));
+
+	if (item)
+	{
+		item->wd = wd;
+		item->node = node;
+		item->next = *slot;
+		*slot = item;
+		node->wd = wd;
+		node->stamp = __atomic_add_fetch(&gDirStamp, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&gDirWatchLock);
+
+	if (!item)
+		inotify_rm_watch(gDirNotify, wd);
+}
+
+static tDirNode* dirwatch_take(int wd, bool remove)
+{
+	tDirNode *node = NULL;
+
+	pthread_mutex_lock(&gDirWatchLock);
+
+	for (tDirWatch **slot = &gDirWatches[(unsigned)wd % DS_WATCH_BUCKETS]; *slot; slot = &(*slot)->next)
+	{
+		if ((*slot)->wd == wd)
+		{
+			tDirWatch *item = *slot;
+			node = item->node;
+
+			if (remove)
+			{
+				*slot = item->next;
+				free(item);
+			}
+
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&gDirWatchLock);
+
+	return node;
+}
+
+static void dirwatch_remove(tDirNode *node)
+{
+	if (node->wd < 0)
+		return;
+
+	dirwatch_take(node->wd, true);
+	inotify_rm_watch(gDirNotify, node->wd);
+	node->wd = -1;
+	__atomic_store_n(&gDirNotifyFull, false, __ATOMIC_RELAXED);
+}
+
+static void dirnode_free(tDirNode *node);
+
+static void dirnode_clear(tDirNode *node)
+{
+	for (size_t i = 0; i < node->nsubdirs; i++)
+		dirnode_free(node->subdirs[i]);
+
+	free(node->subdirs);
+	free(node->links);
+	node->subdirs = NULL;
+	node->nsubdirs = 0;
+	node->links = NULL;
+	node->nlinks = 0;
+	node->size = 0;
+	node->fblocks = 0;
+	memset(node->count, 0, sizeof(node->count));
+	node->dev = 0;
+	node->ino = 0;
+	node->valid = false;
+	node->clean = false;
+}
+
+static void dirnode_free(tDirNode *node)
+{
+	if (!node)
+		return;
+
+	dirnode_clear(node);
+	dirwatch_remove(node);
+	free(node->name);
+	free(node);
+}
+
+static tDirNode* dirnode_new(const char *name)
+{
+	tDirNode *node = calloc(1, sizeof(tDirNode));
+
+	if (node && (node->name = strdup(name)) == NULL)
+	{
+		free(node);
+		return NULL;
+	}
+
+	if (node)
+		node->wd = -1;
+
+	return node;
+}
+
+static int dirnode_cmp(const void *a, const void *b)
+{
+	return strcmp((*(tDirNode**)a)->name, (*(tDirNode**)b)->name);
+}
+
+static tDirNode* dirnode_find(tDirNode *node, const char *name)
+{
+	tDirNode key, *pkey = &key, **found;
+
+	if (node->nsubdirs == 0)
+		return NULL;
+
+	key.name = (char*)name;
+	found = bsearch(&pkey, node->subdirs, node->nsubdirs, sizeof(tDirNode*), dirnode_cmp);
+
+	return found ? *found : NULL;
+}
+
+// a cached root that turns up inside a new walk is moved into the tree instead of being read again
+static tDirNode* dirroots_adopt(const char *path)
+{
+	tDirNode *node = NULL;
+
+	pthread_mutex_lock(&gDirRootsLock);
+
+	for (int i = 0; i < DS_MAX_ROOTS; i++)
+	{
+		if (gDirRoots[i].path && strcmp(gDirRoots[i].path, path) == 0)
+		{
+			node = gDirRoots[i].node;
+			free(gDirRoots[i].path);
+			gDirRoots[i].path = NULL;
+			gDirRoots[i].node = NULL;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&gDirRootsLock);
+
+	return node;
+}
+
+static tDirNode* dirroots_lookup(const char *path, bool create)
+{
+	tDirNode *result = NULL;
+	int empty = -1, oldest = 0;
+
+	pthread_mutex_lock(&gDirRootsLock);
+
+	for (int i = 0; i < DS_MAX_ROOTS && !result; i++)
+	{
+		if (!gDirRoots[i].path)
+		{
+			if (empty == -1)
+				empty = i;
+
+			continue;
+		}
+
+		if (gDirRoots[i].used < gDirRoots[oldest].used || !gDirRoots[oldest].path)
+			oldest = i;
+
+		size_t len = strlen(gDirRoots[i].path);
+
+		if (strncmp(gDirRoots[i].path, path, len) != 0 || (path[len] != '\0' && path[len] != '/'))
+			continue;
+
+		tDirNode *node = gDirRoots[i].node;
+		const char *p = path + len;
+
+		while (node && *p == '/')
+		{
+			char name[PATH_MAX];
+			const char *end = strchrnul(p + 1, '/');
+
+			if ((size_t)(end - p - 1) >= sizeof(name))
+			{
+				node = NULL;
+				break;
+			}
+
+			memcpy(name, p + 1, end - p - 1);
+			name[end - p - 1] = '\0';
+
+			if (name[0] != '\0')
+				node = dirnode_find(node, name);
+
+			p = end;
+		}
+
+		if (node)
+		{
+			gDirRoots[i].used = ++gDirRootsStamp;
+			result = node;
+		}
+	}
+
+	if (!result && create)
+	{
+		int i = (empty != -1) ? empty : oldest;
+		tDirNode *node = dirnode_new(path);
+		char *rpath = strdup(path);
+
+		if (node && rpath)
+		{
+			free(gDirRoots[i].path);
+			dirnode_free(gDirRoots[i].node);
+			gDirRoots[i].path = rpath;
+			gDirRoots[i].node = node;
+			gDirRoots[i].used = ++gDirRootsStamp;
+			result = node;
+		}
+		else
+		{
+			free(rpath);
+			dirnode_free(node);
+		}
+	}
+
+	pthread_mutex_unlock(&gDirRootsLock);
+
+	return result;
+}
+
+static bool dirwalk_push(tDirWorker *w, tDirNode *node, char *path, int flags)
+{
+	tDirWalk *walk = w->walk;
+	tDirQueue *q = &walk->queues[w->index];
+
+	pthread_mutex_lock(&q->lock);
+
+	if (q->count == q->size)
+	{
+		size_t size = q->size ? q->size * 2 : 64;
+		tDirJob *items = realloc(q->items, size * sizeof(tDirJob));
+
+		if (!items)
+		{
+			pthread_mutex_unlock(&q->lock);
+			return false;
+		}
+
+		q->items = items;
+		q->size = size;
+	}
+
+	q->items[q->count].node = node;
+	q->items[q->count].path = path;
+	q->items[q->count].flags = flags;
+	q->count++;
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&walk->lock);
+	walk->pending++;
+	__atomic_add_fetch(&walk->queued, 1, __ATOMIC_RELAXED);
+
+	if (walk->idle > 0)
+		pthread_cond_signal(&walk->cond);
+
+	pthread_mutex_unlock(&walk->lock);
+
+	return true;
+}
+
+// own queue is taken newest first (depth-first), others are robbed oldest first (largest subtrees)
+static bool dirwalk_take(tDirWorker *w, tDirJob *job)
+{
+	bool found = false;
+	tDirWalk *walk = w->walk;
+
+	for (int n = 0; n < walk->nthreads && !found; n++)
+	{
+		tDirQueue *q = &walk->queues[(w->index + n) % walk->nthreads];
+
+		pthread_mutex_lock(&q->lock);
+
+		if (q->head < q->count)
+		{
+			if (n == 0)
+				*job = q->items[--q->count];
+			else
+				*job = q->items[q->head++];
+
+			if (q->head == q->count)
+				q->head = q->count = 0;
+
+			found = true;
+		}
+
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	if (found)
+		__atomic_sub_fetch(&walk->queued, 1, __ATOMIC_RELAXED);
+
+	return found;
+}
+
+static bool dirwalk_cancelled(tDirWalk *walk)
+{
+	return walk->cancel && __atomic_load_n(walk->cancel, __ATOMIC_RELAXED);
+}
+
+static bool dirwalk_should_share(tDirWalk *walk)
+{
+	return __atomic_load_n(&walk->idle, __ATOMIC_RELAXED) > (int)__atomic_load_n(&walk->queued, __ATOMIC_RELAXED);
+}
+
+static bool dirstats_recent(struct stat *buf)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	// same timestamp granularity as a change that may still be going on
+	return (buf->st_mtim.tv_sec >= now.tv_sec - 1 || buf->st_ctim.tv_sec >= now.tv_sec - 1);
+}
+
+static void dirnode_read(tDirWorker *w, tDirNode *node, DIR *dir, size_t len)
+{
+	struct dirent *ent;
+	struct stat buf;
+	tDirNode **old = node->subdirs;
+	size_t nold = node->nsubdirs, nsize = 0, lsize = 0;
+
+	for (size_t i = 0; i < nold; i++)
+		old[i]->mark = false;
+
+	free(node->links);
+	node->links = NULL;
+	node->nlinks = 0;
+	node->subdirs = NULL;
+	node->nsubdirs = 0;
+	node->size = 0;
+	node->fblocks = 0;
+	memset(node->count, 0, sizeof(node->count));
+
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0')))
+			continue;
+
+		int type = dirstats_type(ent->d_type);
+		bool have = false;
+
+		if (type == DS_REG || type == DS_DIR || type == DS_UNKNOWN)
+		{
+			if (fstatat(dirfd(dir), ent->d_name, &buf, AT_SYMLINK_NOFOLLOW) == 0)
+			{
+				type = dirstats_mode_type(buf.st_mode);
+				have = true;
+			}
+		}
+
+		node->count[type]++;
+
+		if (type == DS_REG && have)
+		{
+			if (buf.st_nlink > 1)
+			{
+				if (node->nlinks == lsize)
+				{
+					size_t size = lsize ? lsize * 2 : 16;
+					tDirLink *links = realloc(node->links, size * sizeof(tDirLink));
+
+					if (!links)
+						continue;
+
+					node->links = links;
+					lsize = size;
+				}
+
+				node->links[node->nlinks].dev = buf.st_dev;
+				node->links[node->nlinks].ino = buf.st_ino;
+				node->links[node->nlinks].size = buf.st_size;
+				node->links[node->nlinks].blocks = buf.st_blocks;
+				node->nlinks++;
+			}
+			else
+			{
+				node->size += buf.st_size;
+				node->fblocks += buf.st_blocks;
+			}
+		}
+		else if (type == DS_DIR)
+		{
+			tDirNode key, *pkey = &key, **found = NULL, *child = NULL;
+
+			if (nold > 0)
+			{
+				key.name = ent->d_name;
+				found = bsearch(&pkey, old, nold, sizeof(tDirNode*), dirnode_cmp);
+			}
+
+			if (found)
+				child = *found;
+			else
+			{
+				size_t nlen = strlen(ent->d_name);
+
+				if (len + nlen + 2 <= PATH_MAX)
+				{
+					memcpy(w->path + len, "/", 1);
+					memcpy(w->path + len + 1, ent->d_name, nlen + 1);
+
+					if ((child = dirroots_adopt(w->path)) != NULL)
+					{
+						free(child->name);
+
+						if ((child->name = strdup(ent->d_name)) == NULL)
+						{
+							dirnode_free(child);
+							child = NULL;
+						}
+					}
+
+					w->path[len] = '\0';
+				}
+
+				if (!child && (child = dirnode_new(ent->d_name)) == NULL)
+					continue;
+			}
+
+			if (node->nsubdirs == nsize)
+			{
+				size_t size = nsize ? nsize * 2 : 16;
+				tDirNode **subdirs = realloc(node->subdirs, size * sizeof(tDirNode*));
+
+				if (!subdirs)
+				{
+					if (!found)
+						dirnode_free(child);
+
+					continue;
+				}
+
+				node->subdirs = subdirs;
+				nsize = size;
+			}
+
+			child->mark = true;
+			child->parent = node;
+			node->subdirs[node->nsubdirs++] = child;
+		}
+	}
+
+	for (size_t i = 0; i < nold; i++)
+		if (!old[i]->mark)
+			dirnode_free(old[i]);
+
+	free(old);
+
+	if (node->nsubdirs > 1)
+		qsort(node->subdirs, node->nsubdirs, sizeof(tDirNode*), dirnode_cmp);
+}
+
+static void dirnode_walk(tDirWorker *w, tDirNode *node, int fd, size_t len)
+{
+	DIR *dir = NULL;
+	struct stat buf;
+
+	if (fstat(fd, &buf) != 0)
+	{
+		close(fd);
+		dirnode_clear(node);
+		return;
+	}
+
+	node->blocks = buf.st_blocks;
+	node->clean = false;
+
+	// watch first, so nothing that happens while reading is lost
+	if (len < PATH_MAX)
+		dirwatch_add(node, w->path);
+
+	if (!node->valid || node->dev != buf.st_dev || node->ino != buf.st_ino ||
+	                node->mtime.tv_sec != buf.st_mtim.tv_sec || node->mtime.tv_nsec != buf.st_mtim.tv_nsec ||
+	                node->ctime.tv_sec != buf.st_ctim.tv_sec || node->ctime.tv_nsec != buf.st_ctim.tv_nsec)
+	{
+		if ((dir = fdopendir(fd)) == NULL)
+		{
+			close(fd);
+			dirnode_clear(node);
+			return;
+		}
+
+		node->dev = buf.st_dev;
+		node->ino = buf.st_ino;
+		node->mtime = buf.st_mtim;
+		node->ctime = buf.st_ctim;
+		dirnode_read(w, node, dir, len);
+		node->valid = !dirstats_recent(&buf);
+		fd = dirfd(dir);
+	}
+
+	for (size_t i = 0; i < node->nsubdirs; i++)
+	{
+		tDirNode *child = node->subdirs[i];
+		size_t nlen = strlen(child->name);
+		size_t sublen = (len + nlen + 2 <= PATH_MAX) ? len + nlen + 1 : PATH_MAX;
+
+		if (child->clean && child->wd >= 0 && child->total_unwatched == 0)
+			continue;
+
+		if (dirwalk_cancelled(w->walk))
+			break;
+
+		child->noaccess = (faccessat(fd, child->name, R_OK | X_OK, 0) != 0);
+
+		if (sublen < PATH_MAX)
+		{
+			w->path[len] = '/';
+			memcpy(w->path + len + 1, child->name, nlen + 1);
+		}
+
+		if (sublen < PATH_MAX && dirwalk_should_share(w->walk))
+		{
+			char *path = strdup(w->path);
+
+			if (path && dirwalk_push(w, child, path, O_NOFOLLOW))
+			{
+				w->path[len] = '\0';
+				continue;
+			}
+
+			free(path);
+		}
+
+		int subfd = openat(fd, child->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+		if (subfd != -1)
+			dirnode_walk(w, child, subfd, sublen);
+		else
+			dirnode_clear(child);
+
+		if (len < PATH_MAX)
+			w->path[len] = '\0';
+	}
+
+	if (dir)
+		closedir(dir);
+	else
+		close(fd);
+}
+
+static void* dirwalk_worker(void *data)
+{
+	tDirJob job;
+	tDirWorker *w = (tDirWorker*)data;
+	tDirWalk *walk = w->walk;
+
+	while (true)
+	{
+		if (dirwalk_take(w, &job))
+		{
+			size_t len = strlen(job.path);
+			int fd = -1;
+
+			// a cancelled walk leaves the rest of the tree as it was
+			if (dirwalk_cancelled(walk))
+				job.node->clean = false;
+			else if ((fd = open(job.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC | job.flags)) == -1)
+				dirnode_clear(job.node);
+			else
+			{
+				if (len < PATH_MAX)
+					memcpy(w->path, job.path, len + 1);
+				else
+					w->path[0] = '\0';
+
+				dirnode_walk(w, job.node, fd, len < PATH_MAX ? len : PATH_MAX);
+			}
+
+			free(job.path);
+
+			pthread_mutex_lock(&walk->lock);
+
+			if (--walk->pending == 0)
+				pthread_cond_broadcast(&walk->cond);
+
+			pthread_mutex_unlock(&walk->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&walk->lock);
+
+		while (walk->pending > 0 && __atomic_load_n(&walk->queued, __ATOMIC_RELAXED) == 0)
+		{
+			__atomic_add_fetch(&walk->idle, 1, __ATOMIC_RELAXED);
+			pthread_cond_wait(&walk->cond, &walk->lock);
+			__atomic_sub_fetch(&walk->idle, 1, __ATOMIC_RELAXED);
+		}
+
+		bool done = (walk->pending == 0);
+		pthread_mutex_unlock(&walk->lock);
+
+		if (done)
+			break;
+	}
+
+	return NULL;
+}
+
+// fills node->total, multi-link files are counted against set
+static void dirnode_sum(tDirNode *node, tInodeSet *set)
+{
+	tDirStats *total = &node->total;
+
+	if (node->clean && node->total_links == 0)
+		return;
+
+	memset(total, 0, sizeof(tDirStats));
+	total->size = node->size;
+	total->blocks = node->blocks + node->fblocks;
+	total->empty = true;
+	total->emptydirs = true;
+	node->total_links = node->nlinks;
+	node->total_unwatched = (node->wd < 0);
+
+	for (int i = 0; i < DS_TYPES; i++)
+	{
+		total->count[i] = node->count[i];
+
+		if (node->count[i] > 0)
+			total->empty = false;
+
+		if (i != DS_DIR && node->count[i] > 0)
+			total->emptydirs = false;
+	}
+
+	for (size_t i = 0; i < node->nlinks; i++)
+	{
+		if (inodeset_add(set, &node->links[i]))
+		{
+			total->size += node->links[i].size;
+			total->blocks += node->links[i].blocks;
+		}
+	}
+
+	for (size_t i = 0; i < node->nsubdirs; i++)
+	{
+		tDirNode *child = node->subdirs[i];
+
+		dirnode_sum(child, set);
+
+		total->size += child->total.size;
+		total->blocks += child->total.blocks;
+		total->noaccess += child->total.noaccess + (child->noaccess ? 1 : 0);
+
+		for (int j = 0; j < DS_TYPES; j++)
+			total->count[j] += child->total.count[j];
+
+		if (!child->total.emptydirs)
+			total->emptydirs = false;
+
+		node->total_links += child->total_links;
+		node->total_unwatched += child->total_unwatched;
+	}
+
+	node->clean = true;
+}
+
+static void dirnode_dirty_all(tDirNode *node)
+{
+	node->clean = false;
+
+	for (size_t i = 0; i < node->nsubdirs; i++)
+		dirnode_dirty_all(node->subdirs[i]);
+}
+
+// called with gDirWalkLock held
+static void dirwatch_event(struct inotify_event *event)
+{
+	pthread_mutex_lock(&gDirStatsLock);
+
+	for (int i = 0; i < DS_RESULTS; i++)
+	{
+		free(gDirResults[i].path);
+		gDirResults[i].path = NULL;
+	}
+
+	pthread_mutex_unlock(&gDirStatsLock);
+
+	if (event->mask & IN_Q_OVERFLOW)
+	{
+		// events were lost, fall back to mtime validation everywhere
+		for (int i = 0; i < DS_MAX_ROOTS; i++)
+			if (gDirRoots[i].node)
+				dirnode_dirty_all(gDirRoots[i].node);
+
+		return;
+	}
+
+	tDirNode *node = dirwatch_take(event->wd, (event->mask & IN_IGNORED) != 0);
+
+	if (!node)
+		return;
+
+	if (event->mask & IN_IGNORED)
+	{
+		node->wd = -1;
+		__atomic_store_n(&gDirNotifyFull, false, __ATOMIC_RELAXED);
+	}
+
+	node->valid = false;
+	node->stamp = __atomic_add_fetch(&gDirStamp, 1, __ATOMIC_RELAXED);
+
+	// ancestors of a dirty node are dirty already
+	while (node && node->clean)
+	{
+		node->clean = false;
+		node = node->parent;
+	}
+}
+
+static void* dirwatch_thread(void *data)
+{
+	char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct pollfd fds[2] = { { gDirNotify, POLLIN, 0 }, { gDirNotifyWake[0], POLLIN, 0 } };
+
+	while (true)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		// dirstats_shutdown()
+		if (fds[1].revents)
+			break;
+
+		ssize_t len = read(gDirNotify, buf, sizeof(buf));
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		else if (len <= 0)
+			break;
+
+		pthread_mutex_lock(&gDirWalkLock);
+
+		for (char *p = buf; p < buf + len;)
+		{
+			struct inotify_event *event = (struct inotify_event*)p;
+			dirwatch_event(event);
+			p += sizeof(struct inotify_event) + event->len;
+		}
+
+		pthread_mutex_unlock(&gDirWalkLock);
+	}
+
+	return NULL;
+}
+
+static void dirwatch_init(void)
+{
+	if (pipe2(gDirNotifyWake, O_CLOEXEC) != 0)
+	{
+		gDirNotifyWake[0] = gDirNotifyWake[1] = -1;
+		return;
+	}
+
+	if ((gDirNotify = inotify_init1(IN_CLOEXEC)) == -1 ||
+	                pthread_create(&gDirNotifyThread, NULL, dirwatch_thread, NULL) != 0)
+	{
+		if (gDirNotify != -1)
+			close(gDirNotify);
+
+		close(gDirNotifyWake[0]);
+		close(gDirNotifyWake[1]);
+		gDirNotify = gDirNotifyWake[0] = gDirNotifyWake[1] = -1;
+	}
+}
+
+static void dirstats_walk(tDirNode *node, const char *path, bool follow, const bool *cancel)
+{
+	tDirWalk walk;
+	tDirWorker *workers;
+	pthread_t threads[DS_MAX_THREADS];
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	char *root = strdup(path);
+
+	memset(&walk, 0, sizeof(tDirWalk));
+	walk.cancel = cancel;
+	walk.nthreads = (ncpu < 1) ? 1 : (ncpu > DS_MAX_THREADS ? DS_MAX_THREADS : (int)ncpu);
+
+	if (!root || (workers = calloc(walk.nthreads, sizeof(tDirWorker))) == NULL)
+	{
+		free(root);
+		return;
+	}
+
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	for (int i = 0; i < walk.nthreads; i++)
+	{
+		pthread_mutex_init(&walk.queues[i].lock, NULL);
+		workers[i].walk = &walk;
+		workers[i].index = i;
+	}
+
+	if (!dirwalk_push(&workers[0], node, root, follow ? 0 : O_NOFOLLOW))
+		free(root);
+
+	int started = 1;
+
+	while (started < walk.nthreads && pthread_create(&threads[started], NULL, dirwalk_worker, &workers[started]) == 0)
+		started++;
+
+	dirwalk_worker(&workers[0]);
+
+	for (int i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < walk.nthreads; i++)
+	{
+		free(walk.queues[i].items);
+		pthread_mutex_destroy(&walk.queues[i].lock);
+	}
+
+	free(workers);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+}
+
+static bool dirstats_name(const char *path, char *name)
+{
+	size_t len = strlen(path);
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	if (len >= PATH_MAX)
+		return false;
+
+	memcpy(name, path, len);
+	name[len] = '\0';
+
+	return true;
+}
+
+static bool dirstats_result(const char *name, tDirStats *stats)
+{
+	bool found = false;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&gDirStatsLock);
+
+	for (int i = 0; i < DS_RESULTS && !found; i++)
+	{
+		tDirResult *result = &gDirResults[i];
+
+		if (result->path && strcmp(result->path, name) == 0 &&
+		                (now.tv_sec - result->time.tv_sec) * 1000000000L + (now.tv_nsec - result->time.tv_nsec) < DS_RESULT_TTL)
+		{
+			*stats = result->stats;
+			found = true;
+		}
+	}
+
+	pthread_mutex_unlock(&gDirStatsLock);
+
+	return found;
+}
+
+// called with gDirWalkLock held
+static bool dirstats_cached(const char *name, tDirStats *stats)
+{
+	if (dirstats_result(name, stats))
+		return true;
+
+	tDirNode *node = dirroots_lookup(name, false);
+
+	if (node && node->clean && node->wd >= 0 && node->total_unwatched == 0 && node->total_links == 0)
+	{
+		*stats = node->total;
+		return true;
+	}
+
+	return false;
+}
+
+// the value if it is known without touching the disk (for the CONTENT_DELAYIFSLOW call)
+static inline bool dirstats_peek(const char *path, tDirStats *stats)
+{
+	char name[PATH_MAX];
+
+	if (!dirstats_name(path, name))
+		return false;
+
+	if (dirstats_result(name, stats))
+		return true;
+
+	// a walk is running, the tree is not looked at rather than waited for
+	if (pthread_mutex_trylock(&gDirWalkLock) != 0)
+		return false;
+
+	bool result = dirstats_cached(name, stats);
+	pthread_mutex_unlock(&gDirWalkLock);
+
+	return result;
+}
+
+// follow: open path itself even if it is a symlink (entries below are never followed)
+// cancel: may be NULL, false is returned if the walk was cut short
+static inline bool dirstats_get(const char *path, bool follow, const bool *cancel, tDirStats *stats)
+{
+	tInodeSet set = { NULL, 0, 0 };
+	char name[PATH_MAX];
+
+	memset(stats, 0, sizeof(tDirStats));
+
+	if (!dirstats_name(path, name))
+		return false;
+
+	if (dirstats_result(name, stats))
+		return true;
+
+	pthread_once(&gDirNotifyOnce, dirwatch_init);
+	pthread_mutex_lock(&gDirWalkLock);
+
+	// another walk may have covered it meanwhile
+	if (dirstats_cached(name, stats))
+	{
+		pthread_mutex_unlock(&gDirWalkLock);
+		return true;
+	}
+
+	tDirNode *node = dirroots_lookup(name, true);
+
+	if (!node)
+	{
+		pthread_mutex_unlock(&gDirWalkLock);
+		return false;
+	}
+
+	if (!node->clean || node->wd < 0 || node->total_unwatched > 0)
+		dirstats_walk(node, name, follow, cancel);
+
+	if ((node->dev == 0 && node->ino == 0) || (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED)))
+	{
+		pthread_mutex_unlock(&gDirWalkLock);
+		return false;
+	}
+
+	dirnode_sum(node, &set);
+	*stats = node->total;
+	free(set.items);
+
+	pthread_mutex_lock(&gDirStatsLock);
+	tDirResult *result = &gDirResults[gDirResultsNext];
+	gDirResultsNext = (gDirResultsNext + 1) % DS_RESULTS;
+	free(result->path);
+	result->path = strdup(name);
+	result->stats = *stats;
+	clock_gettime(CLOCK_MONOTONIC, &result->time);
+	pthread_mutex_unlock(&gDirStatsLock);
+
+	pthread_mutex_unlock(&gDirWalkLock);
+
+	return true;
+}
+
+// change counter of a single directory, 0 if it can't be watched
+static inline uint64_t dirstats_stamp(const char *path)
+{
+	uint64_t stamp = 0;
+	char name[PATH_MAX];
+
+	if (!dirstats_name(path, name))
+		return 0;
+
+	pthread_once(&gDirNotifyOnce, dirwatch_init);
+	pthread_mutex_lock(&gDirWalkLock);
+
+	tDirNode *node = dirroots_lookup(name, true);
+
+	if (node)
+	{
+		dirwatch_add(node, name);
+
+		if (node->wd >= 0)
+			stamp = node->stamp;
+	}
+
+	pthread_mutex_unlock(&gDirWalkLock);
+
+	return stamp;
+}
+
+// stops the watcher and drops every cached tree, for ContentPluginUnloading();
+// walks must be over by then (delayed_shutdown() first)
+static inline void dirstats_shutdown(void)
+{
+	if (gDirNotify != -1)
+	{
+		if (write(gDirNotifyWake[1], "", 1) == 1)
+			pthread_join(gDirNotifyThread, NULL);
+
+		close(gDirNotifyWake[0]);
+		close(gDirNotifyWake[1]);
+		gDirNotifyWake[0] = gDirNotifyWake[1] = -1;
+
+		// all watches go with the descriptor
+		close(gDirNotify);
+		gDirNotify = -1;
+	}
+
+	pthread_mutex_lock(&gDirWalkLock);
+	pthread_mutex_lock(&gDirRootsLock);
+
+	for (int i = 0; i < DS_MAX_ROOTS; i++)
+	{
+		dirnode_free(gDirRoots[i].node);
+		free(gDirRoots[i].path);
+		gDirRoots[i].node = NULL;
+		gDirRoots[i].path = NULL;
+	}
+
+	pthread_mutex_unlock(&gDirRootsLock);
+
+	pthread_mutex_lock(&gDirWatchLock);
+
+	for (int i = 0; i < DS_WATCH_BUCKETS; i++)
+	{
+		while (gDirWatches[i])
+		{
+			tDirWatch *item = gDirWatches[i];
+			gDirWatches[i] = item->next;
+			free(item);
+		}
+	}
+
+	pthread_mutex_unlock(&gDirWatchLock);
+
+	pthread_mutex_lock(&gDirStatsLock);
+
+	for (int i = 0; i < DS_RESULTS; i++)
+	{
+		free(gDirResults[i].path);
+		gDirResults[i].path = NULL;
+	}
+
+	pthread_mutex_unlock(&gDirStatsLock);
+	pthread_mutex_unlock(&gDirWalkLock);
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <dirent.h>
@@ -5,71 +6,20 @@
 #include <unistd.h>
 #include <string.h>
 #include "wdxplugin.h"
+#include "dirstats.h"
+#include "delayed.h"
 
-static int64_t calccount(const char *name, unsigned char type)
+static void emptydir_work(const char *path, int arg, const bool *cancel)
 {
-	DIR *dir;
-	int64_t count = 0;
-	struct dirent *ent;
-
-	if ((dir = opendir(name)) != NULL)
-	{
-		while ((ent = readdir(dir)) != NULL)
-		{
-			if ((strcmp(ent->d_name, ".") != 0) && (strcmp(ent->d_name, "..") != 0))
-			{
-				if (ent->d_type == type)
-					count ++;
-
-				if (ent->d_type == DT_DIR)
-				{
-					char path[PATH_MAX];
-					snprintf(path, PATH_MAX, "%s/%s", name, ent->d_name);
-					count += calccount(path, type);
-				}
-			}
-		}
-
-		closedir(dir);
-	}
-
-	return count;
-}
-
-static int64_t calcnoacess(const char *name, bool chk)
-{
-	DIR *dir;
-	int64_t count = 0;
-	struct dirent *ent;
-
-	if ((dir = opendir(name)) != NULL)
-	{
-		while ((ent = readdir(dir)) != NULL)
-		{
-			if ((strcmp(ent->d_name, ".") != 0) && (strcmp(ent->d_name, "..") != 0))
-			{
-				char path[PATH_MAX];
-				snprintf(path, PATH_MAX, "%s/%s", name, ent->d_name);
-				if (ent->d_type == DT_DIR && access(path, R_OK | X_OK) != 0)
-					count ++;
-
-				if (ent->d_type == DT_DIR)
-					count += calcnoacess(path, chk);
-
-				if (chk && count > 0)
-					break;
-			}
-		}
-
-		closedir(dir);
-	}
-
-	return count;
+	tDirStats stats;
+	dirstats_get(path, (arg == 0), cancel, &stats);
 }
 
-static int emptychk(const char *name, bool subf)
+// no need to wait for the whole subtree here
+static int emptychk(const char *name)
 {
 	DIR *dir;
+	int result = 1;
 	struct dirent *ent;
 
 	if ((dir = opendir(name)) != NULL)
@@ -78,29 +28,15 @@ static int emptychk(const char *name, bool subf)
 		{
 			if ((strcmp(ent->d_name, ".") != 0) && (strcmp(ent->d_name, "..") != 0))
 			{
-				if ((subf == true) && (ent->d_type == DT_DIR))
-				{
-					char path[PATH_MAX];
-					sprintf(path, "%s/%s", name, ent->d_name);
-
-					if (emptychk(path, subf) == 0)
-					{
-						closedir(dir);
-						return 0;
-					}
-				}
-				else
-				{
-					closedir(dir);
-					return 0;
-				}
+				result = 0;
+				break;
 			}
 		}
 
 		closedir(dir);
 	}
 
-	return 1;
+	return result;
 }
 
 int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Units, int maxlen)
@@ -180,54 +116,71 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 	if (access(FileName, R_OK) != 0)
 		return ft_fieldempty;
 
-	switch (FieldIndex)
+	if (FieldIndex == 0)
 	{
-	case 0:
-		*(int*)FieldValue = emptychk(FileName, false);
+		*(int*)FieldValue = emptychk(FileName);
 		return ft_boolean;
+	}
+
+	tDirStats stats;
+
+	if (!dirstats_peek(FileName, &stats))
+	{
+		if (flags & CONTENT_DELAYIFSLOW)
+		{
+			delayed_submit(FileName, UnitIndex);
+			*(char*)FieldValue = '\0';
+			return ft_delayed;
+		}
+
+		if (!delayed_run(FileName, UnitIndex) || !dirstats_get(FileName, (UnitIndex == 0), NULL, &stats))
+			return ft_fieldempty;
+	}
 
+	switch (FieldIndex)
+	{
 	case 1:
-		*(int*)FieldValue = emptychk(FileName, true);
+		*(int*)FieldValue = stats.emptydirs;
 		return ft_boolean;
 
 	case 2:
-		*(int64_t*)FieldValue = calccount(FileName, DT_DIR);
+		*(int64_t*)FieldValue = stats.count[DS_DIR];
 		break;
 
 	case 3:
-		*(int64_t*)FieldValue = calccount(FileName, DT_REG);
+		*(int64_t*)FieldValue = stats.count[DS_REG];
 		break;
 
 	case 4:
-		*(int64_t*)FieldValue = calccount(FileName, DT_LNK);
+		*(int64_t*)FieldValue = stats.count[DS_LNK];
 		break;
 
 	case 5:
-		*(int64_t*)FieldValue = calccount(FileName, DT_FIFO);
+		*(int64_t*)FieldValue = stats.count[DS_FIFO];
 		break;
 
 	case 6:
-		*(int64_t*)FieldValue = calccount(FileName, DT_SOCK);
+		*(int64_t*)FieldValue = stats.count[DS_SOCK];
 		break;
 
 	case 7:
-		*(int64_t*)FieldValue = calccount(FileName, DT_BLK);
+		*(int64_t*)FieldValue = stats.count[DS_BLK];
 		break;
 
 	case 8:
-		*(int64_t*)FieldValue = calccount(FileName, DT_CHR);
+		*(int64_t*)FieldValue = stats.count[DS_CHR];
 		break;
 
 	case 9:
-		*(int64_t*)FieldValue = calccount(FileName, DT_UNKNOWN);
+		*(int64_t*)FieldValue = stats.count[DS_UNKNOWN];
 		break;
 
 	case 10:
-		*(int*)FieldValue = calcnoacess(FileName, true);
+		*(int*)FieldValue = (stats.noaccess > 0);
 		return ft_boolean;
 
 	case 11:
-		*(int64_t*)FieldValue = calcnoacess(FileName, false);
+		*(int64_t*)FieldValue = stats.noaccess;
 		break;
 
 	default:
@@ -236,3 +189,20 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 
 	return ft_numeric_64;
 }
+
+void DCPCALL ContentStopGetValue(char* FileName)
+{
+	delayed_stop(FileName);
+}
+
+void DCPCALL ContentSetDefaultParams(ContentDefaultParamStruct* dps)
+{
+	// the walk is parallel itself, one folder at a time is enough
+	delayed_init(emptydir_work, 1);
+}
+
+void DCPCALL ContentPluginUnloading(void)
+{
+	delayed_shutdown();
+	dirstats_shutdown();
+}
@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <string.h>
 #include "wdxplugin.h"
+#include "dirstats.h"
 
 #include <dlfcn.h>
 
@@ -15,6 +16,71 @@
 #define _(STRING) gettext(STRING)
 #define GETTEXT_PACKAGE "plugins"
 #define MAX_FIELDS 10
+#define MAX_NAMES (MAX_FIELDS + 2)
+#define MAX_LISTINGS 32
+
+typedef struct sListing
+{
+	char *path;
+	uint64_t stamp;
+	int count;
+	char *names[MAX_NAMES];
+} tListing;
+
+static tListing gListings[MAX_LISTINGS];
+static int gListingsNext = 0;
+static pthread_mutex_t gListingsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void listing_clear(tListing *listing)
+{
+	for (int i = 0; i < listing->count; i++)
+		free(listing->names[i]);
+
+	free(listing->path);
+	memset(listing, 0, sizeof(tListing));
+}
+
+// first names of the directory, kept while the watcher sees no change; called with gListingsLock held
+static tListing* listing_get(const char *path, int *err)
+{
+	DIR *dir;
+	struct dirent *ent;
+	uint64_t stamp = dirstats_stamp(path);
+
+	for (int i = 0; i < MAX_LISTINGS; i++)
+	{
+		if (stamp != 0 && gListings[i].stamp == stamp && gListings[i].path && strcmp(gListings[i].path, path) == 0)
+			return &gListings[i];
+	}
+
+	if ((dir = opendir(path)) == NULL)
+	{
+		*err = errno;
+		return NULL;
+	}
+
+	tListing *listing = &gListings[gListingsNext];
+	gListingsNext = (gListingsNext + 1) % MAX_LISTINGS;
+	listing_clear(listing);
+
+	while (listing->count < MAX_NAMES && (ent = readdir(dir)) != NULL)
+	{
+		if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0))
+			continue;
+
+		if ((listing->names[listing->count] = strdup(ent->d_name)) == NULL)
+			break;
+
+		listing->count++;
+	}
+
+	closedir(dir);
+
+	listing->path = strdup(path);
+	listing->stamp = listing->path ? stamp : 0;
+
+	return listing;
+}
 
 int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Units, int maxlen)
 {
@@ -30,14 +96,15 @@ int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Unit
 
 int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void* FieldValue, int maxlen, int flags)
 {
-	DIR *dir;
 	char tmp[PATH_MAX];
-	int count = 0;
-	struct dirent *ent;
+	int errsv = 0;
+	tListing *listing;
+
+	pthread_mutex_lock(&gListingsLock);
 
-	if ((dir = opendir(FileName)) == NULL)
+	if ((listing = listing_get(FileName, &errsv)) == NULL)
 	{
-		int errsv = errno;
+		pthread_mutex_unlock(&gListingsLock);
 
 		if (errsv == EACCES)
 		{
@@ -48,11 +115,8 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 			return ft_fileerror;
 	}
 
-	while ((ent = readdir(dir)) != NULL)
+	for (int count = 0; count < listing->count; count++)
 	{
-		if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0))
-			continue;
-
 		if (count > 0)
 		{
 			strncpy(tmp, (char*)FieldValue, maxlen - 1);
@@ -60,20 +124,21 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 			if (FieldIndex + 1 == count)
 				snprintf((char*)FieldValue, maxlen - 1, "%s%s...", tmp, (UnitIndex == 1) ? "\n" : ", ");
 			else
-				snprintf((char*)FieldValue, maxlen - 1, "%s%s%s", tmp, (UnitIndex == 1) ? "\n" : ", ", ent->d_name);
+				snprintf((char*)FieldValue, maxlen - 1, "%s%s%s", tmp, (UnitIndex == 1) ? "\n" : ", ", listing->names[count]);
 
 		}
 		else
-			snprintf((char*)FieldValue, maxlen - 1, "%s", ent->d_name);
+			snprintf((char*)FieldValue, maxlen - 1, "%s", listing->names[count]);
 
-		if (FieldIndex + 1 == count++)
+		if (FieldIndex + 1 == count)
 			break;
 	}
 
-	if (count == 0)
+	if (listing->count == 0)
 		snprintf(FieldValue, maxlen - 1, _("Empty directory"));
 
-	closedir(dir);
+	pthread_mutex_unlock(&gListingsLock);
+
 	return ft_string;
 }
 
@@ -98,3 +163,15 @@ void DCPCALL ContentSetDefaultParams(ContentDefaultParamStruct* dps)
 		textdomain(GETTEXT_PACKAGE);
 	}
 }
+
+void DCPCALL ContentPluginUnloading(void)
+{
+	pthread_mutex_lock(&gListingsLock);
+
+	for (int i = 0; i < MAX_LISTINGS; i++)
+		listing_clear(&gListings[i]);
+
+	pthread_mutex_unlock(&gListingsLock);
+
+	dirstats_shutdown();
+}
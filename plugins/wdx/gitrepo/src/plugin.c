@@ -1,12 +1,20 @@
 #include <git2.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <string.h>
+#include <time.h>
 #include "wdxplugin.h"
 
 #define detect_string "EXT=\"*\""
+#define SNAPSHOT_MAX 4
+#define STAMP_FILES 6
 
 typedef struct s_field
 {
@@ -15,14 +23,38 @@ typedef struct s_field
 	char *unit;
 } t_field;
 
-typedef struct s_cache
+typedef struct s_status
+{
+	char *path;
+	unsigned int flags;
+} t_status;
+
+// everything the columns need for one directory, read at once
+typedef struct s_snapshot
 {
-	unsigned int status_flags;
-	char lastfile[PATH_MAX];
 	char dirname[PATH_MAX];
+	char reldir[PATH_MAX];
+	bool has_reldir;
 	git_repository *repo;
 	const char *workdir;
-} t_cache;
+	struct timespec created;
+	struct timespec stamps[STAMP_FILES];
+	t_status *status;
+	size_t status_size;
+	int is_bare;
+	int is_empty;
+	int is_worktree;
+	int is_shallow;
+	int head_unborn;
+	int head_detached;
+	char *branch;
+	char *branch_ref;
+	char *remote;
+	bool has_ahead_behind;
+	size_t ahead;
+	size_t behind;
+	unsigned int used;
+} t_snapshot;
 
 #define fieldcount (sizeof(fields)/sizeof(t_field))
 
@@ -50,7 +82,9 @@ t_field fields[] =
 	{"filepath",				ft_string,	""},
 };
 
-t_cache *cachedata;
+static t_snapshot snapshots[SNAPSHOT_MAX];
+static unsigned int snapshots_used = 0;
+static pthread_mutex_t snapshots_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 char* strlcpy(char* p, const char* p2, int maxlen)
 {
@@ -65,195 +99,427 @@ char* strlcpy(char* p, const char* p2, int maxlen)
 	return p;
 }
 
-int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Units, int maxlen)
+static uint64_t status_hash(const char *path)
 {
-	if (FieldIndex < 0 || FieldIndex >= fieldcount)
-		return ft_nomorefields;
+	uint64_t hash = 0xcbf29ce484222325ULL;
 
-	strlcpy(FieldName, fields[FieldIndex].name, maxlen - 1);
-	strlcpy(Units, fields[FieldIndex].unit, maxlen - 1);
-	return fields[FieldIndex].type;
+	while (*path)
+	{
+		hash ^= (unsigned char)*path++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
 }
 
-int DCPCALL ContentGetDetectString(char* DetectString, int maxlen)
+static void status_insert(t_snapshot *snap, const char *path, unsigned int flags)
 {
-	strlcpy(DetectString, detect_string, maxlen - 1);
+	size_t i = status_hash(path) & (snap->status_size - 1);
+
+	while (snap->status[i].path)
+	{
+		if (strcmp(snap->status[i].path, path) == 0)
+		{
+			snap->status[i].flags |= flags;
+			return;
+		}
+
+		i = (i + 1) & (snap->status_size - 1);
+	}
+
+	if ((snap->status[i].path = strdup(path)) != NULL)
+		snap->status[i].flags = flags;
+}
+
+static bool status_find(t_snapshot *snap, const char *path, unsigned int *flags)
+{
+	if (snap->status_size == 0)
+		return false;
+
+	size_t i = status_hash(path) & (snap->status_size - 1);
+
+	while (snap->status[i].path)
+	{
+		if (strcmp(snap->status[i].path, path) == 0)
+		{
+			*flags = snap->status[i].flags;
+			return true;
+		}
+
+		i = (i + 1) & (snap->status_size - 1);
+	}
+
+	return false;
+}
+
+// untracked and ignored directories are listed once as "dir/", everything inside inherits their status
+static unsigned int status_lookup(t_snapshot *snap, const char *relpath)
+{
+	char path[PATH_MAX];
+	unsigned int flags = 0;
+	size_t len = strlen(relpath);
+
+	if (len + 2 > PATH_MAX)
+		return 0;
+
+	if (status_find(snap, relpath, &flags))
+		return flags;
+
+	memcpy(path, relpath, len);
+	path[len] = '/';
+	path[len + 1] = '\0';
+
+	if (status_find(snap, path, &flags))
+		return flags;
+
+	while (len > 0)
+	{
+		while (len > 0 && path[len - 1] != '/')
+			len--;
+
+		if (len == 0)
+			break;
+
+		path[len] = '\0';
+
+		if (status_find(snap, path, &flags))
+			return flags;
+
+		len--;
+	}
+
 	return 0;
 }
 
-int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void* FieldValue, int maxlen, int flags)
+static void snapshot_get_stamps(t_snapshot *snap, struct timespec *stamps)
 {
-	int ret;
-	size_t ahead, behind;
-	git_reference *head = NULL;
-	git_strarray remote;
-	git_oid upstream;
-	const git_oid *local;
-	char path_temp[PATH_MAX];
-	const char *string = NULL;
+	struct stat buf;
+	char path[PATH_MAX];
+	const char *gitdir = git_repository_path(snap->repo);
+	const char *commondir = git_repository_commondir(snap->repo);
+	const char *names[STAMP_FILES] = { "index", "HEAD", "FETCH_HEAD", "packed-refs", snap->branch_ref, NULL };
+	char upstream[PATH_MAX];
+
+	if (snap->remote && snap->branch)
+	{
+		snprintf(upstream, sizeof(upstream), "refs/remotes/%s/%s", snap->remote, snap->branch);
+		names[5] = upstream;
+	}
+
+	memset(stamps, 0, sizeof(struct timespec) * STAMP_FILES);
+
+	for (int i = 0; i < STAMP_FILES; i++)
+	{
+		if (!names[i])
+			continue;
+
+		// refs live in the common dir, the rest is per work tree
+		snprintf(path, sizeof(path), "%s%s", (i < 3 || !commondir) ? gitdir : commondir, names[i]);
+
+		if (stat(path, &buf) == 0)
+			stamps[i] = buf.st_mtim;
+		else
+			stamps[i].tv_nsec = -1;
+	}
+}
+
+static void snapshot_clear(t_snapshot *snap)
+{
+	for (size_t i = 0; i < snap->status_size; i++)
+		free(snap->status[i].path);
+
+	free(snap->status);
+	free(snap->branch);
+	free(snap->branch_ref);
+	free(snap->remote);
+
+	if (snap->repo != NULL)
+		git_repository_free(snap->repo);
+
+	memset(snap, 0, sizeof(t_snapshot));
+}
+
+static void snapshot_read_status(t_snapshot *snap)
+{
+	git_status_list *list;
+	git_status_options opts = GIT_STATUS_OPTIONS_INIT;
+	char *pathspec = snap->reldir;
+
+	opts.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+	opts.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED | GIT_STATUS_OPT_INCLUDE_IGNORED | GIT_STATUS_OPT_DISABLE_PATHSPEC_MATCH;
+
+	if (snap->reldir[0] != '\0')
+	{
+		opts.pathspec.strings = &pathspec;
+		opts.pathspec.count = 1;
+	}
+
+	if (git_status_list_new(&list, snap->repo, &opts) != 0)
+		return;
+
+	size_t count = git_status_list_entrycount(list);
+	size_t size = 16;
+
+	while (size < count * 2)
+		size *= 2;
+
+	if ((snap->status = calloc(size, sizeof(t_status))) != NULL)
+	{
+		snap->status_size = size;
 
-	if (strcmp(FileName, cachedata->lastfile) != 0)
+		for (size_t i = 0; i < count; i++)
+		{
+			const git_status_entry *entry = git_status_byindex(list, i);
+			const git_diff_delta *delta = entry->index_to_workdir ? entry->index_to_workdir : entry->head_to_index;
+
+			if (!delta)
+				continue;
+
+			const char *path = delta->new_file.path ? delta->new_file.path : delta->old_file.path;
+
+			if (path)
+				status_insert(snap, path, entry->status);
+		}
+	}
+
+	git_status_list_free(list);
+
+	// inside an untracked or ignored directory the list comes back empty, nothing below it is in the index
+	if (count == 0 && snap->status && snap->reldir[0] != '\0')
 	{
-		strlcpy(path_temp, FileName, PATH_MAX);
-		char *current_dir = dirname(path_temp);
+		git_index *index;
+		size_t pos;
+		int ignored = 0;
+		char prefix[PATH_MAX];
+
+		snprintf(prefix, sizeof(prefix), "%s/", snap->reldir);
 
-		if (strcmp(current_dir, cachedata->dirname) != 0)
+		if (git_repository_index(&index, snap->repo) == 0)
 		{
-			if (cachedata->repo != NULL)
+			if (git_index_find_prefix(&pos, index, prefix) == GIT_ENOTFOUND)
 			{
-				git_repository_free(cachedata->repo);
-				cachedata->repo = NULL;
+				git_ignore_path_is_ignored(&ignored, snap->repo, prefix);
+				status_insert(snap, prefix, ignored ? GIT_STATUS_IGNORED : GIT_STATUS_WT_NEW);
 			}
 
-			git_buf repo_buf = GIT_BUF_INIT_CONST(NULL, 0);
+			git_index_free(index);
+		}
+	}
+}
+
+static void snapshot_read_head(t_snapshot *snap)
+{
+	git_reference *head = NULL;
+	git_strarray remote = { NULL, 0 };
+	git_oid upstream;
+	const git_oid *local;
+	char refname[PATH_MAX];
+
+	snap->is_bare = git_repository_is_bare(snap->repo);
+	snap->is_empty = git_repository_is_empty(snap->repo);
+	snap->is_worktree = git_repository_is_worktree(snap->repo);
+	snap->is_shallow = git_repository_is_shallow(snap->repo);
+	snap->head_unborn = git_repository_head_unborn(snap->repo);
+	snap->head_detached = git_repository_head_detached(snap->repo);
+
+	if (git_repository_head(&head, snap->repo) != 0)
+		return;
+
+	if (git_reference_shorthand(head))
+		snap->branch = strdup(git_reference_shorthand(head));
 
-			if (git_repository_discover(&repo_buf, current_dir, 1, NULL) == 0)
+	if (git_reference_is_branch(head) && git_reference_name(head))
+		snap->branch_ref = strdup(git_reference_name(head));
+
+	if (git_remote_list(&remote, snap->repo) == 0)
+	{
+		if (remote.count > 0 && remote.strings[0])
+		{
+			snap->remote = strdup(remote.strings[0]);
+			local = git_reference_target(head);
+
+			if (local && snap->branch)
 			{
-				git_repository_open(&cachedata->repo, repo_buf.ptr);
-				git_buf_free(&repo_buf);
-			}
+				snprintf(refname, sizeof(refname), "refs/remotes/%s/%s", remote.strings[0], snap->branch);
 
-			strlcpy(cachedata->dirname, current_dir, PATH_MAX);
+				if (git_reference_name_to_id(&upstream, snap->repo, refname) == 0 &&
+				                git_graph_ahead_behind(&snap->ahead, &snap->behind, snap->repo, local, &upstream) == 0)
+					snap->has_ahead_behind = true;
+			}
 		}
 
-		if (cachedata->repo != NULL)
+		git_strarray_free(&remote);
+	}
+
+	git_reference_free(head);
+}
+
+static bool snapshot_open(t_snapshot *snap, const char *dir)
+{
+	char real[PATH_MAX];
+	git_buf repo_buf = GIT_BUF_INIT_CONST(NULL, 0);
+
+	strlcpy(snap->dirname, dir, PATH_MAX - 1);
+
+	if (git_repository_discover(&repo_buf, dir, 1, NULL) != 0)
+		return false;
+
+	git_repository_open(&snap->repo, repo_buf.ptr);
+	git_buf_free(&repo_buf);
+
+	if (snap->repo == NULL)
+		return false;
+
+	snap->workdir = git_repository_workdir(snap->repo);
+
+	if (snap->workdir && realpath(dir, real))
+	{
+		size_t len = strlen(snap->workdir);
+
+		// workdir ends with a slash, the directory itself doesn't
+		if (strncmp(real, snap->workdir, len) == 0)
 		{
-			cachedata->workdir = git_repository_workdir(cachedata->repo);
-			memset(path_temp, 0, PATH_MAX);
+			strlcpy(snap->reldir, real + len, PATH_MAX - 1);
+			snap->has_reldir = true;
+		}
+		else if (strlen(real) + 1 == len && strncmp(real, snap->workdir, len - 1) == 0)
+		{
+			snap->reldir[0] = '\0';
+			snap->has_reldir = true;
+		}
+	}
+
+	// same clock the kernel stamps inodes with, CLOCK_REALTIME runs a tick ahead of it
+	clock_gettime(CLOCK_REALTIME_COARSE, &snap->created);
+	snapshot_read_head(snap);
+
+	if (snap->has_reldir)
+		snapshot_read_status(snap);
+
+	snapshot_get_stamps(snap, snap->stamps);
+
+	return true;
+}
+
+// must be called with snapshots_mutex locked
+static t_snapshot* snapshot_get(const char *dir, struct stat *file)
+{
+	t_snapshot *snap = NULL;
+
+	for (int i = 0; i < SNAPSHOT_MAX && !snap; i++)
+		if (strcmp(snapshots[i].dirname, dir) == 0)
+			snap = &snapshots[i];
+
+	if (snap && snap->repo)
+	{
+		struct timespec stamps[STAMP_FILES];
+
+		snapshot_get_stamps(snap, stamps);
 
-			if (cachedata->workdir && realpath(FileName, path_temp))
-				git_status_file(&cachedata->status_flags, cachedata->repo, path_temp + strlen(cachedata->workdir));
-			else
-				cachedata->status_flags = 0;
+		// the file changed after the status was read, work tree changes don't touch the index
+		if (memcmp(stamps, snap->stamps, sizeof(stamps)) != 0 ||
+		                file->st_ctim.tv_sec > snap->created.tv_sec ||
+		                (file->st_ctim.tv_sec == snap->created.tv_sec && file->st_ctim.tv_nsec >= snap->created.tv_nsec))
+		{
+			snapshot_clear(snap);
+			snapshot_open(snap, dir);
 		}
+	}
+	else if (!snap)
+	{
+		snap = &snapshots[0];
+
+		for (int i = 1; i < SNAPSHOT_MAX; i++)
+			if (snapshots[i].used < snap->used)
+				snap = &snapshots[i];
 
-		strlcpy(cachedata->lastfile, FileName, PATH_MAX);
+		snapshot_clear(snap);
+		snapshot_open(snap, dir);
 	}
 
-	if (cachedata->repo == NULL)
-		return ft_fileerror;
+	snap->used = ++snapshots_used;
+
+	return snap;
+}
+
+int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Units, int maxlen)
+{
+	if (FieldIndex < 0 || FieldIndex >= fieldcount)
+		return ft_nomorefields;
 
+	strlcpy(FieldName, fields[FieldIndex].name, maxlen - 1);
+	strlcpy(Units, fields[FieldIndex].unit, maxlen - 1);
+	return fields[FieldIndex].type;
+}
+
+int DCPCALL ContentGetDetectString(char* DetectString, int maxlen)
+{
+	strlcpy(DetectString, detect_string, maxlen - 1);
+	return 0;
+}
+
+static int ContentGetSnapshotValue(t_snapshot *snap, int FieldIndex, unsigned int status_flags, const char *relpath, void* FieldValue, int maxlen)
+{
 	switch (FieldIndex)
 	{
 	case 0:
-		*(int*)FieldValue = git_repository_is_bare(cachedata->repo);
+		*(int*)FieldValue = snap->is_bare;
 		break;
 
 	case 1:
-		*(int*)FieldValue = git_repository_is_empty(cachedata->repo);
+		*(int*)FieldValue = snap->is_empty;
 		break;
 
 	case 2:
-		*(int*)FieldValue = git_repository_is_worktree(cachedata->repo);
+		*(int*)FieldValue = snap->is_worktree;
 		break;
 
 	case 3:
-		*(int*)FieldValue = git_repository_is_shallow(cachedata->repo);
+		*(int*)FieldValue = snap->is_shallow;
 		break;
 
 	case 4:
-		*(int*)FieldValue = git_repository_head_unborn(cachedata->repo);
+		*(int*)FieldValue = snap->head_unborn;
 		break;
 
 	case 5:
-		*(int*)FieldValue = git_repository_head_detached(cachedata->repo);
+		*(int*)FieldValue = snap->head_detached;
 		break;
 
 	case 6:
-		if (git_repository_head(&head, cachedata->repo) == 0)
-		{
-			string = git_reference_shorthand(head);
-			git_reference_free(head);
-		}
-
-		if (!string)
+		if (!snap->branch)
 			return ft_fieldempty;
 		else
-			strlcpy((char*)FieldValue, string, maxlen - 1);
+			strlcpy((char*)FieldValue, snap->branch, maxlen - 1);
 
 		break;
 
 	case 7:
-		if (git_repository_head(&head, cachedata->repo) == 0)
-		{
-			git_remote_list(&remote, cachedata->repo);
-			git_reference_free(head);
-		}
-
-		if (!remote.strings[0])
+		if (!snap->remote)
 			return ft_fieldempty;
 		else
-			strlcpy((char*)FieldValue, remote.strings[0], maxlen - 1);
+			strlcpy((char*)FieldValue, snap->remote, maxlen - 1);
 
 		break;
 
 	case 8:
-		if (git_repository_head(&head, cachedata->repo) == 0)
-		{
-			string = git_reference_shorthand(head);
-			git_remote_list(&remote, cachedata->repo);
-
-			if (remote.count)
-			{
-				local = git_reference_target(head);
-				strcpy(path_temp, "refs/remotes/");
-
-				if (remote.strings[0])
-					strcat(path_temp, remote.strings[0]);
-
-				strcat(path_temp, "/");
-				strcat(path_temp, string);
-				ret = git_reference_name_to_id(&upstream, cachedata->repo, path_temp);
-
-				if (local && !ret)
-					ret = git_graph_ahead_behind(&ahead, &behind, cachedata->repo, local, &upstream);
-			}
-
-			git_reference_free(head);
-		}
-
-		if (ret != 0)
+		if (!snap->has_ahead_behind)
 			return ft_fieldempty;
 		else
-			*(int*)FieldValue = ahead;
-
+			*(int*)FieldValue = snap->ahead;
 
 		break;
 
 	case 9:
-		if (git_repository_head(&head, cachedata->repo) == 0)
-		{
-			string = git_reference_shorthand(head);
-			git_remote_list(&remote, cachedata->repo);
-
-			if (remote.count)
-			{
-				local = git_reference_target(head);
-				strcpy(path_temp, "refs/remotes/");
-
-				if (remote.strings[0])
-					strcat(path_temp, remote.strings[0]);
-
-				strcat(path_temp, "/");
-				strcat(path_temp, string);
-				ret = git_reference_name_to_id(&upstream, cachedata->repo, path_temp);
-
-				if (local && !ret)
-					ret = git_graph_ahead_behind(&ahead, &behind, cachedata->repo, local, &upstream);
-			}
-
-			git_reference_free(head);
-		}
-
-		if (ret != 0)
+		if (!snap->has_ahead_behind)
 			return ft_fieldempty;
 		else
-			*(int*)FieldValue = behind;
+			*(int*)FieldValue = snap->behind;
 
 		break;
 
 	case 10:
-		if (cachedata->status_flags & GIT_STATUS_WT_NEW)
+		if (status_flags & GIT_STATUS_WT_NEW)
 			*(int*)FieldValue = 1;
 		else
 			*(int*)FieldValue = 0;
@@ -261,7 +527,7 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		break;
 
 	case 11:
-		if (cachedata->status_flags & GIT_STATUS_WT_MODIFIED)
+		if (status_flags & GIT_STATUS_WT_MODIFIED)
 			*(int*)FieldValue = 1;
 		else
 			*(int*)FieldValue = 0;
@@ -269,7 +535,7 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		break;
 
 	case 12:
-		if (cachedata->status_flags & GIT_STATUS_WT_DELETED)
+		if (status_flags & GIT_STATUS_WT_DELETED)
 			*(int*)FieldValue = 1;
 		else
 			*(int*)FieldValue = 0;
@@ -277,7 +543,7 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		break;
 
 	case 13:
-		if (cachedata->status_flags & GIT_STATUS_WT_TYPECHANGE)
+		if (status_flags & GIT_STATUS_WT_TYPECHANGE)
 			*(int*)FieldValue = 1;
 		else
 			*(int*)FieldValue = 0;
@@ -285,7 +551,7 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		break;
 
 	case 14:
-		if (cachedata->status_flags & GIT_STATUS_WT_RENAMED)
+		if (status_flags & GIT_STATUS_WT_RENAMED)
 			*(int*)FieldValue = 1;
 		else
 			*(int*)FieldValue = 0;
@@ -293,7 +559,7 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		break;
 
 	case 15:
-		if (cachedata->status_flags & GIT_STATUS_WT_UNREADABLE)
+		if (status_flags & GIT_STATUS_WT_UNREADABLE)
 			*(int*)FieldValue = 1;
 		else
 			*(int*)FieldValue = 0;
@@ -301,7 +567,7 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		break;
 
 	case 16:
-		if (cachedata->status_flags & GIT_STATUS_IGNORED)
+		if (status_flags & GIT_STATUS_IGNORED)
 			*(int*)FieldValue = 1;
 		else
 			*(int*)FieldValue = 0;
@@ -309,7 +575,7 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		break;
 
 	case 17:
-		if (cachedata->status_flags & GIT_STATUS_CONFLICTED)
+		if (status_flags & GIT_STATUS_CONFLICTED)
 			*(int*)FieldValue = 1;
 		else
 			*(int*)FieldValue = 0;
@@ -317,23 +583,16 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		break;
 
 	case 18:
-		if (cachedata->workdir != NULL)
-			strlcpy((char*)FieldValue, cachedata->workdir, maxlen - 1);
+		if (snap->workdir != NULL)
+			strlcpy((char*)FieldValue, snap->workdir, maxlen - 1);
 		else
 			return ft_fieldempty;
 
 		break;
 
 	case 19:
-		if (cachedata->workdir != NULL)
-		{
-			memset(path_temp, 0, PATH_MAX);
-
-			if (!realpath(FileName, path_temp))
-				return ft_fieldempty;
-
-			strlcpy((char*)FieldValue, path_temp + (strlen(cachedata->workdir) - 1), maxlen - 1);
-		}
+		if (snap->has_reldir)
+			snprintf((char*)FieldValue, maxlen - 1, "/%s", relpath);
 		else
 			return ft_fieldempty;
 
@@ -346,18 +605,57 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 	return fields[FieldIndex].type;
 }
 
+int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void* FieldValue, int maxlen, int flags)
+{
+	struct stat buf;
+	char path_temp[PATH_MAX];
+	char relpath[PATH_MAX];
+	unsigned int status_flags = 0;
+
+	if (lstat(FileName, &buf) != 0)
+		return ft_fileerror;
+
+	strlcpy(path_temp, FileName, PATH_MAX - 1);
+	char *current_dir = dirname(path_temp);
+
+	pthread_mutex_lock(&snapshots_mutex);
+	t_snapshot *snap = snapshot_get(current_dir, &buf);
+
+	if (snap->repo == NULL)
+	{
+		pthread_mutex_unlock(&snapshots_mutex);
+		return ft_fileerror;
+	}
+
+	const char *name = strrchr(FileName, '/');
+	name = name ? name + 1 : FileName;
+
+	if (snap->reldir[0] != '\0')
+		snprintf(relpath, sizeof(relpath), "%s/%s", snap->reldir, name);
+	else
+		strlcpy(relpath, name, PATH_MAX - 1);
+
+	if (snap->has_reldir)
+		status_flags = status_lookup(snap, relpath);
+
+	int result = ContentGetSnapshotValue(snap, FieldIndex, status_flags, relpath, FieldValue, maxlen);
+	pthread_mutex_unlock(&snapshots_mutex);
+
+	return result;
+}
+
 void DCPCALL ContentSetDefaultParams(ContentDefaultParamStruct* dps)
 {
-	cachedata = malloc(sizeof(t_cache));
-	memset(cachedata, 0, sizeof(t_cache));
 	git_libgit2_init();
 }
 
 void DCPCALL ContentPluginUnloading()
 {
-	if (cachedata->repo != NULL)
-		git_repository_free(cachedata->repo);
+	pthread_mutex_lock(&snapshots_mutex);
+
+	for (int i = 0; i < SNAPSHOT_MAX; i++)
+		snapshot_clear(&snapshots[i]);
 
-	free(cachedata);
+	pthread_mutex_unlock(&snapshots_mutex);
 	git_libgit2_shutdown();
 }
@@ -3,48 +3,53 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <archive.h>
 #include <archive_entry.h>
 #include <string.h>
 #include "wdxplugin.h"
+#include "delayed.h"
 
+#define CACHE_SIZE 64
+#define DELAY_MIN_SIZE 1048576
+#define DELAYED_THREADS 2
 
 typedef struct sfield
 {
 	char *name;
 	int type;
-	int64_t val;
 } tfield;
 
 #define fieldcount (sizeof(fields)/sizeof(tfield))
 
 tfield fields[] =
 {
-	{"archive",		ft_multiplechoice,	0},
-	{"~totalsize",		ft_numeric_64,		0},
-	{"items count",		ft_numeric_64,		0},
-	{"files",		ft_numeric_64,		0},
-	{"folders",		ft_numeric_64,		0},
-	{"symlinks",		ft_numeric_64,		0},
-	{"other",		ft_numeric_64,		0},
-	{"filtres count",	ft_numeric_64,		0},
-	{"gzip",		ft_boolean,		0},
-	{"bzip2",		ft_boolean,		0},
-	{"ms compress",		ft_boolean,		0},
-	{"lzma",		ft_boolean,		0},
-	{"xz",			ft_boolean,		0},
-	{"uu",			ft_boolean,		0},
-	{"rpm",			ft_boolean,		0},
-	{"lzip",		ft_boolean,		0},
-	{"lrzip",		ft_boolean,		0},
-	{"lzop",		ft_boolean,		0},
-	{"grzip",		ft_boolean,		0},
-	{"lz4",			ft_boolean,		0},
-	{"zstd",		ft_boolean,		0},
-	{"symlinks_undef",	ft_numeric_64,		0},
-	{"symlinks_file",	ft_numeric_64,		0},
-	{"symlinks_dir",	ft_numeric_64,		0},
-	{"warnings",		ft_numeric_64,		0},
+	{"archive",		ft_multiplechoice},
+	{"~totalsize",		ft_numeric_64},
+	{"items count",		ft_numeric_64},
+	{"files",		ft_numeric_64},
+	{"folders",		ft_numeric_64},
+	{"symlinks",		ft_numeric_64},
+	{"other",		ft_numeric_64},
+	{"filtres count",	ft_numeric_64},
+	{"gzip",		ft_boolean},
+	{"bzip2",		ft_boolean},
+	{"ms compress",		ft_boolean},
+	{"lzma",		ft_boolean},
+	{"xz",			ft_boolean},
+	{"uu",			ft_boolean},
+	{"rpm",			ft_boolean},
+	{"lzip",		ft_boolean},
+	{"lrzip",		ft_boolean},
+	{"lzop",		ft_boolean},
+	{"grzip",		ft_boolean},
+	{"lz4",			ft_boolean},
+	{"zstd",		ft_boolean},
+	{"symlinks_undef",	ft_numeric_64},
+	{"symlinks_file",	ft_numeric_64},
+	{"symlinks_dir",	ft_numeric_64},
+	{"warnings",		ft_numeric_64},
 };
 
 enum fieldnum
@@ -106,8 +111,20 @@ enum multichoicenum
 	M_WARC
 };
 
-char lastfile[PATH_MAX];
-bool lastfile_ok = false;
+typedef struct sarcinfo
+{
+	char path[PATH_MAX];
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	bool ok;
+	int64_t val[fieldcount];
+} tarcinfo;
+
+static tarcinfo gCache[CACHE_SIZE];
+static int gCacheNext = 0;
+static pthread_mutex_t gCacheMutex = PTHREAD_MUTEX_INITIALIZER;
 
 char* strlcpy(char* p, const char* p2, int maxlen)
 {
@@ -153,166 +170,235 @@ int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Unit
 	return fields[FieldIndex].type;
 }
 
-int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void* FieldValue, int maxlen, int flags)
+static bool scan_archive(const char *path, int64_t *val, const bool *cancel)
 {
 	int r;
+	bool ok = true;
 	struct archive *a;
 	struct archive_entry *entry;
-	struct stat buf;
 	__LA_MODE_T mode;
 
-	if (stat(FileName, &buf) != 0 || !S_ISREG(buf.st_mode))
-		return ft_fileerror;
+	memset(val, 0, sizeof(int64_t) * fieldcount);
+	a = archive_read_new();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	r = archive_read_open_filename(a, path, 10240);
 
-	if (strcmp(FileName, lastfile) != 0)
+	if (r != ARCHIVE_OK)
+		ok = false;
+	else
 	{
-		lastfile_ok = true;
 
-		for (int i = 0; i < fieldcount; i++)
-			fields[i].val = 0;
+		while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN)
+		{
+			if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED))
+			{
+				ok = false;
+				break;
+			}
 
-		strlcpy(lastfile, FileName, PATH_MAX);
-		a = archive_read_new();
-		archive_read_support_filter_all(a);
-		archive_read_support_format_all(a);
-		r = archive_read_open_filename(a, FileName, 10240);
+			val[F_TOTALCOUNT]++;
 
-		if (r != ARCHIVE_OK)
-			lastfile_ok = false;
-		else
-		{
+			if (r == ARCHIVE_WARN)
+				val[F_WARNCOUNT]++;
 
-			while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN)
+			val[F_TOTALSIZE] += archive_entry_size(entry);
+			mode = archive_entry_filetype(entry);
+
+			switch (mode & AE_IFMT)
 			{
-				fields[F_TOTALCOUNT].val++;
+			case AE_IFREG:
+				val[F_FILES]++;
+				break;
 
-				if (r == ARCHIVE_WARN)
-					fields[F_WARNCOUNT].val++;
+			case AE_IFDIR:
+				val[F_FOLDERS]++;
+				break;
 
-				fields[F_TOTALSIZE].val += archive_entry_size(entry);
-				mode = archive_entry_filetype(entry);
+			case AE_IFLNK:
+				val[F_SYMLINKS]++;
 
-				switch (mode & AE_IFMT)
+				switch (archive_entry_symlink_type(entry))
 				{
-				case AE_IFREG:
-					fields[F_FILES].val++;
+				case AE_SYMLINK_TYPE_UNDEFINED:
+					val[F_SYMLINKS_UNDEF]++;
 					break;
 
-				case AE_IFDIR:
-					fields[F_FOLDERS].val++;
+				case AE_SYMLINK_TYPE_FILE:
+					val[F_SYMLINKS_FILE]++;
 					break;
 
-				case AE_IFLNK:
-					fields[F_SYMLINKS].val++;
+				case AE_SYMLINK_TYPE_DIRECTORY:
+					val[F_SYMLINKS_DIR]++;
+					break;
+				}
 
-					switch (archive_entry_symlink_type(entry))
-					{
-					case AE_SYMLINK_TYPE_UNDEFINED:
-						fields[F_SYMLINKS_UNDEF].val++;
-						break;
+				break;
 
-					case AE_SYMLINK_TYPE_FILE:
-						fields[F_SYMLINKS_FILE].val++;
-						break;
+			default:
+				val[F_OTHER]++;
+			}
 
-					case AE_SYMLINK_TYPE_DIRECTORY:
-						fields[F_SYMLINKS_DIR].val++;
-						break;
-					}
+		}
 
-					break;
+		val[F_ARCTYPE] = archive_format(a);
+		val[F_FILTESCOUNT] = archive_filter_count(a) - 1;
 
-				default:
-					fields[F_OTHER].val++;
-				}
+		for (int i = 0; i <= val[F_FILTESCOUNT]; i++)
+		{
+			int filter_code = archive_filter_code(a, i);
 
-			}
+			switch (filter_code)
+			{
+			case ARCHIVE_FILTER_GZIP:
+				val[F_BGZIP]++;
+				break;
 
-			fields[F_ARCTYPE].val = archive_format(a);
-			fields[F_FILTESCOUNT].val = archive_filter_count(a) - 1;
+			case ARCHIVE_FILTER_BZIP2:
+				val[F_BBZIP2]++;
+				break;
 
-			for (int i = 0; i <= fields[F_FILTESCOUNT].val; i++)
-			{
-				int filter_code = archive_filter_code(a, i);
+			case ARCHIVE_FILTER_COMPRESS:
+				val[F_BCOMPRESS]++;
+				break;
 
-				switch (filter_code)
-				{
-				case ARCHIVE_FILTER_GZIP:
-					fields[F_BGZIP].val++;
-					break;
+			case ARCHIVE_FILTER_LZMA:
+				val[F_BLZMA]++;
+				break;
 
-				case ARCHIVE_FILTER_BZIP2:
-					fields[F_BBZIP2].val++;
-					break;
+			case ARCHIVE_FILTER_XZ:
+				val[F_BXZ]++;
+				break;
 
-				case ARCHIVE_FILTER_COMPRESS:
-					fields[F_BCOMPRESS].val++;
-					break;
+			case ARCHIVE_FILTER_UU:
+				val[F_BUU]++;
+				break;
 
-				case ARCHIVE_FILTER_LZMA:
-					fields[F_BLZMA].val++;
-					break;
+			case ARCHIVE_FILTER_RPM:
+				val[F_BRPM]++;
+				break;
 
-				case ARCHIVE_FILTER_XZ:
-					fields[F_BXZ].val++;
-					break;
+			case ARCHIVE_FILTER_LZIP:
+				val[F_BLZIP]++;
+				break;
 
-				case ARCHIVE_FILTER_UU:
-					fields[F_BUU].val++;
-					break;
+			case ARCHIVE_FILTER_LRZIP:
+				val[F_BLRZIP]++;
+				break;
 
-				case ARCHIVE_FILTER_RPM:
-					fields[F_BRPM].val++;
-					break;
+			case ARCHIVE_FILTER_LZOP:
+				val[F_BLZOP]++;
+				break;
 
-				case ARCHIVE_FILTER_LZIP:
-					fields[F_BLZIP].val++;
-					break;
+			case ARCHIVE_FILTER_GRZIP:
+				val[F_BGRZIP]++;
+				break;
 
-				case ARCHIVE_FILTER_LRZIP:
-					fields[F_BLRZIP].val++;
-					break;
+			case ARCHIVE_FILTER_LZ4:
+				val[F_BLZ4]++;
+				break;
 
-				case ARCHIVE_FILTER_LZOP:
-					fields[F_BLZOP].val++;
-					break;
+			case ARCHIVE_FILTER_ZSTD:
+				val[F_BZSTD]++;
+				break;
+			}
+		}
 
-				case ARCHIVE_FILTER_GRZIP:
-					fields[F_BGRZIP].val++;
-					break;
+		if (val[F_ARCTYPE] == ARCHIVE_FORMAT_EMPTY || val[F_ARCTYPE] == 0)
+			ok = false;
 
-				case ARCHIVE_FILTER_LZ4:
-					fields[F_BLZ4].val++;
-					break;
+		if (r != ARCHIVE_EOF)
+			ok = false;
+	}
 
-				case ARCHIVE_FILTER_ZSTD:
-					fields[F_BZSTD].val++;
-					break;
-				}
-			}
+	archive_read_close(a);
+	archive_read_free(a);
+
+	return ok;
+}
+
+static bool cache_get(const char *path, struct stat *buf, tarcinfo *info)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&gCacheMutex);
 
-			if (fields[F_ARCTYPE].val == ARCHIVE_FORMAT_EMPTY || fields[F_ARCTYPE].val == 0)
-				lastfile_ok = false;
+	for (int i = 0; i < CACHE_SIZE && !found; i++)
+	{
+		tarcinfo *entry = &gCache[i];
 
-			if (r != ARCHIVE_EOF)
-				lastfile_ok = false;
+		if (entry->ino == buf->st_ino && entry->dev == buf->st_dev && entry->size == buf->st_size &&
+		                entry->mtime.tv_sec == buf->st_mtim.tv_sec && entry->mtime.tv_nsec == buf->st_mtim.tv_nsec &&
+		                strcmp(entry->path, path) == 0)
+		{
+			*info = *entry;
+			found = true;
 		}
+	}
 
-		archive_read_close(a);
-		archive_read_free(a);
+	pthread_mutex_unlock(&gCacheMutex);
 
+	return found;
+}
+
+static void archive_work(const char *path, int arg, const bool *cancel)
+{
+	struct stat buf;
+	int64_t val[fieldcount];
+
+	if (stat(path, &buf) != 0 || !S_ISREG(buf.st_mode))
+		return;
+
+	bool ok = scan_archive(path, val, cancel);
+
+	if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&gCacheMutex);
+	tarcinfo *entry = &gCache[gCacheNext];
+	gCacheNext = (gCacheNext + 1) % CACHE_SIZE;
+	strlcpy(entry->path, path, PATH_MAX - 1);
+	entry->dev = buf.st_dev;
+	entry->ino = buf.st_ino;
+	entry->size = buf.st_size;
+	entry->mtime = buf.st_mtim;
+	entry->ok = ok;
+	memcpy(entry->val, val, sizeof(val));
+	pthread_mutex_unlock(&gCacheMutex);
+}
+
+int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void* FieldValue, int maxlen, int flags)
+{
+	struct stat buf;
+	tarcinfo info;
+
+	if (stat(FileName, &buf) != 0 || !S_ISREG(buf.st_mode))
+		return ft_fileerror;
+
+	if (!cache_get(FileName, &buf, &info))
+	{
+		// small archives are listed right away
+		if ((flags & CONTENT_DELAYIFSLOW) && buf.st_size >= DELAY_MIN_SIZE)
+		{
+			delayed_submit(FileName, 0);
+			*(char*)FieldValue = '\0';
+			return ft_delayed;
+		}
+
+		if (!delayed_run(FileName, 0) || !cache_get(FileName, &buf, &info))
+			return ft_fieldempty;
 	}
 
-	if (lastfile_ok == false)
+	if (!info.ok)
 		return ft_fileerror;
 
 	if (fields[FieldIndex].type == ft_numeric_64)
-		*(int64_t*)FieldValue = fields[FieldIndex].val;
+		*(int64_t*)FieldValue = info.val[FieldIndex];
 	else if (fields[FieldIndex].type == ft_multiplechoice)
 	{
 		int index = -1;
 
-		switch (fields[F_ARCTYPE].val)
+		switch (info.val[F_ARCTYPE])
 		{
 		case ARCHIVE_FORMAT_ZIP:
 			index = M_ZIP;
@@ -425,9 +511,24 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 		strlcpy((char*)FieldValue, archive_multichoice[index], maxlen - 1);
 	}
 	else if (fields[FieldIndex].type == ft_boolean)
-		*(int*)FieldValue = (int)fields[FieldIndex].val;
+		*(int*)FieldValue = (int)info.val[FieldIndex];
 	else
 		return ft_nosuchfield;
 
 	return fields[FieldIndex].type;
 }
+
+void DCPCALL ContentStopGetValue(char* FileName)
+{
+	delayed_stop(FileName);
+}
+
+void DCPCALL ContentSetDefaultParams(ContentDefaultParamStruct* dps)
+{
+	delayed_init(archive_work, DELAYED_THREADS);
+}
+
+void DCPCALL ContentPluginUnloading(void)
+{
+	delayed_shutdown();
+}
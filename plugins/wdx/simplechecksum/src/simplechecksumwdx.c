@@ -1,11 +1,30 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <gcrypt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <linux/limits.h>
 #include <string.h>
+#include <time.h>
 #include "wdxplugin.h"
+#include "delayed.h"
 
-#define BUFF_SIZE 4096
+#define BUFF_SIZE 65536
+#define CACHE_SIZE 16
+#define STORE_MAGIC "DCSCSUM1"
+#define STORE_FILE "simplechecksum.cache"
+#define STORE_SLOTS 65536
+#define STORE_PROBE 8
+#define DIGEST_MAX 64
+#define DELAYED_THREADS 2
+#define REQUEST_TTL 60
 
 typedef struct _field
 {
@@ -53,6 +72,51 @@ FIELD fields[] =
 	{"Whirlpool",		ft_string,	305	/* GCRY_MD_WHIRLPOOL */},
 };
 
+typedef struct _cache
+{
+	char path[PATH_MAX];
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	unsigned char *digest[fieldcount];
+} CACHE;
+
+typedef struct _store_header
+{
+	char magic[8];
+	uint32_t slots;
+	uint32_t slot_size;
+} STORE_HEADER;
+
+typedef struct _store_key
+{
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t algo;
+	uint32_t reserved;
+} STORE_KEY;
+
+typedef struct _store_slot
+{
+	STORE_KEY key;
+	uint32_t len;
+	uint32_t reserved;
+	unsigned char digest[DIGEST_MAX];
+	uint64_t check;
+} STORE_SLOT;
+
+static CACHE gCache[CACHE_SIZE];
+static int gCacheNext = 0;
+static time_t gRequested[fieldcount];
+static pthread_mutex_t gCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static char gStorePath[PATH_MAX];
+static STORE_HEADER *gStore = NULL;
+static size_t gStoreSize = 0;
+
 char* strlcpy(char* p, const char* p2, int maxlen)
 {
 	if ((int)strlen(p2) >= maxlen)
@@ -66,6 +130,382 @@ char* strlcpy(char* p, const char* p2, int maxlen)
 	return p;
 }
 
+static uint64_t fnv1a(const void *data, size_t len, uint64_t hash)
+{
+	const unsigned char *p = data;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static uint64_t store_slot_check(STORE_SLOT *slot)
+{
+	uint64_t hash = fnv1a(&slot->key, sizeof(STORE_KEY), 0xcbf29ce484222325ULL);
+	hash = fnv1a(&slot->len, sizeof(slot->len), hash);
+	hash = fnv1a(slot->digest, DIGEST_MAX, hash);
+
+	return hash | 1;
+}
+
+// must be called with gCacheMutex locked
+static STORE_SLOT* store_open(void)
+{
+	int fd;
+	void *map;
+	struct stat st;
+	size_t size = sizeof(STORE_HEADER) + sizeof(STORE_SLOT) * STORE_SLOTS;
+
+	if (gStore != NULL)
+		return (STORE_SLOT*)(gStore + 1);
+
+	if (gStorePath[0] == '\0')
+		return NULL;
+
+	if ((fd = open(gStorePath, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+	{
+		gStorePath[0] = '\0';
+		return NULL;
+	}
+
+	// another instance may be checking or initialising the same file, the lock goes with close()
+	if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0)
+	{
+		close(fd);
+		gStorePath[0] = '\0';
+		return NULL;
+	}
+
+	STORE_HEADER header;
+
+	// unknown layout, start with a new (sparse) file
+	if ((size_t)st.st_size != size || pread(fd, &header, sizeof(STORE_HEADER), 0) != sizeof(STORE_HEADER) ||
+	                memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) != 0 ||
+	                header.slots != STORE_SLOTS || header.slot_size != sizeof(STORE_SLOT))
+	{
+		memset(&header, 0, sizeof(STORE_HEADER));
+		memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+		header.slots = STORE_SLOTS;
+		header.slot_size = sizeof(STORE_SLOT);
+
+		if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0 ||
+		                pwrite(fd, &header, sizeof(STORE_HEADER), 0) != sizeof(STORE_HEADER))
+		{
+			close(fd);
+			gStorePath[0] = '\0';
+			return NULL;
+		}
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		gStorePath[0] = '\0';
+		return NULL;
+	}
+
+	gStore = (STORE_HEADER*)map;
+	gStoreSize = size;
+
+	return (STORE_SLOT*)(gStore + 1);
+}
+
+static void store_make_key(STORE_KEY *key, struct stat *buf, int algo)
+{
+	memset(key, 0, sizeof(STORE_KEY));
+	key->dev = buf->st_dev;
+	key->ino = buf->st_ino;
+	key->size = buf->st_size;
+	key->mtime_sec = buf->st_mtim.tv_sec;
+	key->mtime_nsec = buf->st_mtim.tv_nsec;
+	key->algo = algo;
+}
+
+// must be called with gCacheMutex locked
+static bool store_get(struct stat *buf, int algo, unsigned char *digest, unsigned int len)
+{
+	STORE_KEY key;
+	STORE_SLOT *slots = store_open();
+
+	if (slots == NULL || len > DIGEST_MAX)
+		return false;
+
+	store_make_key(&key, buf, algo);
+	uint64_t home = fnv1a(&key, sizeof(STORE_KEY), 0xcbf29ce484222325ULL);
+
+	for (int i = 0; i < STORE_PROBE; i++)
+	{
+		STORE_SLOT *slot = &slots[(home + i) % STORE_SLOTS];
+
+		if (slot->len == len && memcmp(&slot->key, &key, sizeof(STORE_KEY)) == 0)
+		{
+			if (slot->check != store_slot_check(slot))
+				return false;
+
+			memcpy(digest, slot->digest, len);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// must be called with gCacheMutex locked
+static void store_put(struct stat *buf, int algo, const unsigned char *digest, unsigned int len)
+{
+	STORE_KEY key;
+	STORE_SLOT *slot = NULL;
+	STORE_SLOT *slots = store_open();
+
+	if (slots == NULL || len > DIGEST_MAX)
+		return;
+
+	store_make_key(&key, buf, algo);
+	uint64_t home = fnv1a(&key, sizeof(STORE_KEY), 0xcbf29ce484222325ULL);
+
+	for (int i = 0; i < STORE_PROBE && slot == NULL; i++)
+	{
+		STORE_SLOT *cur = &slots[(home + i) % STORE_SLOTS];
+
+		if (cur->check == 0 || memcmp(&cur->key, &key, sizeof(STORE_KEY)) == 0)
+			slot = cur;
+	}
+
+	// the window is full, the oldest guess is as good as any
+	if (slot == NULL)
+		slot = &slots[home % STORE_SLOTS];
+
+	memset(slot, 0, sizeof(STORE_SLOT));
+	slot->key = key;
+	slot->len = len;
+	memcpy(slot->digest, digest, len);
+	slot->check = store_slot_check(slot);
+}
+
+static CACHE* cache_lookup(const char *path, struct stat *buf)
+{
+	for (int i = 0; i < CACHE_SIZE; i++)
+	{
+		CACHE *entry = &gCache[i];
+
+		if (entry->ino == buf->st_ino && entry->dev == buf->st_dev && entry->size == buf->st_size &&
+		                entry->mtime.tv_sec == buf->st_mtim.tv_sec && entry->mtime.tv_nsec == buf->st_mtim.tv_nsec &&
+		                strcmp(entry->path, path) == 0)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static CACHE* cache_new_entry(const char *path, struct stat *buf)
+{
+	CACHE *entry = &gCache[gCacheNext];
+	gCacheNext = (gCacheNext + 1) % CACHE_SIZE;
+
+	for (int i = 0; i < fieldcount; i++)
+	{
+		free(entry->digest[i]);
+		entry->digest[i] = NULL;
+	}
+
+	strlcpy(entry->path, path, PATH_MAX - 1);
+	entry->dev = buf->st_dev;
+	entry->ino = buf->st_ino;
+	entry->size = buf->st_size;
+	entry->mtime = buf->st_mtim;
+
+	return entry;
+}
+
+static bool cache_get_value(const char *path, struct stat *buf, int FieldIndex, int UnitIndex, char *FieldValue, int maxlen)
+{
+	bool ret = false;
+	unsigned int i, digestlen = gcry_md_get_algo_dlen(fields[FieldIndex].algo);
+
+	pthread_mutex_lock(&gCacheMutex);
+	CACHE *entry = cache_lookup(path, buf);
+
+	if (entry != NULL && entry->digest[FieldIndex] != NULL && digestlen > 0 && (size_t)maxlen > (size_t)digestlen * 2)
+	{
+		for (i = 0; i < digestlen; i++)
+		{
+			if (UnitIndex == 1)
+				sprintf(&FieldValue[i * 2], "%02X", entry->digest[FieldIndex][i]);
+			else
+				sprintf(&FieldValue[i * 2], "%02x", entry->digest[FieldIndex][i]);
+		}
+
+		ret = true;
+	}
+
+	pthread_mutex_unlock(&gCacheMutex);
+
+	return ret;
+}
+
+static bool cache_load_stored(const char *path, struct stat *buf, int FieldIndex)
+{
+	bool ret = false;
+	unsigned char digest[DIGEST_MAX];
+	unsigned int digestlen = gcry_md_get_algo_dlen(fields[FieldIndex].algo);
+
+	pthread_mutex_lock(&gCacheMutex);
+
+	if (digestlen > 0 && store_get(buf, fields[FieldIndex].algo, digest, digestlen))
+	{
+		CACHE *entry = cache_lookup(path, buf);
+
+		if (entry == NULL)
+			entry = cache_new_entry(path, buf);
+
+		if (entry->digest[FieldIndex] == NULL && (entry->digest[FieldIndex] = malloc(digestlen)) != NULL)
+			memcpy(entry->digest[FieldIndex], digest, digestlen);
+
+		ret = (entry->digest[FieldIndex] != NULL);
+	}
+
+	pthread_mutex_unlock(&gCacheMutex);
+
+	return ret;
+}
+
+static time_t request_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + 1;
+}
+
+// a field counts as wanted for REQUEST_TTL seconds after DC last asked for it,
+// a column that is gone from the panel is no longer computed along with the others
+// must be called with gCacheMutex locked
+static void request_mark(int FieldIndex)
+{
+	gRequested[FieldIndex] = request_clock();
+}
+
+static bool request_wanted(int FieldIndex, time_t now)
+{
+	return gRequested[FieldIndex] != 0 && now - gRequested[FieldIndex] < REQUEST_TTL;
+}
+
+// reads the file once, computing the requested field and every other field that DC has asked for lately
+static int calc_digests(const char *path, struct stat *buf, int FieldIndex, const bool *cancel)
+{
+	int fd, i;
+	ssize_t bytes;
+	gcry_md_hd_t h;
+	bool enabled[fieldcount];
+	unsigned char *data;
+
+	pthread_mutex_lock(&gCacheMutex);
+	request_mark(FieldIndex);
+	CACHE *entry = cache_lookup(path, buf);
+	time_t now = request_clock();
+
+	for (i = 0; i < fieldcount; i++)
+		enabled[i] = (i == FieldIndex || request_wanted(i, now)) && !(entry && entry->digest[i]);
+
+	pthread_mutex_unlock(&gCacheMutex);
+
+	if (gcry_err_code(gcry_md_open(&h, 0, 0)))
+		return ft_fieldempty;
+
+	for (i = 0; i < fieldcount; i++)
+	{
+		if (enabled[i] && gcry_err_code(gcry_md_enable(h, fields[i].algo)))
+		{
+			if (i == FieldIndex)
+			{
+				gcry_md_close(h);
+				return ft_fieldempty;
+			}
+
+			enabled[i] = false;
+		}
+	}
+
+	if ((data = malloc(BUFF_SIZE)) == NULL)
+	{
+		gcry_md_close(h);
+		return ft_fieldempty;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+	{
+		free(data);
+		gcry_md_close(h);
+		return ft_fileerror;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	while ((bytes = read(fd, data, BUFF_SIZE)) != 0)
+	{
+		if (cancel && __atomic_load_n(cancel, __ATOMIC_RELAXED))
+			break;
+
+		if (bytes == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			break;
+		}
+
+		gcry_md_write(h, data, bytes);
+	}
+
+	close(fd);
+	free(data);
+
+	if (bytes != 0)
+	{
+		gcry_md_close(h);
+		return ft_fileerror;
+	}
+
+	pthread_mutex_lock(&gCacheMutex);
+
+	if ((entry = cache_lookup(path, buf)) == NULL)
+		entry = cache_new_entry(path, buf);
+
+	for (i = 0; i < fieldcount; i++)
+	{
+		unsigned int digestlen = gcry_md_get_algo_dlen(fields[i].algo);
+
+		if (!enabled[i] || entry->digest[i] || digestlen == 0)
+			continue;
+
+		if ((entry->digest[i] = malloc(digestlen)) != NULL)
+		{
+			memcpy(entry->digest[i], gcry_md_read(h, fields[i].algo), digestlen);
+			store_put(buf, fields[i].algo, entry->digest[i], digestlen);
+		}
+	}
+
+	pthread_mutex_unlock(&gCacheMutex);
+	gcry_md_close(h);
+
+	return fields[FieldIndex].type;
+}
+
+static void checksum_work(const char *path, int arg, const bool *cancel)
+{
+	struct stat buf;
+
+	if (lstat(path, &buf) == 0 && S_ISREG(buf.st_mode))
+		calc_digests(path, &buf, arg, cancel);
+}
+
 int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Units, int maxlen)
 {
 	if (FieldIndex < 0 || FieldIndex >= fieldcount)
@@ -83,14 +523,7 @@ int DCPCALL ContentGetSupportedField(int FieldIndex, char* FieldName, char* Unit
 
 int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void* FieldValue, int maxlen, int flags)
 {
-	size_t i, bytes, res_size;
-	unsigned char data[BUFF_SIZE];
-	char* result = NULL;
-	unsigned char* digest;
-	unsigned int digestlen;
 	struct stat buf;
-	gcry_md_hd_t h;
-	gcry_error_t err;
 
 	if (FieldIndex < 0 || FieldIndex >= fieldcount)
 		return ft_fieldempty;
@@ -101,61 +534,79 @@ int DCPCALL ContentGetValue(char* FileName, int FieldIndex, int UnitIndex, void*
 	if (!S_ISREG(buf.st_mode))
 		return ft_fileerror;
 
-	if (flags && CONTENT_DELAYIFSLOW)
+	if (cache_get_value(FileName, &buf, FieldIndex, UnitIndex, (char*)FieldValue, maxlen))
+		return fields[FieldIndex].type;
+
+	if (cache_load_stored(FileName, &buf, FieldIndex) &&
+	                cache_get_value(FileName, &buf, FieldIndex, UnitIndex, (char*)FieldValue, maxlen))
+		return fields[FieldIndex].type;
+
+	if (flags & CONTENT_DELAYIFSLOW)
 	{
+		// so that the queued pass computes this one too
+		pthread_mutex_lock(&gCacheMutex);
+		request_mark(FieldIndex);
+		pthread_mutex_unlock(&gCacheMutex);
+
+		delayed_submit(FileName, FieldIndex);
 		strlcpy((char*)FieldValue, "???", maxlen - 1);
 		return ft_delayed;
-		//return ft_ondemand;
 	}
 
-	FILE *inFile = fopen(FileName, "rb");
+	// a pass that was already running may have been started before this field was asked for
+	for (int i = 0; i < 2; i++)
+	{
+		if (!delayed_run(FileName, FieldIndex))
+			return ft_fieldempty;
 
-	if (inFile == NULL)
-		return ft_fileerror;
+		if (cache_get_value(FileName, &buf, FieldIndex, UnitIndex, (char*)FieldValue, maxlen))
+			return fields[FieldIndex].type;
+	}
 
-	err = gcry_md_open(&h, fields[FieldIndex].algo, 0);
+	return ft_fileerror;
+}
 
-	if (gcry_err_code(err))
-	{
-		fclose(inFile);
-		return ft_fieldempty;
-	}
+void DCPCALL ContentStopGetValue(char* FileName)
+{
+	delayed_stop(FileName);
+}
 
-	while ((bytes = fread(data, 1, BUFF_SIZE, inFile)) != 0)
-		gcry_md_write(h, data, bytes);
+void DCPCALL ContentSetDefaultParams(ContentDefaultParamStruct* dps)
+{
+	char *pos;
 
-	digest = gcry_md_read(h, fields[FieldIndex].algo);
-	digestlen = gcry_md_get_algo_dlen(fields[FieldIndex].algo);
+	delayed_init(checksum_work, DELAYED_THREADS);
 
-	if (digestlen > 0)
-	{
-		res_size = (size_t)digestlen * sizeof(char) * 2 + 1;
-		result = (char*)malloc(res_size);
-	}
+	pthread_mutex_lock(&gCacheMutex);
+	strlcpy(gStorePath, dps->DefaultIniName, PATH_MAX - 1);
 
-	if (result != NULL)
-	{
-		memset(result, 0, res_size);
+	if ((pos = strrchr(gStorePath, '/')) != NULL && (size_t)(pos - gStorePath) + sizeof(STORE_FILE) < PATH_MAX)
+		strcpy(pos + 1, STORE_FILE);
+	else
+		gStorePath[0] = '\0';
 
-		for (i = 0; i < digestlen; i++)
-		{
-			if (UnitIndex == 1)
-				sprintf(&result[i * 2], "%02X", digest[i]);
-			else
-				sprintf(&result[i * 2], "%02x", digest[i]);
-		}
-	}
+	pthread_mutex_unlock(&gCacheMutex);
+}
 
-	fclose(inFile);
-	gcry_md_close(h);
+void DCPCALL ContentPluginUnloading(void)
+{
+	delayed_shutdown();
+
+	pthread_mutex_lock(&gCacheMutex);
+
+	if (gStore != NULL)
+		munmap(gStore, gStoreSize);
 
-	if (result != NULL)
+	gStore = NULL;
+
+	for (int i = 0; i < CACHE_SIZE; i++)
 	{
-		strlcpy((char*)FieldValue, result, maxlen - 1);
-		free(result);
+		for (int j = 0; j < fieldcount; j++)
+		{
+			free(gCache[i].digest[j]);
+			gCache[i].digest[j] = NULL;
+		}
 	}
-	else
-		return ft_fieldempty;
 
-	return fields[FieldIndex].type;
+	pthread_mutex_unlock(&gCacheMutex);
 }
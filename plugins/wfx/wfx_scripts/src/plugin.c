@@ -4,6 +4,7 @@
 #include <gio/gio.h>
 #include <glib/gstdio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <time.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -27,7 +28,7 @@
 #endif
 
 #define Int32x32To64(a,b) ((gint64)(a)*(gint64)(b))
-#define LIST_REGEXP "([cbdflrstwxST\\-]{10})\\s+(\\d{4}\\-?\\d{2}\\-?\\d{2}[\\stT]\\d{2}:?\\d{2}:?\\d?\\d?Z?)\\s+([0-9\\-]+)\\s+([^\\n]+)"
+#define LIST_MODE_CHARS "cbdflrstwxST-"
 
 #define CHECKFIELDS_OPT "Fs_GetSupportedField_Needed"
 #define STATUSINFO_OPT "Fs_StatusInfo_Needed"
@@ -39,6 +40,8 @@
 #define NOISE_OPT "Fs_DebugMode"
 #define PUSH_OPT "Fs_PushValue"
 #define ACT_OPT "Fs_PropsActs"
+#define DAEMON_OPT "Fs_Daemon_Mode"
+#define GETVALUES_OPT "Fs_GetValues_Needed"
 
 #define IN_USE_MARK "Fs_InUse"
 
@@ -64,17 +67,61 @@
 #define VERB_REALNAME "localname"
 #define VERB_FIELDS   "getfields"
 #define VERB_GETVALUE "getvalue"
+#define VERB_GETVALUES "getvalues"
+#define VERB_DAEMON   "daemon"
+#define VERB_CANCEL   "cancel"
 
+#define DAEMON_STOP_TIMEOUT 5
+#define DAEMON_KILL_TIMEOUT 2
+#define VALUES_MAX_DIRS 16
+
+
+typedef struct sDaemonRequest
+{
+	guint id;
+	GQueue lines;
+	gboolean done;
+	gint status;
+} tDaemonRequest;
+
+typedef struct sScriptDaemon
+{
+	GPid pid;
+	gint stdin_fd;
+	gint stdout_fd;
+	gint refs;
+	guint next_id;
+	gboolean alive;
+	GMutex lock;
+	GMutex write_lock;
+	GCond cond;
+	GThread *reader;
+	GHashTable *pending;
+} tScriptDaemon;
 
 typedef struct sVFSDirData
 {
 	DIR *dir;
-	gchar *output;
-	GRegex *regex;
 	char script[PATH_MAX];
-	GMatchInfo *match_info;
+	GPid pid;
+	FILE *stdout_fp;
+	gint stderr_fd;
+	gboolean is_eof;
+	char *line;
+	size_t line_size;
+	gchar *daemon_line;
+	tScriptDaemon *daemon;
+	tDaemonRequest *request;
 } tVFSDirData;
 
+typedef struct sDirValues
+{
+	GHashTable *entries;
+	gint64 used;
+	gboolean pending;
+	gboolean stale;
+} tDirValues;
+
 int gPluginNr;
 int gCryptoNr;
 tProgressProc gProgressProc = NULL;
@@ -87,6 +134,11 @@ static gchar *g_props = NULL;
 static gchar *g_caller = NULL;
 static gchar *g_choice = NULL;
 static GKeyFile *g_cfg = NULL;
+static GHashTable *g_daemons = NULL;
+static GMutex g_daemons_lock;
+static GHashTable *g_values = NULL;
+static GMutex g_values_lock;
+static GCond g_values_cond;
 static gchar **g_fields = NULL;
 static gboolean g_noise = FALSE;
 static char g_script[PATH_MAX];
@@ -244,9 +296,471 @@ static gboolean ProgressNeded(gchar *verb)
 	return result;
 }
 
+static gchar *DaemonEscape(const char *str)
+{
+	GString *result = g_string_new(NULL);
+
+	for (const char *p = str; p && *p; p++)
+	{
+		if (*p == '\\')
+			g_string_append(result, "\\\\");
+		else if (*p == '\t')
+			g_string_append(result, "\\t");
+		else if (*p == '\n')
+			g_string_append(result, "\\n");
+		else
+			g_string_append_c(result, *p);
+	}
+
+	return g_string_free(result, FALSE);
+}
+
+static void DaemonUnescape(gchar *str)
+{
+	gchar *out = str;
+
+	for (gchar *p = str; *p; p++)
+	{
+		if (*p == '\\' && p[1] != '\0')
+		{
+			p++;
+			*out++ = (*p == 't') ? '\t' : (*p == 'n') ? '\n' : *p;
+		}
+		else
+			*out++ = *p;
+	}
+
+	*out = '\0';
+}
+
+// a dead daemon must not take DC down with SIGPIPE
+static gboolean DaemonWrite(tScriptDaemon *daemon, gchar *line)
+{
+	sigset_t set, old;
+	gboolean result = TRUE;
+	size_t len = strlen(line);
+	struct timespec zero = {0, 0};
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	g_mutex_lock(&daemon->write_lock);
+
+	while (len > 0 && result)
+	{
+		ssize_t written = daemon->stdin_fd < 0 ? -1 : write(daemon->stdin_fd, line, len);
+
+		if (written > 0)
+		{
+			line += written;
+			len -= written;
+		}
+		else if (written < 0 && errno == EINTR)
+			continue;
+		else
+		{
+			if (errno == EPIPE)
+				sigtimedwait(&set, NULL, &zero);
+
+			result = FALSE;
+		}
+	}
+
+	g_mutex_unlock(&daemon->write_lock);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return result;
+}
+
+static void DaemonFinishRequest(gpointer key, gpointer value, gpointer data)
+{
+	tDaemonRequest *request = (tDaemonRequest*)value;
+
+	request->status = -1;
+	request->done = TRUE;
+}
+
+// reply lines are "ID\tout\tTEXT", "ID\terr\tTEXT" and "ID\tend\tSTATUS"
+static gpointer DaemonReader(gpointer data)
+{
+	size_t len = 0;
+	char *line = NULL;
+	gint status = 0;
+	tScriptDaemon *daemon = (tScriptDaemon*)data;
+	FILE *fp = fdopen(daemon->stdout_fd, "r");
+
+	while (fp && getline(&line, &len, fp) != -1)
+	{
+		g_strchomp(line);
+		gchar **split = g_strsplit(line, "\t", 3);
+
+		if (g_strv_length(split) == 3)
+		{
+			guint id = (guint)g_ascii_strtoull(split[0], NULL, 10);
+
+			g_mutex_lock(&daemon->lock);
+			tDaemonRequest *request = g_hash_table_lookup(daemon->pending, GUINT_TO_POINTER(id));
+
+			if (request && g_strcmp0(split[1], "end") == 0)
+			{
+				request->status = (gint)g_ascii_strtoll(split[2], NULL, 10);
+				request->done = TRUE;
+				g_hash_table_remove(daemon->pending, GUINT_TO_POINTER(id));
+				g_cond_broadcast(&daemon->cond);
+			}
+			else if (request && (g_strcmp0(split[1], "out") == 0 || g_strcmp0(split[1], "err") == 0))
+			{
+				DaemonUnescape(split[2]);
+				g_queue_push_tail(&request->lines, g_strdup_printf("%c%s", split[1][0], split[2]));
+				g_cond_broadcast(&daemon->cond);
+			}
+
+			g_mutex_unlock(&daemon->lock);
+		}
+
+		g_strfreev(split);
+	}
+
+	free(line);
+
+	if (fp)
+		fclose(fp);
+	else
+		close(daemon->stdout_fd);
+
+	waitpid(daemon->pid, &status, 0);
+	g_spawn_close_pid(daemon->pid);
+
+	g_mutex_lock(&daemon->lock);
+	daemon->alive = FALSE;
+	g_hash_table_foreach(daemon->pending, DaemonFinishRequest, NULL);
+	g_hash_table_remove_all(daemon->pending);
+	g_cond_broadcast(&daemon->cond);
+	g_mutex_unlock(&daemon->lock);
+
+	return NULL;
+}
+
+// EOF on stdin is the signal to quit, a daemon that ignores it gets SIGTERM and then SIGKILL,
+// the reader thread can't be joined before the pipe is closed on the other end
+static void DaemonShutdown(tScriptDaemon *daemon)
+{
+	int sig = 0;
+	gint64 end_time = g_get_monotonic_time() + DAEMON_STOP_TIMEOUT * G_TIME_SPAN_SECOND;
+
+	g_mutex_lock(&daemon->write_lock);
+
+	if (daemon->stdin_fd >= 0)
+		close(daemon->stdin_fd);
+
+	daemon->stdin_fd = -1;
+	g_mutex_unlock(&daemon->write_lock);
+
+	g_mutex_lock(&daemon->lock);
+
+	while (daemon->alive)
+	{
+		if (!g_cond_wait_until(&daemon->cond, &daemon->lock, end_time) && daemon->alive)
+		{
+			if (sig == SIGKILL)
+				break;
+
+			sig = (sig == 0) ? SIGTERM : SIGKILL;
+			kill(daemon->pid, sig);
+			end_time = g_get_monotonic_time() + DAEMON_KILL_TIMEOUT * G_TIME_SPAN_SECOND;
+		}
+	}
+
+	g_mutex_unlock(&daemon->lock);
+}
+
+static void DaemonUnref(gpointer data)
+{
+	tScriptDaemon *daemon = (tScriptDaemon*)data;
+
+	if (!g_atomic_int_dec_and_test(&daemon->refs))
+		return;
+
+	DaemonShutdown(daemon);
+	g_thread_join(daemon->reader);
+	g_hash_table_destroy(daemon->pending);
+	g_mutex_clear(&daemon->lock);
+	g_mutex_clear(&daemon->write_lock);
+	g_cond_clear(&daemon->cond);
+	g_free(daemon);
+}
+
+static tScriptDaemon *DaemonStart(gchar *script_name, gchar **envp)
+{
+	GError *err = NULL;
+	tScriptDaemon *daemon = g_new0(tScriptDaemon, 1);
+	gchar *script = g_strdup_printf("./%s", script_name);
+	gchar *argv[] = { script, VERB_DAEMON, NULL };
+
+	if (!g_spawn_async_with_pipes(g_scripts_dir, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &daemon->pid, &daemon->stdin_fd, &daemon->stdout_fd, NULL, &err))
+	{
+		if (err)
+		{
+			LogMessage(gPluginNr, MSGTYPE_IMPORTANTERROR, (err)->message);
+			g_clear_error(&err);
+		}
+
+		g_free(script);
+		g_free(daemon);
+		return NULL;
+	}
+
+	if (g_noise)
+	{
+		gchar *message = g_strdup_printf("%s %s (pid %d)", script, VERB_DAEMON, daemon->pid);
+		LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
+		g_free(message);
+	}
+
+	g_free(script);
+	daemon->refs = 1;
+	daemon->alive = TRUE;
+	g_mutex_init(&daemon->lock);
+	g_mutex_init(&daemon->write_lock);
+	g_cond_init(&daemon->cond);
+	daemon->pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+	daemon->reader = g_thread_new("wfx_scripts", DaemonReader, daemon);
+
+	return daemon;
+}
+
+static tScriptDaemon *DaemonGet(gchar *script_name, gchar **envp)
+{
+	g_mutex_lock(&g_daemons_lock);
+
+	if (!g_daemons)
+		g_daemons = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, DaemonUnref);
+
+	tScriptDaemon *daemon = g_hash_table_lookup(g_daemons, script_name);
+
+	if (daemon && !g_atomic_int_get(&daemon->alive))
+	{
+		g_hash_table_remove(g_daemons, script_name);
+		daemon = NULL;
+	}
+
+	if (!daemon && (daemon = DaemonStart(script_name, envp)) != NULL)
+		g_hash_table_insert(g_daemons, g_strdup(script_name), daemon);
+
+	if (daemon)
+		g_atomic_int_inc(&daemon->refs);
+
+	g_mutex_unlock(&g_daemons_lock);
+
+	return daemon;
+}
+
+static void DaemonStop(gchar *script_name)
+{
+	gpointer key = NULL, value = NULL;
+
+	g_mutex_lock(&g_daemons_lock);
+
+	if (!g_daemons || !g_hash_table_steal_extended(g_daemons, script_name, &key, &value))
+	{
+		g_mutex_unlock(&g_daemons_lock);
+		return;
+	}
+
+	g_mutex_unlock(&g_daemons_lock);
+
+	tScriptDaemon *daemon = (tScriptDaemon*)value;
+
+	// the requests still holding it fail, the daemon is gone
+	DaemonShutdown(daemon);
+	g_free(key);
+	DaemonUnref(daemon);
+}
+
+static void DaemonCancel(tScriptDaemon *daemon, tDaemonRequest *request)
+{
+	gchar *cancel = g_strdup_printf("0\t%s\t%u\t\n", VERB_CANCEL, request->id);
+	DaemonWrite(daemon, cancel);
+	g_free(cancel);
+}
+
+// NULL if the request never reached the script
+static tDaemonRequest *DaemonSubmit(tScriptDaemon *daemon, gchar *verb, char *arg1, char *arg2)
+{
+	gchar *line;
+	tDaemonRequest *request = g_new0(tDaemonRequest, 1);
+	g_queue_init(&request->lines);
+	request->status = -1;
+
+	gchar *escaped1 = DaemonEscape(arg1);
+	gchar *escaped2 = DaemonEscape(arg2);
+
+	g_mutex_lock(&daemon->lock);
+	request->id = ++daemon->next_id;
+	g_hash_table_insert(daemon->pending, GUINT_TO_POINTER(request->id), request);
+	g_mutex_unlock(&daemon->lock);
+
+	line = g_strdup_printf("%u\t%s\t%s\t%s\n", request->id, verb, escaped1, escaped2);
+	gboolean is_sent = DaemonWrite(daemon, line);
+	g_free(line);
+	g_free(escaped1);
+	g_free(escaped2);
+
+	if (!is_sent)
+	{
+		g_mutex_lock(&daemon->lock);
+		g_hash_table_remove(daemon->pending, GUINT_TO_POINTER(request->id));
+
+		while ((line = g_queue_pop_head(&request->lines)) != NULL)
+			g_free(line);
+
+		g_mutex_unlock(&daemon->lock);
+		g_free(request);
+		return NULL;
+	}
+
+	return request;
+}
+
+// next output line of the request, NULL once it is finished
+static gchar *DaemonNextLine(tScriptDaemon *daemon, tDaemonRequest *request)
+{
+	gchar *line = NULL;
+
+	g_mutex_lock(&daemon->lock);
+
+	while (TRUE)
+	{
+		while ((line = g_queue_pop_head(&request->lines)) != NULL && line[0] == 'e')
+		{
+			g_mutex_unlock(&daemon->lock);
+			LogMessage(gPluginNr, MSGTYPE_IMPORTANTERROR, line + 1);
+			g_free(line);
+			g_mutex_lock(&daemon->lock);
+		}
+
+		if (line || request->done || !daemon->alive)
+			break;
+
+		g_cond_wait(&daemon->cond, &daemon->lock);
+	}
+
+	g_mutex_unlock(&daemon->lock);
+
+	if (line)
+		memmove(line, line + 1, strlen(line));
+
+	return line;
+}
+
+static gint DaemonFinish(tScriptDaemon *daemon, tDaemonRequest *request)
+{
+	gchar *line;
+
+	while ((line = DaemonNextLine(daemon, request)) != NULL)
+		g_free(line);
+
+	g_mutex_lock(&daemon->lock);
+	gint status = request->status;
+	g_mutex_unlock(&daemon->lock);
+
+	g_free(request);
+	DaemonUnref(daemon);
+
+	return status;
+}
+
+static tScriptDaemon *DaemonWanted(gchar *script_name, gchar *verb, gchar **envp)
+{
+	if (!g_key_file_get_boolean(g_cfg, script_name, DAEMON_OPT, NULL) ||
+	                g_strcmp0(verb, VERB_INIT) == 0 || g_strcmp0(verb, VERB_FIELDS) == 0)
+		return NULL;
+
+	return DaemonGet(script_name, envp);
+}
+
+static gboolean DaemonExecute(gchar *script_name, gchar *verb, char *arg1, char *arg2, gchar **envp, gchar **output, gint *status)
+{
+	gchar *line;
+	tScriptDaemon *daemon = DaemonWanted(script_name, verb, envp);
+
+	if (!daemon)
+		return FALSE;
+
+	tDaemonRequest *request = DaemonSubmit(daemon, verb, arg1, arg2);
+
+	// never reached the script, the per-process call is still safe to make
+	if (!request)
+	{
+		DaemonUnref(daemon);
+		return FALSE;
+	}
+
+	gboolean is_progress_neded = ProgressNeded(verb);
+	gboolean is_cancelled = FALSE;
+	GString *lines = g_string_new(NULL);
+
+	while ((line = DaemonNextLine(daemon, request)) != NULL)
+	{
+		g_string_append(lines, line);
+		g_string_append_c(lines, '\n');
+
+		if (g_noise)
+			LogMessage(gPluginNr, MSGTYPE_DETAILS, line);
+
+		if (is_progress_neded && !is_cancelled)
+		{
+			gint64 prcnt = g_ascii_strtoll(line, NULL, 0);
+
+			if (prcnt < 0 || prcnt > 100)
+				prcnt = 0;
+
+			if (gProgressProc(gPluginNr, arg1, arg2, (int)prcnt))
+			{
+				DaemonCancel(daemon, request);
+				is_cancelled = TRUE;
+			}
+		}
+
+		g_free(line);
+	}
+
+	*status = DaemonFinish(daemon, request);
+
+	if (output)
+		*output = g_string_free(lines, FALSE);
+	else
+		g_string_free(lines, TRUE);
+
+	return TRUE;
+}
+
+static gboolean VerbLogged(gchar *verb)
+{
+#ifdef  TEMP_PANEL
+	return g_noise;
+#else
+	return (g_noise || g_strcmp0(verb, VERB_FIELDS) != 0);
+#endif
+}
+
+static gchar **ScriptEnviron(gchar *script_name)
+{
+	gchar **envp = NULL;
+	gchar *env_data = g_key_file_get_string(g_cfg, script_name, ENVVAR_OPT, NULL);
+
+	if (env_data)
+	{
+		envp = g_environ_setenv(g_get_environ(), ENVVAR_NAME, env_data, TRUE);
+		g_free(env_data);
+	}
+
+	return envp;
+}
+
 static gboolean ExecuteScript(gchar *script_name, gchar *verb, char *arg1, char *arg2, gchar **output)
 {
-	gchar *argv[4];
+	gchar *argv[5];
 	gsize len, term;
 	gchar *line = NULL;
 	GPid pid;
@@ -270,25 +784,9 @@ static gboolean ExecuteScript(gchar *script_name, gchar *verb, char *arg1, char
 	argv[3] = arg2;
 	argv[4] = NULL;
 
-	gchar *env_data = g_key_file_get_string(g_cfg, script_name, ENVVAR_OPT, NULL);
-
-	if (env_data)
-	{
-		envp = g_environ_setenv(g_get_environ(), ENVVAR_NAME, env_data, TRUE);
-		g_free(env_data);
-	}
-
+	envp = ScriptEnviron(script_name);
 
-#ifdef  TEMP_PANEL
-
-	if (g_noise)
-#else
-	if (!g_noise && g_strcmp0(verb, VERB_FIELDS) == 0)
-	{
-
-	}
-	else
-#endif
+	if (VerbLogged(verb))
 	{
 		message = g_strdup_printf("%s %s %s %s", script, verb, arg1 ? arg1 : "", arg2 ? arg2 : "");
 		LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
@@ -296,7 +794,11 @@ static gboolean ExecuteScript(gchar *script_name, gchar *verb, char *arg1, char
 
 	}
 
-	result = g_spawn_async_with_pipes(g_scripts_dir, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, NULL, &stdout_fp, &stderr_fp, &err);
+	gboolean is_daemon = DaemonExecute(script_name, verb, arg1, arg2, envp, output, &status);
+
+	if (!is_daemon)
+		result = g_spawn_async_with_pipes(g_scripts_dir, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, NULL, &stdout_fp, &stderr_fp, &err);
+
 	g_free(script);
 	g_strfreev(envp);
 
@@ -306,7 +808,7 @@ static gboolean ExecuteScript(gchar *script_name, gchar *verb, char *arg1, char
 		g_clear_error(&err);
 	}
 
-	if (result)
+	if (result && !is_daemon)
 	{
 		GIOChannel *stdout_chan = g_io_channel_unix_new(stdout_fp);
 		GString *lines = g_string_new(NULL);
@@ -325,7 +827,7 @@ static gboolean ExecuteScript(gchar *script_name, gchar *verb, char *arg1, char
 				{
 					gint64 prcnt = g_ascii_strtoll(line, NULL, 0);
 
-					if (prcnt < 0 && prcnt > 100)
+					if (prcnt < 0 || prcnt > 100)
 						prcnt = 0;
 
 					if (gProgressProc(gPluginNr, arg1, arg2, (int)prcnt))
@@ -365,61 +867,243 @@ static gboolean ExecuteScript(gchar *script_name, gchar *verb, char *arg1, char
 		}
 
 
-		waitpid(pid, &status, 0);
-		g_spawn_close_pid(pid);
-		g_io_channel_shutdown(stdout_chan, TRUE, &err);
+		waitpid(pid, &status, 0);
+		g_spawn_close_pid(pid);
+		g_io_channel_shutdown(stdout_chan, TRUE, &err);
+
+		if (err)
+		{
+			LogMessage(gPluginNr, MSGTYPE_IMPORTANTERROR, (err)->message);
+			g_clear_error(&err);
+		}
+
+		g_io_channel_unref(stdout_chan);
+
+		g_io_channel_shutdown(stderr_chan, TRUE, &err);
+
+		if (err)
+		{
+			LogMessage(gPluginNr, MSGTYPE_IMPORTANTERROR, (err)->message);
+			g_clear_error(&err);
+		}
+
+		g_io_channel_unref(stderr_chan);
+		g_close(stdout_fp, NULL);
+		g_close(stderr_fp, NULL);
+
+		if (output)
+			*output = g_string_free(lines, FALSE);
+		else
+			g_string_free(lines, TRUE);
+	}
+
+	if (VerbLogged(verb))
+	{
+		message = g_strdup_printf("exit status %d", is_daemon ? status : WEXITSTATUS(status));
+		LogMessage(gPluginNr, MSGTYPE_OPERATIONCOMPLETE, message);
+		g_free(message);
+	}
+
+	g_free(command);
+
+	if (err)
+		g_error_free(err);
+
+	if (status != 0)
+		result = FALSE;
+
+	return result;
+}
+
+static void FreeDirValues(gpointer data)
+{
+	tDirValues *dirvalues = (tDirValues*)data;
+
+	if (dirvalues->entries)
+		g_hash_table_destroy(dirvalues->entries);
+
+	g_free(dirvalues);
+}
+
+// an entry whose script is still running stays, its owner drops it when the answer comes
+static gboolean ValuesDrop(tDirValues *dirvalues)
+{
+	if (!dirvalues->pending)
+		return TRUE;
+
+	dirvalues->stale = TRUE;
+
+	return FALSE;
+}
+
+static gboolean ValuesMatchScript(gpointer key, gpointer value, gpointer data)
+{
+	return (g_str_has_prefix((gchar*)key, (gchar*)data) && ValuesDrop((tDirValues*)value));
+}
+
+// drop the values of the directory, or of the whole script if dir is NULL
+static void ValuesForget(gchar *script, gchar *dir)
+{
+	g_mutex_lock(&g_values_lock);
+
+	if (g_values)
+	{
+		gchar *key = g_strdup_printf("%s:%s", script, dir ? dir : "");
+
+		if (dir)
+		{
+			tDirValues *dirvalues = g_hash_table_lookup(g_values, key);
+
+			if (dirvalues && ValuesDrop(dirvalues))
+				g_hash_table_remove(g_values, key);
+		}
+		else
+			g_hash_table_foreach_remove(g_values, ValuesMatchScript, key);
+
+		g_free(key);
+	}
+
+	g_mutex_unlock(&g_values_lock);
+}
+
+// entry lines start with the file name, the lines below it are "\tFIELD\tVALUE"
+static GHashTable *ParseValues(gchar *output)
+{
+	GHashTable *fields = NULL;
+	GHashTable *entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_destroy);
+	gchar **split = g_strsplit(output, "\n", -1);
+
+	for (gchar **p = split; *p != NULL; p++)
+	{
+		if (*p[0] == '\0')
+			continue;
+
+		if (*p[0] != '\t')
+		{
+			fields = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+			g_hash_table_replace(entries, g_strdup(*p), fields);
+		}
+		else if (fields)
+		{
+			gchar **value = g_strsplit(*p + 1, "\t", 2);
+
+			if (value[0] && value[1])
+				g_hash_table_replace(fields, g_strdup(value[0]), g_strdup(value[1]));
+
+			g_strfreev(value);
+		}
+	}
+
+	g_strfreev(split);
+
+	return entries;
+}
+
+// called with g_values_lock held, it is released while the script runs
+static tDirValues *GetDirValues(gchar *script, gchar *dir, gchar *key)
+{
+	gchar *output = NULL;
+	GHashTable *entries = NULL;
+	tDirValues *dirvalues;
+
+	// the directory is being asked for by another thread already, its answer is awaited
+	while ((dirvalues = g_hash_table_lookup(g_values, key)) != NULL && dirvalues->pending)
+		g_cond_wait(&g_values_cond, &g_values_lock);
 
-		if (err)
-		{
-			LogMessage(gPluginNr, MSGTYPE_IMPORTANTERROR, (err)->message);
-			g_clear_error(&err);
-		}
+	if (dirvalues)
+		return dirvalues;
 
-		g_io_channel_unref(stdout_chan);
+	if (g_hash_table_size(g_values) >= VALUES_MAX_DIRS)
+	{
+		GHashTableIter iter;
+		gpointer oldest_key = NULL, k, v;
+		gint64 oldest = G_MAXINT64;
 
-		g_io_channel_shutdown(stderr_chan, TRUE, &err);
+		g_hash_table_iter_init(&iter, g_values);
 
-		if (err)
+		while (g_hash_table_iter_next(&iter, &k, &v))
 		{
-			LogMessage(gPluginNr, MSGTYPE_IMPORTANTERROR, (err)->message);
-			g_clear_error(&err);
+			if (!((tDirValues*)v)->pending && ((tDirValues*)v)->used < oldest)
+			{
+				oldest = ((tDirValues*)v)->used;
+				oldest_key = k;
+			}
 		}
 
-		g_io_channel_unref(stderr_chan);
-		g_close(stdout_fp, NULL);
-		g_close(stderr_fp, NULL);
-
-		if (output)
-			*output = g_string_free(lines, FALSE);
-		else
-			g_string_free(lines, TRUE);
+		if (oldest_key)
+			g_hash_table_remove(g_values, oldest_key);
 	}
 
-#ifdef  TEMP_PANEL
+	dirvalues = g_new0(tDirValues, 1);
+	dirvalues->pending = TRUE;
+	g_hash_table_insert(g_values, g_strdup(key), dirvalues);
+	g_mutex_unlock(&g_values_lock);
 
-	if (g_noise)
-#else
-	if (!g_noise && g_strcmp0(verb, VERB_FIELDS) == 0)
-	{
+	if (ExecuteScript(script, VERB_GETVALUES, dir, NULL, &output))
+		entries = ParseValues(output ? output : "");
 
-	}
-	else
-#endif
+	g_free(output);
+	g_mutex_lock(&g_values_lock);
+	dirvalues->pending = FALSE;
+
+	if (dirvalues->stale)
 	{
-		message = g_strdup_printf("exit status %d", WEXITSTATUS(status));
-		LogMessage(gPluginNr, MSGTYPE_OPERATIONCOMPLETE, message);
-		g_free(message);
+		// forgotten while the script ran, the answer may be out of date
+		if (entries)
+			g_hash_table_destroy(entries);
+
+		g_hash_table_remove(g_values, key);
+		dirvalues = NULL;
 	}
+	else // a failed call is remembered too, the files are asked one by one then
+		dirvalues->entries = entries;
 
-	g_free(command);
+	g_cond_broadcast(&g_values_cond);
 
-	if (err)
-		g_error_free(err);
+	return dirvalues;
+}
 
-	if (status != 0)
-		result = FALSE;
+// FALSE if the script can't answer for the whole directory, result is the field type otherwise
+static gboolean GetCachedValue(gchar *script, gchar *path, gchar *field, void* FieldValue, int maxlen, int *result)
+{
+	if (!g_key_file_get_boolean(g_cfg, script, GETVALUES_OPT, NULL))
+		return FALSE;
 
-	return result;
+	gchar *dir = g_path_get_dirname(path);
+	gchar *name = g_path_get_basename(path);
+	gchar *key = g_strdup_printf("%s:%s", script, dir);
+
+	g_mutex_lock(&g_values_lock);
+
+	if (!g_values)
+		g_values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, FreeDirValues);
+
+	tDirValues *dirvalues = GetDirValues(script, dir, key);
+	gboolean is_cached = (dirvalues && dirvalues->entries != NULL);
+
+	if (dirvalues)
+		dirvalues->used = g_get_monotonic_time();
+
+	if (is_cached)
+	{
+		GHashTable *fields = g_hash_table_lookup(dirvalues->entries, name);
+		gchar *value = fields ? g_hash_table_lookup(fields, field) : NULL;
+
+		if (value)
+		{
+			g_strlcpy((char*)FieldValue, value, maxlen - 1);
+			*result = ft_string;
+		}
+		else
+			*result = ft_fieldempty;
+	}
+
+	g_mutex_unlock(&g_values_lock);
+	g_free(key);
+	g_free(name);
+	g_free(dir);
+
+	return is_cached;
 }
 
 static void LoadPreview(uintptr_t pDlg, gchar *file)
@@ -647,6 +1331,10 @@ static void ParseOpts(gchar *script, gchar *text)
 					g_key_file_set_boolean(g_cfg, script, STATUSINFO_OPT, TRUE);
 				else if (g_strcmp0(*p, CHECKFIELDS_OPT) == 0)
 					g_key_file_set_boolean(g_cfg, script, CHECKFIELDS_OPT, TRUE);
+				else if (g_strcmp0(*p, DAEMON_OPT) == 0)
+					g_key_file_set_boolean(g_cfg, script, DAEMON_OPT, TRUE);
+				else if (g_strcmp0(*p, GETVALUES_OPT) == 0)
+					g_key_file_set_boolean(g_cfg, script, GETVALUES_OPT, TRUE);
 				else if (ValidOpt(*p, ENVVAR_OPT))
 				{
 					g_key_file_set_string(g_cfg, script, ENVVAR_OPT, *p + strlen(ENVVAR_OPT) + 1);
@@ -760,8 +1448,12 @@ static void DeInitializeScript(gchar *script)
 		if (!ExecuteScript(script, VERB_DEINIT, NULL, NULL, NULL) && g_noise)
 			LogMessage(gPluginNr, MSGTYPE_DETAILS, "Deinitialization not implemented or not completed successfully");
 
+		DaemonStop(script);
 		g_key_file_remove_key(g_cfg, script, IN_USE_MARK, NULL);
 		g_key_file_remove_key(g_cfg, script, ENVVAR_OPT, NULL);
+		g_key_file_remove_key(g_cfg, script, DAEMON_OPT, NULL);
+		g_key_file_remove_key(g_cfg, script, GETVALUES_OPT, NULL);
+		ValuesForget(script, NULL);
 #ifndef  TEMP_PANEL
 		gchar *message = g_strdup_printf("DISCONNECT \\%s", script);
 
@@ -1039,199 +1731,391 @@ static gboolean SetScriptsFindData(tVFSDirData *dirdata, WIN32_FIND_DATAA *FindD
 	return FALSE;
 }
 
-static gboolean SetFindData(tVFSDirData * dirdata, WIN32_FIND_DATAA * FindData)
+static mode_t ParseListMode(const char *string)
 {
-	gchar *message = NULL, *string = NULL;
-	memset(FindData, 0, sizeof(WIN32_FIND_DATAA));
+	int i = 1;
+	mode_t mode = S_IFREG;
+
+	if (string[0] != '-')
+	{
+		if (string[0] == 'd')
+			mode = S_IFDIR;
+		else if (string[0] == 'b')
+			mode = S_IFBLK;
+		else if (string[0] == 'c')
+			mode = S_IFCHR;
+		else if (string[0] == 'f')
+			mode = S_IFIFO;
+		else if (string[0] == 'l')
+			mode = S_IFLNK;
+		else if (string[0] == 's')
+			mode = S_IFSOCK;
+	}
+
+	if (string[i++] == 'r')
+		mode |= S_IRUSR;
+
+	if (string[i++] == 'w')
+		mode |= S_IWUSR;
+
+	if (string[i] == 'x')
+		mode |= S_IXUSR;
+	else if (string[i] == 'S')
+		mode |= S_ISUID;
+	else if (string[i] == 's')
+		mode |= S_ISUID | S_IXUSR;
+
+	i++;
+
+	if (string[i++] == 'r')
+		mode |= S_IRGRP;
+
+	if (string[i++] == 'w')
+		mode |= S_IWGRP;
+
+	if (string[i] == 'x')
+		mode |= S_IXGRP;
+	else if (string[i] == 'S')
+		mode |= S_ISGID;
+	else if (string[i] == 's')
+		mode |= S_ISGID | S_IXGRP;
+
+	i++;
+
+	if (string[i++] == 'r')
+		mode |= S_IROTH;
+
+	if (string[i++] == 'w')
+		mode |= S_IWOTH;
+
+	if (string[i] == 'x')
+		mode |= S_IXOTH;
+	else if (string[i] == 'T')
+		mode |= S_ISVTX;
+	else if (string[i] == 't')
+		mode |= S_ISVTX | S_IXOTH;
+
+	return mode;
+}
+
+static const char *ParseListDigits(const char *p, int count, int *value)
+{
+	*value = 0;
 
-	while (g_match_info_matches(dirdata->match_info))
+	for (int i = 0; i < count; i++, p++)
 	{
-		string = g_match_info_fetch(dirdata->match_info, 0);
+		if (!g_ascii_isdigit(*p))
+			return NULL;
 
-		if (g_noise)
-		{
-			message = g_strdup_printf("Found: %s", string);
-			LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
-			g_free(message);
-		}
+		*value = *value * 10 + (*p - '0');
+	}
+
+	return p;
+}
 
-		g_free(string);
+// YYYY-MM-DDThh:mm:ssZ, dashes and colons are optional, so are seconds, without Z it is local time
+static const char *ParseListDate(const char *p, gint64 *filetime)
+{
+	struct tm tm = {0};
+	int year, month, day, hour, min, sec = 0, digit;
+	gboolean is_utc = FALSE;
 
-		string = g_match_info_fetch(dirdata->match_info, 1);
+	if ((p = ParseListDigits(p, 4, &year)) == NULL)
+		return NULL;
 
-		if (g_noise)
-		{
-			message = g_strdup_printf("mode: %s", string);
-			LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
-			g_free(message);
-		}
+	if (*p == '-')
+		p++;
 
-		int i = 1;
-		mode_t mode = S_IFREG;
-		FindData->dwFileAttributes = FILE_ATTRIBUTE_UNIX_MODE;
+	if ((p = ParseListDigits(p, 2, &month)) == NULL)
+		return NULL;
 
-		if (string[0] != '-')
-		{
-			if (string[0] == 'd')
-				mode = S_IFDIR;
-			else if (string[0] == 'b')
-				mode = S_IFBLK;
-			else if (string[0] == 'c')
-				mode = S_IFCHR;
-			else if (string[0] == 'f')
-				mode = S_IFIFO;
-			else if (string[0] == 'l')
-				mode = S_IFLNK;
-			else if (string[0] == 's')
-				mode = S_IFSOCK;
-		}
+	if (*p == '-')
+		p++;
+
+	if ((p = ParseListDigits(p, 2, &day)) == NULL)
+		return NULL;
 
-		if (string[i++] == 'r')
-			mode |= S_IRUSR;
+	if (!g_ascii_isspace(*p) && *p != 'T' && *p != 't')
+		return NULL;
 
-		if (string[i++] == 'w')
-			mode |= S_IWUSR;
+	if ((p = ParseListDigits(p + 1, 2, &hour)) == NULL)
+		return NULL;
 
-		if (string[i] == 'x')
-			mode |= S_IXUSR;
-		else if (string[i] == 'S')
-			mode |= S_ISUID;
-		else if (string[i] == 's')
-			mode |= S_ISUID | S_IXUSR;
+	if (*p == ':')
+		p++;
 
-		i++;
+	if ((p = ParseListDigits(p, 2, &min)) == NULL)
+		return NULL;
 
-		if (string[i++] == 'r')
-			mode |= S_IRGRP;
+	if (*p == ':')
+		p++;
 
-		if (string[i++] == 'w')
-			mode |= S_IWGRP;
+	for (int i = 0; i < 2 && g_ascii_isdigit(*p); i++)
+	{
+		ParseListDigits(p++, 1, &digit);
+		sec = sec * 10 + digit;
+	}
+
+	if (*p == 'Z')
+	{
+		is_utc = TRUE;
+		p++;
+	}
+
+	*filetime = 0;
+
+	if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+		return p;
+
+	tm.tm_year = year - 1900;
+	tm.tm_mon = month - 1;
+	tm.tm_mday = day;
+	tm.tm_hour = hour;
+	tm.tm_min = min;
+	tm.tm_sec = sec;
+	tm.tm_isdst = -1;
+
+	*filetime = (gint64)(is_utc ? timegm(&tm) : mktime(&tm));
+
+	return p;
+}
+
+// "MODE DATE SIZE NAME" starting at p, FindData is only touched if the whole line fits
+static gboolean ParseListEntry(const char *p, WIN32_FIND_DATAA *FindData)
+{
+	const char *mode = p;
+	gint64 filetime = 0, filesize = 0;
+
+	for (int i = 0; i < 10; i++, p++)
+		if (*p == '\0' || !strchr(LIST_MODE_CHARS, *p))
+			return FALSE;
+
+	if (!g_ascii_isspace(*p))
+		return FALSE;
+
+	while (g_ascii_isspace(*p))
+		p++;
+
+	if ((p = ParseListDate(p, &filetime)) == NULL || !g_ascii_isspace(*p))
+		return FALSE;
 
-		if (string[i] == 'x')
-			mode |= S_IXGRP;
-		else if (string[i] == 'S')
-			mode |= S_ISGID;
-		else if (string[i] == 's')
-			mode |= S_ISGID | S_IXGRP;
+	while (g_ascii_isspace(*p))
+		p++;
 
-		i++;
+	if (!g_ascii_isdigit(*p) && *p != '-')
+		return FALSE;
 
-		if (string[i++] == 'r')
-			mode |= S_IROTH;
+	for (; g_ascii_isdigit(*p) || *p == '-'; p++)
+		if (g_ascii_isdigit(*p))
+			filesize = filesize * 10 + (*p - '0');
 
-		if (string[i++] == 'w')
-			mode |= S_IWOTH;
+	if (!g_ascii_isspace(*p))
+		return FALSE;
 
-		if (string[i] == 'x')
-			mode |= S_IXOTH;
-		else if (string[i] == 'T')
-			mode |= S_ISVTX;
-		else if (string[i] == 't')
-			mode |= S_ISVTX | S_IXOTH;
+	while (g_ascii_isspace(*p))
+		p++;
 
-		FindData->dwReserved0 = mode;
-		g_free(string);
+	if (*p == '\0')
+		return FALSE;
 
-		string = g_match_info_fetch(dirdata->match_info, 2);
+	memset(FindData, 0, sizeof(WIN32_FIND_DATAA));
+	FindData->dwFileAttributes = FILE_ATTRIBUTE_UNIX_MODE;
+	FindData->dwReserved0 = ParseListMode(mode);
+	FindData->ftCreationTime.dwHighDateTime = 0xFFFFFFFF;
+	FindData->ftCreationTime.dwLowDateTime = 0xFFFFFFFE;
+	FindData->ftLastAccessTime.dwHighDateTime = 0xFFFFFFFF;
+	FindData->ftLastAccessTime.dwLowDateTime = 0xFFFFFFFE;
+
+	if (filetime > 0)
+		UnixTimeToFileTime((time_t)filetime, &FindData->ftLastWriteTime);
+	else
+	{
+		SetCurrentFileTime(&FindData->ftLastWriteTime);
 
 		if (g_noise)
-		{
-			message = g_strdup_printf("date: %s", string);
-			LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
-			g_free(message);
-		}
+			LogMessage(gPluginNr, MSGTYPE_DETAILS, "The current datetime has been set");
+	}
 
-		gint64 filetime = 0;
-		GDateTime *dt = g_date_time_new_from_iso8601(string, NULL);
+	FindData->nFileSizeHigh = (filesize & 0xFFFFFFFF00000000) >> 32;
+	FindData->nFileSizeLow = filesize & 0x00000000FFFFFFFF;
+	g_strlcpy(FindData->cFileName, p, sizeof(FindData->cFileName));
+
+	return TRUE;
+}
 
-		if (dt)
+static gboolean ParseListLine(const char *line, WIN32_FIND_DATAA *FindData)
+{
+	// like the old regex, the entry doesn't have to start the line
+	for (const char *p = line; *p != '\0'; p++)
+	{
+		if (ParseListEntry(p, FindData))
 		{
-			filetime = g_date_time_to_unix(dt);
-			g_date_time_unref(dt);
+			if (g_noise)
+			{
+				gchar *message = g_strdup_printf("Found: %s", p);
+				LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
+				g_free(message);
+			}
+
+			return TRUE;
 		}
-		else if (g_noise)
+	}
+
+	return FALSE;
+}
+
+static gboolean ListStart(tVFSDirData *dirdata, gchar *script_name, char *path)
+{
+	GError *err = NULL;
+	gboolean result = TRUE;
+	gchar **envp = ScriptEnviron(script_name);
+	gchar *script = g_strdup_printf("./%s", script_name);
+	gchar *argv[] = { script, VERB_LIST, path, NULL };
+
+	if (VerbLogged(VERB_LIST))
+	{
+		gchar *message = g_strdup_printf("%s %s %s ", script, VERB_LIST, path);
+		LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
+		g_free(message);
+	}
+
+	g_strlcpy(dirdata->script, script_name, PATH_MAX);
+	dirdata->daemon = DaemonWanted(script_name, VERB_LIST, envp);
+
+	if (dirdata->daemon && (dirdata->request = DaemonSubmit(dirdata->daemon, VERB_LIST, path, NULL)) == NULL)
+	{
+		DaemonUnref(dirdata->daemon);
+		dirdata->daemon = NULL;
+	}
+
+	if (!dirdata->daemon)
+	{
+		gint stdout_fd;
+		result = g_spawn_async_with_pipes(g_scripts_dir, argv, envp, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &dirdata->pid, NULL, &stdout_fd, &dirdata->stderr_fd, &err);
+
+		if (err)
 		{
-			message = g_strdup_printf("\"%s\" is not a valid ISO 8601 UTC formatted string", string);
-			LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
-			g_free(message);
+			LogMessage(gPluginNr, MSGTYPE_IMPORTANTERROR, (err)->message);
+			g_clear_error(&err);
 		}
 
-		if (filetime == 0)
-		{
-			struct tm tm = {0};
+		if (result)
+			dirdata->stdout_fp = fdopen(stdout_fd, "r");
+	}
 
-			gchar *formats[] =
-			{
-				"%Y-%m-%d %R",
-				"%Y-%m-%dT%R",
-				"%Y-%m-%dt%R",
-				"%Y%m%d %R",
-				NULL
-			};
-
-			for (char **p = formats; *p != NULL; p++)
-			{
-				if (strptime(string, *p, &tm))
-				{
-					filetime = (gint64)mktime(&tm);
+	g_free(script);
+	g_strfreev(envp);
 
-					if (g_noise)
-					{
-						message = g_strdup_printf("Used %s to parse the date", *p);
-						LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
-						g_free(message);
-					}
+	return result;
+}
 
-					break;
-				}
-			}
-		}
+// next line of the script output as it arrives, NULL at the end
+static char *ListNextLine(tVFSDirData *dirdata)
+{
+	char *line = NULL;
 
-		FindData->ftCreationTime.dwHighDateTime = 0xFFFFFFFF;
-		FindData->ftCreationTime.dwLowDateTime = 0xFFFFFFFE;
-		FindData->ftLastAccessTime.dwHighDateTime = 0xFFFFFFFF;
-		FindData->ftLastAccessTime.dwLowDateTime = 0xFFFFFFFE;
+	if (dirdata->is_eof)
+		return NULL;
 
-		if (filetime > 0)
-			UnixTimeToFileTime((time_t)filetime, &FindData->ftLastWriteTime);
-		else
+	if (dirdata->daemon)
+	{
+		g_free(dirdata->daemon_line);
+		line = dirdata->daemon_line = DaemonNextLine(dirdata->daemon, dirdata->request);
+	}
+	else if (dirdata->stdout_fp)
+	{
+		ssize_t read = getline(&dirdata->line, &dirdata->line_size, dirdata->stdout_fp);
+
+		if (read != -1)
 		{
-			SetCurrentFileTime(&FindData->ftLastWriteTime);
+			line = dirdata->line;
 
-			if (g_noise)
-				LogMessage(gPluginNr, MSGTYPE_DETAILS, "The current datetime has been set");
+			while (read > 0 && (line[read - 1] == '\n' || line[read - 1] == '\r'))
+				line[--read] = '\0';
 		}
+	}
 
-		g_free(string);
+	if (!line)
+		dirdata->is_eof = TRUE;
+	else if (g_noise)
+		LogMessage(gPluginNr, MSGTYPE_DETAILS, line);
 
-		string = g_match_info_fetch(dirdata->match_info, 3);
+	return line;
+}
 
-		if (g_noise)
-		{
-			message = g_strdup_printf("size: %s", string);
-			LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
-			g_free(message);
-		}
+// stops the script if the listing was abandoned, returns its exit status
+static gint ListFinish(tVFSDirData *dirdata)
+{
+	gint status = 0;
 
-		gdouble filesize = g_ascii_strtod(string, NULL);
-		FindData->nFileSizeHigh = ((int64_t)filesize & 0xFFFFFFFF00000000) >> 32;
-		FindData->nFileSizeLow = (int64_t)filesize & 0x00000000FFFFFFFF;
-		g_free(string);
+	if (dirdata->daemon)
+	{
+		if (!dirdata->is_eof)
+			DaemonCancel(dirdata->daemon, dirdata->request);
 
-		string = g_match_info_fetch(dirdata->match_info, 4);
+		status = DaemonFinish(dirdata->daemon, dirdata->request);
+		dirdata->daemon = NULL;
+		dirdata->request = NULL;
+	}
+	else if (dirdata->stdout_fp)
+	{
+		char *line = NULL;
+		size_t len = 0;
+		ssize_t read;
 
-		if (g_noise)
+		if (!dirdata->is_eof)
+			kill(dirdata->pid, SIGTERM);
+
+		fclose(dirdata->stdout_fp);
+		dirdata->stdout_fp = NULL;
+
+		FILE *stderr_fp = fdopen(dirdata->stderr_fd, "r");
+
+		while (stderr_fp && (read = getline(&line, &len, stderr_fp)) != -1)
 		{
-			message = g_strdup_printf("name: %s", string);
-			LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
-			g_free(message);
+			if (read > 0 && line[read - 1] == '\n')
+				line[read - 1] = '\0';
+
+			LogMessage(gPluginNr, MSGTYPE_IMPORTANTERROR, line);
 		}
 
-		g_strlcpy(FindData->cFileName, string, sizeof(FindData->cFileName));
-		g_free(string);
+		free(line);
 
-		g_match_info_next(dirdata->match_info, NULL);
-		return TRUE;
+		if (stderr_fp)
+			fclose(stderr_fp);
+		else
+			close(dirdata->stderr_fd);
+
+		waitpid(dirdata->pid, &status, 0);
+		g_spawn_close_pid(dirdata->pid);
+		status = WEXITSTATUS(status);
+	}
+	else
+		return -1;
+
+	if (VerbLogged(VERB_LIST))
+	{
+		gchar *message = g_strdup_printf("exit status %d", status);
+		LogMessage(gPluginNr, MSGTYPE_OPERATIONCOMPLETE, message);
+		g_free(message);
+	}
+
+	free(dirdata->line);
+	dirdata->line = NULL;
+	g_free(dirdata->daemon_line);
+	dirdata->daemon_line = NULL;
+
+	return status;
+}
+
+static gboolean SetFindData(tVFSDirData * dirdata, WIN32_FIND_DATAA * FindData)
+{
+	char *line;
+
+	while ((line = ListNextLine(dirdata)) != NULL)
+	{
+		if (ParseListLine(line, FindData))
+			return TRUE;
 	}
 
 	return FALSE;
@@ -1279,7 +2163,6 @@ HANDLE DCPCALL FsFindFirst(char* Path, WIN32_FIND_DATAA * FindData)
 		if (!g_key_file_get_boolean(g_cfg, g_script, IN_USE_MARK, NULL))
 			return (HANDLE)(-1);
 
-		gchar *output = NULL;
 		gchar *script = ExtractScriptFromPath(Path);
 		gchar *list_path = StripScriptFromPath(Path);
 		size_t len = strlen(list_path);
@@ -1287,48 +2170,31 @@ HANDLE DCPCALL FsFindFirst(char* Path, WIN32_FIND_DATAA * FindData)
 		if (len > 1 && list_path[len - 1] == '/')
 			list_path[len - 1] = '\0';
 
-		if (!ExecuteScript(script, VERB_LIST, list_path, NULL, &output))
+		ValuesForget(script, list_path);
+
+		dirdata = g_new0(tVFSDirData, 1);
+
+		// entries are handed to DC as soon as the script prints them
+		if (!ListStart(dirdata, script, list_path))
 		{
 			g_free(list_path);
 			g_free(script);
-			g_free(output);
+			g_free(dirdata);
 			return (HANDLE)(-1);
 		}
 
 		g_free(list_path);
 		g_free(script);
 
-		dirdata = g_new0(tVFSDirData, 1);
-
-		if (!dirdata)
-		{
-			g_free(output);
-			return (HANDLE)(-1);
-		}
-
-		dirdata->regex = g_regex_new(LIST_REGEXP, G_REGEX_MULTILINE, G_REGEX_MATCH_NEWLINE_ANY, NULL);
-
-		if (!g_regex_match(dirdata->regex, output, 0, &(dirdata->match_info)))
+		if (!SetFindData(dirdata, FindData))
 		{
-			if (g_noise)
+			if (ListFinish(dirdata) == 0 && g_noise)
 			{
 				gchar *message = g_strdup_printf("%s: no file list received", Path);
 				LogMessage(gPluginNr, MSGTYPE_DETAILS, message);
 				g_free(message);
 			}
 
-			g_regex_unref(dirdata->regex);
-			g_free(output);
-			return (HANDLE)(-1);
-		}
-
-		dirdata->output = output;
-
-		if (!SetFindData(dirdata, FindData))
-		{
-			g_match_info_free(dirdata->match_info);
-			g_regex_unref(dirdata->regex);
-			g_free(output);
 			g_free(dirdata);
 			return (HANDLE)(-1);
 		}
@@ -1354,13 +2220,9 @@ int DCPCALL FsFindClose(HANDLE Hdl)
 	if (dirdata->dir)
 		closedir(dirdata->dir);
 
-	if (dirdata->match_info)
-		g_match_info_free(dirdata->match_info);
-
-	if (dirdata->regex)
-		g_regex_unref(dirdata->regex);
+	if (dirdata->daemon || dirdata->stdout_fp)
+		ListFinish(dirdata);
 
-	g_free(dirdata->output);
 	g_free(dirdata);
 
 	return 0;
@@ -1774,6 +2636,13 @@ int DCPCALL FsContentGetValue(char* FileName, int FieldIndex, int UnitIndex, voi
 	gchar *script = ExtractScriptFromPath(FileName);
 	gchar *path = StripScriptFromPath(FileName);
 
+	if (GetCachedValue(script, path, g_fields[FieldIndex], FieldValue, maxlen, &result))
+	{
+		g_free(script);
+		g_free(path);
+		return result;
+	}
+
 	ExecuteScript(script, VERB_GETVALUE, g_fields[FieldIndex], path, &output);
 
 	if (output)
@@ -1987,6 +2856,9 @@ void DCPCALL FsSetDefaultParams(FsDefaultParamStruct* dps)
 		{
 			if (g_key_file_get_boolean(g_cfg, *script, IN_USE_MARK, NULL))
 				g_key_file_set_boolean(g_cfg, *script, IN_USE_MARK, FALSE);
+
+			g_key_file_remove_key(g_cfg, *script, DAEMON_OPT, NULL);
+			g_key_file_remove_key(g_cfg, *script, GETVALUES_OPT, NULL);
 		}
 	}
 }
@@ -2017,6 +2889,16 @@ void DCPCALL ExtensionFinalize(void* Reserved)
 
 	g_strfreev(groups);
 
+	if (g_daemons != NULL)
+		g_hash_table_destroy(g_daemons);
+
+	g_daemons = NULL;
+
+	if (g_values != NULL)
+		g_hash_table_destroy(g_values);
+
+	g_values = NULL;
+
 	g_key_file_save_to_file(g_cfg, g_history_file, NULL);
 
 	g_strfreev(g_fields);
@@ -0,0 +1,176 @@
+#ifndef _CSVPARSE_H
+#define _CSVPARSE_H
+
+// Byte-level CSV (RFC 4180) tokenizer shared by the csvview plugins, one pass and no copies:
+// a field points into the input, only a quoted field with "" in it has to go through
+// csv_field_unescape(). Separators and newlines inside quotes are data. A quote opens a quoted
+// field only at the start of the field, anywhere else it is an ordinary character.
+// Plain fields are found with memchr() (vectorised in glibc), the next separator and newline
+// are kept until the scan passes them, so each of them is searched for once. The separator is
+// only looked for up to the end of the line, a missing one does not read through the whole input.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+enum
+{
+	CSV_END,
+	CSV_FIELD,
+	CSV_LAST
+};
+
+typedef struct
+{
+	const char *data;
+	size_t len;
+	bool escaped;
+} tCsvField;
+
+typedef struct
+{
+	const char *pos;
+	const char *end;
+	char separator;
+	bool quoted;
+	bool in_row;
+	const char *next_separator;
+	const char *next_newline;
+} tCsvReader;
+
+static void csv_reader_init(tCsvReader *reader, const char *data, size_t size, char separator, bool quoted)
+{
+	memset(reader, 0, sizeof(tCsvReader));
+	reader->pos = data;
+	reader->end = data + size;
+	reader->separator = separator;
+	reader->quoted = quoted;
+}
+
+// looks for c in [from, limit), limit when there is none
+static const char *csv_find(const char *from, const char *limit, char c, const char **cached)
+{
+	if (!*cached || *cached < from)
+	{
+		*cached = (const char*)memchr(from, c, limit - from);
+
+		if (!*cached)
+			*cached = limit;
+	}
+
+	return *cached;
+}
+
+// CSV_FIELD if more fields follow in the row, CSV_LAST for the last one, CSV_END when the input is over
+static int csv_next_field(tCsvReader *reader, tCsvField *field)
+{
+	const char *p = reader->pos;
+	bool quoted = false;
+
+	if (!reader->in_row && p >= reader->end)
+		return CSV_END;
+
+	reader->in_row = true;
+	field->escaped = false;
+
+	if (reader->quoted && p < reader->end && *p == '"')
+	{
+		quoted = true;
+		field->data = ++p;
+		field->len = reader->end - p;
+
+		for (;;)
+		{
+			const char *quote = (const char*)memchr(p, '"', reader->end - p);
+
+			if (!quote)
+			{
+				p = reader->end;
+				break;
+			}
+
+			if (quote + 1 < reader->end && quote[1] == '"')
+			{
+				field->escaped = true;
+				p = quote + 2;
+			}
+			else
+			{
+				field->len = quote - field->data;
+				p = quote + 1;
+				break;
+			}
+		}
+	}
+	else
+		field->data = p;
+
+	// anything between the closing quote and the separator is dropped
+	const char *newline = csv_find(p, reader->end, '\n', &reader->next_newline);
+	const char *separator = csv_find(p, newline, reader->separator, &reader->next_separator);
+
+	if (separator < newline)
+	{
+		if (!quoted)
+			field->len = separator - p;
+
+		reader->pos = separator + 1;
+
+		return CSV_FIELD;
+	}
+
+	if (!quoted)
+	{
+		field->len = newline - p;
+
+		if (field->len > 0 && p[field->len - 1] == '\r')
+			field->len--;
+	}
+
+	reader->pos = (newline < reader->end) ? newline + 1 : reader->end;
+	reader->in_row = false;
+
+	return CSV_LAST;
+}
+
+// skips the rest of the row, returns where the next one starts
+static const char *csv_skip_row(tCsvReader *reader, int *fields)
+{
+	int result, count = 0;
+	tCsvField field;
+
+	while ((result = csv_next_field(reader, &field)) == CSV_FIELD)
+		count++;
+
+	if (result == CSV_LAST)
+		count++;
+
+	if (fields)
+		*fields = count;
+
+	return reader->pos;
+}
+
+// out must have room for field->len bytes, returns the length without "" escapes
+static size_t csv_field_unescape(const tCsvField *field, char *out)
+{
+	size_t len = 0;
+
+	if (!field->escaped)
+	{
+		memcpy(out, field->data, field->len);
+		return field->len;
+	}
+
+	for (size_t i = 0; i < field->len; i++)
+	{
+		out[len++] = field->data[i];
+
+		if (field->data[i] == '"' && i + 1 < field->len && field->data[i + 1] == '"')
+			i++;
+	}
+
+	return len;
+}
+
+#endif
@@ -4,248 +4,721 @@
 #include <limits.h>
 #include <string.h>
 #include "wlxplugin.h"
+#include "csvparse.h"
+
+#define ENCA_SAMPLE 65536
+#define CHUNK_ROWS 1024
+#define IDLE_ROWS 5000
 
 static char g_lang[3];
 gboolean g_enca = TRUE;
 gboolean g_quoted = TRUE;
 gboolean g_grid = FALSE;
 
-static gboolean quotes_not_closed(gchar *string)
+// The file is mapped and only the row offsets are kept, a worker thread finds them and the rows
+// are handed to the view from an idle callback. Cells are parsed when the view asks for them.
+
+#define CSV_TYPE_MODEL (csv_model_get_type())
+#define CSV_MODEL(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), CSV_TYPE_MODEL, CsvModel))
+
+typedef struct _CsvModel
 {
-	gint count = 0;
+	GObject parent;
+	gint stamp;
+	GMappedFile *file;
+	gchar *buffer;
+	const gchar *data;
+	gsize size;
+	gsize body;
+	gchar separator;
+	gboolean quoted;
+	gchar *charset;
+	gint columns;
+	GArray *rows;
+	guint count;
+	guint *order;
+	gint sort_column;
+	GtkSortType sort_order;
+	guint cache_row;
+	gchar **cache;
+	GThread *thread;
+	GMutex mutex;
+	GArray *pending;
+	guint pending_pos;
+	guint idle_id;
+	gint stop;
+	gboolean loaded;
+	gboolean done;
+} CsvModel;
+
+typedef struct _CsvModelClass
+{
+	GObjectClass parent_class;
+} CsvModelClass;
 
-	while (*string)
-		if (*string++ == '"')
-			count++;
+typedef struct
+{
+	gchar *key;
+	guint pos;
+} tSortKey;
 
-	if (count % 2 == 0)
-		return FALSE;
+static void csv_model_tree_model_init(GtkTreeModelIface *iface);
+static void csv_model_sortable_init(GtkTreeSortableIface *iface);
 
-	return TRUE;
+G_DEFINE_TYPE_WITH_CODE(CsvModel, csv_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL, csv_model_tree_model_init)
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_SORTABLE, csv_model_sortable_init))
+
+static gchar *field_dup(tCsvField *field)
+{
+	gchar *result = g_malloc(field->len + 1);
+	result[csv_field_unescape(field, result)] = '\0';
+
+	return result;
 }
 
-static gchar *unqoute(gchar *string)
+static gchar *field_text(CsvModel *model, tCsvField *field)
 {
-	gchar *target = NULL;
+	gchar *result = NULL;
+	gchar *text = field_dup(field);
 
-	if (string[0] == '"' && string[strlen(string) - 1] == '"')
-		target = g_strndup(string + 1, strlen(string) - 2);
-	else
-		target = g_strdup(string);
+	if (model->charset)
+		result = g_convert_with_fallback(text, -1, "UTF-8", model->charset, NULL, NULL, NULL, NULL);
 
-	gchar **split = g_strsplit(target, "\"\"", -1);
-	gchar *result = g_strjoinv("\"", split);
+	if (!result && !g_utf8_validate(text, -1, NULL))
+		result = g_utf8_make_valid(text, -1);
 
-	g_free(target);
-	g_strfreev(split);
+	if (!result)
+		return text;
+
+	g_free(text);
 
 	return result;
 }
 
-static gchar *get_value(gchar ***p, gchar *separator)
+static void csv_model_clear_cache(CsvModel *model)
 {
-	gchar *result = NULL;
-	gchar **itm = *p;
+	if (!model->cache)
+		return;
 
-	if (g_quoted && separator[0] != '\t' && *itm[0] == '"' && quotes_not_closed(*itm))
+	for (gint i = 0; i <= model->columns; i++)
+		g_free(model->cache[i]);
+
+	g_free(model->cache);
+	model->cache = NULL;
+}
+
+static guint csv_model_row(CsvModel *model, guint pos)
+{
+	return model->order ? model->order[pos] : pos;
+}
+
+// extra fields go to the last column
+static gchar **csv_model_parse_row(CsvModel *model, guint row)
+{
+	tCsvReader reader;
+	tCsvField field;
+	GString *trash = NULL;
+	gint i = 0;
+	int result;
+
+	if (model->cache && model->cache_row == row)
+		return model->cache;
+
+	csv_model_clear_cache(model);
+	model->cache = g_new0(gchar*, model->columns + 1);
+	model->cache_row = row;
+
+	gsize start = g_array_index(model->rows, gsize, row);
+	gsize end = (row + 1 < model->rows->len) ? g_array_index(model->rows, gsize, row + 1) : model->size;
+
+	csv_reader_init(&reader, model->data + start, end - start, model->separator, model->quoted);
+
+	while ((result = csv_next_field(&reader, &field)) != CSV_END)
 	{
-		gchar **nitm = itm + 1;
-		gchar *cat = g_strdup(*itm);
+		gchar *value = field_text(model, &field);
 
-		while (*nitm != NULL)
+		if (i < model->columns)
+			model->cache[i++] = value;
+		else
 		{
-			gchar *tmp = g_strdup(cat);
-			cat = g_strjoin(separator, tmp, *nitm, NULL);
-			g_free(tmp);
-
-			if (cat && cat[strlen(cat) - 1] == '"' && !quotes_not_closed(cat))
-			{
-				result = unqoute(cat);
-				*p = nitm;
-				break;
-			}
+			if (!trash)
+				trash = g_string_new(NULL);
 
-			nitm++;
+			trash = g_string_append(trash, ", ");
+			trash = g_string_append(trash, value);
+			g_free(value);
 		}
 
-		g_free(cat);
+		if (result == CSV_LAST)
+			break;
+	}
 
-		if (*p != nitm)
-			result = g_strdup(*itm);
+	if (trash)
+		model->cache[model->columns] = g_string_free(trash, FALSE);
 
+	return model->cache;
+}
+
+static gchar *csv_model_sort_key(CsvModel *model, guint row)
+{
+	tCsvReader reader;
+	tCsvField field;
+	gchar *value, *result = NULL;
+	gint i = 0;
+	int state;
+
+	if (model->sort_column >= model->columns)
+	{
+		value = csv_model_parse_row(model, row)[model->sort_column];
+		return g_utf8_collate_key(value ? value : "", -1);
+	}
+
+	gsize start = g_array_index(model->rows, gsize, row);
+	csv_reader_init(&reader, model->data + start, model->size - start, model->separator, model->quoted);
+
+	while ((state = csv_next_field(&reader, &field)) != CSV_END)
+	{
+		if (i++ == model->sort_column)
+		{
+			value = field_text(model, &field);
+			result = g_utf8_collate_key(value, -1);
+			g_free(value);
+			break;
+		}
+
+		if (state == CSV_LAST)
+			break;
 	}
-	else if (g_quoted && separator[0] != '\t')
+
+	return result ? result : g_utf8_collate_key("", -1);
+}
+
+static gint compare_keys(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const tSortKey *ka = a;
+	const tSortKey *kb = b;
+	gint result = strcmp(ka->key, kb->key);
+
+	if (result == 0)
+		return (ka->pos > kb->pos) - (ka->pos < kb->pos);
+
+	return (GPOINTER_TO_INT(user_data) == GTK_SORT_DESCENDING) ? -result : result;
+}
+
+static void csv_model_sort(CsvModel *model)
+{
+	GtkTreePath *path;
+	gint *new_order;
+	guint *order;
+
+	if (model->count == 0)
+		return;
+
+	new_order = g_new(gint, model->count);
+	order = g_new(guint, model->count);
+
+	if (model->sort_column < 0)
 	{
-		result = unqoute(*itm);
+		// back to the file order
+		for (guint i = 0; i < model->count; i++)
+			new_order[csv_model_row(model, i)] = i;
+
+		for (guint i = 0; i < model->count; i++)
+			order[i] = i;
 	}
 	else
-		result = strdup(*itm);
+	{
+		tSortKey *keys = g_new(tSortKey, model->count);
 
-	return result;
+		for (guint i = 0; i < model->count; i++)
+		{
+			keys[i].key = csv_model_sort_key(model, csv_model_row(model, i));
+			keys[i].pos = i;
+		}
+
+		g_qsort_with_data(keys, model->count, sizeof(tSortKey), compare_keys, GINT_TO_POINTER(model->sort_order));
+
+		for (guint i = 0; i < model->count; i++)
+		{
+			new_order[i] = keys[i].pos;
+			order[i] = csv_model_row(model, keys[i].pos);
+			g_free(keys[i].key);
+		}
+
+		g_free(keys);
+	}
+
+	g_free(model->order);
+	model->order = order;
+
+	path = gtk_tree_path_new();
+	gtk_tree_model_rows_reordered(GTK_TREE_MODEL(model), path, NULL, new_order);
+	gtk_tree_path_free(path);
+	g_free(new_order);
 }
 
-static GtkListStore *parse_file(char* FileToLoad, GtkTreeView *list)
+static gboolean csv_model_flush(gpointer data)
 {
-	GtkCellRenderer *renderer;
-	GtkTreeViewColumn *column;
-	GtkListStore *store = NULL;
+	CsvModel *model = CSV_MODEL(data);
 	GtkTreeIter iter;
-	gsize columns = 0;
-	GType *types;
-	gchar *separator, *buffer, enc[256];
-	gchar *seps[] = { ",", ";", "\t", NULL };
-	gchar **lines, **row;
-	gsize bytes_read, len, i;
-	EncaAnalyser analyser;
-	EncaEncoding encoding;
+	GtkTreePath *path;
+	gboolean more;
 
-	gtk_tree_view_set_model(list, NULL);
+	g_mutex_lock(&model->mutex);
 
-	if (!g_file_get_contents(FileToLoad, &buffer, &bytes_read, NULL))
-		return NULL;
+	guint count = MIN(model->pending->len - model->pending_pos, IDLE_ROWS);
+	g_array_append_vals(model->rows, &g_array_index(model->pending, gsize, model->pending_pos), count);
+	model->pending_pos += count;
+	more = (model->pending_pos < model->pending->len);
 
-	if (bytes_read == 0)
+	if (!more)
 	{
-		g_free(buffer);
-		return NULL;
+		g_array_set_size(model->pending, 0);
+		model->pending_pos = 0;
+		model->done = model->loaded;
+		model->idle_id = 0;
 	}
 
-	if (g_enca)
+	g_mutex_unlock(&model->mutex);
+
+	iter.stamp = model->stamp;
+
+	while (model->count < model->rows->len)
 	{
-		analyser = enca_analyser_alloc(g_lang);
+		path = gtk_tree_path_new_from_indices(model->count, -1);
+		iter.user_data = GUINT_TO_POINTER(model->count);
+		model->count++;
+		gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &iter);
+		gtk_tree_path_free(path);
+	}
 
-		if (analyser)
-		{
-			enca_set_threshold(analyser, 1.38);
-			enca_set_multibyte(analyser, 1);
-			enca_set_ambiguity(analyser, 1);
-			enca_set_garbage_test(analyser, 1);
-			enca_set_filtering(analyser, 0);
-
-			encoding = enca_analyse(analyser, (unsigned char*)buffer, (size_t)bytes_read);
-			g_strlcpy(enc, enca_charset_name(encoding.charset, ENCA_NAME_STYLE_ICONV), 256);
-			enca_analyser_free(analyser);
-		}
+	// a sort requested while loading
+	if (model->done && model->sort_column >= 0)
+		csv_model_sort(model);
+
+	return more;
+}
+
+static gboolean csv_model_push(CsvModel *model, GArray *batch, gboolean last)
+{
+	gboolean result;
+
+	g_mutex_lock(&model->mutex);
+	result = !g_atomic_int_get(&model->stop);
 
-		gchar *converted = g_convert_with_fallback(buffer, bytes_read, "UTF-8", enc, NULL, NULL, &len, NULL);
+	if (result)
+	{
+		g_array_append_vals(model->pending, batch->data, batch->len);
+		model->loaded = last;
+
+		if (model->idle_id == 0)
+			model->idle_id = g_idle_add(csv_model_flush, model);
+	}
+
+	g_mutex_unlock(&model->mutex);
+	g_array_set_size(batch, 0);
 
-		if (converted != NULL)
+	return result;
+}
+
+// empty lines are skipped
+static gpointer csv_model_index(gpointer data)
+{
+	CsvModel *model = CSV_MODEL(data);
+	GArray *batch = g_array_sized_new(FALSE, FALSE, sizeof(gsize), CHUNK_ROWS);
+	tCsvReader reader;
+
+	csv_reader_init(&reader, model->data + model->body, model->size - model->body, model->separator, model->quoted);
+
+	while (reader.pos < reader.end && !g_atomic_int_get(&model->stop))
+	{
+		const gchar *row = reader.pos;
+		csv_skip_row(&reader, NULL);
+
+		if (row[0] != '\n' && !(row[0] == '\r' && row + 1 < reader.end && row[1] == '\n'))
 		{
-			g_free(buffer);
-			buffer = converted;
+			gsize offset = row - model->data;
+			g_array_append_val(batch, offset);
 		}
+
+		if (batch->len >= CHUNK_ROWS && !csv_model_push(model, batch, FALSE))
+			break;
 	}
 
-	if (!buffer)
+	csv_model_push(model, batch, TRUE);
+	g_array_free(batch, TRUE);
+
+	return NULL;
+}
+
+static GtkTreeModelFlags csv_model_get_flags(GtkTreeModel *tree_model)
+{
+	return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+static gint csv_model_get_n_columns(GtkTreeModel *tree_model)
+{
+	return CSV_MODEL(tree_model)->columns + 1;
+}
+
+static GType csv_model_get_column_type(GtkTreeModel *tree_model, gint index)
+{
+	return G_TYPE_STRING;
+}
+
+static gboolean csv_model_iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent, gint n)
+{
+	CsvModel *model = CSV_MODEL(tree_model);
+
+	if (parent || n < 0 || (guint)n >= model->count)
+		return FALSE;
+
+	iter->stamp = model->stamp;
+	iter->user_data = GUINT_TO_POINTER(n);
+
+	return TRUE;
+}
+
+static gboolean csv_model_get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreePath *path)
+{
+	if (gtk_tree_path_get_depth(path) != 1)
+		return FALSE;
+
+	return csv_model_iter_nth_child(tree_model, iter, NULL, gtk_tree_path_get_indices(path)[0]);
+}
+
+static GtkTreePath *csv_model_get_path(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	return gtk_tree_path_new_from_indices(GPOINTER_TO_UINT(iter->user_data), -1);
+}
+
+static void csv_model_get_value(GtkTreeModel *tree_model, GtkTreeIter *iter, gint column, GValue *value)
+{
+	CsvModel *model = CSV_MODEL(tree_model);
+	guint pos = GPOINTER_TO_UINT(iter->user_data);
+
+	g_value_init(value, G_TYPE_STRING);
+
+	if (iter->stamp == model->stamp && pos < model->count && column >= 0 && column <= model->columns)
+		g_value_set_string(value, csv_model_parse_row(model, csv_model_row(model, pos))[column]);
+}
+
+static gboolean csv_model_iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	CsvModel *model = CSV_MODEL(tree_model);
+	guint pos = GPOINTER_TO_UINT(iter->user_data) + 1;
+
+	if (pos >= model->count)
+		return FALSE;
+
+	iter->user_data = GUINT_TO_POINTER(pos);
+
+	return TRUE;
+}
+
+static gboolean csv_model_iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *parent)
+{
+	return csv_model_iter_nth_child(tree_model, iter, parent, 0);
+}
+
+static gboolean csv_model_iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	return FALSE;
+}
+
+static gint csv_model_iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter)
+{
+	return iter ? 0 : (gint)CSV_MODEL(tree_model)->count;
+}
+
+static gboolean csv_model_iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter, GtkTreeIter *child)
+{
+	return FALSE;
+}
+
+static void csv_model_tree_model_init(GtkTreeModelIface *iface)
+{
+	iface->get_flags = csv_model_get_flags;
+	iface->get_n_columns = csv_model_get_n_columns;
+	iface->get_column_type = csv_model_get_column_type;
+	iface->get_iter = csv_model_get_iter;
+	iface->get_path = csv_model_get_path;
+	iface->get_value = csv_model_get_value;
+	iface->iter_next = csv_model_iter_next;
+	iface->iter_children = csv_model_iter_children;
+	iface->iter_has_child = csv_model_iter_has_child;
+	iface->iter_n_children = csv_model_iter_n_children;
+	iface->iter_nth_child = csv_model_iter_nth_child;
+	iface->iter_parent = csv_model_iter_parent;
+}
+
+static gboolean csv_model_get_sort_column_id(GtkTreeSortable *sortable, gint *sort_column_id, GtkSortType *order)
+{
+	CsvModel *model = CSV_MODEL(sortable);
+
+	if (sort_column_id)
+		*sort_column_id = model->sort_column;
+
+	if (order)
+		*order = model->sort_order;
+
+	return model->sort_column >= 0;
+}
+
+// sorting waits until all rows are loaded
+static void csv_model_set_sort_column_id(GtkTreeSortable *sortable, gint sort_column_id, GtkSortType order)
+{
+	CsvModel *model = CSV_MODEL(sortable);
+
+	if (model->sort_column == sort_column_id && model->sort_order == order)
+		return;
+
+	if (sort_column_id == GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID)
+		sort_column_id = GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID;
+
+	model->sort_column = sort_column_id;
+	model->sort_order = order;
+	gtk_tree_sortable_sort_column_changed(sortable);
+
+	if (model->done)
+		csv_model_sort(model);
+}
+
+static void csv_model_set_sort_func(GtkTreeSortable *sortable, gint sort_column_id,
+                                    GtkTreeIterCompareFunc func, gpointer data, GDestroyNotify destroy)
+{
+
+}
+
+static void csv_model_set_default_sort_func(GtkTreeSortable *sortable,
+                                            GtkTreeIterCompareFunc func, gpointer data, GDestroyNotify destroy)
+{
+
+}
+
+static gboolean csv_model_has_default_sort_func(GtkTreeSortable *sortable)
+{
+	return FALSE;
+}
+
+static void csv_model_sortable_init(GtkTreeSortableIface *iface)
+{
+	iface->get_sort_column_id = csv_model_get_sort_column_id;
+	iface->set_sort_column_id = csv_model_set_sort_column_id;
+	iface->set_sort_func = csv_model_set_sort_func;
+	iface->set_default_sort_func = csv_model_set_default_sort_func;
+	iface->has_default_sort_func = csv_model_has_default_sort_func;
+}
+
+static void csv_model_init(CsvModel *model)
+{
+	model->stamp = g_random_int();
+	model->rows = g_array_new(FALSE, FALSE, sizeof(gsize));
+	model->pending = g_array_new(FALSE, FALSE, sizeof(gsize));
+	model->sort_column = GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID;
+	model->sort_order = GTK_SORT_ASCENDING;
+	g_mutex_init(&model->mutex);
+}
+
+static void csv_model_finalize(GObject *object)
+{
+	CsvModel *model = CSV_MODEL(object);
+
+	g_mutex_lock(&model->mutex);
+	g_atomic_int_set(&model->stop, TRUE);
+	g_mutex_unlock(&model->mutex);
+
+	if (model->thread)
+		g_thread_join(model->thread);
+
+	if (model->idle_id)
+		g_source_remove(model->idle_id);
+
+	csv_model_clear_cache(model);
+	g_array_free(model->rows, TRUE);
+	g_array_free(model->pending, TRUE);
+	g_free(model->order);
+	g_free(model->charset);
+	g_free(model->buffer);
+
+	if (model->file)
+		g_mapped_file_unref(model->file);
+
+	g_mutex_clear(&model->mutex);
+
+	G_OBJECT_CLASS(csv_model_parent_class)->finalize(object);
+}
+
+static void csv_model_class_init(CsvModelClass *klass)
+{
+	G_OBJECT_CLASS(klass)->finalize = csv_model_finalize;
+}
+
+// NULL if the text can be shown as is
+static gchar *detect_charset(const gchar *data, gsize size)
+{
+	EncaAnalyser analyser;
+	EncaEncoding encoding;
+	const gchar *name = NULL;
+	gsize sample = size;
+
+	if (sample > ENCA_SAMPLE)
+	{
+		const gchar *newline = g_strrstr_len(data, ENCA_SAMPLE, "\n");
+		sample = newline ? (gsize)(newline - data) : ENCA_SAMPLE;
+	}
+
+	analyser = enca_analyser_alloc(g_lang);
+
+	if (!analyser)
 		return NULL;
 
-	lines = g_regex_split_simple("[\r\n]+", buffer, 0, 0);
-	g_free(buffer);
+	enca_set_threshold(analyser, 1.38);
+	enca_set_multibyte(analyser, 1);
+	enca_set_ambiguity(analyser, 1);
+	enca_set_garbage_test(analyser, 1);
+	enca_set_filtering(analyser, 0);
 
-	if (!lines)
+	encoding = enca_analyse(analyser, (unsigned char*)data, sample);
+	name = enca_charset_name(encoding.charset, ENCA_NAME_STYLE_ICONV);
+	enca_analyser_free(analyser);
+
+	if (!name || g_ascii_strcasecmp(name, "UTF-8") == 0 || g_ascii_strcasecmp(name, "ASCII") == 0)
 		return NULL;
 
-	for (gchar **chr = seps; *chr != NULL; chr++)
-	{
-		row = g_strsplit(*lines, *chr, -1);
+	GIConv conv = g_iconv_open("UTF-8", name);
 
-		if (row)
-			columns = g_strv_length(row);
-		else
-			continue;
+	if (conv == (GIConv)-1)
+		return NULL;
 
-		if (columns > 1)
+	g_iconv_close(conv);
+
+	return g_strdup(name);
+}
+
+// cells of an ASCII compatible charset are converted when shown, anything else (UTF-16) is converted at once
+static gboolean csv_model_load(CsvModel *model, char* FileToLoad)
+{
+	model->file = g_mapped_file_new(FileToLoad, FALSE, NULL);
+
+	if (!model->file)
+		return FALSE;
+
+	model->data = g_mapped_file_get_contents(model->file);
+	model->size = g_mapped_file_get_length(model->file);
+
+	if (model->size == 0)
+		return FALSE;
+
+	if (g_enca)
+		model->charset = detect_charset(model->data, model->size);
+
+	if (model->charset)
+	{
+		gchar *delims = g_convert(",;\t\"\r\n", -1, model->charset, "UTF-8", NULL, NULL, NULL);
+
+		if (!delims || strcmp(delims, ",;\t\"\r\n") != 0)
 		{
-			GList *cols = gtk_tree_view_get_columns(list);
+			model->buffer = g_convert_with_fallback(model->data, model->size, "UTF-8", model->charset, NULL, NULL, &model->size, NULL);
+			g_clear_pointer(&model->charset, g_free);
 
-			for (GList *l = cols; l != NULL; l = l->next)
+			if (!model->buffer)
 			{
-				if (GTK_IS_TREE_VIEW_COLUMN(l->data))
-					gtk_tree_view_remove_column(list, GTK_TREE_VIEW_COLUMN(l->data));
+				g_free(delims);
+				return FALSE;
 			}
 
-			separator = *chr;
-			types = (GType*)g_malloc((columns + 1) * sizeof(GType));
+			model->data = model->buffer;
+		}
 
-			for (i = 0; i <= columns; i++)
-				types[i] = G_TYPE_STRING;
+		g_free(delims);
+	}
 
-			store = gtk_list_store_newv(columns + 1, types);
-			g_free(types);
+	if (model->size >= 3 && memcmp(model->data, "\xEF\xBB\xBF", 3) == 0)
+		model->body = 3;
 
-			i = 0;
+	return TRUE;
+}
 
-			for (gchar **itm = row; *itm != NULL; itm++)
-			{
-				renderer = gtk_cell_renderer_text_new();
-				g_object_set(G_OBJECT(renderer), "editable", TRUE, NULL);
+static CsvModel *parse_file(char* FileToLoad, GtkTreeView *list)
+{
+	GtkCellRenderer *renderer;
+	GtkTreeViewColumn *column;
+	CsvModel *model;
+	gchar seps[] = ",;\t";
+	gint i, columns = 0;
+	tCsvReader reader;
+	tCsvField field;
+	int result;
+
+	gtk_tree_view_set_model(list, NULL);
 
-				gchar *header = get_value(&itm, separator);
-				column = gtk_tree_view_column_new_with_attributes(header, renderer, "text", i, NULL);
-				g_free(header);
+	model = g_object_new(CSV_TYPE_MODEL, NULL);
 
-				gtk_tree_view_column_set_sort_column_id(column, i);
-				gtk_tree_view_append_column(list, column);
-				i++;
-			}
+	if (!csv_model_load(model, FileToLoad))
+	{
+		g_object_unref(model);
+		return NULL;
+	}
 
-			renderer = gtk_cell_renderer_text_new();
-			column = gtk_tree_view_column_new_with_attributes("", renderer, "text", i, NULL);
-			gtk_tree_view_column_set_sort_column_id(column, i);
-			gtk_tree_view_append_column(GTK_TREE_VIEW(list), column);
+	for (gchar *chr = seps; *chr != '\0'; chr++)
+	{
+		model->separator = *chr;
+		model->quoted = (g_quoted && model->separator != '\t');
+		csv_reader_init(&reader, model->data + model->body, model->size - model->body, model->separator, model->quoted);
+		csv_skip_row(&reader, &columns);
 
+		if (columns > 1)
 			break;
-		}
-
-		g_strfreev(row);
 	}
 
 	if (columns < 2)
 	{
-		if (G_IS_OBJECT(store))
-			g_object_unref(store);
-
-		g_strfreev(lines);
+		g_object_unref(model);
 		return NULL;
 	}
 
-	for (gchar **line = lines + 1; *line != NULL; line++)
+	GList *cols = gtk_tree_view_get_columns(list);
+
+	for (GList *l = cols; l != NULL; l = l->next)
 	{
-		i = 0;
+		if (GTK_IS_TREE_VIEW_COLUMN(l->data))
+			gtk_tree_view_remove_column(list, GTK_TREE_VIEW_COLUMN(l->data));
+	}
 
-		if (strlen(*line) < 1)
-			continue;
+	g_list_free(cols);
 
-		row = g_strsplit(*line, separator, -1);
+	model->columns = columns;
+	csv_reader_init(&reader, model->data + model->body, model->size - model->body, model->separator, model->quoted);
+	i = 0;
 
-		if (row)
-		{
-			gtk_list_store_append(store, &iter);
-			GString *trash = g_string_new(NULL);
+	while ((result = csv_next_field(&reader, &field)) != CSV_END)
+	{
+		renderer = gtk_cell_renderer_text_new();
+		g_object_set(G_OBJECT(renderer), "editable", TRUE, NULL);
 
-			for (gchar **itm = row; *itm != NULL; itm++)
-			{
-				if (i >= columns)
-				{
-					trash = g_string_append(trash, ", ");
-					trash = g_string_append(trash, *itm);
-				}
-				else
-				{
-					gchar *value = get_value(&itm, separator);
-					gtk_list_store_set(store, &iter, i++, value, -1);
-					g_free(value);
-				}
-			}
+		gchar *header = field_text(model, &field);
+		column = gtk_tree_view_column_new_with_attributes(header, renderer, "text", i, NULL);
+		g_free(header);
 
-			gtk_list_store_set(store, &iter, i++, g_string_free(trash, FALSE), -1);
-			g_strfreev(row);
-		}
+		gtk_tree_view_column_set_sort_column_id(column, i);
+		gtk_tree_view_append_column(list, column);
+		i++;
+
+		if (result == CSV_LAST)
+			break;
 	}
 
-	g_strfreev(lines);
+	renderer = gtk_cell_renderer_text_new();
+	column = gtk_tree_view_column_new_with_attributes("", renderer, "text", i, NULL);
+	gtk_tree_view_column_set_sort_column_id(column, i);
+	gtk_tree_view_append_column(GTK_TREE_VIEW(list), column);
+
+	model->body = reader.pos - model->data;
+	model->thread = g_thread_new("csvview", csv_model_index, model);
 
-	return store;
+	return model;
 }
 
 HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
@@ -256,9 +729,9 @@ HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
 
 	list = gtk_tree_view_new();
 
-	GtkListStore *store = parse_file(FileToLoad, GTK_TREE_VIEW(list));
+	CsvModel *model = parse_file(FileToLoad, GTK_TREE_VIEW(list));
 
-	if (!store)
+	if (!model)
 	{
 		gtk_widget_destroy(list);
 		return NULL;
@@ -269,8 +742,8 @@ HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
 	scroll = gtk_scrolled_window_new(NULL, NULL);
 	gtk_container_add(GTK_CONTAINER(gFix), scroll);
 
-	gtk_tree_view_set_model(GTK_TREE_VIEW(list), GTK_TREE_MODEL(store));
-	g_object_unref(store);
+	gtk_tree_view_set_model(GTK_TREE_VIEW(list), GTK_TREE_MODEL(model));
+	g_object_unref(model);
 
 
 	if (g_grid)
@@ -293,13 +766,13 @@ int DCPCALL ListLoadNext(HWND ParentWin, HWND PluginWin, char* FileToLoad, int S
 {
 	GtkWidget *list = (GtkWidget*)g_object_get_data(G_OBJECT(PluginWin), "list");
 
-	GtkListStore *store = parse_file(FileToLoad, GTK_TREE_VIEW(list));
+	CsvModel *model = parse_file(FileToLoad, GTK_TREE_VIEW(list));
 
-	if (!store)
+	if (!model)
 		return LISTPLUGIN_ERROR;
 
-	gtk_tree_view_set_model(GTK_TREE_VIEW(list), GTK_TREE_MODEL(store));
-	g_object_unref(store);
+	gtk_tree_view_set_model(GTK_TREE_VIEW(list), GTK_TREE_MODEL(model));
+	g_object_unref(model);
 	return LISTPLUGIN_OK;
 }
 
@@ -1,7 +1,10 @@
 #include <QFile>
 #include <QTextCodec>
-#include <QTableWidget>
+#include <QTableView>
 #include <QHeaderView>
+#include <QAbstractTableModel>
+#include <QCache>
+#include <QTimer>
 
 #include <QApplication>
 #include <QClipboard>
@@ -13,6 +16,12 @@
 
 #include <enca.h>
 
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <string.h>
+
 #include <dlfcn.h>
 #include <libintl.h>
 #include <locale.h>
@@ -20,6 +29,7 @@
 #define GETTEXT_PACKAGE "plugins"
 
 #include "wlxplugin.h"
+#include "csvparse.h"
 
 static bool g_enca = true;
 static bool g_resize = false;
@@ -28,82 +38,357 @@ static bool g_quoted = true;
 static bool g_grid = false;
 static QString g_lang;
 
+#define INDEX_FIRST_ROWS 1000
+#define INDEX_BATCH 65536
+#define INDEX_INTERVAL 100
+#define CACHE_ROWS 4096
+
 
-static QStringList parse_line(QByteArray line, QTextCodec *codec, char separator)
+static QStringList parse_line(const char *data, qint64 len, QTextCodec *codec, char separator)
 {
-	QStringList list, rawlist;
+	int result;
+	QStringList list;
+	tCsvField field;
+	tCsvReader reader;
 
-	if (codec)
-		rawlist = codec->toUnicode(line).split(QLatin1Char(separator));
-	else
-		rawlist = QString(line).split(QLatin1Char(separator));
+	csv_reader_init(&reader, data, len, separator, g_quoted && separator != '\t');
+
+	while ((result = csv_next_field(&reader, &field)) != CSV_END)
+	{
+		QByteArray bytes;
+
+		if (field.escaped)
+		{
+			bytes.resize(field.len);
+			bytes.resize(csv_field_unescape(&field, bytes.data()));
+		}
+		else
+			bytes = QByteArray::fromRawData(field.data, field.len);
+
+		if (codec)
+			list.append(codec->toUnicode(bytes).trimmed());
+		else
+			list.append(QString(bytes).trimmed());
+
+		if (result == CSV_LAST)
+			break;
+	}
+
+	return list;
+}
+
+// Rows are kept as end offsets into the mapped file and decoded only when the view asks for them.
+// The first rows are indexed right away, the rest in a thread, the timer moves its results to the model.
+class CsvModel : public QAbstractTableModel
+{
+public:
+	CsvModel(QFile *file, char separator, QTextCodec *codec, QObject *parent);
+	~CsvModel();
+
+	int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+	int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+	QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+	QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
+	Qt::ItemFlags flags(const QModelIndex &index) const override;
+	void sort(int column, Qt::SortOrder order = Qt::AscendingOrder) override;
+
+	QModelIndex find(const QString &needle, Qt::CaseSensitivity cs, int row, int column, bool backwards) const;
+
+private:
+	QStringList decode(qint64 begin, qint64 end) const;
+	QStringList decode_row(int row) const;
+	const QStringList *row_fields(int row) const;
+	void index_rows(qint64 pos);
+	void fetch();
+	void apply_sort();
+
+	QFile *m_file;
+	const char *m_data;
+	qint64 m_size;
+	qint64 m_start = 0;
+	char m_separator;
+	bool m_quoted;
+	QTextCodec *m_codec;
+	QStringList m_header;
+	QVector<qint64> m_ends;
+	QVector<int> m_order;
+	int m_columns;
+	int m_sort_column = -1;
+	Qt::SortOrder m_sort_order = Qt::AscendingOrder;
+	bool m_indexed = false;
+	mutable QCache<int, QStringList> m_cache;
+	QTimer *m_timer = nullptr;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::atomic<bool> m_stop;
+	QVector<qint64> m_pending;
+	int m_pending_columns = 0;
+	bool m_pending_done = false;
+};
+
+CsvModel::CsvModel(QFile *file, char separator, QTextCodec *codec, QObject *parent)
+	: QAbstractTableModel(parent), m_file(file), m_separator(separator), m_codec(codec), m_cache(CACHE_ROWS), m_stop(false)
+{
+	int fields;
 
-	rawlist.last().remove(-1, 1);
+	m_file->setParent(this);
+	m_data = (const char*)m_file->map(0, m_file->size());
+	m_size = m_data ? m_file->size() : 0;
+	m_quoted = (g_quoted && separator != '\t');
 
-	if (!g_quoted || separator == '\t')
-		list = rawlist;
+	tCsvReader reader;
+	csv_reader_init(&reader, m_data, m_size, m_separator, m_quoted);
+
+	m_start = csv_skip_row(&reader, &fields) - m_data;
+	m_header = decode(0, m_start);
+	m_columns = m_header.size();
+
+	qint64 pos = m_start;
+
+	while (pos < m_size && m_ends.size() < INDEX_FIRST_ROWS)
+	{
+		pos = csv_skip_row(&reader, &fields) - m_data;
+		m_ends.append(pos);
+		m_columns = qMax(m_columns, fields);
+	}
+
+	if (pos >= m_size)
+		m_indexed = true;
 	else
 	{
-		for (int c = 0; c < rawlist.size(); ++c)
-		{
-			const QString itm = rawlist.at(c);
+		m_timer = new QTimer(this);
+		QObject::connect(m_timer, &QTimer::timeout, [this]() { fetch(); });
+		m_timer->start(INDEX_INTERVAL);
+		m_thread = std::thread(&CsvModel::index_rows, this, pos);
+	}
+}
 
-			if (!itm.isEmpty() && itm.front() == '"')
-			{
-				QString temp(itm.trimmed());
+CsvModel::~CsvModel()
+{
+	m_stop = true;
 
-				if (itm.back() == '"' && itm.count(QLatin1Char('"')) > 3 && itm.count(QLatin1Char('"')) % 2 == 0)
-					temp = QString(itm).remove(0, 1).remove(-1, 1);
-				else
-				{
-					for (int x = c + 1; x < rawlist.size(); x++)
-					{
-						const QString nitm = rawlist.at(x);
-
-						if (!nitm.isEmpty() && nitm.back() == '"')
-						{
-							temp = rawlist.mid(c, x - c + 1).join(QLatin1Char(separator)).remove(0, 1).remove(-1, 1);
-
-							if (temp.count(QLatin1Char('"')) % 2 == 0)
-							{
-								c = x;
-								break;
-							}
-						}
-					}
-				}
+	if (m_thread.joinable())
+		m_thread.join();
+}
 
-				list.append(temp);
-			}
-			else
-				list.append(rawlist.at(c).trimmed());
+void CsvModel::index_rows(qint64 pos)
+{
+	int fields, columns = 0;
+	QVector<qint64> batch;
+	tCsvReader reader;
+
+	csv_reader_init(&reader, m_data + pos, m_size - pos, m_separator, m_quoted);
+
+	while (pos < m_size && !m_stop)
+	{
+		pos = csv_skip_row(&reader, &fields) - m_data;
+		batch.append(pos);
+		columns = qMax(columns, fields);
 
-			list.last().replace("\"\"", "\"");
+		if (batch.size() >= INDEX_BATCH || pos >= m_size)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pending += batch;
+			m_pending_columns = qMax(m_pending_columns, columns);
+			batch.clear();
 		}
 	}
 
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pending_done = true;
+}
+
+void CsvModel::fetch()
+{
+	QVector<qint64> rows;
+	int columns;
+	bool done;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		rows.swap(m_pending);
+		columns = m_pending_columns;
+		done = m_pending_done;
+	}
+
+	if (columns > m_columns)
+	{
+		beginInsertColumns(QModelIndex(), m_columns, columns - 1);
+		m_columns = columns;
+		endInsertColumns();
+	}
+
+	if (!rows.isEmpty())
+	{
+		beginInsertRows(QModelIndex(), m_ends.size(), m_ends.size() + rows.size() - 1);
+		m_ends += rows;
+		endInsertRows();
+	}
+
+	if (done)
+	{
+		m_timer->stop();
+		m_indexed = true;
+
+		if (m_sort_column >= 0)
+			apply_sort();
+	}
+}
+
+QStringList CsvModel::decode(qint64 begin, qint64 end) const
+{
+	return parse_line(m_data + begin, end - begin, m_codec, m_separator);
+}
+
+QStringList CsvModel::decode_row(int row) const
+{
+	if (!m_order.isEmpty())
+		row = m_order.at(row);
+
+	return decode(row > 0 ? m_ends.at(row - 1) : m_start, m_ends.at(row));
+}
+
+const QStringList *CsvModel::row_fields(int row) const
+{
+	QStringList *list = m_cache.object(row);
+
+	if (!list)
+	{
+		list = new QStringList(decode_row(row));
+		m_cache.insert(row, list);
+	}
+
 	return list;
 }
 
+int CsvModel::rowCount(const QModelIndex &parent) const
+{
+	return parent.isValid() ? 0 : m_ends.size();
+}
+
+int CsvModel::columnCount(const QModelIndex &parent) const
+{
+	return parent.isValid() ? 0 : m_columns;
+}
+
+QVariant CsvModel::data(const QModelIndex &index, int role) const
+{
+	if (!index.isValid() || (role != Qt::DisplayRole && role != Qt::ToolTipRole))
+		return QVariant();
+
+	const QStringList *list = row_fields(index.row());
+
+	if (index.column() < list->size())
+		return list->at(index.column());
+
+	return QVariant();
+}
+
+QVariant CsvModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+	if (orientation == Qt::Horizontal && role == Qt::DisplayRole && section < m_header.size())
+		return m_header.at(section);
+
+	return QAbstractTableModel::headerData(section, orientation, role);
+}
+
+Qt::ItemFlags CsvModel::flags(const QModelIndex &index) const
+{
+	return Qt::ItemIsSelectable | Qt::ItemIsEnabled;
+}
+
+void CsvModel::sort(int column, Qt::SortOrder order)
+{
+	if (column < 0 && m_order.isEmpty())
+	{
+		m_sort_column = -1;
+		return;
+	}
+
+	m_sort_column = column;
+	m_sort_order = order;
+
+	// the rest of the file is not there yet, sort when it is
+	if (m_indexed)
+		apply_sort();
+}
+
+void CsvModel::apply_sort()
+{
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	beginResetModel();
+	m_order.clear();
+	m_cache.clear();
+
+	if (m_sort_column >= 0)
+	{
+		QVector<QString> keys(m_ends.size());
+
+		for (int i = 0; i < m_ends.size(); ++i)
+		{
+			QStringList list = decode_row(i);
+
+			if (m_sort_column < list.size())
+				keys[i] = list.at(m_sort_column);
+		}
+
+		m_order.resize(m_ends.size());
+
+		for (int i = 0; i < m_order.size(); ++i)
+			m_order[i] = i;
+
+		if (m_sort_order == Qt::AscendingOrder)
+			std::stable_sort(m_order.begin(), m_order.end(), [&keys](int a, int b) { return keys.at(a) < keys.at(b); });
+		else
+			std::stable_sort(m_order.begin(), m_order.end(), [&keys](int a, int b) { return keys.at(b) < keys.at(a); });
+	}
+
+	endResetModel();
+	QApplication::restoreOverrideCursor();
+}
+
+QModelIndex CsvModel::find(const QString &needle, Qt::CaseSensitivity cs, int row, int column, bool backwards) const
+{
+	int step = backwards ? -1 : 1;
+
+	// column -1 is the whole row
+	for (; row >= 0 && row < m_ends.size(); row += step, column = -1)
+	{
+		QStringList list = decode_row(row);
+
+		if (column < 0 || (backwards && column >= list.size()))
+			column = backwards ? list.size() - 1 : 0;
+
+		for (; column >= 0 && column < list.size(); column += step)
+			if (list.at(column).contains(needle, cs))
+				return index(row, column);
+	}
+
+	return QModelIndex();
+}
+
 HANDLE DCPCALL ListLoad(HANDLE ParentWin, char* FileToLoad, int ShowFlags)
 {
 	char separator;
-	char codec_name[13];
-	int columns, row = 0;
-	QStringList header, list;
-	QFile file(FileToLoad);
-	QByteArray line;
+	char codec_name[13] = "System";
+	int columns = 0;
+	QFile *file = new QFile(FileToLoad);
+	const char *data = nullptr;
 
-	if (!file.open(QFile::ReadOnly | QFile::Text))
+	if (file->open(QFile::ReadOnly) && file->size() > 0)
+		data = (const char*)file->map(0, file->size());
+
+	if (!data)
+	{
+		delete file;
 		return nullptr;
+	}
+
+	qint64 size = file->size();
 
 	if (g_enca)
 	{
-		if (g_readall)
-			line = file.readAll();
-		else
-			line = file.read(4096);
-
 		EncaAnalyser analyser;
 		EncaEncoding encoding;
 		analyser = enca_analyser_alloc(g_lang.toStdString().c_str());
@@ -115,7 +400,7 @@ HANDLE DCPCALL ListLoad(HANDLE ParentWin, char* FileToLoad, int ShowFlags)
 			enca_set_ambiguity(analyser, 1);
 			enca_set_garbage_test(analyser, 1);
 			enca_set_filtering(analyser, 0);
-			encoding = enca_analyse(analyser, (unsigned char*)line.data(), (size_t)line.size());
+			encoding = enca_analyse(analyser, (unsigned char*)data, (size_t)(g_readall ? size : qMin(size, (qint64)4096)));
 
 			switch (encoding.charset)
 			{
@@ -138,68 +423,44 @@ HANDLE DCPCALL ListLoad(HANDLE ParentWin, char* FileToLoad, int ShowFlags)
 
 			enca_analyser_free(analyser);
 		}
-
-
-		file.seek(0);
 	}
 
-	line = file.readLine();
 	QTextCodec *codec = QTextCodec::codecForName(codec_name);
 	QByteArray seps(",;\t");
 
-	QTableWidget *view = new QTableWidget((QWidget*)ParentWin);
+	// the separator is guessed from the header line alone, the fields are only counted
+	const char *eol = (const char*)memchr(data, '\n', size);
+	qint64 header_len = eol ? eol - data : size;
 
 	for (int i = 0; i < seps.size(); ++i)
 	{
+		tCsvReader reader;
 		separator = seps.at(i);
 
-		header = parse_line(line, codec, separator);
-		columns = header.size();
+		csv_reader_init(&reader, data, header_len, separator, g_quoted && separator != '\t');
+		csv_skip_row(&reader, &columns);
 
 		if (columns > 1)
-		{
-			view->setColumnCount(columns);
-
-			for (int c = 0; c < columns; ++c)
-				view->setHorizontalHeaderItem(c, new QTableWidgetItem(header.at(c).trimmed()));
-
 			break;
-		}
 	}
 
+	file->unmap((uchar*)data);
+
 	if (columns <= 1)
 	{
-		delete view;
+		delete file;
 		return nullptr;
 	}
 
+	QTableView *view = new QTableView((QWidget*)ParentWin);
+	CsvModel *model = new CsvModel(file, separator, codec, view);
+	view->setModel(model);
+
 	if (g_resize)
 		view->horizontalHeader()->setSectionResizeMode(QHeaderView::ResizeToContents);
 
-	while (!file.atEnd())
-	{
-		view->insertRow(row);
-		list = parse_line(file.readLine(), codec, separator);
-
-		if (list.size() > columns)
-		{
-			columns = list.size();
-			view->setColumnCount(columns);
-		}
-
-		for (int c = 0; c < list.size(); ++c)
-		{
-			QTableWidgetItem *item = new QTableWidgetItem(list.at(c).trimmed());
-			item->setToolTip(list.at(c).trimmed());
-			item->setFlags(Qt::ItemIsSelectable | Qt::ItemIsEnabled);
-			view->setItem(row, c, item);
-		}
-
-		row++;
-	}
-
-	file.close();
-
+	// keep the file order until a column header is clicked
+	view->horizontalHeader()->setSortIndicator(-1, Qt::AscendingOrder);
 	view->setSortingEnabled(true);
 	view->setShowGrid(g_grid);
 
@@ -210,13 +471,13 @@ HANDLE DCPCALL ListLoad(HANDLE ParentWin, char* FileToLoad, int ShowFlags)
 
 void DCPCALL ListCloseWindow(HANDLE ListWin)
 {
-	QTableWidget *view = (QTableWidget*)ListWin;
+	QTableView *view = (QTableView*)ListWin;
 	delete view;
 }
 
 int DCPCALL ListSendCommand(HWND ListWin, int Command, int Parameter)
 {
-	QTableWidget *view = (QTableWidget*)ListWin;
+	QTableView *view = (QTableView*)ListWin;
 
 	switch (Command)
 	{
@@ -270,43 +531,45 @@ int DCPCALL ListSendCommand(HWND ListWin, int Command, int Parameter)
 
 int DCPCALL ListSearchText(HWND ListWin, char* SearchString, int SearchParameter)
 {
-	QList<QTableWidgetItem*> list;
-	QTableWidget *view = (QTableWidget*)ListWin;
+	int row, column;
+	QTableView *view = (QTableView*)ListWin;
+	CsvModel *model = (CsvModel*)view->model();
+	bool backwards = (SearchParameter & lcs_backwards);
 
-	Qt::MatchFlags sflags = Qt::MatchContains;
+	Qt::CaseSensitivity cs = Qt::CaseInsensitive;
 
 	if (SearchParameter & lcs_matchcase)
-		sflags |= Qt::MatchCaseSensitive;
+		cs = Qt::CaseSensitive;
 
 	QString needle(SearchString);
 	QString prev = view->property("needle").value<QString>();
 	view->setProperty("needle", needle);
 
-	list = view->findItems(QString(SearchString), sflags);
+	QModelIndex cur = view->currentIndex();
 
-	if (!list.isEmpty())
+	if (needle != prev || SearchParameter & lcs_findfirst || !cur.isValid())
 	{
-		int i = view->property("findit").value<int>();
+		row = backwards ? model->rowCount() - 1 : 0;
+		column = -1;
+	}
+	else
+	{
+		row = cur.row();
+		column = cur.column() + (backwards ? -1 : 1);
 
-		if (needle != prev || SearchParameter & lcs_findfirst)
-		{
-			if (SearchParameter & lcs_backwards)
-				i = list.size() - 1;
-			else
-				i = 0;
-		}
-		else if (SearchParameter & lcs_backwards)
-			i--;
-		else
-			i++;
+		if (column < 0)
+			row--;
+	}
 
-		if (i >= 0 && i < list.size() && list.at(i))
-		{
-			view->scrollToItem(list.at(i));
-			view->setCurrentItem(list.at(i));
-			view->setProperty("findit", i);
-			return LISTPLUGIN_OK;
-		}
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	QModelIndex found = model->find(needle, cs, row, column, backwards);
+	QApplication::restoreOverrideCursor();
+
+	if (found.isValid())
+	{
+		view->scrollTo(found);
+		view->setCurrentIndex(found);
+		return LISTPLUGIN_OK;
 	}
 
 	QMessageBox::information(view, "", QString::asprintf(_("\"%s\" not found!"), SearchString));
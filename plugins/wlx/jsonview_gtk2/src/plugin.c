@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <gtk/gtk.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <json-glib/json-glib.h>
 #include "wlxplugin.h"
 
@@ -10,12 +11,34 @@
 #include <locale.h>
 #define GETTEXT_PACKAGE "plugins"
 
+#define PAGE_LINES 10000
+#define PREVIEW_LEN 256
+#define PROBE_LEN 1048576
+
+// JSON Lines: a thread finds where each page of PAGE_LINES records starts, the pages, their records
+// and the records' contents are added to the store when the rows are expanded.
+
+typedef struct sPage
+{
+	gint64 offset;
+	guint first;
+	guint last;
+} tPage;
+
 typedef struct sCustomData
 {
 	GtkTreeStore *store;
 	GtkTreeIter child;
 	GtkTreeIter parent;
 	GtkWidget *tree;
+	GtkTreeIter root;
+	GMappedFile *file;
+	GThread *thread;
+	GMutex mutex;
+	GArray *pages;
+	guint idle_id;
+	gint stop;
+	gboolean expanded;
 } CustomData;
 
 enum
@@ -23,9 +46,19 @@ enum
 	KEY = 0,
 	VALUE,
 	TYPE,
+	OFFSET,
+	INDEX,
+	LAZY,
 	N_COLS
 };
 
+enum
+{
+	LAZY_NONE = 0,
+	LAZY_PAGE,
+	LAZY_RECORD
+};
+
 gboolean g_expand = TRUE;
 gboolean g_sorting = FALSE;
 gboolean g_filename = TRUE;
@@ -109,19 +142,289 @@ static void check_value(JsonNode *node, CustomData *data, GtkTreeIter parent)
 	}
 }
 
-HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
+static gboolean is_blank(const gchar *p, const gchar *eol)
+{
+	while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+
+	return p >= eol;
+}
+
+static const gchar *line_end(const gchar *p, const gchar *end)
+{
+	const gchar *eol = (const gchar*)memchr(p, '\n', end - p);
+
+	return eol ? eol : end;
+}
+
+// by the extension, or a complete object or array on the first line followed by more lines
+static gboolean is_ndjson(const gchar *filename, const gchar *data, gsize size)
+{
+	const gchar *end = data + size;
+	const gchar *p = data, *eol = data;
+	gboolean result = FALSE;
+	gchar *name = g_ascii_strdown(filename, -1);
+
+	if (g_str_has_suffix(name, ".ndjson") || g_str_has_suffix(name, ".jsonl") || g_str_has_suffix(name, ".ldjson"))
+		result = TRUE;
+
+	g_free(name);
+
+	if (result)
+		return TRUE;
+
+	while (p < end && is_blank(p, (eol = line_end(p, end))))
+		p = eol + 1;
+
+	if (p >= end || (eol - p) > PROBE_LEN)
+		return FALSE;
+
+	const gchar *next = eol;
+
+	while (next < end && (*next == '\n' || *next == '\r' || *next == ' ' || *next == '\t'))
+		next++;
+
+	p += strspn(p, " \t");
+
+	if (next >= end || (*p != '{' && *p != '['))
+		return FALSE;
+
+	JsonParser *parser = json_parser_new();
+	result = json_parser_load_from_data(parser, p, eol - p, NULL);
+	g_object_unref(parser);
+
+	return result;
+}
+
+static void push_page(CustomData *data, tPage *page);
+
+static gpointer index_lines(gpointer user_data)
+{
+	CustomData *data = (CustomData*)user_data;
+	const gchar *start = g_mapped_file_get_contents(data->file);
+	const gchar *end = start + g_mapped_file_get_length(data->file);
+	const gchar *p = start, *eol;
+	tPage page = { -1, 0, 0 };
+	guint count = 0;
+
+	for (; p < end && !g_atomic_int_get(&data->stop); p = eol + 1)
+	{
+		eol = line_end(p, end);
+
+		if (is_blank(p, eol))
+			continue;
+
+		if (count % PAGE_LINES == 0)
+		{
+			page.offset = p - start;
+			page.first = count;
+		}
+
+		page.last = count++;
+
+		if (count % PAGE_LINES == 0)
+			push_page(data, &page);
+	}
+
+	if (count % PAGE_LINES != 0 && !g_atomic_int_get(&data->stop))
+		push_page(data, &page);
+
+	return NULL;
+}
+
+static gboolean add_pages(gpointer user_data)
+{
+	CustomData *data = (CustomData*)user_data;
+	GtkTreeIter iter, placeholder;
+	GArray *pages;
+
+	g_mutex_lock(&data->mutex);
+	pages = data->pages;
+	data->pages = g_array_new(FALSE, FALSE, sizeof(tPage));
+	data->idle_id = 0;
+	g_mutex_unlock(&data->mutex);
+
+	for (guint i = 0; i < pages->len; i++)
+	{
+		tPage *page = &g_array_index(pages, tPage, i);
+		gchar *key = g_strdup_printf("[%u - %u] ", page->first, page->last);
+		gtk_tree_store_append(data->store, &iter, &data->root);
+		gtk_tree_store_set(data->store, &iter, KEY, key, OFFSET, page->offset, INDEX, page->first, LAZY, LAZY_PAGE, -1);
+		gtk_tree_store_append(data->store, &placeholder, &iter);
+		g_free(key);
+	}
+
+	g_array_free(pages, TRUE);
+
+	if (g_expand && !data->expanded)
+	{
+		GtkTreePath *path = gtk_tree_model_get_path(GTK_TREE_MODEL(data->store), &data->root);
+		gtk_tree_view_expand_row(GTK_TREE_VIEW(data->tree), path, FALSE);
+		gtk_tree_path_free(path);
+		data->expanded = TRUE;
+	}
+
+	return FALSE;
+}
+
+static void push_page(CustomData *data, tPage *page)
+{
+	g_mutex_lock(&data->mutex);
+
+	if (!g_atomic_int_get(&data->stop))
+	{
+		g_array_append_val(data->pages, *page);
+
+		if (data->idle_id == 0)
+			data->idle_id = g_idle_add(add_pages, data);
+	}
+
+	g_mutex_unlock(&data->mutex);
+}
+
+static void stop_lines(CustomData *data)
+{
+	if (!data->file)
+		return;
+
+	g_mutex_lock(&data->mutex);
+	g_atomic_int_set(&data->stop, TRUE);
+	g_mutex_unlock(&data->mutex);
+
+	if (data->thread)
+		g_thread_join(data->thread);
+
+	if (data->idle_id)
+		g_source_remove(data->idle_id);
+
+	g_array_free(data->pages, TRUE);
+	g_mapped_file_unref(data->file);
+	g_mutex_clear(&data->mutex);
+
+	data->thread = NULL;
+	data->idle_id = 0;
+	data->file = NULL;
+	data->pages = NULL;
+	data->stop = FALSE;
+	data->expanded = FALSE;
+}
+
+static void add_records(CustomData *data, GtkTreeIter *page, gint64 offset, guint first)
+{
+	GtkTreeIter iter, placeholder;
+	const gchar *start = g_mapped_file_get_contents(data->file);
+	const gchar *end = start + g_mapped_file_get_length(data->file);
+	const gchar *p = start + offset, *eol;
+	guint i = 0;
+
+	for (; i < PAGE_LINES && p < end; p = eol + 1)
+	{
+		eol = line_end(p, end);
+
+		if (is_blank(p, eol))
+			continue;
+
+		gsize len = MIN(eol - p, PREVIEW_LEN);
+		gchar *preview = g_utf8_make_valid(p, len);
+		gchar *key = g_strdup_printf("[%u] ", first + i);
+		const gchar *value = p + strspn(p, " \t");
+		gtk_tree_store_append(data->store, &iter, page);
+		gtk_tree_store_set(data->store, &iter, KEY, key, VALUE, g_strstrip(preview), OFFSET, (gint64)(p - start), LAZY, LAZY_RECORD, -1);
+
+		if (*value == '{')
+			gtk_tree_store_set(data->store, &iter, TYPE, _("Object"), -1);
+		else if (*value == '[')
+			gtk_tree_store_set(data->store, &iter, TYPE, _("Array"), -1);
+
+		gtk_tree_store_append(data->store, &placeholder, &iter);
+		g_free(preview);
+		g_free(key);
+		i++;
+	}
+}
+
+static void parse_record(CustomData *data, GtkTreeIter *record, gint64 offset)
+{
+	const gchar *start = g_mapped_file_get_contents(data->file);
+	const gchar *end = start + g_mapped_file_get_length(data->file);
+	const gchar *p = start + offset;
+	JsonParser *parser = json_parser_new();
+
+	if (json_parser_load_from_data(parser, p, line_end(p, end) - p, NULL))
+		check_value(json_parser_get_root(parser), data, *record);
+	else
+		gtk_tree_store_set(data->store, record, TYPE, _("Undefined"), -1);
+
+	g_object_unref(parser);
+}
+
+static gboolean expand_row(GtkTreeView *tree_view, GtkTreeIter *iter, GtkTreePath *path, gpointer user_data)
+{
+	CustomData *data = (CustomData*)user_data;
+	GtkTreeIter placeholder;
+	gint64 offset;
+	guint first;
+	gint lazy;
+
+	gtk_tree_model_get(GTK_TREE_MODEL(data->store), iter, OFFSET, &offset, INDEX, &first, LAZY, &lazy, -1);
+
+	if (lazy == LAZY_NONE || !data->file || !gtk_tree_model_iter_children(GTK_TREE_MODEL(data->store), &placeholder, iter))
+		return FALSE;
+
+	gtk_tree_store_set(data->store, iter, LAZY, LAZY_NONE, -1);
+
+	if (lazy == LAZY_PAGE)
+		add_records(data, iter, offset, first);
+	else
+		parse_record(data, iter, offset);
+
+	gtk_tree_store_remove(data->store, &placeholder);
+
+	return FALSE;
+}
+
+static void add_root(CustomData *data, char* FileToLoad)
+{
+	gtk_tree_store_append(data->store, &data->root, NULL);
+	data->child = data->root;
+
+	if (g_filename)
+	{
+		gchar *fname = g_path_get_basename(FileToLoad);
+		gtk_tree_store_set(data->store, &data->root, KEY, fname, -1);
+		g_free(fname);
+	}
+	else
+		gtk_tree_store_set(data->store, &data->root, KEY, _("Root"), -1);
+}
+
+static gboolean load_file(CustomData *data, char* FileToLoad)
 {
-	GtkWidget *gFix;
-	GtkWidget *scroll;
-	GtkCellRenderer *renderer;
-	GtkTreeViewColumn *column;
 	JsonParser *parser;
 	GError *err = NULL;
-	CustomData *data;
 	struct stat st;
 
 	if (lstat(FileToLoad, &st) == -1 || st.st_size == 0)
-		return NULL;
+		return FALSE;
+
+	GMappedFile *file = g_mapped_file_new(FileToLoad, FALSE, NULL);
+
+	if (file && is_ndjson(FileToLoad, g_mapped_file_get_contents(file), g_mapped_file_get_length(file)))
+	{
+		gtk_tree_store_clear(data->store);
+		add_root(data, FileToLoad);
+		gtk_tree_store_set(data->store, &data->root, TYPE, _("Array"), -1);
+
+		data->file = file;
+		data->pages = g_array_new(FALSE, FALSE, sizeof(tPage));
+		g_mutex_init(&data->mutex);
+		data->thread = g_thread_new("jsonview", index_lines, data);
+
+		return TRUE;
+	}
+
+	if (file)
+		g_mapped_file_unref(file);
 
 	parser = json_parser_new();
 	json_parser_load_from_file(parser, FileToLoad, &err);
@@ -130,7 +433,7 @@ HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
 	{
 		g_error_free(err);
 		g_object_unref(parser);
-		return NULL;
+		return FALSE;
 	}
 
 	JsonNode *root = json_parser_get_root(parser);
@@ -139,33 +442,45 @@ HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
 	if (root_type != JSON_NODE_OBJECT && root_type != JSON_NODE_ARRAY)
 	{
 		g_object_unref(parser);
-		return NULL;
+		return FALSE;
 	}
 
+	gtk_tree_store_clear(data->store);
+	add_root(data, FileToLoad);
+	check_value(root, data, data->root);
+
+	g_object_unref(parser);
+
+	return TRUE;
+}
+
+HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
+{
+	GtkWidget *gFix;
+	GtkWidget *scroll;
+	GtkCellRenderer *renderer;
+	GtkTreeViewColumn *column;
+	CustomData *data;
+
 	data = g_new0(CustomData, 1);
-	data->store = gtk_tree_store_new(N_COLS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
-	gtk_tree_store_append(data->store, &data->child, NULL);
+	data->store = gtk_tree_store_new(N_COLS, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INT64, G_TYPE_UINT, G_TYPE_INT);
+	data->tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(data->store));
+	g_object_ref_sink(data->tree);
 
-	if (g_filename)
+	if (!load_file(data, FileToLoad))
 	{
-		gchar *fname = g_path_get_basename(FileToLoad);
-		gtk_tree_store_set(data->store, &data->child, KEY, fname, -1);
-		g_free(fname);
+		g_object_unref(data->tree);
+		g_object_unref(data->store);
+		g_free(data);
+		return NULL;
 	}
-	else
-		gtk_tree_store_set(data->store, &data->child, KEY, _("Root"), -1);
-
-	check_value(root, data, data->child);
-
-	g_object_unref(parser);
 
 	gFix = gtk_vbox_new(FALSE, 5);
 	gtk_container_add(GTK_CONTAINER(GTK_WIDGET(ParentWin)), gFix);
 	scroll = gtk_scrolled_window_new(NULL, NULL);
 	gtk_container_add(GTK_CONTAINER(gFix), scroll);
 	g_object_set_data_full(G_OBJECT(gFix), "custom-data", data, (GDestroyNotify)g_free);
-
-	data->tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(data->store));
+	g_signal_connect(G_OBJECT(data->tree), "test-expand-row", G_CALLBACK(expand_row), data);
 
 	GValue val = G_VALUE_INIT;
 	g_value_init(&val, G_TYPE_BOOLEAN);
@@ -208,8 +523,9 @@ HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
 
 	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scroll), GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
 	gtk_container_add(GTK_CONTAINER(scroll), data->tree);
+	g_object_unref(data->tree);
 
-	if (g_expand)
+	if (g_expand && !data->file)
 		gtk_tree_view_expand_all(GTK_TREE_VIEW(data->tree));
 
 	g_value_unset(&val);
@@ -222,51 +538,25 @@ HWND DCPCALL ListLoad(HWND ParentWin, char* FileToLoad, int ShowFlags)
 
 int DCPCALL ListLoadNext(HWND ParentWin, HWND PluginWin, char* FileToLoad, int ShowFlags)
 {
-	JsonParser *parser;
-	GError *err = NULL;
-	struct stat st;
-
-	if (lstat(FileToLoad, &st) == -1 || st.st_size == 0)
-		return LISTPLUGIN_ERROR;
-
-	parser = json_parser_new();
-	json_parser_load_from_file(parser, FileToLoad, &err);
-
-	if (err)
-	{
-		g_error_free(err);
-		g_object_unref(parser);
-		return LISTPLUGIN_ERROR;
-	}
-
 	CustomData *data = (CustomData*)g_object_get_data(G_OBJECT(PluginWin), "custom-data");
-	gtk_tree_store_clear(data->store);
 
-	gtk_tree_store_append(data->store, &data->child, NULL);
+	stop_lines(data);
 
-	if (g_filename)
-	{
-		gchar *fname = g_path_get_basename(FileToLoad);
-		gtk_tree_store_set(data->store, &data->child, KEY, fname, -1);
-		g_free(fname);
-	}
-	else
-		gtk_tree_store_set(data->store, &data->child, KEY, _("Root"), -1);
-
-	check_value(json_parser_get_root(parser), data, data->child);
+	if (!load_file(data, FileToLoad))
+		return LISTPLUGIN_ERROR;
 
-	if (g_expand)
+	if (g_expand && !data->file)
 		gtk_tree_view_expand_all(GTK_TREE_VIEW(data->tree));
 
 	gtk_tree_view_columns_autosize(GTK_TREE_VIEW(data->tree));
 
-	g_object_unref(parser);
 	return LISTPLUGIN_OK;
 }
 
 void DCPCALL ListCloseWindow(HWND ListWin)
 {
 	CustomData *data = (CustomData*)g_object_get_data(G_OBJECT(ListWin), "custom-data");
+	stop_lines(data);
 	gtk_tree_store_clear(data->store);
 	g_object_unref(data->store);
 	gtk_widget_destroy(GTK_WIDGET(ListWin));
@@ -7,6 +7,14 @@
 #include <QApplication>
 
 #include <QMessageBox>
+#include <QTimer>
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <string.h>
+#include <strings.h>
 
 #include <dlfcn.h>
 #include <libintl.h>
@@ -21,149 +29,1107 @@ static bool g_resize = false;
 static bool g_expand = true;
 static bool g_sorting = false;
 static bool g_filename = true;
-static void check_value(const QJsonValue value, QTreeWidgetItem *item);
 
-static void walk_array(const QJsonArray array, QTreeWidgetItem *item)
+#define JUMP_MIN 4096
+#define MAX_DEPTH 1024
+#define FETCH_BATCH 10000
+#define EXPAND_ALL_SIZE 1048576
+#define PAGE_LINES 10000
+#define PROBE_LEN 1048576
+#define INDEX_INTERVAL 100
+
+// The file is mapped and checked in one pass, the only thing kept from it is where the containers
+// larger than JUMP_MIN end, so any value can be skipped without reading much of it.
+// Tree items are created when their parent is expanded, FETCH_BATCH at a time.
+
+// JSON Lines are not checked upfront, a thread finds where each page of PAGE_LINES records starts
+// and the records of a page are checked when it is expanded.
+
+struct JsonJump
+{
+	qint64 open;
+	qint64 end;
+};
+
+struct JsonPage
+{
+	qint64 start;
+	qint64 end;
+	int lines;
+};
+
+enum
+{
+	NODE_VALUE,
+	NODE_LINES,
+	NODE_PAGE,
+	NODE_INVALID
+};
+
+static bool jump_before(const JsonJump &a, const JsonJump &b)
+{
+	return a.open < b.open;
+}
+
+static const char *skip_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		p++;
+
+	return p;
+}
+
+// p is at the opening quote
+static const char *skip_string(const char *p, const char *end)
 {
-	for (int i = 0; i < array.count(); i++)
+	const char *start = ++p;
+
+	while (p < end)
 	{
-		QTreeWidgetItem *newitem = new QTreeWidgetItem(item);
-		newitem->setText(0, QString("[%1]").arg(i));
-		check_value(array.at(i), newitem);
+		const char *quote = (const char*)memchr(p, '"', end - p);
+
+		if (!quote)
+			return nullptr;
+
+		const char *bs = quote;
+
+		while (bs > start && bs[-1] == '\\')
+			bs--;
+
+		if ((quote - bs) % 2 == 0)
+			return quote + 1;
+
+		p = quote + 1;
 	}
+
+	return nullptr;
+}
+
+static const char *skip_scalar(const char *p, const char *end)
+{
+	while (p < end && *p != ',' && *p != ']' && *p != '}' && *p != ':' &&
+	                *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+		p++;
+
+	return p;
 }
 
-static void walk_object(const QJsonObject object, QTreeWidgetItem *item)
+static bool is_digit(char c)
 {
-	QJsonObject::const_iterator iter;
+	return c >= '0' && c <= '9';
+}
+
+static bool check_scalar(const char *p, const char *end)
+{
+	qint64 len = end - p;
+
+	if ((len == 4 && (memcmp(p, "true", 4) == 0 || memcmp(p, "null", 4) == 0)) || (len == 5 && memcmp(p, "false", 5) == 0))
+		return true;
+
+	if (p < end && *p == '-')
+		p++;
+
+	if (p >= end || !is_digit(*p))
+		return false;
+
+	while (p < end && is_digit(*p))
+		p++;
+
+	if (p < end && *p == '.')
+	{
+		if (++p >= end || !is_digit(*p))
+			return false;
+
+		while (p < end && is_digit(*p))
+			p++;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		if (++p < end && (*p == '+' || *p == '-'))
+			p++;
+
+		if (p >= end || !is_digit(*p))
+			return false;
+
+		while (p < end && is_digit(*p))
+			p++;
+	}
+
+	return p == end;
+}
+
+// checks one value, returns the position after it or nullptr, the jumps are appended as the containers close
+static const char *index_value(const char *data, const char *p, const char *end, QVector<JsonJump> &jumps)
+{
+	enum { VALUE, KEY, NEXT } state = VALUE;
+	QVector<const char*> stack;
+
+	for (;;)
+	{
+		p = skip_ws(p, end);
+
+		if (p >= end)
+			return (state == NEXT && stack.isEmpty()) ? p : nullptr;
+
+		if (state == VALUE)
+		{
+			if (*p == '{' || *p == '[')
+			{
+				if (stack.size() >= MAX_DEPTH)
+					return nullptr;
+
+				stack.append(p);
+				p = skip_ws(p + 1, end);
+
+				if (p < end && (*p == '}' || *p == ']'))
+					state = NEXT;
+				else
+				{
+					state = (*stack.last() == '{') ? KEY : VALUE;
+					continue;
+				}
+			}
+			else if (*p == '"')
+			{
+				if (!(p = skip_string(p, end)))
+					return nullptr;
+
+				state = NEXT;
+				continue;
+			}
+			else
+			{
+				const char *scalar = p;
+				p = skip_scalar(p, end);
+
+				if (!check_scalar(scalar, p))
+					return nullptr;
+
+				state = NEXT;
+				continue;
+			}
+		}
+		else if (state == KEY)
+		{
+			if (*p != '"' || !(p = skip_string(p, end)))
+				return nullptr;
+
+			p = skip_ws(p, end);
+
+			if (p >= end || *p != ':')
+				return nullptr;
+
+			p++;
+			state = VALUE;
+			continue;
+		}
+		else if (stack.isEmpty())
+			return p;
+		else if (*p == ',')
+		{
+			p++;
+			state = (*stack.last() == '{') ? KEY : VALUE;
+			continue;
+		}
+
+		// closing bracket
+		if (stack.isEmpty() || *p != (*stack.last() == '{' ? '}' : ']'))
+			return nullptr;
+
+		const char *open = stack.takeLast();
+		p++;
+
+		if (p - open >= JUMP_MIN)
+			jumps.append({open - data, p - data});
+
+		if (stack.isEmpty())
+			return p;
+	}
+}
+
+static bool is_blank(const char *p, const char *eol)
+{
+	while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+
+	return p >= eol;
+}
+
+static const char *line_end(const char *p, const char *end)
+{
+	const char *eol = (const char*)memchr(p, '\n', end - p);
+
+	return eol ? eol : end;
+}
+
+static bool has_lines_suffix(const QFileInfo &fi)
+{
+	QString suffix = fi.suffix().toLower();
+
+	return (suffix == "ndjson" || suffix == "jsonl" || suffix == "ldjson");
+}
+
+// by the extension, or a complete object or array on the first line followed by more lines
+static bool is_ndjson(const QFileInfo &fi, const char *p, const char *end)
+{
+	if (has_lines_suffix(fi))
+		return true;
+
+	const char *eol = p;
 
-	for (iter = object.constBegin(); iter != object.constEnd(); ++iter)
+	while (p < end && is_blank(p, (eol = line_end(p, end))))
+		p = eol + 1;
+
+	if (p >= end || eol - p > PROBE_LEN)
+		return false;
+
+	p = skip_ws(p, eol);
+
+	if (*p != '{' && *p != '[')
+		return false;
+
+	QVector<JsonJump> jumps;
+	const char *tail = index_value(p, p, eol, jumps);
+
+	return (tail && skip_ws(tail, eol) == eol && skip_ws(eol, end) < end);
+}
+
+struct JsonNode
+{
+	JsonNode *parent;
+	int row;
+	int kind;
+	qint64 key;
+	qint64 value;
+	qint64 end;
+	qint64 next;
+	QVector<JsonNode*> children;
+
+	~JsonNode()
 	{
-		QTreeWidgetItem *newitem = new QTreeWidgetItem(item);
-		newitem->setText(0, iter.key());
-		newitem->setToolTip(0, iter.key());
-		check_value(iter.value(), newitem);
+		qDeleteAll(children);
 	}
+};
+
+class JsonModel : public QAbstractItemModel
+{
+public:
+	JsonModel(QFile *file, qint64 root, QVector<JsonJump> jumps, const QString &name, QObject *parent);
+	JsonModel(QFile *file, qint64 start, const QString &name, QObject *parent);
+	~JsonModel();
+
+	QModelIndex index(int row, int column, const QModelIndex &parent = QModelIndex()) const override;
+	QModelIndex parent(const QModelIndex &index) const override;
+	int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+	int columnCount(const QModelIndex &parent = QModelIndex()) const override;
+	bool hasChildren(const QModelIndex &parent = QModelIndex()) const override;
+	bool canFetchMore(const QModelIndex &parent) const override;
+	void fetchMore(const QModelIndex &parent) override;
+	QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+	QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const override;
+	Qt::ItemFlags flags(const QModelIndex &index) const override;
+
+	qint64 find(const QByteArray &needle, bool matchcase, qint64 from, bool backwards) const;
+	QModelIndex locate(qint64 pos);
+
+private:
+	JsonNode *node(const QModelIndex &index) const;
+	JsonNode *new_node(JsonNode *parent, int row, qint64 key, qint64 value) const;
+	const char *skip_value(const char *p) const;
+	QString decode_string(qint64 pos) const;
+	QVariant value_text(const char *value, bool tooltip) const;
+	QVariant type_name(const char *value) const;
+	void fetch_records(const QModelIndex &parent, JsonNode *item);
+	void index_lines(qint64 pos);
+	void fetch_pages();
+
+	QFile *m_file;
+	const char *m_data;
+	const char *m_end;
+	QVector<JsonJump> m_jumps;
+	QString m_name;
+	JsonNode m_top;
+	int m_lines = 0;
+	bool m_indexed = true;
+	QTimer *m_timer = nullptr;
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::atomic<bool> m_stop;
+	QVector<JsonPage> m_pending;
+	bool m_pending_done = false;
+};
+
+JsonModel::JsonModel(QFile *file, qint64 root, QVector<JsonJump> jumps, const QString &name, QObject *parent)
+	: QAbstractItemModel(parent), m_file(file), m_jumps(jumps), m_name(name), m_stop(false)
+{
+	m_file->setParent(this);
+	m_data = (const char*)m_file->map(0, m_file->size());
+	m_end = m_data + m_file->size();
+
+	std::sort(m_jumps.begin(), m_jumps.end(), jump_before);
+
+	m_top.parent = nullptr;
+	m_top.row = 0;
+	m_top.kind = NODE_VALUE;
+	m_top.key = -1;
+	m_top.value = -1;
+	m_top.end = -1;
+	m_top.next = -1;
+	m_top.children.append(new_node(&m_top, 0, -1, root));
 }
 
-static void check_value(const QJsonValue value, QTreeWidgetItem *item)
+// JSON Lines, the root holds the pages, these are added as the thread finds them
+JsonModel::JsonModel(QFile *file, qint64 start, const QString &name, QObject *parent)
+	: QAbstractItemModel(parent), m_file(file), m_name(name), m_stop(false)
 {
-	double d;
+	m_file->setParent(this);
+	m_data = (const char*)m_file->map(0, m_file->size());
+	m_end = m_data + m_file->size();
+
+	m_top.parent = nullptr;
+	m_top.row = 0;
+	m_top.kind = NODE_VALUE;
+	m_top.key = -1;
+	m_top.value = -1;
+	m_top.end = -1;
+	m_top.next = -1;
+
+	JsonNode *root = new JsonNode;
+	root->parent = &m_top;
+	root->row = 0;
+	root->kind = NODE_LINES;
+	root->key = -1;
+	root->value = start;
+	root->end = m_end - m_data;
+	root->next = -1;
+	m_top.children.append(root);
+
+	m_indexed = false;
+	m_timer = new QTimer(this);
+	QObject::connect(m_timer, &QTimer::timeout, [this]() { fetch_pages(); });
+	m_timer->start(INDEX_INTERVAL);
+	m_thread = std::thread(&JsonModel::index_lines, this, start);
+}
+
+JsonModel::~JsonModel()
+{
+	m_stop = true;
+
+	if (m_thread.joinable())
+		m_thread.join();
+
+	qDeleteAll(m_top.children);
+	m_top.children.clear();
+}
 
-	switch (value.type())
+void JsonModel::index_lines(qint64 pos)
+{
+	const char *p = m_data + pos;
+	const char *eol;
+	JsonPage page = { pos, pos, 0 };
+
+	for (; p < m_end && !m_stop; p = eol + 1)
 	{
-	case QJsonValue::Object:
+		eol = line_end(p, m_end);
+
+		if (is_blank(p, eol))
+			continue;
+
+		if (page.lines == PAGE_LINES)
+		{
+			page.end = p - m_data;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pending.append(page);
+			page.lines = 0;
+		}
+
+		if (page.lines == 0)
+			page.start = p - m_data;
+
+		page.lines++;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (page.lines > 0)
 	{
-		item->setText(2, _("Object"));
-		walk_object(value.toObject(), item);
-		break;
+		page.end = m_end - m_data;
+		m_pending.append(page);
 	}
 
-	case QJsonValue::Array:
+	m_pending_done = true;
+}
+
+void JsonModel::fetch_pages()
+{
+	QVector<JsonPage> pages;
+	bool done;
+
 	{
-		item->setText(2, _("Array"));
-		walk_array(value.toArray(), item);
-		break;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		pages.swap(m_pending);
+		done = m_pending_done;
 	}
 
-	case QJsonValue::String:
+	JsonNode *root = m_top.children.first();
+
+	if (!pages.isEmpty())
 	{
-		item->setText(2, _("String"));
-		item->setText(1, value.toString());
-		item->setToolTip(1, value.toString());
-		break;
+		QVector<JsonNode*> batch;
+		int row = root->children.size();
+
+		for (const JsonPage &page : pages)
+		{
+			JsonNode *item = new JsonNode;
+			item->parent = root;
+			item->row = row + batch.size();
+			item->kind = NODE_PAGE;
+			item->key = -1;
+			item->value = page.start;
+			item->end = page.end;
+			item->next = page.start;
+			batch.append(item);
+			m_lines += page.lines;
+		}
+
+		beginInsertRows(index(0, 0), row, row + batch.size() - 1);
+		root->children += batch;
+		endInsertRows();
 	}
 
-	case QJsonValue::Double:
+	if (done)
 	{
-		d = value.toDouble();
+		m_timer->stop();
+		m_indexed = true;
+	}
+}
 
-		if (trunc(d) == d)
+JsonNode *JsonModel::new_node(JsonNode *parent, int row, qint64 key, qint64 value) const
+{
+	JsonNode *item = new JsonNode;
+	const char *p = m_data + value;
+
+	item->parent = parent;
+	item->row = row;
+	item->kind = NODE_VALUE;
+	item->key = key;
+	item->value = value;
+	item->end = skip_value(p) - m_data;
+	item->next = (*p == '{' || *p == '[') ? value + 1 : -1;
+
+	return item;
+}
+
+const char *JsonModel::skip_value(const char *p) const
+{
+	if (*p == '"')
+		return skip_string(p, m_end);
+
+	if (*p != '{' && *p != '[')
+		return skip_scalar(p, m_end);
+
+	qint64 pos = p - m_data;
+	auto jump = std::lower_bound(m_jumps.constBegin(), m_jumps.constEnd(), JsonJump{pos, pos}, jump_before);
+
+	if (jump != m_jumps.constEnd() && jump->open == pos)
+		return m_data + jump->end;
+
+	// small enough to be read through
+	int depth = 0;
+
+	while (p < m_end)
+	{
+		if (*p == '"')
 		{
-			item->setText(2, _("Integer"));
-			item->setText(1, QString::number(d, 'f', 0));
+			p = skip_string(p, m_end);
+			continue;
 		}
-		else
+
+		if (*p == '{' || *p == '[')
+			depth++;
+		else if ((*p == '}' || *p == ']') && --depth == 0)
+			return p + 1;
+
+		p++;
+	}
+
+	return m_end;
+}
+
+JsonNode *JsonModel::node(const QModelIndex &index) const
+{
+	if (!index.isValid())
+		return (JsonNode*)&m_top;
+
+	return (JsonNode*)index.internalPointer();
+}
+
+QModelIndex JsonModel::index(int row, int column, const QModelIndex &parent) const
+{
+	if (!hasIndex(row, column, parent))
+		return QModelIndex();
+
+	return createIndex(row, column, node(parent)->children.at(row));
+}
+
+QModelIndex JsonModel::parent(const QModelIndex &index) const
+{
+	if (!index.isValid())
+		return QModelIndex();
+
+	JsonNode *item = node(index)->parent;
+
+	if (item == &m_top)
+		return QModelIndex();
+
+	return createIndex(item->row, 0, item);
+}
+
+int JsonModel::rowCount(const QModelIndex &parent) const
+{
+	if (parent.column() > 0)
+		return 0;
+
+	return node(parent)->children.size();
+}
+
+int JsonModel::columnCount(const QModelIndex &parent) const
+{
+	return 3;
+}
+
+bool JsonModel::hasChildren(const QModelIndex &parent) const
+{
+	if (parent.column() > 0)
+		return false;
+
+	JsonNode *item = node(parent);
+
+	if (!item->children.isEmpty() || item->kind == NODE_PAGE)
+		return true;
+
+	if (item->kind == NODE_LINES)
+		return !m_indexed;
+
+	if (item->next < 0)
+		return false;
+
+	const char *p = skip_ws(m_data + item->value + 1, m_end);
+
+	return (p < m_end && *p != '}' && *p != ']');
+}
+
+bool JsonModel::canFetchMore(const QModelIndex &parent) const
+{
+	return parent.column() <= 0 && node(parent)->next >= 0;
+}
+
+void JsonModel::fetchMore(const QModelIndex &parent)
+{
+	JsonNode *item = node(parent);
+
+	if (parent.column() > 0 || item->next < 0)
+		return;
+
+	if (item->kind == NODE_PAGE)
+	{
+		fetch_records(parent, item);
+		return;
+	}
+
+	QVector<JsonNode*> batch;
+	bool object = (m_data[item->value] == '{');
+	const char *p = m_data + item->next;
+	int row = item->children.size();
+
+	while (batch.size() < FETCH_BATCH)
+	{
+		qint64 key = -1;
+		p = skip_ws(p, m_end);
+
+		if (*p == ',')
+			p = skip_ws(p + 1, m_end);
+
+		if (*p == '}' || *p == ']')
+		{
+			p = nullptr;
+			break;
+		}
+
+		if (object)
 		{
-			item->setText(2, _("Double"));
-			item->setText(1, QString::number(d));
+			key = p - m_data;
+			p = skip_ws(skip_string(p, m_end), m_end);
+			p = skip_ws(p + 1, m_end);
 		}
 
-		item->setToolTip(1, QString::number(d, 'f', 1));
-		break;
+		JsonNode *child = new_node(item, row + batch.size(), key, p - m_data);
+		batch.append(child);
+		p = m_data + child->end;
 	}
 
-	case QJsonValue::Bool:
+	item->next = p ? p - m_data : -1;
+
+	if (!batch.isEmpty())
 	{
-		item->setText(2, _("Boolean"));
+		beginInsertRows(parent, row, row + batch.size() - 1);
+		item->children += batch;
+		endInsertRows();
+	}
+}
 
-		if (value.toBool())
-			item->setText(1, _("True"));
+// the records are checked before their items are made, the large ones leave their jumps
+void JsonModel::fetch_records(const QModelIndex &parent, JsonNode *item)
+{
+	struct Record
+	{
+		qint64 value;
+		qint64 end;
+		bool valid;
+	};
+
+	QVector<Record> records;
+	QVector<JsonJump> jumps;
+	const char *p = m_data + item->next;
+	const char *end = m_data + item->end;
+	const char *eol;
+
+	for (; p < end && records.size() < FETCH_BATCH; p = eol + 1)
+	{
+		eol = line_end(p, end);
+
+		if (is_blank(p, eol))
+			continue;
+
+		const char *value = skip_ws(p, eol);
+		const char *tail = index_value(m_data, value, eol, jumps);
+		bool valid = (tail && skip_ws(tail, eol) == eol);
+
+		if (!valid)
+		{
+			tail = eol;
+
+			while (tail > value && (tail[-1] == '\r' || tail[-1] == ' ' || tail[-1] == '\t'))
+				tail--;
+		}
+
+		records.append({value - m_data, tail - m_data, valid});
+	}
+
+	item->next = (p < end) ? p - m_data : -1;
+
+	if (!jumps.isEmpty())
+	{
+		int size = m_jumps.size();
+		std::sort(jumps.begin(), jumps.end(), jump_before);
+		m_jumps += jumps;
+		std::inplace_merge(m_jumps.begin(), m_jumps.begin() + size, m_jumps.end(), jump_before);
+	}
+
+	QVector<JsonNode*> batch;
+	int row = item->children.size();
+
+	for (const Record &record : records)
+	{
+		JsonNode *child;
+
+		if (record.valid)
+			child = new_node(item, row + batch.size(), -1, record.value);
 		else
-			item->setText(1, _("False"));
+		{
+			child = new JsonNode;
+			child->parent = item;
+			child->row = row + batch.size();
+			child->kind = NODE_INVALID;
+			child->key = -1;
+			child->value = record.value;
+			child->end = record.end;
+			child->next = -1;
+		}
+
+		batch.append(child);
+	}
+
+	if (!batch.isEmpty())
+	{
+		beginInsertRows(parent, row, row + batch.size() - 1);
+		item->children += batch;
+		endInsertRows();
+	}
+}
+
+QString JsonModel::decode_string(qint64 pos) const
+{
+	const char *p = m_data + pos + 1;
+	const char *end = skip_string(m_data + pos, m_end) - 1;
+
+	if (!memchr(p, '\\', end - p))
+		return QString::fromUtf8(p, end - p);
+
+	QString result;
+
+	while (p < end)
+	{
+		const char *bs = (const char*)memchr(p, '\\', end - p);
+
+		if (!bs)
+			bs = end;
+
+		result += QString::fromUtf8(p, bs - p);
+
+		if (bs + 1 >= end)
+			break;
+
+		p = bs + 2;
+
+		switch (bs[1])
+		{
+		case 'b':
+			result += QLatin1Char('\b');
+			break;
+
+		case 'f':
+			result += QLatin1Char('\f');
+			break;
+
+		case 'n':
+			result += QLatin1Char('\n');
+			break;
+
+		case 'r':
+			result += QLatin1Char('\r');
+			break;
+
+		case 't':
+			result += QLatin1Char('\t');
+			break;
+
+		// surrogate pairs come as two of these and make a valid UTF-16 string together
+		case 'u':
+			if (end - p >= 4)
+			{
+				result += QChar((ushort)QByteArray(p, 4).toUShort(nullptr, 16));
+				p += 4;
+			}
+
+			break;
+
+		default:
+			result += QLatin1Char(bs[1]);
+		}
+	}
+
+	return result;
+}
+
+QVariant JsonModel::value_text(const char *value, bool tooltip) const
+{
+	switch (*value)
+	{
+	case '"':
+		return decode_string(value - m_data);
+
+	case 't':
+		return tooltip ? QVariant() : QString(_("True"));
+
+	case 'f':
+		return tooltip ? QVariant() : QString(_("False"));
+
+	case '{':
+	case '[':
+	case 'n':
+		return QVariant();
+	}
+
+	double d = QByteArray::fromRawData(value, skip_scalar(value, m_end) - value).toDouble();
+
+	if (tooltip)
+		return QString::number(d, 'f', 1);
+
+	if (trunc(d) == d)
+		return QString::number(d, 'f', 0);
+
+	return QString::number(d);
+}
+
+QVariant JsonModel::type_name(const char *value) const
+{
+	switch (*value)
+	{
+	case '{':
+		return QString(_("Object"));
+
+	case '[':
+		return QString(_("Array"));
+
+	case '"':
+		return QString(_("String"));
+
+	case 't':
+	case 'f':
+		return QString(_("Boolean"));
+
+	case 'n':
+		return QString(_("Null"));
+	}
+
+	double d = QByteArray::fromRawData(value, skip_scalar(value, m_end) - value).toDouble();
+
+	return QString(trunc(d) == d ? _("Integer") : _("Double"));
+}
+
+QVariant JsonModel::data(const QModelIndex &index, int role) const
+{
+	if (!index.isValid() || (role != Qt::DisplayRole && role != Qt::ToolTipRole))
+		return QVariant();
 
-		break;
+	JsonNode *item = node(index);
+	const char *value = m_data + item->value;
+
+	switch (index.column())
+	{
+	case 0:
+		if (item->key >= 0)
+			return decode_string(item->key);
+		else if (role == Qt::ToolTipRole)
+			return QVariant();
+		else if (item->parent == &m_top)
+			return m_name;
+		else if (item->kind == NODE_PAGE)
+			return QString("[%1 - %2]").arg(item->row * PAGE_LINES).arg(qMin((item->row + 1) * PAGE_LINES, m_lines) - 1);
+		else if (item->parent->kind == NODE_PAGE)
+			return QString("[%1]").arg(item->parent->row * PAGE_LINES + item->row);
+
+		return QString("[%1]").arg(item->row);
+
+	case 1:
+		if (item->kind == NODE_INVALID)
+			return QString::fromUtf8(value, item->end - item->value);
+		else if (item->kind != NODE_VALUE)
+			return QVariant();
+
+		return value_text(value, role == Qt::ToolTipRole);
+
+	case 2:
+		if (role != Qt::DisplayRole || item->kind == NODE_PAGE)
+			return QVariant();
+		else if (item->kind == NODE_LINES)
+			return QString(_("Array"));
+		else if (item->kind == NODE_INVALID)
+			return QString(_("Undefined"));
+
+		return type_name(value);
 	}
 
-	case QJsonValue::Null:
+	return QVariant();
+}
+
+QVariant JsonModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+	if (orientation == Qt::Horizontal && role == Qt::DisplayRole)
 	{
-		item->setText(2, _("Null"));
-		break;
+		switch (section)
+		{
+		case 0:
+			return QString(_("Node"));
+
+		case 1:
+			return QString(_("Value"));
+
+		case 2:
+			return QString(_("Type"));
+		}
 	}
 
-	default:
+	return QAbstractItemModel::headerData(section, orientation, role);
+}
+
+Qt::ItemFlags JsonModel::flags(const QModelIndex &index) const
+{
+	return Qt::ItemIsSelectable | Qt::ItemIsEnabled;
+}
+
+// searches the raw text, -1 if not found
+qint64 JsonModel::find(const QByteArray &needle, bool matchcase, qint64 from, bool backwards) const
+{
+	qint64 size = m_end - m_data;
+	qint64 len = needle.size();
+
+	if (len == 0 || len > size)
+		return -1;
+
+	// both cases of the first byte are found with memchr, the rest is compared at these positions
+	QByteArray lower = needle.toLower();
+	char first[2] = { needle.at(0), needle.at(0) };
+	const char *next[2] = { nullptr, nullptr };
+	bool none[2] = { false, false };
+
+	if (!matchcase)
 	{
-		item->setText(2, _("Undefined"));
-		break;
+		first[0] = lower.at(0);
+		first[1] = toupper((uchar)lower.at(0));
 	}
+
+	none[1] = (first[1] == first[0]);
+
+	const char *last = m_end - len;
+	const char *p = m_data + (backwards ? qMin(from, size - len) : qMax(from, (qint64)0));
+
+	while (p >= m_data && p <= last)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			if (!none[i] && (!next[i] || (backwards ? next[i] > p : next[i] < p)))
+			{
+				if (backwards)
+					next[i] = (const char*)memrchr(m_data, first[i], p - m_data + 1);
+				else
+					next[i] = (const char*)memchr(p, first[i], last - p + 1);
+
+				none[i] = !next[i];
+			}
+		}
+
+		if (none[0] && none[1])
+			break;
+		else if (none[0] || none[1])
+			p = none[0] ? next[1] : next[0];
+		else
+			p = backwards ? qMax(next[0], next[1]) : qMin(next[0], next[1]);
+
+		if (matchcase ? memcmp(p, needle.constData(), len) == 0 : strncasecmp(p, lower.constData(), len) == 0)
+			return p - m_data;
+
+		p += backwards ? -1 : 1;
 	}
+
+	return -1;
+}
+
+// fetches the items down to the text at pos
+QModelIndex JsonModel::locate(qint64 pos)
+{
+	QModelIndex parent = index(0, 0);
+
+	for (;;)
+	{
+		JsonNode *item = node(parent);
+
+		if (item->kind == NODE_INVALID || (item->kind == NODE_VALUE && m_data[item->value] != '{' && m_data[item->value] != '['))
+			return index(parent.row(), 1, parent.parent());
+
+		while (canFetchMore(parent) && (item->children.isEmpty() || item->children.last()->end <= pos))
+			fetchMore(parent);
+
+		auto child = std::upper_bound(item->children.constBegin(), item->children.constEnd(), pos,
+		                              [](qint64 at, const JsonNode * n) { return at < (n->key >= 0 ? n->key : n->value); });
+
+		if (child == item->children.constBegin() || pos >= (*(child - 1))->end)
+			return parent;
+
+		JsonNode *found = *(child - 1);
+
+		if (found->key >= 0 && pos < found->value)
+			return index(found->row, 0, parent);
+
+		parent = index(found->row, 0, parent);
+	}
+}
+
+static void fetch_all(QAbstractItemModel *model, const QModelIndex &parent)
+{
+	while (model->canFetchMore(parent))
+		model->fetchMore(parent);
+
+	for (int i = 0; i < model->rowCount(parent); i++)
+		fetch_all(model, model->index(i, 0, parent));
 }
 
 HANDLE DCPCALL ListLoad(HANDLE ParentWin, char* FileToLoad, int ShowFlags)
 {
 	QMimeDatabase db;
 	QMimeType type = db.mimeTypeForFile(QString(FileToLoad));
+	QFileInfo fi(FileToLoad);
 
-	if (type.name() != "text/plain" && type.name() != "application/json")
+	if (!type.inherits("text/plain") && type.name() != "application/json" && !has_lines_suffix(fi))
 		return nullptr;
 
-	QFile file(FileToLoad);
+	QFile *file = new QFile(FileToLoad);
+	const char *data = nullptr;
+
+	if (file->open(QFile::ReadOnly) && file->size() > 0)
+		data = (const char*)file->map(0, file->size());
 
-	if (!file.open(QFile::ReadOnly | QFile::Text))
+	if (!data)
+	{
+		delete file;
 		return nullptr;
+	}
 
-	QJsonDocument json = QJsonDocument().fromJson(file.readAll());
-	file.close();
+	QVector<JsonJump> jumps;
+	const char *end = data + file->size();
+	const char *root = data;
 
-	if (json.isNull() || json.isEmpty())
-		return nullptr;
+	if (end - root >= 3 && memcmp(root, "\xEF\xBB\xBF", 3) == 0)
+		root += 3;
 
-	QFileInfo fi(FileToLoad);
-	QTreeWidget *view = new QTreeWidget((QWidget*)ParentWin);
-	view->setColumnCount(3);
+	bool lines = is_ndjson(fi, root, end);
+	qint64 start = root - data;
+	root = skip_ws(root, end);
+
+	// only a non-empty object or array, as before
+	const char *first = (root < end) ? skip_ws(root + 1, end) : end;
+	bool valid = lines || (root < end && (*root == '{' || *root == '[') && first < end && *first != '}' && *first != ']');
+
+	if (valid && !lines)
+	{
+		const char *tail = index_value(data, root, end, jumps);
+		valid = (tail && skip_ws(tail, end) == end);
+	}
+
+	file->unmap((uchar*)data);
+
+	if (!valid)
+	{
+		delete file;
+		return nullptr;
+	}
 
-	QTreeWidgetItem *root = new QTreeWidgetItem(view);
+	QTreeView *view = new QTreeView((QWidget*)ParentWin);
+	QString name = g_filename ? fi.fileName() : QString(_("Root"));
+	JsonModel *model;
 
-	if (g_filename)
-		root->setText(0, fi.fileName());
+	if (lines)
+		model = new JsonModel(file, start, name, view);
 	else
-		root->setText(0,  _("Root"));
+		model = new JsonModel(file, root - data, jumps, name, view);
 
-	if (json.isObject())
+	if (g_sorting)
 	{
-		root->setText(2, _("Object"));
-		walk_object(json.object(), root);
+		QSortFilterProxyModel *proxy = new QSortFilterProxyModel(view);
+		proxy->setSourceModel(model);
+		view->setModel(proxy);
 	}
-	else if (json.isArray())
+	else
+		view->setModel(model);
+
+	// everything only for small files, the items are created as they are expanded
+	if (g_expand && !lines && fi.size() <= EXPAND_ALL_SIZE)
 	{
-		root->setText(2, _("Array"));
-		walk_array(json.array(), root);
+		fetch_all(view->model(), QModelIndex());
+		view->expandAll();
 	}
+	else if (g_expand)
+	{
+		QModelIndex top = view->model()->index(0, 0);
 
-	view->insertTopLevelItem(0, root);
+		if (view->model()->canFetchMore(top))
+			view->model()->fetchMore(top);
 
-	if (g_expand)
-		view->expandAll();
+		view->expand(top);
+	}
 
 	for (int i = 0; i < 3; i++)
 	{
@@ -173,10 +1139,6 @@ HANDLE DCPCALL ListLoad(HANDLE ParentWin, char* FileToLoad, int ShowFlags)
 			view->setColumnWidth(i, g_width);
 	}
 
-	QStringList headers;
-	headers << _("Node") << _("Value") << _("Type");
-	view->setHeaderLabels(headers);
-
 	view->setSelectionMode(QAbstractItemView::SingleSelection);
 	view->setSelectionBehavior(QAbstractItemView::SelectItems);
 
@@ -190,18 +1152,17 @@ HANDLE DCPCALL ListLoad(HANDLE ParentWin, char* FileToLoad, int ShowFlags)
 
 void DCPCALL ListCloseWindow(HANDLE ListWin)
 {
-	QTreeWidget *view = (QTreeWidget*)ListWin;
-	view->clear();
-	view->~QTreeWidget();
+	QTreeView *view = (QTreeView*)ListWin;
+	delete view;
 }
 
 int DCPCALL ListSendCommand(HWND ListWin, int Command, int Parameter)
 {
-	QTreeWidget *view = (QTreeWidget*)ListWin;
+	QTreeView *view = (QTreeView*)ListWin;
 
 	if (Command == lc_copy)
 	{
-		QString text(view->currentItem()->text(view->currentColumn()));
+		QString text(view->currentIndex().data().toString());
 
 		if (!text.isEmpty())
 			QApplication::clipboard()->setText(text);
@@ -212,45 +1173,45 @@ int DCPCALL ListSendCommand(HWND ListWin, int Command, int Parameter)
 	return LISTPLUGIN_ERROR;
 }
 
+// the match is looked for in the file and then the items down to it are fetched
 int DCPCALL ListSearchText(HWND ListWin, char* SearchString, int SearchParameter)
 {
-	QList<QTreeWidgetItem*> list;
-	QTreeWidget *view = (QTreeWidget*)ListWin;
+	QTreeView *view = (QTreeView*)ListWin;
+	QSortFilterProxyModel *proxy = qobject_cast<QSortFilterProxyModel*>(view->model());
+	JsonModel *model = (JsonModel*)(proxy ? proxy->sourceModel() : view->model());
+	bool backwards = (SearchParameter & lcs_backwards);
 
-	Qt::MatchFlags sflags = Qt::MatchContains | Qt::MatchRecursive;
+	QByteArray needle(SearchString);
+	QByteArray prev = view->property("needle").value<QByteArray>();
+	view->setProperty("needle", needle);
 
-	if (SearchParameter & lcs_matchcase)
-		sflags |= Qt::MatchCaseSensitive;
+	qint64 from = view->property("findpos").value<qint64>();
 
-	QString needle(SearchString);
-	QString prev = view->property("needle").value<QString>();
-	view->setProperty("needle", needle);
+	if (needle != prev || SearchParameter & lcs_findfirst || !view->property("findpos").isValid())
+		from = backwards ? LLONG_MAX : 0;
+	else
+		from += backwards ? -1 : 1;
 
-	list = view->findItems(QString(SearchString), sflags, view->currentColumn());
+	QApplication::setOverrideCursor(Qt::WaitCursor);
+	qint64 pos = model->find(needle, SearchParameter & lcs_matchcase, from, backwards);
+	QModelIndex found;
 
-	if (!list.isEmpty())
+	if (pos >= 0)
 	{
-		int i = view->property("findit").value<int>();
+		found = model->locate(pos);
 
-		if (needle != prev || SearchParameter & lcs_findfirst)
-		{
-			if (SearchParameter & lcs_backwards)
-				i = list.size() - 1;
-			else
-				i = 0;
-		}
-		else if (SearchParameter & lcs_backwards)
-			i--;
-		else
-			i++;
+		if (proxy)
+			found = proxy->mapFromSource(found);
+	}
 
-		if (i >= 0 && i < list.size() && list.at(i))
-		{
-			view->scrollToItem(list.at(i));
-			view->setCurrentItem(list.at(i), view->currentColumn());
-			view->setProperty("findit", i);
-			return LISTPLUGIN_OK;
-		}
+	QApplication::restoreOverrideCursor();
+
+	if (found.isValid())
+	{
+		view->setProperty("findpos", pos);
+		view->scrollTo(found);
+		view->setCurrentIndex(found);
+		return LISTPLUGIN_OK;
 	}
 
 	QMessageBox::information(view, "", QString::asprintf(_("\"%s\" not found!"), SearchString));